@@ -67,6 +67,9 @@ BBS_SINGULAR_CALLBACK_DECLARE(pwresethandler, int, const char *username, const c
 /* Only one user info handler */
 BBS_SINGULAR_CALLBACK_DECLARE(userinfohandler, struct bbs_user *, const char *username);
 
+/* Only one user info by ID handler */
+BBS_SINGULAR_CALLBACK_DECLARE(useridinfohandler, struct bbs_user *, unsigned int userid);
+
 /* Only one user list handler */
 BBS_SINGULAR_CALLBACK_DECLARE(userlisthandler, struct bbs_user**, void);
 
@@ -163,6 +166,16 @@ int bbs_unregister_user_info_handler(struct bbs_user* (*handler)(const char *use
 	return bbs_singular_callback_unregister(&userinfohandler, handler);
 }
 
+int __bbs_register_user_info_by_id_handler(struct bbs_user* (*handler)(unsigned int userid), void *mod)
+{
+	return bbs_singular_callback_register(&useridinfohandler, handler, mod);
+}
+
+int bbs_unregister_user_info_by_id_handler(struct bbs_user* (*handler)(unsigned int userid))
+{
+	return bbs_singular_callback_unregister(&useridinfohandler, handler);
+}
+
 int __bbs_register_user_list_handler(struct bbs_user** (*handler)(void), void *mod)
 {
 	return bbs_singular_callback_register(&userlisthandler, handler, mod);
@@ -658,6 +671,7 @@ int bbs_user_authenticate(struct bbs_user *user, const char *username, const cha
 static int post_auth(struct bbs_node *node, struct bbs_user *user)
 {
 	bbs_auth("Node %d now logged in as %s (via %s)\n", node->id, bbs_username(user), node->protname);
+	bbs_node_presence_add(node);
 	bbs_event_dispatch(node, EVENT_USER_LOGIN);
 	return 0;
 }
@@ -775,6 +789,7 @@ int bbs_user_register(struct bbs_node *node)
 		}
 		/* If we got here, then the user was able to self-register (or the sysop-enabled registration process completed before the reg provider returned) */
 		bbs_auth("New user registration successful for %s\n", bbs_username(node->user));
+		bbs_user_cache_invalidate(node->user->id); /* In case anything was cached for this user ID before the record existed */
 		bbs_event_dispatch(node, EVENT_USER_REGISTRATION);
 	}
 	return res;
@@ -795,6 +810,7 @@ int bbs_user_reset_password(const char *username, const char *password)
 	if (!res) {
 		struct bbs_event event;
 		login_cache_cleanup(); /* Purge any cached passwords. Here we purge all of them, but could probably just do the relevant user only... */
+		bbs_user_cache_invalidate(bbs_userid_from_username(username)); /* If the user can't be resolved, this flushes all cached users */
 		bbs_auth("Password changed for user '%s'\n", username);
 		memset(&event, 0, sizeof(event));
 		event.type = EVENT_USER_PASSWORD_CHANGE;
@@ -820,6 +836,34 @@ struct bbs_user *bbs_user_info_by_username(const char *username)
 	return user;
 }
 
+struct bbs_user *bbs_user_info_by_id(unsigned int userid)
+{
+	int index = 0;
+	struct bbs_user *retuser = NULL;
+	struct bbs_user *user, **userlist;
+
+	if (!bbs_singular_callback_execute_pre(&useridinfohandler)) {
+		user = BBS_SINGULAR_CALLBACK_EXECUTE(useridinfohandler)(userid);
+		bbs_singular_callback_execute_post(&useridinfohandler);
+		return user;
+	}
+
+	/* The auth provider can't look up users by ID directly, so search the entire list */
+	userlist = bbs_user_list();
+	if (!userlist) {
+		return NULL;
+	}
+	while ((user = userlist[index++])) {
+		if (!retuser && user->id == userid) {
+			retuser = user; /* Keep this one */
+		} else {
+			bbs_user_destroy(user);
+		}
+	}
+	free(userlist); /* Free the list itself */
+	return retuser;
+}
+
 struct bbs_user **bbs_user_list(void)
 {
 	struct bbs_user **userlist = NULL;
@@ -593,6 +593,7 @@ static void bbs_shutdown(void)
 	bbs_configs_free_all(); /* Clean up any remaining configs that modules didn't. */
 	bbs_vars_cleanup();
 	bbs_cli_unregister_remaining();
+	bbs_shutdown_system(); /* Stop the spawn helper */
 	bbs_fd_shutdown();
 	bbs_mutex_unlock(&sig_lock); /* Don't release the lock until the very end */
 	bbs_mutex_destroy(&sig_lock);
@@ -1006,6 +1007,7 @@ int main(int argc, char *argv[])
 	CHECK_INIT(bbs_transfer_config_load());
 	CHECK_INIT(bbs_mail_init());
 	CHECK_INIT(bbs_init_auth());
+	CHECK_INIT(bbs_init_events());
 	CHECK_INIT(bbs_groups_init());
 	CHECK_INIT(bbs_load_menus(0));
 	CHECK_INIT(bbs_init_menu_handlers());
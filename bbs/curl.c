@@ -23,15 +23,325 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h> /* use strdup */
+#include <pthread.h>
 
 #include <curl/curl.h>
 
 #include "include/curl.h"
+#include "include/linkedlists.h"
+#include "include/module.h"
+#include "include/thread.h"
+#include "include/cli.h"
 
 #define BBS_CURL_USER_AGENT STRCAT(STRCAT(BBS_NAME, " "), BBS_VERSION)
 
+/*! \brief Request timeout, in seconds */
+#define CURL_TIMEOUT 20
+
+/*! \brief Maximum number of idle easy handles kept around for reuse */
+#define CURL_POOL_MAX_IDLE 8
+
+/*! \brief Maximum number of concurrent requests to any one host */
+#define CURL_MAX_HOST_CONNECTIONS 4
+
+/* All handles share the DNS cache, TLS session cache, and connection cache,
+ * so repeated requests to the same host can skip DNS resolution, the TCP handshake,
+ * and a full TLS handshake, even when made from different threads. */
+static CURLSH *share = NULL;
+static bbs_mutex_t share_locks[CURL_LOCK_DATA_LAST];
+
+/* Idle easy handles. curl_easy_reset retains the handle's caches, so reusing handles is cheaper than recreating them. */
+static CURL *idle_handles[CURL_POOL_MAX_IDLE];
+static unsigned int num_idle = 0;
+static unsigned long handles_created = 0;
+static unsigned long handles_reused = 0;
+static bbs_mutex_t pool_lock = BBS_MUTEX_INITIALIZER;
+
+struct host_stats {
+	unsigned int active;		/*!< Requests currently in progress (protected by slot_lock) */
+	unsigned int maxactive;		/*!< Most concurrent requests in progress (protected by slot_lock) */
+	unsigned long requests;		/*!< Completed requests */
+	unsigned long failures;		/*!< Requests that failed at the transport level */
+	unsigned long reused;		/*!< Requests that reused an existing connection */
+	unsigned long waits;		/*!< Requests that had to wait for another request to the host to finish (protected by slot_lock) */
+	curl_off_t totaltime;		/*!< Total time of all requests, in microseconds */
+	curl_off_t maxtime;			/*!< Longest request, in microseconds */
+	RWLIST_ENTRY(host_stats) entry;
+	char host[];
+};
+
+static RWLIST_HEAD_STATIC(hosts, host_stats);
+
+/* Connection slots are tracked separately from the rest of the statistics,
+ * so that synchronous requests can sleep until a slot is released, rather than polling. */
+static bbs_mutex_t slot_lock = BBS_MUTEX_INITIALIZER;
+static pthread_cond_t slot_cond = PTHREAD_COND_INITIALIZER;
+
+struct curl_response_data {
+	char *str;
+	char *resp;	/* XXX This is a total hack. For some reason str is NULL when we get back to main func so dup the pointer */
+	size_t len;
+};
+
+struct curl_transfer {
+	CURL *curl;
+	struct bbs_curl *c;
+	FILE *fp;
+	struct host_stats *host;
+	struct curl_response_data response;
+	/* Asynchronous requests only */
+	void (*callback)(struct bbs_curl *c, int res, void *data);
+	void *data;
+	void *module;
+	RWLIST_ENTRY(curl_transfer) entry;
+};
+
+/* Asynchronous requests are all driven by a single multi handle, in its own thread */
+static CURLM *multi = NULL;
+static pthread_t multi_thread;
+static int multi_stop = 0;
+static RWLIST_HEAD_STATIC(pending_transfers, curl_transfer);
+static RWLIST_HEAD_STATIC(running_transfers, curl_transfer); /* Only used by the worker thread */
+
+static void share_lock(CURL *handle, curl_lock_data data, curl_lock_access access, void *userptr)
+{
+	UNUSED(handle);
+	UNUSED(access);
+	UNUSED(userptr);
+	bbs_mutex_lock(&share_locks[data]);
+}
+
+static void share_unlock(CURL *handle, curl_lock_data data, void *userptr)
+{
+	UNUSED(handle);
+	UNUSED(userptr);
+	bbs_mutex_unlock(&share_locks[data]);
+}
+
+static CURL *handle_get(void)
+{
+	CURL *curl = NULL;
+
+	bbs_mutex_lock(&pool_lock);
+	if (num_idle) {
+		curl = idle_handles[--num_idle];
+		handles_reused++;
+	} else {
+		handles_created++;
+	}
+	bbs_mutex_unlock(&pool_lock);
+
+	if (curl) {
+		curl_easy_reset(curl); /* Resets all options, but keeps connections and caches */
+	} else {
+		curl = curl_easy_init();
+		if (!curl) {
+			bbs_warning("curl_easy_init failed\n");
+			return NULL;
+		}
+	}
+	if (share) {
+		curl_easy_setopt(curl, CURLOPT_SHARE, share);
+	}
+	return curl;
+}
+
+static void handle_put(CURL *curl)
+{
+	bbs_mutex_lock(&pool_lock);
+	if (num_idle < CURL_POOL_MAX_IDLE) {
+		idle_handles[num_idle++] = curl;
+		curl = NULL;
+	}
+	bbs_mutex_unlock(&pool_lock);
+
+	if (curl) {
+		curl_easy_cleanup(curl);
+	}
+}
+
+/*! \brief Get the host (and port, if present) from a URL */
+static void url_host(const char *url, char *buf, size_t len)
+{
+	const char *s, *end, *at;
+
+	s = strstr(url, "://");
+	s = s ? s + STRLEN("://") : url;
+	end = s + strcspn(s, "/?#");
+	at = memchr(s, '@', (size_t) (end - s));
+	if (at) {
+		s = at + 1; /* Skip userinfo */
+	}
+	snprintf(buf, len, "%.*s", (int) (end - s), s);
+}
+
+static struct host_stats *host_get(const char *url)
+{
+	struct host_stats *h;
+	char host[256];
+
+	url_host(url, host, sizeof(host));
+
+	RWLIST_WRLOCK(&hosts);
+	RWLIST_TRAVERSE(&hosts, h, entry) {
+		if (!strcasecmp(h->host, host)) {
+			break;
+		}
+	}
+	if (!h) {
+		h = calloc(1, sizeof(*h) + strlen(host) + 1);
+		if (ALLOC_SUCCESS(h)) {
+			strcpy(h->host, host); /* Safe */
+			RWLIST_INSERT_TAIL(&hosts, h, entry);
+		}
+	}
+	RWLIST_UNLOCK(&hosts);
+	return h;
+}
+
+/*!
+ * \brief Reserve one of a host's connection slots
+ * \param h
+ * \param wait Whether to wait for a slot to become available
+ * \retval 0 on success, -1 if no slot available
+ */
+static int host_acquire(struct host_stats *h, int wait)
+{
+	int waited = 0;
+	struct timespec deadline;
+
+	if (!h) {
+		return 0; /* Allocation failure earlier, just proceed without limiting */
+	}
+
+	bbs_mutex_lock(&slot_lock);
+	while (h->active >= CURL_MAX_HOST_CONNECTIONS) {
+		if (!wait) {
+			bbs_mutex_unlock(&slot_lock);
+			return -1;
+		}
+		if (!waited) {
+			bbs_debug(3, "Too many concurrent requests to %s, waiting\n", h->host);
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_sec += CURL_TIMEOUT;
+			waited = 1;
+		}
+		/* host_release signals whenever any host's slot is freed, so recheck after each wakeup */
+		if (bbs_cond_timedwait(&slot_cond, &slot_lock, &deadline) == ETIMEDOUT && h->active >= CURL_MAX_HOST_CONNECTIONS) {
+			bbs_mutex_unlock(&slot_lock);
+			bbs_warning("Timed out waiting for a connection slot for %s\n", h->host);
+			return -1;
+		}
+	}
+	h->active++;
+	h->maxactive = MAX(h->maxactive, h->active);
+	if (waited) {
+		h->waits++;
+	}
+	bbs_mutex_unlock(&slot_lock);
+	return 0;
+}
+
+static void host_release(struct host_stats *h, CURL *curl, CURLcode res)
+{
+	curl_off_t totaltime = 0;
+	long connects = 0;
+
+	if (!h) {
+		return;
+	}
+
+	bbs_mutex_lock(&slot_lock);
+	h->active--;
+	pthread_cond_broadcast(&slot_cond);
+	bbs_mutex_unlock(&slot_lock);
+	/* The multi handle is only created and destroyed with pending_transfers locked,
+	 * so hold the lock to ensure it stays valid while we use it. */
+	RWLIST_RDLOCK(&pending_transfers);
+	if (multi) {
+		curl_multi_wakeup(multi); /* Pending asynchronous transfers to this host may be able to start now */
+	}
+	RWLIST_UNLOCK(&pending_transfers);
+
+	curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &totaltime);
+	curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connects);
+
+	RWLIST_WRLOCK(&hosts);
+	h->requests++;
+	if (res != CURLE_OK) {
+		h->failures++;
+	} else if (!connects) {
+		h->reused++; /* No new connections were needed */
+	}
+	h->totaltime += totaltime;
+	h->maxtime = MAX(h->maxtime, totaltime);
+	RWLIST_UNLOCK(&hosts);
+}
+
+int bbs_curl_host_stats(const char *url, struct bbs_curl_host_stats *stats)
+{
+	struct host_stats *h;
+	char host[256];
+
+	url_host(url, host, sizeof(host));
+
+	RWLIST_RDLOCK(&hosts);
+	RWLIST_TRAVERSE(&hosts, h, entry) {
+		if (!strcasecmp(h->host, host)) {
+			stats->requests = h->requests;
+			stats->reused = h->reused;
+			stats->failures = h->failures;
+			break;
+		}
+	}
+	RWLIST_UNLOCK(&hosts);
+	return h ? 0 : -1;
+}
+
+static int cli_curl(struct bbs_cli_args *a)
+{
+	struct host_stats *h;
+
+	bbs_mutex_lock(&pool_lock);
+	bbs_dprintf(a->fdout, "Easy handles: %u idle, %lu created, %lu reused\n", num_idle, handles_created, handles_reused);
+	bbs_mutex_unlock(&pool_lock);
+
+	bbs_dprintf(a->fdout, "%-30s %6s %6s %8s %8s %6s %6s %8s %8s\n", "Host", "Active", "Max", "Requests", "Reused", "Failed", "Waited", "Avg (ms)", "Max (ms)");
+	RWLIST_RDLOCK(&hosts);
+	bbs_mutex_lock(&slot_lock);
+	RWLIST_TRAVERSE(&hosts, h, entry) {
+		long avg = h->requests ? (long) (h->totaltime / (curl_off_t) h->requests / 1000) : 0;
+		bbs_dprintf(a->fdout, "%-30s %6u %6u %8lu %8lu %6lu %6lu %8ld %8ld\n",
+			h->host, h->active, h->maxactive, h->requests, h->reused, h->failures, h->waits, avg, (long) (h->maxtime / 1000));
+	}
+	bbs_mutex_unlock(&slot_lock);
+	RWLIST_UNLOCK(&hosts);
+	return 0;
+}
+
+static struct bbs_cli_entry cli_commands_curl[] = {
+	BBS_CLI_COMMAND(cli_curl, "curl", 1, "Show cURL connection pool and per-host request statistics", NULL),
+};
+
+static void multi_stop_worker(void);
+
 int bbs_curl_shutdown(void)
 {
+	multi_stop_worker();
+
+	while (num_idle) {
+		curl_easy_cleanup(idle_handles[--num_idle]);
+	}
+	if (share) {
+		int i;
+		curl_share_cleanup(share);
+		share = NULL;
+		for (i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+			bbs_mutex_destroy(&share_locks[i]);
+		}
+	}
+	RWLIST_WRLOCK_REMOVE_ALL(&hosts, entry, free);
+
 	/* XXX Memory leak: https://curl-library.cool.haxx.narkive.com/e2XublwY/memory-leak-detected-by-valgrind
 	 * This is suppressed in valgrind.supp. */
 	curl_global_cleanup();
@@ -41,7 +351,25 @@ int bbs_curl_shutdown(void)
 int bbs_curl_init(void)
 {
 	curl_global_init(CURL_GLOBAL_ALL);
-	return 0;
+
+	share = curl_share_init();
+	if (share) {
+		int i;
+		for (i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+			bbs_mutex_init(&share_locks[i], NULL);
+		}
+		curl_share_setopt(share, CURLSHOPT_LOCKFUNC, share_lock);
+		curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, share_unlock);
+		curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+		curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+		if (curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT) != CURLSHE_OK) {
+			bbs_warning("This version of libcurl cannot share connections between handles\n");
+		}
+	} else {
+		bbs_warning("curl_share_init failed, handles will not share caches\n");
+	}
+
+	return bbs_cli_register_multiple(cli_commands_curl);
 }
 
 void bbs_curl_free(struct bbs_curl *c)
@@ -50,12 +378,6 @@ void bbs_curl_free(struct bbs_curl *c)
 	/* Don't actually free c, it's probably stack allocated! */
 }
 
-struct curl_response_data {
-	char *str;
-	char *resp;	/* XXX This is a total hack. For some reason str is NULL when we get back to main func so dup the pointer */
-	size_t len;
-};
-
 #define MAX_CURL_DOWNLOAD_SIZE 10000000 /* 10 MB */
 
 static size_t WriteMemoryCallback(void *restrict ptr, size_t size, size_t nmemb, void *restrict data)
@@ -111,47 +433,28 @@ static size_t WriteMemoryCallback(void *restrict ptr, size_t size, size_t nmemb,
 	return realsize;
 }
 
-static int curl_common_setup(CURL **curl_ptr, const char *url)
+static int curl_common_setup(CURL *curl, const char *url)
 {
-	CURL *curl;
-
-	if (strlen_zero(url)) {
-		bbs_warning("URL is empty!\n");
-		return -1;
-	}
-
-	curl = curl_easy_init();
-	if (!curl) {
-		bbs_warning("curl_easy_init failed\n");
-		return -1;
-	}
-
-	*curl_ptr = curl;
-
 	/* see https://curl.se/libcurl/c/ for documentation */
 
 	/* curl_easy_setopt: https://curl.se/libcurl/c/curl_easy_setopt.html */
 	if (curl_easy_setopt(curl, CURLOPT_USERAGENT, BBS_CURL_USER_AGENT)) {
 		bbs_warning("Failed to set cURL user agent\n");
-		goto cleanup;
+		return -1;
 	}
 	if (curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1)) {
 		bbs_warning("Failed to set cURL option NOSIGNAL\n");
-		goto cleanup;
+		return -1;
 	}
-	if (curl_easy_setopt(curl, CURLOPT_TIMEOUT, 20)) { /* Max 20 seconds */
+	if (curl_easy_setopt(curl, CURLOPT_TIMEOUT, CURL_TIMEOUT)) {
 		bbs_warning("Failed to set cURL timeout\n");
-		goto cleanup;
+		return -1;
 	}
 	if (curl_easy_setopt(curl, CURLOPT_URL, url)) {
 		bbs_warning("Failed to set cURL option CURLOPT_URL\n");
-		goto cleanup;
+		return -1;
 	}
 	return 0;
-
-cleanup:
-	curl_easy_cleanup(curl);
-	return -1;
 }
 
 #ifdef DEBUG_CURL
@@ -191,25 +494,40 @@ static int curl_debug(CURL *handle, curl_infotype type, char *data, size_t size,
 }
 #endif
 
-static int curl_common_run(CURL *curl, struct bbs_curl *c, FILE *fp)
+static int transfer_setup(struct curl_transfer *t, struct bbs_curl *c, FILE *fp, int post)
 {
-	int res, cres = -1;
-	struct curl_response_data response;
-	long http_code;
+	CURL *curl;
 
-	memset(&response, 0, sizeof(response));
+	if (strlen_zero(c->url)) {
+		bbs_warning("URL is empty!\n");
+		return -1;
+	}
+
+	memset(t, 0, sizeof(*t));
+	t->c = c;
+	t->fp = fp;
+
+	curl = handle_get();
+	if (!curl) {
+		return -1;
+	}
+	t->curl = curl;
+
+	if (curl_common_setup(curl, c->url)) {
+		goto cleanup;
+	}
 
 	if (fp) {
 		/* Write response body to a file */
 		curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, NULL);
 		if (curl_easy_setopt(curl, CURLOPT_WRITEDATA, fp)) {
 			bbs_warning("Failed to set cURL opt CURLOPT_WRITEDATA\n");
-			return -1;
+			goto cleanup;
 		}
 	} else {
 		/* Write response body to an allocated string */
 		curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteMemoryCallback);
-		if (curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response)) {
+		if (curl_easy_setopt(curl, CURLOPT_WRITEDATA, &t->response)) {
 			bbs_warning("Failed to set cURL WRITEDATA\n");
 		}
 	}
@@ -224,15 +542,49 @@ static int curl_common_run(CURL *curl, struct bbs_curl *c, FILE *fp)
 	curl_easy_setopt(curl, CURLOPT_DEBUGFUNCTION, curl_debug);
 	curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
 #endif
-	res = curl_easy_perform(curl);
+
+	if (post) {
+		if (curl_easy_setopt(curl, CURLOPT_POST, 1)) {
+			bbs_warning("Failed to set cURL option CURLOPT_POST\n");
+		}
+		if (c->postfields) {
+			if (curl_easy_setopt(curl, CURLOPT_POSTFIELDS, c->postfields)) {
+				bbs_warning("Failed to set POST fields\n");
+			}
+		} else {
+			bbs_debug(5, "No post fields in CURL POST... interesting...\n"); /* Not necessarily wrong, but strange... */
+		}
+	}
+
+	t->host = host_get(c->url);
+	return 0;
+
+cleanup:
+	handle_put(curl);
+	return -1;
+}
+
+/*!
+ * \brief Process the result of a completed transfer and release its resources
+ * \note The host slot must have been acquired
+ */
+static int transfer_finish(struct curl_transfer *t, CURLcode res)
+{
+	int cres = -1;
+	long http_code;
+	struct bbs_curl *c = t->c;
+	CURL *curl = t->curl;
+	FILE *fp = t->fp;
+
+	host_release(t->host, curl, res);
 
 	c->response = NULL;
 
 	if (res != CURLE_OK) {
 		bbs_warning("curl_easy_perform() failed for %s: %s\n", c->url, curl_easy_strerror(res));
-		if (response.len && response.str) {
-			response.str = response.resp;
-			free_if(response.str); /* Free response if we're not going to return it */
+		if (t->response.len && t->response.str) {
+			t->response.str = t->response.resp;
+			free_if(t->response.str); /* Free response if we're not going to return it */
 		}
 	} else {
 		int failed;
@@ -244,26 +596,26 @@ static int curl_common_run(CURL *curl, struct bbs_curl *c, FILE *fp)
 			long int sz = ftell(fp);
 			bbs_debug(4, "CURL Response Code: %ld - %ld bytes (%s)\n", http_code, sz, c->url);
 		} else {
-			bbs_debug(4, "CURL Response Code: %ld - %ld bytes (%s)\n", http_code, response.len, c->url);
+			bbs_debug(4, "CURL Response Code: %ld - %ld bytes (%s)\n", http_code, t->response.len, c->url);
 		}
 		c->http_code = (int) http_code;
 		failed = STARTS_WITH(c->url, "http") ? !HTTP_RESPONSE_SUCCESS(http_code) : http_code != 0;
 		if (c->forcefail && failed) {
-			bbs_debug(4, "Response failed, freeing response (length %ld)\n", response.len);
-			response.str = response.resp;
-			free_if(response.str); /* Free response if we're not going to return it */
+			bbs_debug(4, "Response failed, freeing response (length %ld)\n", t->response.len);
+			t->response.str = t->response.resp;
+			free_if(t->response.str); /* Free response if we're not going to return it */
 		} else {
-			if (response.len) {
-				if (!response.str && response.resp) {
+			if (t->response.len) {
+				if (!t->response.str && t->response.resp) {
 					bbs_debug(3, "Strange, str was NULL but resp was not?\n"); /* XXX See comments above */
-					response.str = response.resp;
+					t->response.str = t->response.resp;
 				} else {
-					response.str = response.resp; /* XXX Do it anyways, since response.str can be an invalid reference at this point */
+					t->response.str = t->response.resp; /* XXX Do it anyways, since response.str can be an invalid reference at this point */
 				}
-				if (!response.str) {
+				if (!t->response.str) {
 					bbs_warning("Response string is NULL?\n");
 				} else {
-					c->response = response.str; /* Caller is now responsible for freeing this when done */
+					c->response = t->response.str; /* Caller is now responsible for freeing this when done */
 				}
 			} else {
 				/* We don't want to read response and get garbage, so make it null terminated */
@@ -277,27 +629,38 @@ static int curl_common_run(CURL *curl, struct bbs_curl *c, FILE *fp)
 		}
 	}
 
-	curl_easy_cleanup(curl);
+	handle_put(curl); /* Return the handle (and its connection) to the pool */
 	return cres;
 }
 
-int bbs_curl_get(struct bbs_curl *c)
+static int curl_common_run(struct bbs_curl *c, FILE *fp, int post)
 {
-	CURL *curl = NULL; /* Dummy initialization to make gcc happy... we'll do the real initialization in curl_common_setup */
+	struct curl_transfer t;
+	CURLcode res;
 
-	if (curl_common_setup(&curl, c->url)) {
+	if (transfer_setup(&t, c, fp, post)) {
 		return -1;
 	}
+	if (host_acquire(t.host, 1)) {
+		bbs_warning("Timed out waiting to make request to %s\n", t.host->host);
+		handle_put(t.curl);
+		return -1;
+	}
+
+	res = curl_easy_perform(t.curl);
+	return transfer_finish(&t, res);
+}
 
+int bbs_curl_get(struct bbs_curl *c)
+{
 	bbs_debug(5, "cURL GET: %s\n", c->url);
-	return curl_common_run(curl, c, NULL);
+	return curl_common_run(c, NULL, 0);
 }
 
 int bbs_curl_get_file(struct bbs_curl *c, const char *filename)
 {
 	int res;
 	FILE *fp;
-	CURL *curl = NULL; /* Dummy initialization to make gcc happy... we'll do the real initialization in curl_common_setup */
 
 	fp = fopen(filename, "wb");
 	if (!fp) {
@@ -305,13 +668,8 @@ int bbs_curl_get_file(struct bbs_curl *c, const char *filename)
 		return -1;
 	}
 
-	if (curl_common_setup(&curl, c->url)) {
-		fclose(fp);
-		return -1;
-	}
-
 	bbs_debug(5, "cURL GET: %s -> %s\n", c->url, filename);
-	res = curl_common_run(curl, c, fp);
+	res = curl_common_run(c, fp, 0);
 
 	fclose(fp);
 	return res;
@@ -319,22 +677,153 @@ int bbs_curl_get_file(struct bbs_curl *c, const char *filename)
 
 int bbs_curl_post(struct bbs_curl *c)
 {
-	CURL *curl = NULL;
+	bbs_debug(5, "cURL POST: %s\n", c->url);
+	return curl_common_run(c, NULL, 1);
+}
+
+static void transfer_complete(struct curl_transfer *t, int res)
+{
+	t->callback(t->c, res, t->data);
+	if (t->module) {
+		bbs_module_unref(t->module, 1);
+	}
+	free(t);
+}
+
+static void *multi_worker(void *unused)
+{
+	struct curl_transfer *t;
 
-	if (curl_common_setup(&curl, c->url)) {
+	UNUSED(unused);
+
+	for (;;) {
+		CURLMsg *msg;
+		int msgs, stillrunning;
+		int finished = 0;
+
+		/* Start any pending transfers, as long as their hosts have free slots */
+		RWLIST_WRLOCK(&pending_transfers);
+		if (multi_stop) {
+			RWLIST_UNLOCK(&pending_transfers);
+			break;
+		}
+		RWLIST_TRAVERSE_SAFE_BEGIN(&pending_transfers, t, entry) {
+			if (host_acquire(t->host, 0)) {
+				continue; /* Try again once another request to this host finishes */
+			}
+			RWLIST_REMOVE_CURRENT(entry);
+			curl_easy_setopt(t->curl, CURLOPT_PRIVATE, t);
+			curl_multi_add_handle(multi, t->curl);
+			RWLIST_INSERT_TAIL(&running_transfers, t, entry);
+		}
+		RWLIST_TRAVERSE_SAFE_END;
+		RWLIST_UNLOCK(&pending_transfers);
+
+		curl_multi_perform(multi, &stillrunning);
+		while ((msg = curl_multi_info_read(multi, &msgs))) {
+			CURL *curl;
+			CURLcode res;
+			if (msg->msg != CURLMSG_DONE) {
+				continue;
+			}
+			curl = msg->easy_handle;
+			res = msg->data.result;
+			curl_easy_getinfo(curl, CURLINFO_PRIVATE, (char**) &t);
+			curl_multi_remove_handle(multi, curl); /* msg is no longer valid after this */
+			RWLIST_REMOVE(&running_transfers, t, entry);
+			transfer_complete(t, transfer_finish(t, res));
+			finished++;
+		}
+
+		if (!finished) {
+			/* If anything finished, loop again immediately, since pending transfers may be able to start now */
+			curl_multi_poll(multi, NULL, 0, SEC_MS(1), NULL);
+		}
+	}
+
+	/* Shutting down. Abort anything that hasn't finished yet. */
+	while ((t = RWLIST_REMOVE_HEAD(&running_transfers, entry))) {
+		curl_multi_remove_handle(multi, t->curl);
+		transfer_complete(t, transfer_finish(t, CURLE_ABORTED_BY_CALLBACK));
+	}
+	return NULL;
+}
+
+static void multi_stop_worker(void)
+{
+	struct curl_transfer *t;
+	CURLM *m;
+
+	RWLIST_WRLOCK(&pending_transfers);
+	multi_stop = 1;
+	if (!multi) {
+		RWLIST_UNLOCK(&pending_transfers);
+		return;
+	}
+	curl_multi_wakeup(multi);
+	RWLIST_UNLOCK(&pending_transfers);
+
+	bbs_pthread_join(multi_thread, NULL);
+
+	/* Transfers that never started */
+	while ((t = RWLIST_REMOVE_HEAD(&pending_transfers, entry))) {
+		handle_put(t->curl);
+		transfer_complete(t, -1);
+	}
+
+	/* Synchronous transfers may still be finishing, and they use the handle to wake up the worker */
+	RWLIST_WRLOCK(&pending_transfers);
+	m = multi;
+	multi = NULL;
+	RWLIST_UNLOCK(&pending_transfers);
+	curl_multi_cleanup(m);
+}
+
+int __bbs_curl_request_async(struct bbs_curl *c, int post, void (*callback)(struct bbs_curl *c, int res, void *data), void *data, void *mod)
+{
+	struct curl_transfer *t;
+
+	t = malloc(sizeof(*t));
+	if (ALLOC_FAILURE(t)) {
 		return -1;
 	}
-	if (curl_easy_setopt(curl, CURLOPT_POST, 1)) {
-		bbs_warning("Failed to set cURL option CURLOPT_POST\n");
+	if (transfer_setup(t, c, NULL, post)) {
+		free(t);
+		return -1;
+	}
+	t->callback = callback;
+	t->data = data;
+	t->module = mod;
+
+	RWLIST_WRLOCK(&pending_transfers);
+	if (multi_stop) {
+		RWLIST_UNLOCK(&pending_transfers);
+		handle_put(t->curl);
+		free(t);
+		return -1;
 	}
-	if (c->postfields) {
-		if (curl_easy_setopt(curl, CURLOPT_POSTFIELDS, c->postfields)) {
-			bbs_warning("Failed to set POST fields\n");
+	if (!multi) {
+		/* Start the worker on first use */
+		multi = curl_multi_init();
+		if (!multi || bbs_pthread_create(&multi_thread, NULL, multi_worker, NULL)) {
+			bbs_error("Failed to start asynchronous cURL worker\n");
+			if (multi) {
+				curl_multi_cleanup(multi);
+				multi = NULL;
+			}
+			RWLIST_UNLOCK(&pending_transfers);
+			handle_put(t->curl);
+			free(t);
+			return -1;
 		}
-	} else {
-		bbs_debug(5, "No post fields in CURL POST... interesting...\n"); /* Not necessarily wrong, but strange... */
 	}
+	if (mod) {
+		bbs_module_ref(mod, 1); /* Module can't be unloaded until the callback has executed */
+	}
+	RWLIST_INSERT_TAIL(&pending_transfers, t, entry);
+	curl_multi_wakeup(multi);
+	RWLIST_UNLOCK(&pending_transfers);
 
-	bbs_debug(5, "cURL POST: %s\n", c->url);
-	return curl_common_run(curl, c, NULL);
+	bbs_debug(5, "cURL %s (async): %s\n", post ? "POST" : "GET", c->url);
+	return 0;
 }
@@ -28,16 +28,75 @@
 #include "include/event.h"
 #include "include/node.h"
 #include "include/user.h"
+#include "include/alertpipe.h"
+#include "include/cli.h"
+
+/*! \brief Maximum number of events queued for an asynchronous consumer. Once full, further events are dropped. */
+#define ASYNC_QUEUE_MAX 256
+
+/*! \brief A copy of an event, queued for an asynchronous consumer */
+struct queued_event {
+	struct bbs_event event;
+	struct bbs_file_transfer_event transfer;	/*!< Copy of cdata, for file transfer events */
+	RWLIST_ENTRY(queued_event) entry;
+	char data[];								/*!< Storage for strings in transfer */
+};
+
+RWLIST_HEAD(event_queue, queued_event);
 
 struct event_consumer {
 	int (*callback)(struct bbs_event *event);
 	struct bbs_module *module;
+	/* Asynchronous consumers only */
+	struct event_queue queue;	/*!< Pending events */
+	pthread_t thread;			/*!< Worker thread that drains the queue */
+	int alertpipe[2];			/*!< Signaled for each queued event */
+	unsigned int queued;		/*!< Number of events currently queued */
+	unsigned int maxqueued;		/*!< High water mark of queue */
+	unsigned long delivered;	/*!< Number of events delivered */
+	unsigned long overflows;	/*!< Number of events dropped because the queue was full */
+	unsigned int async:1;		/*!< Events are delivered from a separate thread */
+	unsigned int stopping:1;	/*!< Worker should exit once the queue is empty */
 	RWLIST_ENTRY(event_consumer) entry;
 };
 
 static RWLIST_HEAD_STATIC(consumers, event_consumer);
 
-int __bbs_register_event_consumer(int (*callback)(struct bbs_event *event), void *mod)
+/*! \brief Deliver queued events to an asynchronous consumer, in the order they were broadcast */
+static void *event_worker(void *varg)
+{
+	struct event_consumer *c = varg;
+
+	for (;;) {
+		struct queued_event *qe;
+
+		RWLIST_WRLOCK(&c->queue);
+		qe = RWLIST_REMOVE_HEAD(&c->queue, entry);
+		if (qe) {
+			c->queued--;
+		}
+		RWLIST_UNLOCK(&c->queue);
+
+		if (!qe) {
+			if (c->stopping) {
+				break;
+			}
+			if (bbs_alertpipe_poll(c->alertpipe, -1) > 0) {
+				bbs_alertpipe_read(c->alertpipe);
+			}
+			continue;
+		}
+
+		bbs_module_ref(c->module, 2);
+		c->callback(&qe->event);
+		bbs_module_unref(c->module, 2);
+		c->delivered++;
+		free(qe);
+	}
+	return NULL;
+}
+
+static int register_consumer(int (*callback)(struct bbs_event *event), void *mod, int async)
 {
 	struct event_consumer *c;
 
@@ -59,11 +118,38 @@ int __bbs_register_event_consumer(int (*callback)(struct bbs_event *event), void
 	}
 	c->callback = callback;
 	c->module = mod;
+	if (async) {
+		SET_BITFIELD(c->async, 1);
+		RWLIST_HEAD_INIT(&c->queue);
+		if (bbs_alertpipe_create(c->alertpipe)) {
+			RWLIST_HEAD_DESTROY(&c->queue);
+			free(c);
+			RWLIST_UNLOCK(&consumers);
+			return -1;
+		}
+		if (bbs_pthread_create(&c->thread, NULL, event_worker, c)) {
+			bbs_alertpipe_close(c->alertpipe);
+			RWLIST_HEAD_DESTROY(&c->queue);
+			free(c);
+			RWLIST_UNLOCK(&consumers);
+			return -1;
+		}
+	}
 	RWLIST_INSERT_TAIL(&consumers, c, entry);
 	RWLIST_UNLOCK(&consumers);
 	return 0;
 }
 
+int __bbs_register_event_consumer(int (*callback)(struct bbs_event *event), void *mod)
+{
+	return register_consumer(callback, mod, 0);
+}
+
+int __bbs_register_event_consumer_async(int (*callback)(struct bbs_event *event), void *mod)
+{
+	return register_consumer(callback, mod, 1);
+}
+
 int bbs_unregister_event_consumer(int (*callback)(struct bbs_event *event))
 {
 	struct event_consumer *c;
@@ -72,12 +158,87 @@ int bbs_unregister_event_consumer(int (*callback)(struct bbs_event *event))
 	if (!c) {
 		bbs_error("Failed to unregister event consumer: not currently registered\n");
 		return -1;
-	} else {
-		free(c);
 	}
+	if (c->async) {
+		/* Nothing else can be queued now, so let the worker finish delivering what's left, then exit */
+		SET_BITFIELD(c->stopping, 1);
+		bbs_alertpipe_write(c->alertpipe);
+		bbs_pthread_join(c->thread, NULL);
+		bbs_alertpipe_close(c->alertpipe);
+		RWLIST_HEAD_DESTROY(&c->queue);
+	}
+	free(c);
 	return 0;
 }
 
+/*! \brief Queue a copy of an event for an asynchronous consumer */
+static void event_enqueue(struct event_consumer *c, struct bbs_event *event)
+{
+	struct queued_event *qe;
+	const struct bbs_file_transfer_event *transfer = NULL;
+	size_t userpathlen = 0, diskpathlen = 0;
+
+	switch (event->type) {
+		case EVENT_NODE_INTERACTIVE_START:
+		case EVENT_NODE_INTERACTIVE_LOGIN:
+			/* These need to be handled synchronously, since they refer to the node directly */
+			return;
+		case EVENT_FILE_DOWNLOAD_START:
+		case EVENT_FILE_DOWNLOAD_COMPLETE:
+		case EVENT_FILE_UPLOAD_START:
+		case EVENT_FILE_UPLOAD_COMPLETE:
+			transfer = event->cdata;
+			if (transfer) {
+				userpathlen = transfer->userpath ? strlen(transfer->userpath) + 1 : 0;
+				diskpathlen = transfer->diskpath ? strlen(transfer->diskpath) + 1 : 0;
+			}
+			break;
+		default:
+			break;
+	}
+
+	RWLIST_WRLOCK(&c->queue);
+	if (c->queued >= ASYNC_QUEUE_MAX) {
+		c->overflows++;
+		RWLIST_UNLOCK(&c->queue);
+		if (c->overflows == 1 || !(c->overflows % 100)) {
+			bbs_warning("Event queue for %s is full, dropped %s (%lu dropped so far)\n", bbs_module_name(c->module), bbs_event_name(event->type), c->overflows);
+		}
+		return;
+	}
+
+	qe = malloc(sizeof(*qe) + userpathlen + diskpathlen);
+	if (ALLOC_FAILURE(qe)) {
+		RWLIST_UNLOCK(&c->queue);
+		return;
+	}
+	memcpy(&qe->event, event, sizeof(qe->event));
+	qe->event.node = NULL; /* The node may be gone by the time the event is delivered */
+	if (transfer) {
+		char *pos = qe->data;
+		memcpy(&qe->transfer, transfer, sizeof(qe->transfer));
+		if (userpathlen) {
+			memcpy(pos, transfer->userpath, userpathlen);
+			qe->transfer.userpath = pos;
+			pos += userpathlen;
+		}
+		if (diskpathlen) {
+			memcpy(pos, transfer->diskpath, diskpathlen);
+			qe->transfer.diskpath = pos;
+		}
+		qe->event.cdata = &qe->transfer;
+	} else {
+		qe->event.cdata = NULL;
+	}
+	memset(&qe->entry, 0, sizeof(qe->entry));
+	RWLIST_INSERT_TAIL(&c->queue, qe, entry);
+	c->queued++;
+	c->maxqueued = MAX(c->maxqueued, c->queued);
+	RWLIST_UNLOCK(&c->queue);
+
+	bbs_alertpipe_write(c->alertpipe);
+}
+
 const char *bbs_event_name(enum bbs_event_type type)
 {
 	switch (type) {
@@ -127,6 +288,11 @@ int bbs_event_broadcast(struct bbs_event *event)
 	RWLIST_RDLOCK(&consumers);
 	RWLIST_TRAVERSE(&consumers, c, entry) {
 		int mres;
+		if (c->async) {
+			/* The outcome isn't known yet, so asynchronous consumers can't affect the return value */
+			event_enqueue(c, event);
+			continue;
+		}
 		bbs_module_ref(c->module, 1);
 		mres = c->callback(event);
 		bbs_module_unref(c->module, 1);
@@ -217,3 +383,29 @@ int bbs_event_dispatch_custom(struct bbs_node *node, enum bbs_event_type type, c
 
 	return bbs_event_broadcast(&event);
 }
+
+static int cli_events(struct bbs_cli_args *a)
+{
+	struct event_consumer *c;
+
+	bbs_dprintf(a->fdout, "%-25s %-5s %6s %6s %10s %8s\n", "Module", "Mode", "Queued", "Max", "Delivered", "Dropped");
+	RWLIST_RDLOCK(&consumers);
+	RWLIST_TRAVERSE(&consumers, c, entry) {
+		if (c->async) {
+			bbs_dprintf(a->fdout, "%-25s %-5s %6u %6u %10lu %8lu\n", bbs_module_name(c->module), "async", c->queued, c->maxqueued, c->delivered, c->overflows);
+		} else {
+			bbs_dprintf(a->fdout, "%-25s %-5s %6s %6s %10s %8s\n", bbs_module_name(c->module), "sync", "-", "-", "-", "-");
+		}
+	}
+	RWLIST_UNLOCK(&consumers);
+	return 0;
+}
+
+static struct bbs_cli_entry cli_commands_events[] = {
+	BBS_CLI_COMMAND(cli_events, "events", 1, "List event consumers and their queues", NULL),
+};
+
+int bbs_init_events(void)
+{
+	return bbs_cli_register_multiple(cli_commands_events);
+}
@@ -235,6 +235,29 @@ int __bbs_mutex_unlock(bbs_mutex_t *t, const char *filename, int lineno, const c
 	return res;
 }
 
+int __bbs_cond_timedwait(pthread_cond_t *cond, bbs_mutex_t *t, const struct timespec *abstime, const char *filename, int lineno, const char *func, const char *name)
+{
+	int res;
+
+	if (unlikely(t->info.owners != 1)) {
+		lock_error("Attempt to wait on condition with unheld mutex %s\n", name);
+	}
+
+	/* The mutex is released for the duration of the wait, so other threads may lock it in the meantime */
+	t->info.owners--;
+	res = pthread_cond_timedwait(cond, &t->mutex, abstime);
+	if (unlikely(res && res != ETIMEDOUT)) {
+		lock_warning("Failed to wait on condition with mutex %s: %s\n", name, strerror(res));
+	}
+	t->info.lastlocked = time(NULL);
+	if (unlikely(++t->info.owners != 1)) {
+		lock_error("Mutex %s locked more than once?\n", name);
+	}
+	STORE_CALLER_INFO();
+
+	return res;
+}
+
 int __bbs_rwlock_init(bbs_rwlock_t *t, const char *filename, int lineno, const char *func, const char *name)
 {
 	int res;
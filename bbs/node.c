@@ -44,6 +44,7 @@
 #include "include/notify.h"
 #include "include/cli.h"
 #include "include/reload.h"
+#include "include/system.h" /* use bbs_pidfd_open */
 
 #define DEFAULT_MAX_NODES 64
 
@@ -442,58 +443,65 @@ int bbs_node_safe_sleep(struct bbs_node *node, int ms)
 	return res;
 }
 
-static int kill_pid(pid_t *pidptr)
+/*!
+ * \brief Wait for a process to exit after signaling it
+ * \param pidfd pidfd for the process, or -1 if not available
+ * \param pidptr Cleared by the thread waiting on the process once it has exited
+ * \param ms Maximum time to wait
+ * \retval 1 if exited, 0 if not
+ */
+static int child_exited(int pidfd, pid_t *pidptr, int ms)
 {
 	int i;
-	pid_t pid = *pidptr;
-
-	/* Executing an external process? Kill it, so the node thread (which is the thread waiting on it) can return.
-	 * First, try politely, but get aggressive if we have to.
-	 * Remember that there's already another thread waiting on the child in system.c.
-	 * It's not our job to wait on the child, the thread that called fork() is doing that right now.
-	 */
 
-	/* Send a SIGINT first, in case that will effect an exit. */
-	if (kill(pid, SIGINT)) {
-		bbs_error("kill failed: %s\n", strerror(errno));
+	if (pidfd != -1) {
+		/* The pidfd becomes readable as soon as the process terminates, no need to poll *pidptr */
+		return bbs_poll(pidfd, ms) > 0 || !*pidptr;
 	}
+
 	for (i = 0; *pidptr && i < 25; i++) {
 		/* In practice, even 1 us is enough time for this to work.
 		 * But if some reason it takes longer,
 		 * keep trying for a little bit with exponential backoff. */
 		usleep((unsigned int) i + 1);
 	}
-	/* Next, try a SIGTERM */
-	if (*pidptr) {
-		if (kill(pid, SIGTERM)) {
+	return !*pidptr;
+}
+
+static int kill_pid(pid_t *pidptr)
+{
+	/* First, try politely, but get aggressive if we have to. */
+	const int signals[] = { SIGINT, SIGTERM, SIGKILL };
+	const int waitms[] = { 100, 250, 1000 };
+	size_t i;
+	int pidfd;
+	pid_t pid = *pidptr;
+
+	/* Executing an external process? Kill it, so the node thread (which is the thread waiting on it) can return.
+	 * Remember that there's already another thread waiting on the child in system.c.
+	 * It's not our job to wait on the child, the thread that called fork() is doing that right now.
+	 * The process may also be a child of the spawn helper, rather than the BBS, which is fine for pidfds.
+	 */
+	pidfd = bbs_pidfd_open(pid);
+	if (pidfd == -1 && errno == ESRCH) {
+		bbs_debug(3, "Child process %d already exited\n", pid);
+		return 0;
+	}
+
+	for (i = 0; i < ARRAY_LEN(signals); i++) {
+		if (kill(pid, signals[i])) {
 			bbs_error("kill failed: %s\n", strerror(errno));
 		}
-		/* Just to make sure, see if it really died. */
-		for (i = 0; *pidptr && i < 25; i++) {
-			usleep((unsigned int) i + 1);
-		}
-		/* If node->childpid is still set, then send a SIGKILL and get on with it. */
-		if (*pidptr) {
-			if (kill(pid, SIGKILL)) {
-				bbs_error("kill failed: %s\n", strerror(errno));
-			}
-			/* Just to make sure, see if it really died. */
-			for (i = 0; *pidptr && i < 25; i++) {
-				usleep((unsigned int) i + 1);
-			}
-			if (*pidptr) {
-				bbs_error("Child process %d has not exited yet?\n", pid);
-				return -1;
-			} else {
-				bbs_debug(3, "Killed child process %d using SIGKILL after %d iterations\n", pid, i);
-			}
-		} else {
-			bbs_debug(3, "Killed child process %d using SIGINT after %d iterations\n", pid, i);
+		if (child_exited(pidfd, pidptr, waitms[i])) {
+			bbs_debug(3, "Killed child process %d using %s\n", pid, i == 0 ? "SIGINT" : i == 1 ? "SIGTERM" : "SIGKILL");
+			close_if(pidfd);
+			return 0;
 		}
-	} else {
-		bbs_debug(3, "Killed child process %d using SIGINT after %d iterations\n", pid, i);
 	}
-	return 0;
+
+	close_if(pidfd);
+	bbs_error("Child process %d has not exited yet?\n", pid);
+	return -1;
 }
 
 int bbs_node_kill_child(struct bbs_node *node)
@@ -504,8 +512,189 @@ int bbs_node_kill_child(struct bbs_node *node)
 	return -1;
 }
 
+/* Presence index: which registered users are logged in, and on which nodes.
+ * This is maintained as nodes log in and out, so that questions like
+ * "is this user online?" don't require walking the entire node list. */
+
+/*! \brief Number of hash buckets for online users */
+#define PRESENCE_BUCKETS 64
+
+struct online_user {
+	unsigned int userid;
+	unsigned int numnodes;		/*!< Number of nodes the user is logged in on */
+	unsigned int allocated;		/*!< Allocated size of nodeids */
+	unsigned int *nodeids;		/*!< Node numbers */
+	struct online_user *next;	/*!< Next user in the same bucket */
+};
+
+static struct online_user *presence[PRESENCE_BUCKETS];
+static unsigned int online_users = 0;
+static bbs_rwlock_t presence_lock = BBS_RWLOCK_INITIALIZER;
+
+struct presence_watcher {
+	void (*watcher)(PRESENCE_WATCHER_PARAMS);
+	void *module;
+	RWLIST_ENTRY(presence_watcher) entry;
+};
+
+static RWLIST_HEAD_STATIC(presence_watchers, presence_watcher);
+
+int __bbs_register_presence_watcher(void (*watcher)(PRESENCE_WATCHER_PARAMS), void *mod)
+{
+	struct presence_watcher *w;
+
+	RWLIST_WRLOCK(&presence_watchers);
+	RWLIST_TRAVERSE(&presence_watchers, w, entry) {
+		if (w->watcher == watcher) {
+			break;
+		}
+	}
+	if (w) {
+		bbs_error("Presence watcher is already registered\n");
+		RWLIST_UNLOCK(&presence_watchers);
+		return -1;
+	}
+	w = calloc(1, sizeof(*w));
+	if (ALLOC_FAILURE(w)) {
+		RWLIST_UNLOCK(&presence_watchers);
+		return -1;
+	}
+	w->watcher = watcher;
+	w->module = mod;
+	RWLIST_INSERT_TAIL(&presence_watchers, w, entry);
+	RWLIST_UNLOCK(&presence_watchers);
+	return 0;
+}
+
+int bbs_unregister_presence_watcher(void (*watcher)(PRESENCE_WATCHER_PARAMS))
+{
+	struct presence_watcher *w;
+
+	w = RWLIST_WRLOCK_REMOVE_BY_FIELD(&presence_watchers, watcher, watcher, entry);
+	if (!w) {
+		bbs_error("Failed to unregister presence watcher: not currently registered\n");
+		return -1;
+	}
+	free(w);
+	return 0;
+}
+
+static void presence_notify(unsigned int userid, unsigned int nodeid, int online, unsigned int numnodes)
+{
+	struct presence_watcher *w;
+
+	RWLIST_RDLOCK(&presence_watchers);
+	RWLIST_TRAVERSE(&presence_watchers, w, entry) {
+		bbs_module_ref(w->module, 2);
+		w->watcher(userid, nodeid, online, numnodes);
+		bbs_module_unref(w->module, 2);
+	}
+	RWLIST_UNLOCK(&presence_watchers);
+}
+
+/*! \note Must be called with presence_lock held */
+static struct online_user *presence_find(unsigned int userid, struct online_user ***prevptr)
+{
+	struct online_user *ou, **prev = &presence[userid % PRESENCE_BUCKETS];
+
+	for (ou = *prev; ou; prev = &ou->next, ou = ou->next) {
+		if (ou->userid == userid) {
+			break;
+		}
+	}
+	if (prevptr) {
+		*prevptr = prev;
+	}
+	return ou;
+}
+
+void bbs_node_presence_add(struct bbs_node *node)
+{
+	struct online_user *ou, **prev;
+	unsigned int userid, numnodes, i;
+
+	if (!bbs_user_is_registered(node->user)) {
+		return; /* Guests aren't tracked, since they don't have a user ID */
+	}
+
+	userid = node->user->id;
+	bbs_rwlock_wrlock(&presence_lock);
+	ou = presence_find(userid, &prev);
+	if (!ou) {
+		ou = calloc(1, sizeof(*ou));
+		if (ALLOC_FAILURE(ou)) {
+			bbs_rwlock_unlock(&presence_lock);
+			return;
+		}
+		ou->userid = userid;
+		*prev = ou; /* Append to bucket */
+		online_users++;
+	}
+	for (i = 0; i < ou->numnodes; i++) {
+		if (ou->nodeids[i] == node->id) {
+			bbs_rwlock_unlock(&presence_lock);
+			return; /* Already tracked */
+		}
+	}
+	if (ou->numnodes == ou->allocated) {
+		unsigned int newsize = ou->allocated ? ou->allocated * 2 : 2;
+		unsigned int *newids = realloc(ou->nodeids, newsize * sizeof(*newids));
+		if (ALLOC_FAILURE(newids)) {
+			bbs_rwlock_unlock(&presence_lock);
+			return;
+		}
+		ou->nodeids = newids;
+		ou->allocated = newsize;
+	}
+	ou->nodeids[ou->numnodes++] = node->id;
+	numnodes = ou->numnodes;
+	bbs_rwlock_unlock(&presence_lock);
+
+	presence_notify(userid, node->id, 1, numnodes);
+}
+
+static void presence_remove(struct bbs_node *node)
+{
+	struct online_user *ou, **prev;
+	unsigned int userid, numnodes, i;
+
+	if (!bbs_user_is_registered(node->user)) {
+		return;
+	}
+
+	userid = node->user->id;
+	bbs_rwlock_wrlock(&presence_lock);
+	ou = presence_find(userid, &prev);
+	if (ou) {
+		for (i = 0; i < ou->numnodes; i++) {
+			if (ou->nodeids[i] == node->id) {
+				break;
+			}
+		}
+	}
+	if (!ou || i == ou->numnodes) {
+		/* Node logged out without ever being added, e.g. it never finished logging in */
+		bbs_rwlock_unlock(&presence_lock);
+		return;
+	}
+	ou->nodeids[i] = ou->nodeids[--ou->numnodes]; /* Order doesn't matter */
+	numnodes = ou->numnodes;
+	if (!numnodes) {
+		*prev = ou->next;
+		free(ou->nodeids);
+		free(ou);
+		online_users--;
+	}
+	bbs_rwlock_unlock(&presence_lock);
+
+	presence_notify(userid, node->id, 0, numnodes);
+}
+
 int bbs_node_logout(struct bbs_node *node)
 {
+	if (node->user) {
+		presence_remove(node);
+	}
 	bbs_user_destroy(node->user);
 	node->user = NULL;
 	return 0;
@@ -1016,17 +1205,46 @@ static int cli_node(struct bbs_cli_args *a)
 
 int bbs_user_online(unsigned int userid)
 {
-	struct bbs_node *n;
+	return bbs_user_node_count(userid) ? 1 : 0;
+}
 
-	RWLIST_RDLOCK(&nodes);
-	RWLIST_TRAVERSE(&nodes, n, entry) {
-		if (n->user && n->user->id == userid) {
-			break;
-		}
+unsigned int bbs_user_node_count(unsigned int userid)
+{
+	struct online_user *ou;
+	unsigned int numnodes = 0;
+
+	bbs_rwlock_rdlock(&presence_lock);
+	ou = presence_find(userid, NULL);
+	if (ou) {
+		numnodes = ou->numnodes;
 	}
-	RWLIST_UNLOCK(&nodes);
+	bbs_rwlock_unlock(&presence_lock);
+	return numnodes;
+}
+
+unsigned int bbs_user_nodes(unsigned int userid, unsigned int *nodeids, unsigned int max)
+{
+	struct online_user *ou;
+	unsigned int numnodes = 0;
+
+	bbs_rwlock_rdlock(&presence_lock);
+	ou = presence_find(userid, NULL);
+	if (ou) {
+		numnodes = MIN(ou->numnodes, max);
+		memcpy(nodeids, ou->nodeids, numnodes * sizeof(*nodeids));
+	}
+	bbs_rwlock_unlock(&presence_lock);
+	return numnodes;
+}
+
+unsigned int bbs_online_user_count(void)
+{
+	unsigned int count;
 
-	return n ? 1 : 0;
+	bbs_rwlock_rdlock(&presence_lock);
+	count = online_users;
+	bbs_rwlock_unlock(&presence_lock);
+	return count;
 }
 
 struct bbs_node *bbs_node_get(unsigned int nodenum)
@@ -2095,12 +2313,17 @@ void bbs_node_exit(struct bbs_node *node)
 	}
 }
 
+void bbs_node_term_session(struct bbs_node *node)
+{
+	bbs_node_begin(node);
+	node_handler_term(node); /* Run the normal terminal handler */
+}
+
 void *bbs_node_handler(void *varg)
 {
 	struct bbs_node *node = varg;
 
-	bbs_node_begin(node);
-	node_handler_term(node); /* Run the normal terminal handler */
+	bbs_node_term_session(node);
 	bbs_node_exit(node);
 
 	return NULL;
@@ -26,60 +26,144 @@
 #include "include/utils.h"
 #include "include/range.h"
 
-int in_range_allocated(const char *s, int num, char *sequences)
+struct range_interval {
+	unsigned int min;
+	unsigned int max;
+};
+
+struct range_set {
+	int num;	/* Number of intervals */
+	struct range_interval intervals[];	/* Sorted, non-overlapping, non-adjacent intervals */
+};
+
+static int interval_cmp(const void *a, const void *b)
+{
+	const struct range_interval *x = a, *y = b;
+	return x->min < y->min ? -1 : x->min > y->min ? 1 : 0;
+}
+
+static unsigned int parse_range_number(const char *s)
 {
-	char *sequence;
+	if (!strcmp(s, "*")) {
+		return UINT_MAX;
+	}
+	return (unsigned int) strtoul(s, NULL, 10);
+}
 
-	strcpy(sequences, s); /* This is safe, as it is assumed that sequences itself was strdup'd or malloc'd from s / strlen(s) + 1 previously */
+struct range_set *range_set_parse(const char *s)
+{
+	struct range_set *set;
+	const char *c;
+	int i, num = 1;
 
-	/*! \todo since atoi would stop on a , anyways, strsep isn't really necessary.
-	 * We could parse the string in place, avoiding the need to allocate and copy in the first place. */
+	for (c = s; *c; c++) {
+		if (*c == ',') {
+			num++;
+		}
+	}
 
-	while ((sequence = strsep(&sequences, ","))) {
-		int min, max;
-		char *begin = strsep(&sequence, ":");
-		if (strlen_zero(begin)) {
+	set = malloc(sizeof(*set) + (size_t) num * sizeof(struct range_interval));
+	if (ALLOC_FAILURE(set)) {
+		return NULL;
+	}
+	set->num = 0;
+
+	while (*s) {
+		char sequence[32];
+		char *begin, *end;
+		size_t len = strcspn(s, ",");
+		struct range_interval *interval;
+
+		if (!len || len >= sizeof(sequence)) {
+			bbs_warning("Malformed range: %.*s\n", (int) len, s);
+			goto next;
+		}
+		memcpy(sequence, s, len);
+		sequence[len] = '\0';
+		end = sequence;
+		begin = strsep(&end, ":");
+		if (strlen_zero(begin) || (end && strlen_zero(end))) {
 			bbs_warning("Malformed range: %s\n", s);
-			continue;
+			goto next;
 		}
-		if (!strcmp(begin, "*")) {
-			/* Something like just *, everything matches */
-			return 1;
+		interval = &set->intervals[set->num++];
+		if (!end && !strcmp(begin, "*")) {
+			/* Just *, without knowing the largest number in use, we have to assume that everything matches */
+			interval->min = 1;
+			interval->max = UINT_MAX;
+			goto next;
 		}
-		min = atoi(begin);
-		if (num < min) {
-			continue;
+		interval->min = parse_range_number(begin);
+		interval->max = end ? parse_range_number(end) : interval->min;
+		if (interval->min > interval->max) {
+			/* 4:2 is the same as 2:4 */
+			unsigned int tmp = interval->min;
+			interval->min = interval->max;
+			interval->max = tmp;
 		}
-		if (sequence) {
-			if (!strcmp(sequence, "*")) { /* Something like 1:* */
-				max = INT_MAX;
+next:
+		s += len;
+		if (*s == ',') {
+			s++;
+		}
+	}
+
+	if (set->num > 1) {
+		/* Sort and merge any overlapping or adjacent intervals */
+		qsort(set->intervals, (size_t) set->num, sizeof(struct range_interval), interval_cmp);
+		num = 0;
+		for (i = 1; i < set->num; i++) {
+			struct range_interval *last = &set->intervals[num];
+			if (last->max == UINT_MAX || set->intervals[i].min <= last->max + 1) {
+				last->max = MAX(last->max, set->intervals[i].max);
 			} else {
-				max = atoi(sequence);
+				set->intervals[++num] = set->intervals[i];
 			}
-		} else {
-			max = min;
 		}
-		if (num > max) {
-			continue;
+		set->num = num + 1;
+	}
+	return set;
+}
+
+/*! \brief Index of the last interval whose lower bound is <= num, -1 if none */
+static int range_set_find(const struct range_set *set, unsigned int num)
+{
+	int low = 0, high = set->num - 1, res = -1;
+
+	while (low <= high) {
+		int mid = low + (high - low) / 2;
+		if (set->intervals[mid].min <= num) {
+			res = mid;
+			low = mid + 1;
+		} else {
+			high = mid - 1;
 		}
-		return 1; /* Matches */
 	}
-	return 0;
+	return res;
+}
+
+int range_set_contains(const struct range_set *set, unsigned int num)
+{
+	int i = range_set_find(set, num);
+	return i >= 0 && num <= set->intervals[i].max;
+}
+
+void range_set_free(struct range_set *set)
+{
+	free(set);
 }
 
 int in_range(const char *s, int num)
 {
-	int res = 0;
-	char *dup;
+	int res;
+	struct range_set *set;
 
-	dup = strdup(s);
-	if (ALLOC_FAILURE(dup)) {
+	set = range_set_parse(s);
+	if (!set) {
 		return 0;
 	}
-
-	res = in_range_allocated(s, num, dup);
-
-	free(dup);
+	res = range_set_contains(set, (unsigned int) num);
+	range_set_free(set);
 	return res;
 }
 
@@ -67,6 +67,7 @@
 #include "include/net.h"
 #include "include/linkedlists.h"
 #include "include/startup.h"
+#include "include/module.h"
 
 extern int option_rebind;
 
@@ -636,6 +637,7 @@ int bbs_socket_pending_shutdown(int fd)
 
 struct tcp_listener {
 	void *(*handler)(void *varg);
+	int (*triage)(enum bbs_tcp_triage_event event, int fd, const char *ip);
 	void *module;
 	int port;
 	int socket;
@@ -666,11 +668,96 @@ static struct tcp_listener *list_add_listener(int port, int sfd, const char *nam
 	return l;
 }
 
+/*! \brief Maximum number of connections that may be held for triage at once. Beyond this, the triage callback decides whether to reject or hand off. */
+#define MAX_TRIAGE_CONNECTIONS 256
+
+/*! \brief A connection accepted by the multilistener that is being held for triage, without a node or thread */
+struct tcp_held {
+	int fd;
+	int port;
+	struct sockaddr_in sinaddr;
+	struct timeval deadline;
+	const char *name;
+	void *(*handler)(void *varg);
+	int (*triage)(enum bbs_tcp_triage_event event, int fd, const char *ip);
+	void *module;
+	char ip[56];
+};
+
+/*! \brief Create a node for a newly accepted connection, and spawn a thread to service it */
+static void tcp_handoff(int sfd, struct sockaddr_in *sinaddr, int port, const char *name, void *(*handler)(void *varg), void *module)
+{
+	struct bbs_node *node;
+
+	/* Note that name is const memory allocated as part of the listener.
+	 * That means the listener must not go away while any nodes are using it
+	 * (which shouldn't happen anyways) */
+	node = __bbs_node_request(sfd, name, module);
+	if (!node) {
+		close(sfd);
+	} else if (bbs_save_remote_ip(sinaddr, node)) {
+		bbs_node_unlink(node);
+	} else {
+		node->port = (short unsigned int) port;
+		node->skipjoin = 1;
+		if (bbs_pthread_create_detached(&node->thread, NULL, handler, node)) { /* Run the BBS on this node */
+			bbs_node_unlink(node);
+		}
+	}
+}
+
+/*! \brief Stop holding a connection without handing it off */
+static void tcp_held_drop(struct tcp_held *h)
+{
+	h->triage(TCP_TRIAGE_RELEASE, h->fd, h->ip);
+	close(h->fd);
+	bbs_module_unref(h->module, 1);
+}
+
+/*!
+ * \brief Run the triage callback for a connection and act on the result
+ * \param h
+ * \param event. If not TCP_TRIAGE_CONNECT, the connection is currently being held.
+ * \retval 1 if the connection is still being held, 0 if it is no longer held
+ */
+static int tcp_triage(struct tcp_held *h, enum bbs_tcp_triage_event event)
+{
+	int res = h->triage(event, h->fd, h->ip);
+
+	if (res > 0) {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Waggregate-return"
+		h->deadline = bbs_tvnow();
+#pragma GCC diagnostic pop
+		h->deadline.tv_sec += res / 1000;
+		h->deadline.tv_usec += (res % 1000) * 1000;
+		if (h->deadline.tv_usec >= 1000000) {
+			h->deadline.tv_sec++;
+			h->deadline.tv_usec -= 1000000;
+		}
+		return 1;
+	}
+	if (event != TCP_TRIAGE_CONNECT) {
+		h->triage(TCP_TRIAGE_RELEASE, h->fd, h->ip);
+	}
+	if (res < 0) {
+		bbs_debug(3, "%s connection from %s rejected during triage\n", h->name, h->ip);
+		close(h->fd);
+	} else {
+		tcp_handoff(h->fd, &h->sinaddr, h->port, h->name, h->handler, h->module);
+	}
+	bbs_module_unref(h->module, 1);
+	return 0;
+}
+
 /*! \brief Single thread to poll all registered TCP listeners, to avoid creating lots of listener threads (similar to ssl_io_thread in tls.c) */
 static void *tcp_multilistener(void *unused)
 {
 	static RWLIST_HEAD_STATIC(listeners_local, tcp_listener);
+	static struct tcp_held held[MAX_TRIAGE_CONNECTIONS];
+	int num_held = 0;
 	int num_sockets = 0;
+	int i;
 	struct pollfd *pfds = NULL;
 	int exiting = 0;
 	int rebuild = 1; /* This thread isn't started unless there's a listener, so we need to build a list from the get go. */
@@ -678,7 +765,8 @@ static void *tcp_multilistener(void *unused)
 	UNUSED(unused);
 
 	for (;;) {
-		int i, res;
+		int res, timeout = -1;
+		struct timeval now;
 		struct tcp_listener *l, *l2;
 		if (bbs_is_shutting_down() && !exiting) {
 			/* Stop accepting connections on this socket. We do this to prevent an influx of connections
@@ -697,18 +785,31 @@ static void *tcp_multilistener(void *unused)
 			RWLIST_TRAVERSE(&listeners, l, entry) {
 				l2 = list_add_listener(l->port, l->socket, l->name, l->handler, l->module);
 				if (ALLOC_SUCCESS(l2)) {
+					l2->triage = l->triage;
 					RWLIST_INSERT_TAIL(&listeners_local, l2, entry);
 					num_sockets++;
 				}
 			}
 			RWLIST_UNLOCK(&listeners);
 			bbs_debug(6, "TCP multilistener is now watching %d socket%s\n", num_sockets, ESS(num_sockets));
+			/* Drop any held connections whose listener went away (or that we won't get to finish, if we're exiting) */
+			for (i = 0; i < num_held; i++) {
+				RWLIST_TRAVERSE(&listeners_local, l, entry) {
+					if (l->port == held[i].port && l->triage) {
+						break;
+					}
+				}
+				if (!l || exiting) {
+					tcp_held_drop(&held[i]);
+					held[i--] = held[--num_held];
+				}
+			}
 			if (!num_sockets && bbs_is_shutting_down()) {
 				/* If we're shutting down and we're the last listener, then we can safely exit. */
 				break;
 			}
 			free_if(pfds);
-			pfds = calloc((size_t) num_sockets + 1, sizeof(*pfds));
+			pfds = calloc((size_t) num_sockets + 1 + MAX_TRIAGE_CONNECTIONS, sizeof(*pfds));
 			if (ALLOC_FAILURE(pfds)) {
 				break; /* Uh oh... */
 			}
@@ -725,7 +826,24 @@ static void *tcp_multilistener(void *unused)
 		for (i = 0; i < num_sockets + 1; i++) {
 			pfds[i].revents = 0;
 		}
-		res = poll(pfds, (nfds_t) num_sockets + 1, -1);
+		/* Held connections come after the listeners, and wake us up either when they send something or when their time is up */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Waggregate-return"
+		now = bbs_tvnow();
+#pragma GCC diagnostic pop
+		for (i = 0; i < num_held; i++) {
+			int64_t remaining = bbs_tvdiff_ms(held[i].deadline, now);
+			pfds[num_sockets + 1 + i].fd = held[i].fd;
+			pfds[num_sockets + 1 + i].events = POLLIN;
+			pfds[num_sockets + 1 + i].revents = 0;
+			if (remaining < 0) {
+				remaining = 0;
+			}
+			if (timeout < 0 || remaining < timeout) {
+				timeout = (int) remaining;
+			}
+		}
+		res = poll(pfds, (nfds_t) (num_sockets + 1 + num_held), timeout);
 		if (res < 0) {
 			if (errno != EINTR) {
 				bbs_warning("poll returned error: %s\n", strerror(errno));
@@ -738,16 +856,39 @@ static void *tcp_multilistener(void *unused)
 			rebuild = 1;
 			continue; /* Rebuild list immediately */
 		}
+		if (num_held) {
+			/* Process held connections first, since accepting new connections may add more.
+			 * Iterate backwards, so that entries can be removed as we go. */
+			int held_at_poll = num_held;
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Waggregate-return"
+			now = bbs_tvnow();
+#pragma GCC diagnostic pop
+			for (i = held_at_poll - 1; i >= 0; i--) {
+				struct tcp_held *h = &held[i];
+				int still_held;
+				if (pfds[num_sockets + 1 + i].revents) {
+					res--;
+					still_held = tcp_triage(h, TCP_TRIAGE_INPUT);
+				} else if (bbs_tvdiff_ms(h->deadline, now) <= 0) {
+					still_held = tcp_triage(h, TCP_TRIAGE_EXPIRE);
+				} else {
+					continue;
+				}
+				if (!still_held) {
+					held[i] = held[--num_held];
+				}
+			}
+		}
 		i = 0; /* The first listener is at index 1, so start at 0 so the ++ will start us at 1 */
 		RWLIST_TRAVERSE(&listeners_local, l, entry) {
 			struct sockaddr_in sinaddr;
 			socklen_t len;
 			int sfd;
-			struct bbs_node *node;
 			char new_ip[56];
 
 			i++;
-			if (!res || i >= num_sockets + 1) {
+			if (res <= 0 || i >= num_sockets + 1) {
 				break;
 			} else if (!pfds[i].revents) {
 				continue;
@@ -768,24 +909,39 @@ static void *tcp_multilistener(void *unused)
 			bbs_soft_assert(l->name != NULL);
 			bbs_debug(1, "Accepting new %s connection from %s\n", l->name, new_ip);
 
-			/* Note that l->name is const memory allocated as part of l.
-			 * That means the listener must not go away while any nodes are using it
-			 * (which shouldn't happen anyways) */
-			node = __bbs_node_request(sfd, l->name, l->module);
-			if (!node) {
-				close(sfd);
-			} else if (bbs_save_remote_ip(&sinaddr, node)) {
-				bbs_node_unlink(node);
-			} else {
-				node->port = (short unsigned int) l->port;
-				node->skipjoin = 1;
-				if (bbs_pthread_create_detached(&node->thread, NULL, l->handler, node)) { /* Run the BBS on this node */
-					bbs_node_unlink(node);
+			if (l->triage && num_held < MAX_TRIAGE_CONNECTIONS) {
+				/* Let the listener decide what to do with this connection before we commit a node and thread to it */
+				struct tcp_held *h = &held[num_held];
+				h->fd = sfd;
+				h->port = l->port;
+				h->sinaddr = sinaddr;
+				h->name = l->name;
+				h->handler = l->handler;
+				h->triage = l->triage;
+				h->module = l->module;
+				safe_strncpy(h->ip, new_ip, sizeof(h->ip));
+				bbs_module_ref(h->module, 1); /* Module can't go away while it's holding connections */
+				if (tcp_triage(h, TCP_TRIAGE_CONNECT)) {
+					num_held++;
 				}
+				continue;
+			} else if (l->triage) {
+				/* No room to hold it, so let the listener decide whether to take it anyways */
+				if (l->triage(TCP_TRIAGE_FULL, sfd, new_ip) < 0) {
+					bbs_debug(3, "Too many connections held for triage, rejected %s connection from %s\n", l->name, new_ip);
+					close(sfd);
+					continue;
+				}
+				bbs_debug(3, "Too many connections held for triage, handing off %s connection from %s immediately\n", l->name, new_ip);
 			}
+
+			tcp_handoff(sfd, &sinaddr, l->port, l->name, l->handler, l->module);
 		}
 	}
 
+	for (i = 0; i < num_held; i++) {
+		tcp_held_drop(&held[i]);
+	}
 	free_if(pfds);
 	bbs_alertpipe_close(multilistener_alertpipe);
 	RWLIST_WRLOCK_REMOVE_ALL(&listeners_local, entry, free);
@@ -933,6 +1089,30 @@ int bbs_stop_tcp_listener(int port)
 	return 0;
 }
 
+int bbs_tcp_listener_set_triage(int port, int (*triage)(enum bbs_tcp_triage_event event, int fd, const char *ip))
+{
+	struct tcp_listener *l;
+
+	RWLIST_WRLOCK(&listeners);
+	RWLIST_TRAVERSE(&listeners, l, entry) {
+		if (l->port == port) {
+			l->triage = triage;
+			break;
+		}
+	}
+	RWLIST_UNLOCK(&listeners);
+
+	if (!l) {
+		bbs_error("Port %d is not registered\n", port);
+		return -1;
+	}
+
+	if (bbs_is_fully_started()) {
+		bbs_alertpipe_write(multilistener_alertpipe); /* Pick up the change */
+	}
+	return 0;
+}
+
 void bbs_tcp_listener3(int socket, int socket2, int socket3, const char *name, const char *name2, const char *name3, void *(*handler)(void *varg), void *module)
 {
 	struct sockaddr_in sinaddr;
@@ -37,6 +37,9 @@
 #include <sched.h> /* use clone */
 #include <dirent.h>
 #include <termios.h>
+#include <poll.h>
+#include <ftw.h>
+#include <sys/socket.h>
 
 #include <sys/mount.h>
 
@@ -74,6 +77,12 @@ static int display_motd = 0;
 static int maxmemory = 0;
 static int maxcpu = 0;
 static int minnice = 0;
+static int containerpool = 0;
+
+static int spawn_helper_enabled = 1;
+
+static int spawn_helper_start(void);
+static void spawn_helper_update_config(void);
 
 static int load_config(void)
 {
@@ -99,15 +108,22 @@ static int load_config(void)
 			return -1;
 		}
 	}
+	bbs_config_val_set_int(cfg, "container", "pool", &containerpool);
+	bbs_config_val_set_true(cfg, "spawn", "helper", &spawn_helper_enabled);
 
 	return 0;
 }
 
 static int reload_container(int fd)
 {
-	/* No locking is needed, since these are only accessed in the child process,
-	 * so in fact, locks would do no good. */
+	/* These settings are only used by the processes that launch programs:
+	 * the spawn helper, which has its own copy that we send it below,
+	 * and, for programs executed directly, children forked from this process,
+	 * which get a snapshot of them at fork time.
+	 * Neither can take our locks, so there is nothing to lock here.
+	 * At worst, a program launched during a reload gets a mix of old and new settings. */
 	load_config();
+	spawn_helper_update_config();
 	bbs_dprintf(fd, "Reloaded isoexec container settings\n");
 	return 0;
 }
@@ -115,7 +131,11 @@ static int reload_container(int fd)
 int bbs_init_system(void)
 {
 	bbs_register_reload_handler("container", "Reload isoexec container settings", reload_container);
-	return load_config();
+	if (load_config()) {
+		return -1;
+	}
+	/* Start the spawn helper now, while the BBS process is still small */
+	return spawn_helper_start();
 }
 
 /* Can be used to debug controlling terminal for child
@@ -180,7 +200,22 @@ static int set_controlling_term(int fd)
 	return pres;
 }
 
-static int term_type_exists(const char *term)
+/*! \brief How long to remember that a terminal type is missing, so adding it to the terminfo database takes effect reasonably soon */
+#define TERM_CACHE_NEGATIVE_SECS 300
+
+/*! \brief Maximum number of missing terminal types to remember. TERM is client-supplied, so these can't be allowed to accumulate. */
+#define TERM_CACHE_NEGATIVE_MAX 32
+
+struct term_type {
+	time_t checked;
+	unsigned int exists:1;
+	RWLIST_ENTRY(term_type) entry;
+	char name[];
+};
+
+static RWLIST_HEAD_STATIC(term_types, term_type);
+
+static int __term_type_exists(const char *term)
 {
 	/* Check if a term type exists in the system.
 	 * libtermcap doesn't seem to offer an easy way to query
@@ -196,30 +231,127 @@ static int term_type_exists(const char *term)
 	 * may need to add that to the termcap database.
 	 */
 	pid_t pid;
-	int status;
+	int res, waitfd, nullfd;
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wdiscarded-qualifiers"
 #pragma GCC diagnostic ignored "-Wcast-qual"
-	char *const argv[] = { (char*) "infocmp", term, NULL };
+	char *const argv[] = { (char*) "infocmp", (char*) term, NULL };
+#pragma GCC diagnostic pop
 
-	pid = fork();
+	nullfd = open("/dev/null", O_WRONLY);
+	if (nullfd == -1) {
+		bbs_error("open failed: %s\n", strerror(errno));
+		return -1;
+	}
+	pid = bbs_spawn(-1, nullfd, "infocmp", argv, NULL, &waitfd);
+	close(nullfd);
 	if (pid < 0) {
-		bbs_error("fork failed: %s\n", strerror(errno));
 		return -1;
-	} else if (!pid) {
-		execvp("infocmp", argv);
-		_exit(errno);
 	}
-#pragma GCC diagnostic pop
-	waitpid(pid, &status, WUNTRACED | WCONTINUED);
-	if (WIFEXITED(status)) {
-		status = WEXITSTATUS(status);
-		if (status) {
-			return 0;
+	res = bbs_spawn_wait(pid, waitfd, "infocmp");
+	if (res < 0) {
+		return -1;
+	}
+	return res ? 0 : 1;
+}
+
+static int term_type_exists(const char *term)
+{
+	struct term_type *t;
+	time_t now = time(NULL);
+	int exists, missing = 0;
+
+	/* Asking infocmp means executing a program, so remember the answer */
+	RWLIST_RDLOCK(&term_types);
+	RWLIST_TRAVERSE(&term_types, t, entry) {
+		if (!strcmp(t->name, term)) {
+			break;
+		}
+	}
+	if (t && (t->exists || t->checked > now - TERM_CACHE_NEGATIVE_SECS)) {
+		exists = t->exists;
+		RWLIST_UNLOCK(&term_types);
+		return exists;
+	}
+	RWLIST_UNLOCK(&term_types);
+
+	exists = __term_type_exists(term);
+	if (exists < 0) {
+		return exists; /* Couldn't tell, so don't cache anything */
+	}
+
+	RWLIST_WRLOCK(&term_types);
+	RWLIST_TRAVERSE_SAFE_BEGIN(&term_types, t, entry) {
+		if (!strcmp(t->name, term)) {
+			break;
+		}
+		if (!t->exists) {
+			/* Purge missing types that are no longer current, and if there are still too many, the ones added longest ago (at the tail) */
+			if (t->checked <= now - TERM_CACHE_NEGATIVE_SECS || ++missing >= TERM_CACHE_NEGATIVE_MAX) {
+				RWLIST_REMOVE_CURRENT(entry);
+				free(t);
+			}
 		}
 	}
+	RWLIST_TRAVERSE_SAFE_END;
+	if (!t) {
+		t = calloc(1, sizeof(*t) + strlen(term) + 1);
+		if (ALLOC_FAILURE(t)) {
+			RWLIST_UNLOCK(&term_types);
+			return exists;
+		}
+		strcpy(t->name, term); /* Safe */
+		RWLIST_INSERT_HEAD(&term_types, t, entry);
+	}
+	t->exists = exists ? 1 : 0;
+	t->checked = now;
+	RWLIST_UNLOCK(&term_types);
+	return exists;
+}
+
+#ifdef __linux__
+#if !defined(SYS_pidfd_open) && defined(__NR_pidfd_open)
+#define SYS_pidfd_open __NR_pidfd_open
+#endif
+#endif /* __linux__ */
+
+int bbs_pidfd_open(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+	return (int) syscall(SYS_pidfd_open, pid, 0);
+#else
+	UNUSED(pid);
+	errno = ENOSYS;
+	return -1;
+#endif
+}
 
-	return 1;
+/*! \brief Translate the wait status of a process that has terminated to the result of executing it */
+static void exit_status(pid_t pid, const char *filename, int status, int *res)
+{
+	if (WIFEXITED(status)) { /* Child terminated normally */
+		*res = WEXITSTATUS(status);
+		bbs_debug(5, "Process %d (%s) exited, status %d\n", pid, filename, *res);
+	} else if (WIFSIGNALED(status)) { /* Child terminated by signal */
+		bbs_debug(3, "Process %d (%s) killed, signal %d\n", pid, filename, WTERMSIG(status));
+		/* Return 0, and menu exec will return -1 if it detects node shutdown */
+		*res = 0;
+	}
+
+	if (*res > 0) {
+		/* Sometimes it can be legitimate for programs to exit nonzero, and that's not our fault. */
+		switch (*res) {
+			/* These are probably due to misconfigurations, and should be raised to the sysop's attention */
+			case ENOENT:
+			case EPERM:
+				bbs_warning("Command failed (%d - %s): %s\n", *res, strerror(*res), filename);
+				break;
+			default:
+				bbs_debug(1, "Command failed (%d - %s): %s\n", *res, strerror(*res), filename);
+		}
+	} else {
+		bbs_debug(4, "Command execution finished (%s): res = %d\n", filename, *res);
+	}
 }
 
 static void waitpidexit(pid_t pid, const char *filename, int *res)
@@ -232,40 +364,19 @@ static void waitpidexit(pid_t pid, const char *filename, int *res)
 		w = waitpid(pid, &status, WUNTRACED | WCONTINUED);
 		if (w == -1) {
 			bbs_error("waitpid (%s): %s\n", filename, strerror(errno));
-			break;
+			return;
 		}
-		if (WIFEXITED(status)) { /* Child terminated normally */
-			*res = WEXITSTATUS(status);
-			bbs_debug(5, "Process %d (%s) exited, status %d\n", pid, filename, *res);
-		} else if (WIFSIGNALED(status)) { /* Child terminated by signal */
-			bbs_debug(3, "Process %d (%s) killed, signal %d\n", pid, filename, WTERMSIG(status));
-			/* Return 0, and menu exec will return -1 if it detects node shutdown */
-			*res = 0;
-		} else if (WIFSTOPPED(status)) { /* Child stopped by signal */
+		if (WIFSTOPPED(status)) { /* Child stopped by signal */
 			bbs_debug(3, "Process %d (%s) stopped, signal %d\n", pid, filename, WSTOPSIG(status));
 			kill(pid, SIGCONT); /* Continue the child */
 		} else if (WIFCONTINUED(status)) { /* Child resumed by SIGCONT */
 			bbs_debug(3, "Process %d (%s) continued\n", pid, filename);
-		} else {
+		} else if (!WIFEXITED(status) && !WIFSIGNALED(status)) {
 			bbs_debug(3, "Process %d (%s) has status %d\n", pid, filename, status);
 		}
 	} while (!WIFEXITED(status) && !WIFSIGNALED(status));
 
-	if (*res > 0) {
-		/* Sometimes it can be legitimate for programs to exit nonzero, and that's not our fault. */
-		switch (*res) {
-			/* These are probably due to misconfigurations, and should be raised to the sysop's attention */
-			case ENOENT:
-			case EPERM:
-				bbs_warning("Command failed (%d - %s): %s\n", *res, strerror(*res), filename);
-				break;
-			default:
-				bbs_debug(1, "Command failed (%d - %s): %s\n", *res, strerror(*res), filename);
-		}
-	} else {
-		bbs_debug(4, "Command execution finished (%s): res = %d\n", filename, *res);
-	}
-	return;
+	exit_status(pid, filename, status, res);
 }
 
 static int fdlimit = -1;
@@ -297,19 +408,22 @@ static void my_close_range(int start, int end)
 }
 #endif
 
-static void cleanup_fds(int maxfd, int fdin, int fdout, int exclude)
+static void cleanup_fds(int maxfd, int fdin, int fdout, int fderr, int exclude)
 {
 	int minfd = 0;
 	int exempt = 0;
-	int fds[4];
+	int i, fds[4];
 
 	/* Don't close these file descriptors */
 	if (fdin >= 0) {
 		fds[exempt++] = fdin;
 	}
-	if (fdout >= 0 && fdout != fdin) { /* These are often the same, if so, no need to include twice */
+	if (fdout >= 0) {
 		fds[exempt++] = fdout;
 	}
+	if (fderr >= 0) {
+		fds[exempt++] = fderr;
+	}
 	if (exclude >= 0) {
 		fds[exempt++] = exclude;
 	}
@@ -322,30 +436,26 @@ static void cleanup_fds(int maxfd, int fdin, int fdout, int exclude)
 	minfd = STDERR_FILENO + 1;
 #endif
 
-	child_debug(5, "Cleaning up file descriptors [%d, %d], %d exempt: %d, %d, %d\n", minfd, maxfd, exempt, fdin, fdout, exclude);
+	child_debug(5, "Cleaning up file descriptors [%d, %d], %d exempt: %d, %d, %d, %d\n", minfd, maxfd, exempt, fdin, fdout, fderr, exclude);
 
 	/* Close all open file descriptors, so the child doesn't inherit any of them, except for node->slavefd
 	 * And yes, we close STDIN/STDOUT/STDERR as well since these refer to the sysop console, if there even is one.
 	 * The BBS node has nothing to do with that. */
 
 	/* If first is greater than last, close_range will return EINVAL,
-	 * so we can just pass in the next excluded fd - 1 for each chunk. */
-	if (exempt > 0) {
-		close_range(minfd, fds[0] - 1, 0);
-		minfd = fds[0] + 1;
-		if (exempt > 1) {
-			close_range(minfd, fds[1] - 1, 0);
-			minfd = fds[1] + 1;
-			if (exempt > 2) {
-				close_range(minfd, fds[2] - 1, 0);
-				minfd = fds[2] + 1;
-			}
+	 * so we can just pass in the next excluded fd - 1 for each chunk.
+	 * These are often the same (e.g. fdin and fdout), so skip duplicates. */
+	for (i = 0; i < exempt; i++) {
+		if (fds[i] < minfd) {
+			continue;
 		}
+		close_range(minfd, fds[i] - 1, 0);
+		minfd = fds[i] + 1;
 	}
 	close_range(minfd, maxfd, 0);
 }
 
-static int exec_pre(int fdin, int fdout, int exclude)
+static int exec_pre(int fdin, int fdout, int fderr, int exclude)
 {
 	struct rlimit rl;
 
@@ -365,7 +475,7 @@ static int exec_pre(int fdin, int fdout, int exclude)
 		child_debug(7, "fdlimit %d\n", fdlimit);
 	}
 
-	cleanup_fds(fdlimit - 1, fdin, fdout, exclude);
+	cleanup_fds(fdlimit - 1, fdin, fdout, fderr, exclude);
 
 	/* Assign the appropriate file descriptors */
 	if (fdin != -1) {
@@ -373,7 +483,9 @@ static int exec_pre(int fdin, int fdout, int exclude)
 	}
 	if (fdout != -1) {
 		dup2(fdout, STDOUT_FILENO);
-		dup2(fdout, STDERR_FILENO);
+	}
+	if (fderr != -1) {
+		dup2(fderr, STDERR_FILENO);
 	}
 
 	return 0;
@@ -542,7 +654,39 @@ static void temp_container_root(char *buf, size_t len, int pid)
 	snprintf(buf, len, "%s/%d", rundir, pid);
 }
 
-static int clone_container(char *rootdir, size_t rootlen, int pid)
+/*!
+ * \brief Create the skeleton of a container root: an empty directory for each top-level directory in the template
+ * \note Does not log, since this is also used by the spawn helper
+ */
+static int container_skeleton(const char *rootdir)
+{
+	DIR *dir;
+	struct dirent *entry;
+
+	if (!(dir = opendir(templatedir))) {
+		return -1;
+	}
+	if (mkdir(rootdir, 0700)) {
+		closedir(dir);
+		return -1;
+	}
+	while ((entry = readdir(dir)) != NULL) {
+		char symlinkdir[PATH_MAX];
+		if ((entry->d_type != DT_DIR && entry->d_type != DT_LNK) || !strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) {
+			continue;
+		}
+		/* We can't bind without a directory existing there already */
+		snprintf(symlinkdir, sizeof(symlinkdir), "%s/%s", rootdir, entry->d_name);
+		if (mkdir(symlinkdir, 0700)) {
+			closedir(dir);
+			return -1;
+		}
+	}
+	closedir(dir);
+	return 0;
+}
+
+static int clone_container(char *rootdir, size_t rootlen, int pid, int prebuilt)
 {
 	/* templatedir contains a base, template root filesystem.
 	 * However, we need to clone certain directories for a functional "container",
@@ -558,18 +702,22 @@ static int clone_container(char *rootdir, size_t rootlen, int pid)
 
 	/* Each session (not just each user) gets its own directory. So use the current PID, not the user ID. */
 	temp_container_root(rootdir, rootlen, pid);
-	if (!eaccess(rootdir, R_OK) && bbs_delete_directory(rootdir)) {
-		/* If it exists, delete it, it must be leftover from a previous session with the same PID.
-		 * Can't be an in-use session because that would imply a second process with the same PID. */
-		closedir(dir);
-		return -1;
-	}
 
-	/* Now, make the directory fresh */
-	if (mkdir(rootdir, 0700)) {
-		bbs_error("mkdir(%s) failed: %s\n", rootdir, strerror(errno));
-		closedir(dir);
-		return -1;
+	/* If the spawn helper already renamed a pre-built root from its pool to this path,
+	 * all the directories already exist and we only need to do the mounts. */
+	if (!prebuilt) {
+		if (!eaccess(rootdir, R_OK) && bbs_delete_directory(rootdir)) {
+			/* If it exists, delete it, it must be leftover from a previous session with the same PID.
+			 * Can't be an in-use session because that would imply a second process with the same PID. */
+			closedir(dir);
+			return -1;
+		}
+		/* Now, make the directory fresh */
+		if (container_skeleton(rootdir)) {
+			bbs_error("Failed to create container root %s: %s\n", rootdir, strerror(errno));
+			closedir(dir);
+			return -1;
+		}
 	}
 
 	while ((entry = readdir(dir)) != NULL) { /* Don't just bail out if errno becomes set, modules could set errno when we load them. */
@@ -608,12 +756,6 @@ static int clone_container(char *rootdir, size_t rootlen, int pid)
 		snprintf(fulldir, sizeof(fulldir), "%s/%s", templatedir, entry->d_name);
 		snprintf(symlinkdir, sizeof(symlinkdir), "%s/%s", rootdir, entry->d_name);
 
-		/* We can't bind without a directory existing there already */
-		if (mkdir(symlinkdir, 0700)) {
-			bbs_error("mkdir(%s) failed: %s\n", symlinkdir, strerror(errno));
-			return -1;
-		}
-
 		/* Don't symlink these, we'll make fresh copies momentarily */
 		if (!strcmp(entry->d_name, "proc") || !strcmp(entry->d_name, "tmp") || !strcmp(entry->d_name, "home")) {
 			continue;
@@ -725,98 +867,317 @@ static ssize_t full_read(int fd, char *restrict buf, size_t len)
 }
 #endif /* ISOEXEC_SUPPORTED */
 
+/*! \brief Everything needed to launch a program, whether in this process or in the spawn helper */
+struct exec_params {
+	const char *filename;		/* Program name to execute */
+	char *const *argv;			/* Arguments */
+	char *const *envp;			/* Environment, NULL to use the default environment */
+	int fdin;					/* STDIN for the program, or -1 */
+	int fdout;					/* STDOUT for the program, or -1 */
+	int fderr;					/* STDERR for the program, or -1 */
+	int isolated;				/* Isolation level, see __bbs_execvpe_fd */
+	unsigned int ctty:1;		/* Make fdin the controlling terminal */
+	unsigned int motd:1;		/* Display the container's MOTD, if launching a shell and displaymotd is enabled */
+	unsigned int userenv:1;		/* Set up the user's home directory and environment inside the container */
+	unsigned int registered:1;	/* User is registered and homedir is the user's home directory */
+	unsigned int publicwrite:1;	/* Public transfer directory is writable */
+	char term[32];				/* TERM, for the default environment */
+	char username[32];			/* Lowercase username, for BBS_USER */
+	char homedir[256];			/* User's home directory on the host, for isolated execution */
+	char publichome[256];		/* Public transfer directory on the host, if the user may access it */
+};
+
 /*!
- * \brief Execute an external program. Most calls to exec() should funnel through this function...
- * \param node
- * \param usenode
- * \param fdin
- * \param fdout
- * \param filename Program name to execute
- * \param argv Arguments
- * \param envp Environment (optional)
- * \param isolated Isolation level. 0 = no isolation. 1 = isolated in separate namespace, no network. 2 = isolated in separate namespace, sharing host network
- * \retval -1 on failure
- * \return Result of program execution
+ * \brief Finish setting up the child process and execute the program. Never returns.
+ * \param p
+ * \param procfd Read end of pipe on which the parent signals that it has set up the namespace, for isolated execution
+ * \note No BBS logging can be done here, since this runs in a newly forked child process
  */
-static int __bbs_execvpe_fd(struct bbs_node *node, int usenode, int fdin, int fdout, const char *filename, char *const argv[], char *const envp[], int isolated)
+static void __attribute__((noreturn)) exec_child(const struct exec_params *p, int procfd)
 {
-	pid_t pid;
-	struct termios term;
-	int fd = fdout;
-	int res = -1;
-	int pfd[2], procpipe[2];
-	char fullpath[256] = "", fullterm[32] = "";
+	int res;
+	char fullpath[256] = "", fullterm[40] = "";
+	char *const *envp = p->envp;
 #ifdef ISOEXEC_SUPPORTED
-	/* Only needed if isoexec is supported */
-	int public_home_dir_readable = 0, public_home_dir_writable = 0; /* Should not need to be initialized, but gcc complains if it isn't */
 	char fulluser[48] = "", homeenv[433] = "HOME=";
 #endif /* ISOEXEC_SUPPORTED */
 	char *parentpath;
-#define MYENVP_SIZE 5 /* End with 3 NULLs so we can add up to 2 env vars if needed */
-	char *myenvp[MYENVP_SIZE] = { fullpath, fullterm, NULL, NULL, NULL }; /* Last NULL is always the sentinel */
-
-#ifdef __FreeBSD__
-	if (isolated) {
-		/* The mount() API is not implemented in clone_container for FreeBSD.
-		 * Additionally, CLONE_NEW... is not available for FreeBSD.
-		 * As such, these preclude isoexec from being used on that platform. */
-		bbs_error("Sorry, isoexec(%s) is not supported on FreeBSD\n", filename);
-		return -1;
-	}
-#endif
+#define MYENVP_SIZE 5 /* PATH, TERM, BBS_USER, HOME, and NULL sentinel */
+	char *myenvp[MYENVP_SIZE] = { NULL };
+	int envc = 0;
 
 	if (!envp) {
+		parentpath = getenv("PATH"); /* Use $PATH with which BBS was started, for execvpe */
+		if (parentpath) {
+			snprintf(fullpath, sizeof(fullpath), "PATH=%s", parentpath);
+			myenvp[envc++] = fullpath;
+		}
+		if (!s_strlen_zero(p->term)) {
+			snprintf(fullterm, sizeof(fullterm), "TERM=%s", p->term);
+			myenvp[envc++] = fullterm;
+		}
 		envp = myenvp;
 	}
 
-	parentpath = getenv("PATH"); /* Use $PATH with which BBS was started, for execvpe */
-	if (parentpath) {
-		snprintf(fullpath, sizeof(fullpath), "PATH=%s", parentpath);
-	}
+	if (!p->isolated) {
+		/* Immediately install a dummy signal handler for SIGWINCH.
+		 * Until we call exec, the child retains the parent's signal handlers.
+		 * However, if we have a node, we immediately call bbs_node_update_winsize
+		 * to force send a SIGWINCH to the child immediately, to give it its current dimensions.
+		 * If we don't block SIGWINCH in the child, then it'll run __sigwinch_handler
+		 * from bbs.c, which will print out a log message if parent has option_nofork (bad!)
+		 * This still reeks of a race condition, but in practice we're able to block the signal
+		 * here ASAP before the parent does the SIGWINCH (but if we didn't do this, we would
+		 * send the SIGWINCH before the child executes exec).
+		 * It's actually a GOOD thing the SIGWINCH is sent prior to exec, this way the child
+		 * process has the dimensions available immediately when the program starts. So this
+		 * is probably the best thing to do here.
+		 */
 
-	bbs_debug(6, "node: %p, usenode: %d, fdin: %d, fdout: %d, filename: %s, isolated: %s\n", node, usenode, fdin, fdout, filename, isolated ? "yes" : "no");
-	if (node && usenode && (fdin != -1 || fdout != -1)) {
-		bbs_warning("fdin/fdout should not be provided if usenode == 1 (node is preferred, fdin/fdout will be ignored)\n");
+		/* SIG_IGN will survive exec, so we must avoid that.
+		 * We could install an empty handler since we want this to go away with exec(), or just use SIG_DFL to reset to default.
+		 * Normally we should use sigaction over signal, and probably here too, but this signal handler
+		 * will only be relevant from the time between fork() and exec(), and my intuition suggests that
+		 * signal will execute faster than sigaction. I have not actually verified this though. */
+		/* XXX Maybe we should just always use clone() and always pass CLONE_CLEAR_SIGHAND */
+		signal(SIGWINCH, SIG_DFL);
+		/* Reset other signal handlers */
+		signal(SIGTERM, SIG_DFL);
+		signal(SIGINT, SIG_DFL);
+		signal(SIGPIPE, SIG_DFL);
+	} /* else, if CLONE_CLEAR_SIGHAND was provided to clone, then the signal handlers didn't carry over, we're good. */
+	signal(SIGCHLD, SIG_DFL); /* The spawn helper catches SIGCHLD */
+
+	exec_pre(p->fdin, p->fdout, p->fderr, p->isolated ? procfd : -1); /* If we still need procfd, don't close that */
+	if (p->ctty) {
+		/* Set controlling terminal, or otherwise shells don't fully work properly. */
+		if (set_controlling_term(STDIN_FILENO)) { /* we dup2'd this to the slavefd. This is NOT the parent's STDIN. */
+			/* If anything failed, abort.
+			 * We can't do any logging in the child.
+			 * Exit with errno and the parent will know what happened (although it may be ambiguous which function failed...)
+			 */
+			_exit(errno);
+		}
 	}
 
-	/* If we have a node, use its fd for STDIN/STDOUT/STDERR */
-	if (node && usenode) {
-		/* If a node thread is calling this function, it MUST
-		 * pass a handle to node (it MUST NOT pass NULL),
-		 * regardless of whether the node is to be used for I/O.
-		 * This is because we must be able to kill the child process,
-		 * i.e. we must store node->childpid so the child can be killed
-		 * if needed. Think of it like "autoservicing" (except way simpler).
-		 * This is why the clunky "usenode" param exists.
-		 */
-		fd = node->slavefd;
-		fdin = fdout = fd;
-		bbs_assert(isatty(fd));
-		/* Don't call tcgetsid here, it will fail */
-		bbs_debug(6, "sid: %d, tcpgrp: %d, term: %s\n", getsid(getpid()), tcgetpgrp(fd), S_IF(node->term));
-		snprintf(fullterm, sizeof(fullterm), "TERM=%s", S_OR(node->term, "xterm")); /* Many interactive programs will whine if $TERM is not set */
-		/* Save terminal settings to restore after execution */
-		memset(&term, 0, sizeof(term));
-		if (tcgetattr(node->slavefd, &term)) {
-			bbs_error("tcgetattr failed: %s\n", strerror(errno));
-			return -1;
+#ifdef ISOEXEC_SUPPORTED
+#define SYSCALL_OR_DIE(func, ...) if (func(__VA_ARGS__) < 0) { fprintf(stderr, #func " failed (ln %d): %s\n", __LINE__, strerror(errno)); _exit(errno); }
+#ifndef pivot_root
+#define pivot_root(new, old) syscall(SYS_pivot_root, new, old)
+#endif
+	if (p->isolated) {
+		struct utsname uts;
+		char pidbuf[24];
+		char oldroot[384 + STRLEN("/.old")], newroot[384];
+		char homedir[438];
+		char *prebuilt;
+		const char *homepath = NULL;
+
+		if (set_limits()) {
+			_exit(errno);
+		}
+
+		/* Wait until parent has updated mappings. */
+		res = (int) full_read(procfd, pidbuf, sizeof(pidbuf) - 1);
+		if (res < 1) {
+			fprintf(stderr, "read returned %d for fd %d: %s\n", res, procfd, strerror(errno));
+			_exit(errno);
+		}
+		pidbuf[res] = '\0';
+		close(procfd);
+		prebuilt = strchr(pidbuf, ' ');
+
+		/* Prepare temporary container */
+		if (clone_container(newroot, sizeof(newroot), atoi(pidbuf), prebuilt && atoi(prebuilt + 1))) {
+			_exit(errno);
+		}
+
+		/* Instead of showing root@bbs if we're launching a shell, which is just confusing, show the BBS username */
+		if (p->userenv) {
+			/* Used if /root/.bashrc in rootfs contains this prompt override:
+			 * PS1='${debian_chroot:+($debian_chroot)}$BBS_USER@\h:\w\$ '
+			 */
+			snprintf(fulluser, sizeof(fulluser), "BBS_USER=%s", p->username);
+			myenvp[envc++] = fulluser;
+
+			if (p->registered) {
+				/* Make the user's home directory accessible within the container, at /home/${BBS_USERNAME} in the container */
+				snprintf(homeenv + STRLEN("HOME="), sizeof(homeenv) - STRLEN("HOME="), "/home/%s", p->username);
+				snprintf(homedir, sizeof(homedir), "%s/home/%s", newroot, p->username);
+				SYSCALL_OR_DIE(mkdir, homedir, 0700);
+				SYSCALL_OR_DIE(mount, p->homedir, homedir, "bind", MS_BIND | MS_REC, NULL);
+
+				/* Also set the $HOME var to change the home directory from /root to /home/${BBS_USERNAME} */
+				homepath = homeenv;
+				/* However, now that we changed $HOME, bash for example will look for /home/${BBS_USERNAME}/.bashrc, not /root/.bashrc
+				 * So if the files in /root do not exist in the user's home directory, copy them there. */
+			}
+
+			/* Also symlink the transfer root, as read only depending on transfer permissions. */
+			if (!s_strlen_zero(p->publichome)) {
+				/* At least grant read only access. */
+				char publicroot[401];
+				snprintf(publicroot, sizeof(publicroot), "%s/home/public", newroot);
+				SYSCALL_OR_DIE(mkdir, publicroot, 0700);
+				if (p->publicwrite) {
+					SYSCALL_OR_DIE(mount, p->publichome, publicroot, "bind", MS_BIND | MS_REC, NULL);
+				} else {
+					/* See other code in this file that uses MS_RDONLY for why it's like this */
+					SYSCALL_OR_DIE(mount, p->publichome, publicroot, "bind", MS_BIND | MS_REC | MS_RDONLY, NULL);
+					SYSCALL_OR_DIE(mount, p->publichome, publicroot, "bind", MS_REMOUNT | MS_BIND | MS_REC | MS_RDONLY, NULL);
+				}
+				if (!p->registered) {
+					/* If it's guest access, the user doesn't have a home directory,
+					 * so just make it the /home/public directory, which is better than nothing.
+					 * We make it /home/public instead of /home, so that all of the "relevant"
+					 * files that are of interest are in /home. */
+					snprintf(homeenv + STRLEN("HOME="), sizeof(homeenv) - STRLEN("HOME="), "/home/public");
+					homepath = homeenv;
+				}
+			}
+			if (homepath) {
+				myenvp[envc++] = homeenv;
+			}
+		}
+
+		snprintf(oldroot, sizeof(oldroot), "%s%s", newroot, oldrootname);
+
+		SYSCALL_OR_DIE(sethostname, hostname, strlen(hostname)); /* Change hostname in child's UTS namespace */
+		SYSCALL_OR_DIE(uname, &uts);
+
+		/* Set mount points */
+		SYSCALL_OR_DIE(mount, newroot, newroot, "bind", MS_BIND | MS_REC, "");
+		if (eaccess(oldroot, R_OK)) {
+			if (mkdir(oldroot, 0777)) { /* If ./rootfs/.old doesn't yet exist, create it in the rootfs */
+				if (errno != EEXIST) {
+					SYSCALL_OR_DIE(mkdir, oldroot, 0777); /* Repeat, for error message */
+				} else {
+					fprintf(stderr, "Can't access %s (already exists)\n", oldroot);
+					SYSCALL_OR_DIE(chmod, oldroot, 0777);
+					_exit(errno);
+				}
+			}
+		}
+		SYSCALL_OR_DIE(pivot_root, newroot, oldroot);
+		SYSCALL_OR_DIE(mount, "proc", "/proc", "proc", 0, NULL);
+		SYSCALL_OR_DIE(chdir, "/");
+		SYSCALL_OR_DIE(umount2, oldrootname, MNT_DETACH);
+		/* XXX For some reason, .old seems to persist when we launch the container.
+		 * Interestingly, rmdir(oldroot) fails here,
+		 * an inside the container, rm -rf .old errors with "Device or resource busy". */
+		rmdir(oldroot); /* There is an empty /.old left behind, get rid of it as it's not needed anymore */
+
+		/* Shells will automatically default to our home directory,
+		 * but other programs may not. Move to that directory now, if defined. */
+		if (homepath) {
+			SYSCALL_OR_DIE(chdir, homepath + STRLEN("HOME="));
+		}
+
+		if (p->motd && display_motd) {
+			FILE *fp;
+			/* We also have to handle the motd (Message of the Day).
+			 * The shell does not display the MOTD, the login program does after login before spawning the shell.
+			 * So, if there's an /etc/motd in the container, display its contents before we actually call exec.
+			 * Of course, we should only do this if we are actually launching a shell!
+			 * Fortunately, /etc/shells contains the list of shells, so we don't need to guess or hardcode a list. */
+			fp = fopen("/etc/shells", "r");
+			if (fp) {
+				char line[64];
+				int is_shell = 0;
+				while ((fgets(line, sizeof(line), fp))) {
+					bbs_strterm(line, '\n');
+					if (!strcmp(line, p->filename)) {
+						is_shell = 1;
+						break;
+					}
+				}
+				fclose(fp);
+				if (is_shell) {
+					fp = fopen("/etc/motd", "r");
+					if (fp) {
+						while ((fgets(line, sizeof(line), fp))) {
+							fputs(line, stdout); /* Use fputs instead of puts, since puts adds its own newline */
+						}
+						fclose(fp);
+					}
+				}
+			}
+			/* Other things to keep in mind for shells specifically:
+			 * bash will print exit after it closes. This is standard behavior (for bash) whenever exiting
+			 * an interactive shell that is not a login shell.
+			 * A login shell has a - at the beginning of its progname, e.g. echo $0 will show -bash instead of bash.
+			 * It *might* make sense to consider this is a login shell, but it also might not.
+			 * It is the first shell session that we're spawning, but it's just a program being launched from the BBS.
+			 * So currently, it's not considered a login shell, and that's probably just fine. */
 		}
 	}
-	if (fdout == -1) {
-		/* If no node and no output fd, create file descriptors using a temporary pipe */
-		if (pipe(pfd)) {
-			bbs_error("pipe failed (%s): %s\n", filename, strerror(errno));
-			return -1;
+#else
+	UNUSED(procfd);
+#endif /* ISOEXEC_SUPPORTED */
+
+#ifdef __FreeBSD__
+	/* FreeBSD doesn't export its execvpe function: https://github.com/openzfs/zfs/pull/12051
+	 * We can't use the execvpe from the above PR since the project's license is incompatible with GPL. */
+	res = execvp(p->filename, p->argv);
+#else
+	res = execvpe(p->filename, p->argv, envp);
+#endif
+	bbs_assert(res == -1);
+
+	/* For menu exec: handler, we hold a RDLOCK on the menu when we get here, and it was locked in this thread,
+	 * helgrind will show an error if exec fails and we fall through here.
+	 * See:
+	 * - https://stackoverflow.com/questions/45889293/forking-while-holding-a-lock
+	 * - https://stackoverflow.com/questions/2620313/how-to-use-pthread-atfork-and-pthread-once-to-reinitialize-mutexes-in-child
+	 * Unfortunately, pthread_atfork doesn't really solve the issue.
+	 * For now, I just accept that we'll have this helgrind issue when exec fails,
+	 * it doesn't really matter since fork should always be followed by exec in the child,
+	 * and if it fails, we die anyways.
+	 */
+	/* Can't use BBS logging in the child.
+	 * But the parent will know that we failed since we return errno, and parent can log it. */
+	/* Also, use _exit, not exit, since exit will execute the parent's atexit function, etc.
+	 * That matters because exec failed, so atexit is still registered. */
+	if (p->isolated) {
+		int saved_errno = errno;
+		fprintf(stderr, "%s: %s\n", p->filename, strerror(errno));
+#ifdef DEBUG_NEW_FS
+		if (1) {
+			struct dirent *entry;
+			DIR *dir = opendir(".");
+			if (dir) {
+				while ((entry = readdir(dir))) {
+					fprintf(stderr, "%s\n", entry->d_name);
+				}
+			} else {
+				fprintf(stderr, "opendir: %s\n", strerror(errno));
+			}
 		}
+#endif
+		errno = saved_errno;
 	}
+	_exit(errno);
+}
+
+/*!
+ * \brief fork() or clone() a child process that will execute a program
+ * \param p
+ * \param poolroot Pre-built container root to use, for isolated execution. NULL to build one in the child.
+ * \retval -1 on failure (errno is set), child PID otherwise
+ * \note Does not log, since this is also used by the spawn helper
+ */
+static pid_t exec_fork(const struct exec_params *p, const char *poolroot)
+{
+	pid_t pid;
+	int procpipe[2];
 
 #ifdef ISOEXEC_SUPPORTED
 	/* If we have flags, we need to use clone(2). Otherwise, just use fork(2) */
-	if (isolated) {
+	if (p->isolated) {
 		int flags = 0;
 		/* We need to do more than fork() allows */
 		flags |= SIGCHLD | CLONE_NEWIPC | CLONE_NEWNS | CLONE_NEWPID | CLONE_NEWUTS | CLONE_NEWNET | CLONE_NEWUSER; /* fork() sets SIGCHLD implicitly. */
-		if (isolated == 2) {
+		if (p->isolated == 2) {
 			/* Keep network connectivity */
 			flags &= ~CLONE_NEWNET;
 		}
@@ -825,20 +1186,10 @@ static int __bbs_execvpe_fd(struct bbs_node *node, int usenode, int fdin, int fd
 #else
 		flags &= ~CLONE_SIGHAND;
 #endif
-
-		if (eaccess(templatedir, R_OK)) {
-			bbs_error("rootfs template directory '%s' does not exist\n", templatedir);
-			return -1;
-		} else if (pipe(procpipe)) {
-			bbs_error("pipe failed: %s\n", strerror(errno));
+		if (pipe(procpipe)) {
 			return -1;
 		}
 
-		/* Check now, since once we close file descriptors in the child,
-		 * we cannot call this function, since it logs. */
-		public_home_dir_readable = bbs_transfer_operation_allowed(node, TRANSFER_ACCESS, NULL) && bbs_transfer_operation_allowed(node, TRANSFER_DOWNLOAD, NULL);
-		public_home_dir_writable = bbs_transfer_operation_allowed(node, TRANSFER_UPLOAD, NULL);
-
 		/* We use the clone syscall directly, rather than the clone(2) glibc function.
 		 * The reason for this is clone launches a function for the child,
 		 * whereas the raw syscall is similar to fork and continues in the child as well.
@@ -847,294 +1198,847 @@ static int __bbs_execvpe_fd(struct bbs_node *node, int usenode, int fdin, int fd
 		 * but our usage here is portable to x86-64, which is pretty much everything anyways.
 		 */
 		pid = (pid_t) syscall(SYS_clone, flags, NULL, NULL, NULL, 0);
-#else
-	if (0) {
+	} else
 #endif /* ISOEXEC_SUPPORTED */
-	} else {
+	{
+		procpipe[0] = procpipe[1] = -1;
 		pid = fork(); /* fork has an implicit SIGCHLD */
 	}
 
 	if (pid == -1) {
-		bbs_error("%s failed (%s): %s\n", isolated ? "clone" : "fork", filename, strerror(errno));
-		if (isolated) {
-			close(procpipe[0]);
-			close(procpipe[1]);
-		}
+		int saved_errno = errno;
+		close_if(procpipe[0]);
+		close_if(procpipe[1]);
+		errno = saved_errno;
 		return -1;
 	} else if (pid == 0) { /* Child */
-		if (!isolated) {
-			/* Immediately install a dummy signal handler for SIGWINCH.
-			 * Until we call exec, the child retains the parent's signal handlers.
-			 * However, if we have a node, we immediately call bbs_node_update_winsize
-			 * to force send a SIGWINCH to the child immediately, to give it its current dimensions.
-			 * If we don't block SIGWINCH in the child, then it'll run __sigwinch_handler
-			 * from bbs.c, which will print out a log message if parent has option_nofork (bad!)
-			 * This still reeks of a race condition, but in practice we're able to block the signal
-			 * here ASAP before the parent does the SIGWINCH (but if we didn't do this, we would
-			 * send the SIGWINCH before the child executes exec).
-			 * It's actually a GOOD thing the SIGWINCH is sent prior to exec, this way the child
-			 * process has the dimensions available immediately when the program starts. So this
-			 * is probably the best thing to do here.
-			 */
+		exec_child(p, procpipe[0]);
+	} /* else, parent */
 
-			/* SIG_IGN will survive exec, so we must avoid that.
-			 * We could install an empty handler since we want this to go away with exec(), or just use SIG_DFL to reset to default.
-			 * Normally we should use sigaction over signal, and probably here too, but this signal handler
-			 * will only be relevant from the time between fork() and exec(), and my intuition suggests that
-			 * signal will execute faster than sigaction. I have not actually verified this though. */
-			/* XXX Maybe we should just always use clone() and always pass CLONE_CLEAR_SIGHAND */
-			signal(SIGWINCH, SIG_DFL);
-			/* Reset other signal handlers */
-			signal(SIGTERM, SIG_DFL);
-			signal(SIGINT, SIG_DFL);
-			signal(SIGPIPE, SIG_DFL);
-		} /* else, if CLONE_CLEAR_SIGHAND was provided to clone, then the signal handlers didn't carry over, we're good. */
-
-		if (fdout == -1) {
-			close(pfd[0]); /* Close read end of pipe */
-			fd = pfd[1]; /* Use write end of pipe */
-			fdout = fd;
-		}
-		exec_pre(fdin, fdout, isolated ? procpipe[0] : -1); /* If we still need procpipe, don't close that */
-		if (node && usenode) {
-			/* Set controlling terminal, or otherwise shells don't fully work properly. */
-			if (set_controlling_term(STDIN_FILENO)) { /* we dup2'd this to the slavefd. This is NOT the parent's STDIN. */
-				/* If anything failed, abort.
-				 * We can't do any logging in the child.
-				 * Exit with errno and the parent will know what happened (although it may be ambiguous which function failed...)
-				 */
-				_exit(errno);
+#ifdef ISOEXEC_SUPPORTED
+	if (p->isolated) {
+		close(procpipe[0]);
+		if (!setup_namespace(pid)) {
+			char childpid[24];
+			size_t pidlen;
+			int prebuilt = 0;
+			if (poolroot) {
+				char rootdir[268];
+				/* Hand over the pre-built root. If something is still at this path, just let the child build a new one. */
+				temp_container_root(rootdir, sizeof(rootdir), pid);
+				prebuilt = !rename(poolroot, rootdir);
+			}
+			/* Also write the child PID, since with CLONE_NEWPID, the child can't use getpid() to get the real child PID */
+			pidlen = (size_t) snprintf(childpid, sizeof(childpid), "%d %d", pid, prebuilt);
+			/* Write to write end of pipe, to signal that UID/GID maps have been updated. */
+			if (write(procpipe[1], childpid, pidlen) != (ssize_t) pidlen) {
+				kill(pid, SIGKILL);
 			}
 		}
+		close(procpipe[1]);
+	}
+#else
+	UNUSED(poolroot);
+#endif /* ISOEXEC_SUPPORTED */
+	return pid;
+}
 
-#ifdef ISOEXEC_SUPPORTED
-#define SYSCALL_OR_DIE(func, ...) if (func(__VA_ARGS__) < 0) { fprintf(stderr, #func " failed (ln %d): %s\n", __LINE__, strerror(errno)); _exit(errno); }
-#ifndef pivot_root
-#define pivot_root(new, old) syscall(SYS_pivot_root, new, old)
-#endif
-		if (isolated) {
-			struct utsname uts;
-			char pidbuf[15];
-			char oldroot[384 + STRLEN("/.old")], newroot[384];
-			char homedir[438];
-
-			if (set_limits()) {
-				_exit(errno);
-			}
-
-			/* Wait until parent has updated mappings. */
-			res = (int) full_read(procpipe[0], pidbuf, sizeof(pidbuf));
-			if (res < 1) {
-				fprintf(stderr, "read returned %d for fd %d: %s\n", res, procpipe[0], strerror(errno));
-				_exit(errno);
-			}
-			close(procpipe[0]);
+/*
+ * The spawn helper is a small process, forked from the BBS at startup before the address space is large
+ * and before any modules have spawned threads. Forking a process with a large address space is expensive
+ * (page tables must be copied, and every page the parent writes to afterwards must be copied),
+ * so the BBS hands requests to execute programs to the helper over a Unix socket,
+ * including the file descriptors for the program's STDIN/STDOUT/STDERR, and the helper forks instead.
+ *
+ * Each request includes a socket on which the helper replies twice: once with the PID of the child
+ * (or an error), and once with its wait status when it exits. Because the helper, not the BBS,
+ * is the child's parent, the BBS blocks reading the second reply instead of calling waitpid.
+ *
+ * The helper can't use any BBS facilities that might take locks (including logging),
+ * since other threads may have held them at the time of the fork.
+ */
 
-			/* Prepare temporary container */
-			if (clone_container(newroot, sizeof(newroot), atoi(pidbuf))) {
-				_exit(errno);
-			}
+enum spawn_msg_type {
+	SPAWN_EXEC = 0,		/* Execute a program */
+	SPAWN_CONFIG,		/* Settings have been reloaded */
+	SPAWN_STARTED,		/* Child process started (or failed to start) */
+	SPAWN_EXITED,		/* Child process exited */
+};
+
+struct spawn_request {
+	enum spawn_msg_type type;
+	struct exec_params params;	/* Pointers are not valid in the helper and are rebuilt from the data that follows */
+	int argc;
+	int envc;					/* -1 for the default environment */
+	size_t datalen;
+	/* Followed by the filename, arguments, and environment, each NUL terminated */
+};
+
+struct spawn_config {
+	enum spawn_msg_type type;
+	char hostname[84];
+	char templatedir[256];
+	char rundir[256];
+	int display_motd;
+	int maxmemory;
+	int maxcpu;
+	int minnice;
+	int containerpool;
+};
+
+struct spawn_reply {
+	enum spawn_msg_type type;
+	pid_t pid;
+	int status;					/* errno for SPAWN_STARTED, wait status for SPAWN_EXITED */
+};
 
-			/* Instead of showing root@bbs if we're launching a shell, which is just confusing, show the BBS username */
-			if (node && envp == myenvp && bbs_transfer_available()) {
-				char *tmp;
-
-				const char *username = bbs_user_is_registered(node->user) ? bbs_username(node->user) : "guest";
-				/* Used if /root/.bashrc in rootfs contains this prompt override:
-				 * PS1='${debian_chroot:+($debian_chroot)}$BBS_USER@\h:\w\$ '
-				 */
-				myenvp[2] = fulluser;
-				snprintf(fulluser, sizeof(fulluser), "BBS_USER=%s", username);
-				/* Make it all lowercase, per *nix conventions */
-				username = tmp = fulluser + STRLEN("BBS_USER=");
-				while (*tmp) {
-					*tmp= (char) tolower(*tmp);
-					tmp++;
-				}
+/*! \brief Largest request that can be passed to the spawn helper. Larger requests are executed directly. */
+#define SPAWN_MAX_REQUEST 65536
+#define SPAWN_MAX_CHILDREN 512
+#define SPAWN_MAX_POOL 64
 
-				if (bbs_user_is_registered(node->user)) {
-					char masterhomedir[256];
-					/* Make the user's home directory accessible within the container, at /home/${BBS_USERNAME} in the container */
-					if (bbs_transfer_home_dir(node->user->id, masterhomedir, sizeof(masterhomedir))) {
-						_exit(errno);
-					}
-					snprintf(homeenv + STRLEN("HOME="), sizeof(homeenv) - STRLEN("HOME="), "/home/%s", username);
-					snprintf(homedir, sizeof(homedir), "%s/home/%s", newroot, username);
-					SYSCALL_OR_DIE(mkdir, homedir, 0700);
-					SYSCALL_OR_DIE(mount, masterhomedir, homedir, "bind", MS_BIND | MS_REC, NULL);
-
-					/* Also set the $HOME var to change the home directory from /root to /home/${BBS_USERNAME} */
-					myenvp[3] = homeenv;
-					/* However, now that we changed $HOME, bash for example will look for /home/${BBS_USERNAME}/.bashrc, not /root/.bashrc
-					 * So if the files in /root do not exist in the user's home directory, copy them there. */
-				}
+static bbs_mutex_t spawn_lock = BBS_MUTEX_INITIALIZER;
+static int spawn_fd = -1;
+static pid_t spawn_pid = -1;
 
-				/* Also symlink the transfer root, as read only depending on transfer permissions. */
-				if (public_home_dir_readable) {
-					/* At least grant read only access. */
-					char publicroot[401];
-					char publichome[401];
-					snprintf(publicroot, sizeof(publicroot), "%s/home/public", newroot);
-					SYSCALL_OR_DIE(mkdir, publicroot, 0700);
-					if (bbs_transfer_home_dir(0, publichome, sizeof(publichome))) {
-						_exit(errno);
-					}
-					if (public_home_dir_writable) {
-						SYSCALL_OR_DIE(mount, publichome, publicroot, "bind", MS_BIND | MS_REC, NULL);
-					} else {
-						/* See other code in this file that uses MS_RDONLY for why it's like this */
-						SYSCALL_OR_DIE(mount, publichome, publicroot, "bind", MS_BIND | MS_REC | MS_RDONLY, NULL);
-						SYSCALL_OR_DIE(mount, publichome, publicroot, "bind", MS_REMOUNT | MS_BIND | MS_REC | MS_RDONLY, NULL);
-					}
-					if (!bbs_user_is_registered(node->user)) {
-						/* If it's guest access, the user doesn't have a home directory,
-						 * so just make it the /home/public directory, which is better than nothing.
-						 * We make it /home/public instead of /home, so that all of the "relevant"
-						 * files that are of interest are in /home. */
-						snprintf(homeenv + STRLEN("HOME="), sizeof(homeenv) - STRLEN("HOME="), "/home/public");
-						myenvp[3] = homeenv;
-					}
-				}
-			}
+/* Helper state. These are only used inside the spawn helper process. */
+static int spawn_sigpipe[2] = { -1, -1 };
+static struct spawn_child {
+	pid_t pid;
+	int replyfd;
+	int isolated;
+} spawn_children[SPAWN_MAX_CHILDREN];
+static char spawn_pool[SPAWN_MAX_POOL][268];
+static int spawn_pool_count = 0;
+static unsigned int spawn_pool_seqno = 0;
+
+static void spawn_sigchld(int num)
+{
+	int saved_errno = errno;
+	UNUSED(num);
+	if (write(spawn_sigpipe[1], "", 1) < 0) {
+		/* The pipe is full, so a wakeup is already pending */
+	}
+	errno = saved_errno;
+}
 
-			snprintf(oldroot, sizeof(oldroot), "%s%s", newroot, oldrootname);
-
-			SYSCALL_OR_DIE(sethostname, hostname, strlen(hostname)); /* Change hostname in child's UTS namespace */
-			SYSCALL_OR_DIE(uname, &uts);
-
-			/* Set mount points */
-			SYSCALL_OR_DIE(mount, newroot, newroot, "bind", MS_BIND | MS_REC, "");
-			if (eaccess(oldroot, R_OK)) {
-				if (mkdir(oldroot, 0777)) { /* If ./rootfs/.old doesn't yet exist, create it in the rootfs */
-					if (errno != EEXIST) {
-						SYSCALL_OR_DIE(mkdir, oldroot, 0777); /* Repeat, for error message */
-					} else {
-						fprintf(stderr, "Can't access %s (already exists)\n", oldroot);
-						SYSCALL_OR_DIE(chmod, oldroot, 0777);
-						_exit(errno);
-					}
+static int spawn_rm(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+	UNUSED(st);
+	UNUSED(flag);
+	UNUSED(ftw);
+	remove(path);
+	return 0;
+}
+
+/*! \brief Recursively delete a directory, without logging */
+static void spawn_rmtree(const char *path)
+{
+	nftw(path, spawn_rm, 2, FTW_MOUNT | FTW_PHYS | FTW_DEPTH);
+}
+
+/*! \brief Build container roots in advance, so that isolated children only need to do the mounts */
+static void spawn_pool_fill(void)
+{
+#ifdef ISOEXEC_SUPPORTED
+	int want = MIN(containerpool, SPAWN_MAX_POOL);
+
+	if (want > 0 && eaccess(templatedir, R_OK)) {
+		return;
+	}
+	while (spawn_pool_count < want) {
+		char *rootdir = spawn_pool[spawn_pool_count];
+		snprintf(rootdir, sizeof(spawn_pool[0]), "%s/pool-%d-%u", rundir, getpid(), spawn_pool_seqno++);
+		if (container_skeleton(rootdir)) {
+			spawn_rmtree(rootdir);
+			return;
+		}
+		spawn_pool_count++;
+	}
+	/* If the pool was shrunk, get rid of the extras */
+	while (spawn_pool_count > want) {
+		spawn_rmtree(spawn_pool[--spawn_pool_count]);
+	}
+#endif /* ISOEXEC_SUPPORTED */
+}
+
+static void spawn_helper_reply(int fd, enum spawn_msg_type type, pid_t pid, int status)
+{
+	struct spawn_reply reply;
+
+	memset(&reply, 0, sizeof(reply));
+	reply.type = type;
+	reply.pid = pid;
+	reply.status = status;
+	/* If the BBS is no longer waiting, there's nothing to be done */
+	if (send(fd, &reply, sizeof(reply), MSG_NOSIGNAL) < 0) {
+		return;
+	}
+}
+
+/*! \brief Unpack an argument vector from a request. Returns pointer to the data following it. */
+static char *spawn_unpack(char *data, char *end, char **vec, int count)
+{
+	int i;
+
+	for (i = 0; i < count && data < end; i++) {
+		vec[i] = data;
+		data += strlen(data) + 1;
+	}
+	vec[i] = NULL;
+	return data;
+}
+
+static void spawn_helper_exec(char *buf, size_t len, int *fds, int nfds)
+{
+	struct spawn_request req;
+	char *data, *end;
+	char *argv[256], *envp[256];
+	const char *poolroot = NULL;
+	int i, fdi = 1, slot = -1;
+	pid_t pid;
+
+	if (nfds < 1) {
+		return; /* No way to reply */
+	}
+	memcpy(&req, buf, sizeof(req));
+	data = buf + sizeof(req);
+	end = buf + len;
+
+	/* Assign the received file descriptors, in the same order as they were sent */
+	if (req.params.fdin != -1) {
+		req.params.fdin = fdi < nfds ? fds[fdi++] : -1;
+	}
+	if (req.params.fdout != -1) {
+		req.params.fdout = fdi < nfds ? fds[fdi++] : -1;
+	}
+	if (req.params.fderr != -1) {
+		req.params.fderr = fdi < nfds ? fds[fdi++] : -1;
+	}
+
+	for (i = 0; i < SPAWN_MAX_CHILDREN; i++) {
+		if (!spawn_children[i].pid) {
+			slot = i;
+			break;
+		}
+	}
+	if (slot == -1 || req.argc >= (int) ARRAY_LEN(argv) || req.envc >= (int) ARRAY_LEN(envp) || (size_t) (end - data) != req.datalen || !req.datalen || end[-1]) {
+		spawn_helper_reply(fds[0], SPAWN_STARTED, -1, slot == -1 ? EAGAIN : EINVAL);
+		goto cleanup;
+	}
+
+	req.params.filename = data;
+	data += strlen(data) + 1;
+	data = spawn_unpack(data, end, argv, req.argc);
+	req.params.argv = argv;
+	if (req.envc >= 0) {
+		spawn_unpack(data, end, envp, req.envc);
+		req.params.envp = envp;
+	} else {
+		req.params.envp = NULL;
+	}
+
+	if (req.params.isolated && spawn_pool_count) {
+		poolroot = spawn_pool[--spawn_pool_count];
+	}
+
+	pid = exec_fork(&req.params, poolroot);
+	if (pid < 0) {
+		spawn_helper_reply(fds[0], SPAWN_STARTED, -1, errno);
+		goto cleanup;
+	}
+	spawn_helper_reply(fds[0], SPAWN_STARTED, pid, 0);
+	spawn_children[slot].pid = pid;
+	spawn_children[slot].replyfd = fds[0];
+	spawn_children[slot].isolated = req.params.isolated;
+	fds[0] = -1; /* Keep the reply socket until the child exits */
+
+cleanup:
+	if (poolroot && !eaccess(poolroot, R_OK)) {
+		/* The root was not handed over */
+		spawn_rmtree(poolroot);
+	}
+	for (i = 0; i < nfds; i++) {
+		close_if(fds[i]);
+	}
+}
+
+static void spawn_helper_config(char *buf, size_t len)
+{
+	struct spawn_config cfg;
+
+	if (len != sizeof(cfg)) {
+		return;
+	}
+	memcpy(&cfg, buf, sizeof(cfg));
+	safe_strncpy(hostname, cfg.hostname, sizeof(hostname));
+	safe_strncpy(templatedir, cfg.templatedir, sizeof(templatedir));
+	if (strcmp(rundir, cfg.rundir)) {
+		/* The existing pool is in the old run directory */
+		while (spawn_pool_count > 0) {
+			spawn_rmtree(spawn_pool[--spawn_pool_count]);
+		}
+		safe_strncpy(rundir, cfg.rundir, sizeof(rundir));
+	}
+	display_motd = cfg.display_motd;
+	maxmemory = cfg.maxmemory;
+	maxcpu = cfg.maxcpu;
+	minnice = cfg.minnice;
+	containerpool = cfg.containerpool;
+}
+
+/*! \brief Reap exited children and notify the BBS */
+static void spawn_helper_reap(void)
+{
+	for (;;) {
+		int i, status;
+		pid_t pid = waitpid(-1, &status, WNOHANG | WUNTRACED);
+		if (pid <= 0) {
+			break;
+		}
+		if (WIFSTOPPED(status)) { /* Child stopped by signal */
+			kill(pid, SIGCONT); /* Continue the child */
+			continue;
+		}
+		for (i = 0; i < SPAWN_MAX_CHILDREN; i++) {
+			if (spawn_children[i].pid == pid) {
+				spawn_helper_reply(spawn_children[i].replyfd, SPAWN_EXITED, pid, status);
+				close(spawn_children[i].replyfd);
+#ifdef ISOEXEC_SUPPORTED
+				if (spawn_children[i].isolated) {
+					char rootdir[268];
+					/* Clean up the temporary container. The mounts were in the child's namespace, so this is just directories. */
+					temp_container_root(rootdir, sizeof(rootdir), pid);
+					spawn_rmtree(rootdir);
 				}
+#endif /* ISOEXEC_SUPPORTED */
+				memset(&spawn_children[i], 0, sizeof(spawn_children[i]));
+				break;
 			}
-			SYSCALL_OR_DIE(pivot_root, newroot, oldroot);
-			SYSCALL_OR_DIE(mount, "proc", "/proc", "proc", 0, NULL);
-			SYSCALL_OR_DIE(chdir, "/");
-			SYSCALL_OR_DIE(umount2, oldrootname, MNT_DETACH);
-			/* XXX For some reason, .old seems to persist when we launch the container.
-			 * Interestingly, rmdir(oldroot) fails here,
-			 * an inside the container, rm -rf .old errors with "Device or resource busy". */
-			rmdir(oldroot); /* There is an empty /.old left behind, get rid of it as it's not needed anymore */
-
-			/* Shells will automatically default to our home directory,
-			 * but other programs may not. Move to that directory now, if defined. */
-			if (myenvp[3]) {
-				const char *startdir = myenvp[3] + STRLEN("HOME=");
-				SYSCALL_OR_DIE(chdir, startdir);
+		}
+	}
+}
+
+static void __attribute__((noreturn)) spawn_helper_main(int fd)
+{
+	static char buf[SPAWN_MAX_REQUEST];
+	struct pollfd pfds[2];
+	int i;
+
+	setsid(); /* Don't get signals meant for the BBS's process group, e.g. Ctrl+C on the foreground console */
+	signal(SIGWINCH, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGINT, SIG_IGN);
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGCHLD, spawn_sigchld);
+
+	/* Close everything we don't need. STDERR is kept, for child error messages. */
+	exec_pre(-1, -1, STDERR_FILENO, fd);
+	i = open("/dev/null", O_RDWR);
+	if (i != -1) {
+		/* Keep STDIN and STDOUT occupied, so nothing else ends up there */
+		dup2(i, STDIN_FILENO);
+		dup2(i, STDOUT_FILENO);
+		if (i > STDERR_FILENO) {
+			close(i);
+		}
+	}
+	if (pipe(spawn_sigpipe)) {
+		_exit(errno);
+	}
+	fcntl(spawn_sigpipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(spawn_sigpipe[1], F_SETFL, O_NONBLOCK);
+
+	pfds[0].fd = fd;
+	pfds[0].events = POLLIN;
+	pfds[1].fd = spawn_sigpipe[0];
+	pfds[1].events = POLLIN;
+
+	for (;;) {
+		struct msghdr msg;
+		struct iovec iov;
+		struct cmsghdr *cmsg;
+		char control[CMSG_SPACE(4 * sizeof(int))];
+		int fds[4];
+		int nfds = 0;
+		enum spawn_msg_type type;
+		ssize_t res;
+
+		spawn_pool_fill();
+
+		if (poll(pfds, 2, -1) < 0) {
+			if (errno == EINTR) {
+				continue;
 			}
+			break;
+		}
+		if (pfds[1].revents) {
+			char c[32];
+			while (read(spawn_sigpipe[0], c, sizeof(c)) > 0);
+			spawn_helper_reap();
+		}
+		if (!pfds[0].revents) {
+			continue;
+		}
 
-			if (node && envp == myenvp && display_motd) {
-				FILE *fp;
-				/* cd to the home directory; this way, if this is launching a shell session,
-				 * it's a better user experience. Only makes sense to do this after we've changed the root. */
-				SYSCALL_OR_DIE(chdir, homeenv + STRLEN("HOME="));
-				/* We also have to handle the motd (Message of the Day).
-				 * The shell does not display the MOTD, the login program does after login before spawning the shell.
-				 * So, if there's an /etc/motd in the container, display its contents before we actually call exec.
-				 * Of course, we should only do this if we are actually launching a shell!
-				 * Fortunately, /etc/shells contains the list of shells, so we don't need to guess or hardcode a list. */
-				fp = fopen("/etc/shells", "r");
-				if (fp) {
-					char line[64];
-					int is_shell = 0;
-					while ((fgets(line, sizeof(line), fp))) {
-						bbs_strterm(line, '\n');
-						if (!strcmp(line, filename)) {
-							is_shell = 1;
-							break;
-						}
-					}
-					fclose(fp);
-					if (is_shell) {
-						fp = fopen("/etc/motd", "r");
-						if (fp) {
-							while ((fgets(line, sizeof(line), fp))) {
-								fputs(line, stdout); /* Use fputs instead of puts, since puts adds its own newline */
-							}
-							fclose(fp);
-						}
-					}
-				}
-				/* Other things to keep in mind for shells specifically:
-				 * bash will print exit after it closes. This is standard behavior (for bash) whenever exiting
-				 * an interactive shell that is not a login shell.
-				 * A login shell has a - at the beginning of its progname, e.g. echo $0 will show -bash instead of bash.
-				 * It *might* make sense to consider this is a login shell, but it also might not.
-				 * It is the first shell session that we're spawning, but it's just a program being launched from the BBS.
-				 * So currently, it's not considered a login shell, and that's probably just fine. */
+		memset(&msg, 0, sizeof(msg));
+		iov.iov_base = buf;
+		iov.iov_len = sizeof(buf);
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		res = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+		if (res < 0 && errno == EINTR) {
+			continue;
+		} else if (res <= 0) {
+			break; /* The BBS has exited or is shutting down */
+		}
+		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+				nfds = (int) ((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+				nfds = MIN(nfds, (int) ARRAY_LEN(fds));
+				memcpy(fds, CMSG_DATA(cmsg), (size_t) nfds * sizeof(int));
 			}
 		}
-#endif /* ISOEXEC_SUPPORTED */
+		if ((size_t) res < sizeof(type)) {
+			type = SPAWN_EXITED; /* Invalid */
+		} else {
+			memcpy(&type, buf, sizeof(type));
+		}
+		if (type == SPAWN_EXEC && (size_t) res >= sizeof(struct spawn_request)) {
+			spawn_helper_exec(buf, (size_t) res, fds, nfds);
+		} else {
+			if (type == SPAWN_CONFIG) {
+				spawn_helper_config(buf, (size_t) res);
+			}
+			for (i = 0; i < nfds; i++) {
+				close(fds[i]);
+			}
+		}
+	}
 
-#ifdef __FreeBSD__
-		/* FreeBSD doesn't export its execvpe function: https://github.com/openzfs/zfs/pull/12051
-		 * We can't use the execvpe from the above PR since the project's license is incompatible with GPL. */
-		if (envp != myenvp) {
-			bbs_warning("FreeBSD does not support execvpe\n");
+	/* Programs still running will be reparented, but nobody is waiting for them anymore */
+	while (spawn_pool_count > 0) {
+		spawn_rmtree(spawn_pool[--spawn_pool_count]);
+	}
+	_exit(0);
+}
+
+static int spawn_helper_start(void)
+{
+	int sv[2];
+
+	if (!spawn_helper_enabled) {
+		return 0;
+	}
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv)) {
+		bbs_error("socketpair failed: %s\n", strerror(errno));
+		return -1;
+	}
+	spawn_pid = fork();
+	if (spawn_pid < 0) {
+		bbs_error("fork failed: %s\n", strerror(errno));
+		close(sv[0]);
+		close(sv[1]);
+		return -1;
+	} else if (!spawn_pid) {
+		spawn_helper_main(sv[1]);
+	}
+	close(sv[1]);
+	spawn_fd = sv[0];
+	bbs_debug(3, "Started spawn helper (PID %d)\n", spawn_pid);
+	return 0;
+}
+
+void bbs_shutdown_system(void)
+{
+	RWLIST_WRLOCK_REMOVE_ALL(&term_types, entry, free);
+
+	bbs_mutex_lock(&spawn_lock);
+	if (spawn_fd != -1) {
+		/* The helper exits once its end of the socket is closed */
+		close(spawn_fd);
+		spawn_fd = -1;
+		waitpid(spawn_pid, NULL, 0);
+		spawn_pid = -1;
+	}
+	bbs_mutex_unlock(&spawn_lock);
+}
+
+static void spawn_helper_update_config(void)
+{
+	struct spawn_config cfg;
+
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.type = SPAWN_CONFIG;
+	safe_strncpy(cfg.hostname, hostname, sizeof(cfg.hostname));
+	safe_strncpy(cfg.templatedir, templatedir, sizeof(cfg.templatedir));
+	safe_strncpy(cfg.rundir, rundir, sizeof(cfg.rundir));
+	cfg.display_motd = display_motd;
+	cfg.maxmemory = maxmemory;
+	cfg.maxcpu = maxcpu;
+	cfg.minnice = minnice;
+	cfg.containerpool = containerpool;
+
+	bbs_mutex_lock(&spawn_lock);
+	if (spawn_fd != -1 && send(spawn_fd, &cfg, sizeof(cfg), MSG_NOSIGNAL) < 0) {
+		bbs_warning("Failed to update spawn helper settings: %s\n", strerror(errno));
+	}
+	bbs_mutex_unlock(&spawn_lock);
+}
+
+/*!
+ * \brief Pack a string vector into a request buffer
+ * \retval -1 if it doesn't fit, number of strings otherwise
+ */
+static int spawn_pack(char **pos, char *end, const char *const *vec)
+{
+	int count = 0;
+
+	for (; vec && *vec; vec++, count++) {
+		size_t len = strlen(*vec) + 1;
+		if (*pos + len > end) {
+			return -1;
 		}
-		res = execvp(filename, argv);
-#else
-		res = execvpe(filename, argv, envp);
+		memcpy(*pos, *vec, len);
+		*pos += len;
+	}
+	return count;
+}
+
+/*!
+ * \brief Execute a program using the spawn helper
+ * \param p
+ * \param[out] waitfd Socket on which the exit status will be sent, to be passed to spawn_helper_wait
+ * \retval -1 if the helper could not be used (the caller should execute the program directly)
+ * \retval -2 if the helper could not start the program (errno is set)
+ * \return Child PID on success
+ */
+static pid_t spawn_helper_exec_request(const struct exec_params *p, int *waitfd)
+{
+	char *buf, *pos, *end;
+	struct spawn_request *req;
+	struct spawn_reply reply;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char control[CMSG_SPACE(4 * sizeof(int))];
+	int fds[4], nfds = 0;
+	int sv[2];
+	ssize_t res;
+	size_t len;
+
+	if (spawn_fd == -1) {
+		return -1;
+	}
+
+	len = strlen(p->filename) + 1;
+	if (len > SPAWN_MAX_REQUEST / 2) {
+		return -1;
+	}
+	buf = malloc(SPAWN_MAX_REQUEST);
+	if (ALLOC_FAILURE(buf)) {
+		return -1;
+	}
+	req = (struct spawn_request *) buf;
+	memset(req, 0, sizeof(*req));
+	req->type = SPAWN_EXEC;
+	req->params = *p;
+	req->params.filename = NULL;
+	req->params.argv = req->params.envp = NULL;
+	pos = buf + sizeof(*req);
+	end = buf + SPAWN_MAX_REQUEST;
+	memcpy(pos, p->filename, len);
+	pos += len;
+	req->argc = spawn_pack(&pos, end, (const char *const *) p->argv);
+	req->envc = p->envp ? spawn_pack(&pos, end, (const char *const *) p->envp) : -1;
+	if (req->argc < 0 || (p->envp && req->envc < 0)) {
+		bbs_debug(3, "Request to execute %s is too large for spawn helper\n", p->filename);
+		free(buf);
+		return -1;
+	}
+	req->datalen = (size_t) (pos - buf) - sizeof(*req);
+
+	/* Each request gets its own socket for replies, so the replies can't get mixed up between threads */
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv)) {
+		bbs_error("socketpair failed: %s\n", strerror(errno));
+		free(buf);
+		return -1;
+	}
+	fds[nfds++] = sv[1];
+	if (p->fdin != -1) {
+		fds[nfds++] = p->fdin;
+	}
+	if (p->fdout != -1) {
+		fds[nfds++] = p->fdout;
+	}
+	if (p->fderr != -1) {
+		fds[nfds++] = p->fderr;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = buf;
+	iov.iov_len = (size_t) (pos - buf);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = CMSG_SPACE((size_t) nfds * sizeof(int));
+	memset(control, 0, sizeof(control));
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN((size_t) nfds * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, (size_t) nfds * sizeof(int));
+
+	bbs_mutex_lock(&spawn_lock);
+	res = spawn_fd == -1 ? -1 : sendmsg(spawn_fd, &msg, MSG_NOSIGNAL);
+	bbs_mutex_unlock(&spawn_lock);
+	free(buf);
+	close(sv[1]); /* The helper has its own copy now */
+
+	if (res < 0) {
+		bbs_warning("Failed to send request to spawn helper: %s\n", strerror(errno));
+		close(sv[0]);
+		return -1;
+	}
+
+	/* The helper replies as soon as it has forked */
+	do {
+		res = recv(sv[0], &reply, sizeof(reply), 0);
+	} while (res < 0 && errno == EINTR);
+	if (res != sizeof(reply) || reply.type != SPAWN_STARTED) {
+		bbs_warning("Spawn helper did not respond to request to execute %s\n", p->filename);
+		close(sv[0]);
+		return -1;
+	} else if (reply.pid < 0) {
+		close(sv[0]);
+		if (reply.status == EAGAIN) {
+			return -1; /* Too busy, do it ourselves */
+		}
+		errno = reply.status;
+		return -2;
+	}
+	*waitfd = sv[0];
+	return reply.pid;
+}
+
+/*!
+ * \brief Wait for a program started by the spawn helper to exit
+ * \param pid
+ * \param waitfd Socket returned by spawn_helper_exec_request. Closed by this function.
+ * \param[out] status Wait status
+ * \retval 0 on success, -1 on failure
+ */
+static int spawn_helper_wait(pid_t pid, int waitfd, int *status)
+{
+	struct spawn_reply reply;
+	ssize_t res;
+
+	do {
+		res = recv(waitfd, &reply, sizeof(reply), 0);
+	} while (res < 0 && errno == EINTR);
+	close(waitfd);
+	if (res != sizeof(reply) || reply.type != SPAWN_EXITED || reply.pid != pid) {
+		bbs_error("Lost track of process %d (spawn helper exited?)\n", pid);
+		return -1;
+	}
+	*status = reply.status;
+	return 0;
+}
+
+/*!
+ * \brief Start a program, using the spawn helper if possible
+ * \param p
+ * \param[out] waitfd Socket to wait on for the exit status, or -1 if the program is a child of this process
+ * \retval -1 on failure, child PID otherwise
+ */
+static pid_t exec_start(const struct exec_params *p, int *waitfd)
+{
+	pid_t pid;
+
+	*waitfd = -1;
+	pid = spawn_helper_exec_request(p, waitfd);
+	if (pid == -1) {
+		/* Can't use the helper, so fork ourselves */
+		pid = exec_fork(p, NULL);
+	}
+	if (pid < 0) {
+		bbs_error("%s failed (%s): %s\n", p->isolated ? "clone" : "fork", p->filename, strerror(errno));
+		return -1;
+	}
+	return pid;
+}
+
+/*! \brief Wait for a program started by exec_start to exit, and return the result of executing it */
+static int exec_wait(pid_t pid, int waitfd, const char *filename)
+{
+	int res = -1;
+
+	if (waitfd == -1) {
+		waitpidexit(pid, filename, &res);
+	} else {
+		int status;
+		if (!spawn_helper_wait(pid, waitfd, &status)) {
+			exit_status(pid, filename, status, &res);
+		}
+	}
+	return res;
+}
+
+pid_t bbs_spawn(int fdin, int fdout, const char *filename, char *const argv[], char *const envp[], int *waitfd)
+{
+	struct exec_params p;
+
+	memset(&p, 0, sizeof(p));
+	p.filename = filename;
+	p.argv = argv;
+	p.envp = envp;
+	p.fdin = fdin;
+	p.fdout = fdout;
+	p.fderr = STDERR_FILENO;
+	return exec_start(&p, waitfd);
+}
+
+int bbs_spawn_wait(pid_t pid, int waitfd, const char *filename)
+{
+	int status;
+
+	if (waitfd == -1) {
+		if (waitpid(pid, &status, 0) == -1) {
+			bbs_error("waitpid (%s): %s\n", filename, strerror(errno));
+			return -1;
+		}
+	} else if (spawn_helper_wait(pid, waitfd, &status)) {
+		return -1;
+	}
+	if (!WIFEXITED(status)) {
+		bbs_debug(3, "Process %d (%s) did not exit normally\n", pid, filename);
+		return -1;
+	}
+	bbs_debug(5, "Process %d (%s) exited, status %d\n", pid, filename, WEXITSTATUS(status));
+	return WEXITSTATUS(status);
+}
+
+/*!
+ * \brief Execute an external program. Most calls to exec() should funnel through this function...
+ * \param node
+ * \param usenode
+ * \param fdin
+ * \param fdout
+ * \param filename Program name to execute
+ * \param argv Arguments
+ * \param envp Environment (optional)
+ * \param isolated Isolation level. 0 = no isolation. 1 = isolated in separate namespace, no network. 2 = isolated in separate namespace, sharing host network
+ * \retval -1 on failure
+ * \return Result of program execution
+ */
+static int __bbs_execvpe_fd(struct bbs_node *node, int usenode, int fdin, int fdout, const char *filename, char *const argv[], char *const envp[], int isolated)
+{
+	pid_t pid;
+	struct termios term;
+	struct exec_params p;
+	int fd = fdout;
+	int res = -1;
+	int pfd[2];
+	int waitfd;
+
+#ifdef __FreeBSD__
+	if (isolated) {
+		/* The mount() API is not implemented in clone_container for FreeBSD.
+		 * Additionally, CLONE_NEW... is not available for FreeBSD.
+		 * As such, these preclude isoexec from being used on that platform. */
+		bbs_error("Sorry, isoexec(%s) is not supported on FreeBSD\n", filename);
+		return -1;
+	}
+	if (envp) {
+		bbs_warning("FreeBSD does not support execvpe\n");
+	}
 #endif
-		bbs_assert(res == -1);
-
-		/* For menu exec: handler, we hold a RDLOCK on the menu when we get here, and it was locked in this thread,
-		 * helgrind will show an error if exec fails and we fall through here.
-		 * See:
-		 * - https://stackoverflow.com/questions/45889293/forking-while-holding-a-lock
-		 * - https://stackoverflow.com/questions/2620313/how-to-use-pthread-atfork-and-pthread-once-to-reinitialize-mutexes-in-child
-		 * Unfortunately, pthread_atfork doesn't really solve the issue.
-		 * For now, I just accept that we'll have this helgrind issue when exec fails,
-		 * it doesn't really matter since fork should always be followed by exec in the child,
-		 * and if it fails, we die anyways.
+
+	memset(&p, 0, sizeof(p));
+	p.filename = filename;
+	p.argv = argv;
+	p.envp = envp;
+	p.isolated = isolated;
+
+	bbs_debug(6, "node: %p, usenode: %d, fdin: %d, fdout: %d, filename: %s, isolated: %s\n", node, usenode, fdin, fdout, filename, isolated ? "yes" : "no");
+	if (node && usenode && (fdin != -1 || fdout != -1)) {
+		bbs_warning("fdin/fdout should not be provided if usenode == 1 (node is preferred, fdin/fdout will be ignored)\n");
+	}
+
+	/* If we have a node, use its fd for STDIN/STDOUT/STDERR */
+	if (node && usenode) {
+		/* If a node thread is calling this function, it MUST
+		 * pass a handle to node (it MUST NOT pass NULL),
+		 * regardless of whether the node is to be used for I/O.
+		 * This is because we must be able to kill the child process,
+		 * i.e. we must store node->childpid so the child can be killed
+		 * if needed. Think of it like "autoservicing" (except way simpler).
+		 * This is why the clunky "usenode" param exists.
 		 */
-		/* Can't use BBS logging in the child.
-		 * But the parent will know that we failed since we return errno, and parent can log it. */
-		/* Also, use _exit, not exit, since exit will execute the parent's atexit function, etc.
-		 * That matters because exec failed, so atexit is still registered. */
-		if (isolated) {
-			int saved_errno = errno;
-			fprintf(stderr, "%s: %s\n", filename, strerror(errno));
-#ifdef DEBUG_NEW_FS
-			if (1) {
-				struct dirent *entry;
-				DIR *dir = opendir(".");
-				if (dir) {
-					while ((entry = readdir(dir))) {
-						fprintf(stderr, "%s\n", entry->d_name);
-					}
-				} else {
-					fprintf(stderr, "opendir: %s\n", strerror(errno));
-				}
-			}
-#endif
-			errno = saved_errno;
+		fd = node->slavefd;
+		fdin = fdout = fd;
+		bbs_assert(isatty(fd));
+		/* Don't call tcgetsid here, it will fail */
+		bbs_debug(6, "sid: %d, tcpgrp: %d, term: %s\n", getsid(getpid()), tcgetpgrp(fd), S_IF(node->term));
+		safe_strncpy(p.term, S_OR(node->term, "xterm"), sizeof(p.term)); /* Many interactive programs will whine if $TERM is not set */
+		p.ctty = 1;
+		/* Save terminal settings to restore after execution */
+		memset(&term, 0, sizeof(term));
+		if (tcgetattr(node->slavefd, &term)) {
+			bbs_error("tcgetattr failed: %s\n", strerror(errno));
+			return -1;
 		}
-		_exit(errno);
-	} /* else, parent */
+	}
+	if (fdout == -1) {
+		/* If no node and no output fd, create file descriptors using a temporary pipe */
+		if (pipe(pfd)) {
+			bbs_error("pipe failed (%s): %s\n", filename, strerror(errno));
+			return -1;
+		}
+		fdout = pfd[1]; /* Use write end of pipe */
+	}
+	p.fdin = fdin;
+	p.fdout = p.fderr = fdout;
 
 #ifdef ISOEXEC_SUPPORTED
 	if (isolated) {
-		close(procpipe[0]);
-		res = setup_namespace(pid);
-		if (!res) {
-			char childpid[10];
-			/* Also write the child PID, since with CLONE_NEWPID, the child can't use getpid() to get the real child PID */
-			size_t pidlen = (size_t) snprintf(childpid, sizeof(childpid), "%d", pid);
-			bbs_write(procpipe[1], childpid, pidlen); /* Write to write end of pipe, to signal that UID/GID maps have been updated. */
+		if (eaccess(templatedir, R_OK)) {
+			bbs_error("rootfs template directory '%s' does not exist\n", templatedir);
+			goto cleanup;
+		}
+		/* Figure out everything that involves the user now, since the child can't log or take locks */
+		p.motd = node && !envp;
+		if (node && !envp && bbs_transfer_available()) {
+			char *tmp;
+			p.userenv = 1;
+			safe_strncpy(p.username, bbs_user_is_registered(node->user) ? bbs_username(node->user) : "guest", sizeof(p.username));
+			/* Make it all lowercase, per *nix conventions */
+			for (tmp = p.username; *tmp; tmp++) {
+				*tmp = (char) tolower(*tmp);
+			}
+			if (bbs_user_is_registered(node->user)) {
+				p.registered = 1;
+				if (bbs_transfer_home_dir(node->user->id, p.homedir, sizeof(p.homedir))) {
+					goto cleanup;
+				}
+			}
+			if (bbs_transfer_operation_allowed(node, TRANSFER_ACCESS, NULL) && bbs_transfer_operation_allowed(node, TRANSFER_DOWNLOAD, NULL)) {
+				if (bbs_transfer_home_dir(0, p.publichome, sizeof(p.publichome))) {
+					goto cleanup;
+				}
+				p.publicwrite = bbs_transfer_operation_allowed(node, TRANSFER_UPLOAD, NULL) ? 1 : 0;
+			}
 		}
-		close(procpipe[1]);
 	}
 #endif /* ISOEXEC_SUPPORTED */
 
+	pid = exec_start(&p, &waitfd);
+	if (pid < 0) {
+		goto cleanup;
+	}
+
 	if (fd == -1) {
 		close(pfd[1]); /* Close write end of pipe */
 	}
@@ -1155,7 +2059,7 @@ static int __bbs_execvpe_fd(struct bbs_node *node, int usenode, int fdin, int fd
 	}
 
 	bbs_debug(5, "Waiting for process %d to exit\n", pid);
-	waitpidexit(pid, filename, &res);
+	res = exec_wait(pid, waitfd, filename);
 	if (res == 1) {
 		/* Check if this failed because the $TERM used is not in the termcap database. */
 		if (node && !strlen_zero(node->term) && !term_type_exists(node->term)) {
@@ -1185,9 +2089,9 @@ static int __bbs_execvpe_fd(struct bbs_node *node, int usenode, int fdin, int fd
 	}
 
 #ifdef ISOEXEC_SUPPORTED
-	if (isolated) {
+	if (isolated && waitfd == -1) {
 		char rootdir[268];
-		/* Clean up the temporary container, if one was created */
+		/* Clean up the temporary container, if one was created (the spawn helper cleans up after its own children) */
 		temp_container_root(rootdir, sizeof(rootdir), pid);
 		if (!eaccess(rootdir, R_OK) && bbs_delete_directory(rootdir)) {
 			bbs_warning("Failed to remove temporary container rootfs: %s\n", rootdir);
@@ -1214,4 +2118,10 @@ static int __bbs_execvpe_fd(struct bbs_node *node, int usenode, int fdin, int fd
 		close(pfd[0]);
 	}
 	return res;
+
+cleanup:
+	if (fd == -1) {
+		PIPE_CLOSE(pfd);
+	}
+	return -1;
 }
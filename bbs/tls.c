@@ -48,6 +48,34 @@ SSL_CTX *ssl_ctx = NULL;
 static int ssl_is_available = 0;
 static int ssl_shutting_down = 0;
 
+#ifdef HAVE_OPENSSL
+/*! \brief Maximum amount of time for a client to complete a TLS handshake with us */
+#define TLS_ACCEPT_TIMEOUT_MS 3000
+
+/*! \brief Maximum amount of time for a remote server to complete a TLS handshake with us */
+#define TLS_CONNECT_TIMEOUT_MS 10000
+
+/*! \brief Maximum amount of time the I/O thread will wait for a stalled SSL_write to make progress */
+#define TLS_WRITE_TIMEOUT_MS 1500
+
+/*! \brief Handshake and I/O statistics, for the "tlsstats" CLI command */
+static struct tls_stats {
+	unsigned int accepted;		/* Server handshakes completed */
+	unsigned int acceptfailed;	/* Server handshakes that failed */
+	unsigned int accepttimeouts;	/* Server handshakes that timed out */
+	unsigned int connected;		/* Client handshakes completed */
+	unsigned int connectfailed;	/* Client handshakes that failed or timed out */
+	int64_t accepttotalms;		/* Cumulative duration of completed server handshakes */
+	int64_t acceptmaxms;		/* Longest completed server handshake */
+	int64_t connecttotalms;		/* Cumulative duration of completed client handshakes */
+	int64_t connectmaxms;		/* Longest completed client handshake */
+	unsigned int writestalls;	/* Number of times SSL_write could not immediately complete */
+	unsigned int writetimeouts;	/* Number of connections killed because SSL_write stalled for too long */
+} tls_stats;
+
+static bbs_mutex_t tls_stats_lock = BBS_MUTEX_INITIALIZER;
+#endif
+
 #ifdef HAVE_OPENSSL
 static bbs_mutex_t *lock_cs = NULL;
 static long *lock_count = NULL;
@@ -288,6 +316,103 @@ static pthread_t ssl_thread;
 		} \
 	} \
 
+/*!
+ * \brief Wait until an SSL operation that could not complete may be retried
+ * \param ssl
+ * \param sslerr SSL_get_error result for the operation
+ * \param start Time at which the operation started
+ * \param timeout Maximum duration of the operation, in ms
+ * \retval 1 if the operation should be retried, 0 if the deadline has passed, -1 if sslerr is not retryable or on error
+ */
+static int ssl_wait(SSL *ssl, int sslerr, struct timeval start, int timeout)
+{
+	struct pollfd pfd;
+	int remaining, res;
+
+	switch (sslerr) {
+		case SSL_ERROR_WANT_READ:
+			pfd.events = POLLIN;
+			break;
+		case SSL_ERROR_WANT_WRITE:
+			pfd.events = POLLOUT;
+			break;
+		default:
+			return -1;
+	}
+
+	pfd.fd = SSL_get_fd(ssl);
+	for (;;) {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Waggregate-return"
+		remaining = timeout - (int) bbs_tvdiff_ms(bbs_tvnow(), start);
+#pragma GCC diagnostic pop
+		if (remaining <= 0) {
+			return 0;
+		}
+		pfd.revents = 0;
+		res = poll(&pfd, 1, remaining);
+		if (res < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			bbs_debug(3, "poll failed: %s\n", strerror(errno));
+			return -1;
+		} else if (!res) {
+			return 0;
+		}
+		/* Even on POLLHUP or POLLERR, let OpenSSL retry and report the actual error */
+		return 1;
+	}
+}
+
+static void record_handshake(int server, int success, int timedout, struct timeval start)
+{
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Waggregate-return"
+	int64_t ms = bbs_tvdiff_ms(bbs_tvnow(), start);
+#pragma GCC diagnostic pop
+
+	bbs_mutex_lock(&tls_stats_lock);
+	if (server) {
+		if (success) {
+			tls_stats.accepted++;
+			tls_stats.accepttotalms += ms;
+			tls_stats.acceptmaxms = MAX(tls_stats.acceptmaxms, ms);
+		} else if (timedout) {
+			tls_stats.accepttimeouts++;
+		} else {
+			tls_stats.acceptfailed++;
+		}
+	} else {
+		if (success) {
+			tls_stats.connected++;
+			tls_stats.connecttotalms += ms;
+			tls_stats.connectmaxms = MAX(tls_stats.connectmaxms, ms);
+		} else {
+			tls_stats.connectfailed++;
+		}
+	}
+	bbs_mutex_unlock(&tls_stats_lock);
+}
+
+/*! \brief Show TLS handshake and I/O statistics */
+static int cli_tlsstats(struct bbs_cli_args *a)
+{
+	struct tls_stats stats;
+
+	bbs_mutex_lock(&tls_stats_lock);
+	stats = tls_stats;
+	bbs_mutex_unlock(&tls_stats_lock);
+
+	bbs_dprintf(a->fdout, "%-18s %10s %10s %10s %10s %10s\n", "Handshakes", "Completed", "Failed", "Timed Out", "Avg (ms)", "Max (ms)");
+	bbs_dprintf(a->fdout, "%-18s %10u %10u %10u %10ld %10ld\n", "Server (accept)",
+		stats.accepted, stats.acceptfailed, stats.accepttimeouts, stats.accepted ? stats.accepttotalms / stats.accepted : 0, stats.acceptmaxms);
+	bbs_dprintf(a->fdout, "%-18s %10u %10u %10s %10ld %10ld\n", "Client (connect)",
+		stats.connected, stats.connectfailed, "-", stats.connected ? stats.connecttotalms / stats.connected : 0, stats.connectmaxms);
+	bbs_dprintf(a->fdout, "Stalled writes: %u (%u timed out)\n", stats.writestalls, stats.writetimeouts);
+	return 0;
+}
+
 /*! \brief Dump TLS sessions */
 static int cli_tls(struct bbs_cli_args *a)
 {
@@ -533,6 +658,7 @@ static void *ssl_io_thread(void *unused)
 				}
 			} else if (!overtime) { /* sfd->writepipe has activity */
 				int write_attempts = 0;
+				struct timeval writestart;
 				int readpipe = readpipes[(i - 1) / 2]; /* If SSL connection is dead, can't write to it either */
 				/* Read from writepipe and relay to socket using SSL_write */
 				SSL *ssl = ssl_list[(i - 1) / 2];
@@ -561,31 +687,37 @@ static void *ssl_io_thread(void *unused)
 							int err = SSL_get_error(ssl, (int) wres);
 							switch (err) {
 								case SSL_ERROR_WANT_WRITE:
+								case SSL_ERROR_WANT_READ: /* e.g. renegotiation */
 									/* We are supposed to retry with the same arguments,
 									 * we cannot just come back and try this again later,
 									 * since the buffer is shared amongst all TLS users,
 									 * we cannot store this for later.
-									 * It may not be a great idea to retry again because this may hold
+									 * It may not be a great idea to wait here because this may hold
 									 * other connections up, and no single SSL connection must be allowed to hog
-									 * the thread.
+									 * the thread, so wait on the socket (rather than sleeping) and give up
+									 * if it doesn't drain in time.
 									 * We COULD malloc dup the # of bytes in the buffer (and store how many)
 									 * and check for such a buffer on previous visits to this item in the loop.
-									 * We certainly SHOULD do this if this turns out to be a major issue,
-									 * i.e. more than just tens or a couple hunderd milliseconds.
 									 * This is definitely a downside of using a single thread for all TLS relaying.
 									 */
 									if (!write_attempts++) { /* Log the first time. Debug, not warning, since this could happen legitimately */
 										bbs_debug(4, "SSL_write returned %ld (%s)\n", wres, ssl_strerror(err));
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Waggregate-return"
+										writestart = bbs_tvnow();
+#pragma GCC diagnostic pop
+										bbs_mutex_lock(&tls_stats_lock);
+										tls_stats.writestalls++;
+										bbs_mutex_unlock(&tls_stats_lock);
 									}
-									if (write_attempts < 3000) {
-										/* Don't make the loop super tight, it'll probably take several hunderd/thousand us anyways,
-										 * and we don't need to service I/O in realtime.
-										 * Don't make it super loose either, we have other work we need to get on with. */
-										usleep(500);
+									if (ssl_wait(ssl, err, writestart, TLS_WRITE_TIMEOUT_MS) > 0) {
 										continue;
 									}
-									/* This is more than a second without making any progress, abort. */
-									bbs_error("Max SSL_write retries (%d) exceeded\n", write_attempts);
+									/* Too long without making any progress, abort. */
+									bbs_error("SSL_write made no progress in %d ms (%d attempts)\n", TLS_WRITE_TIMEOUT_MS, write_attempts);
+									bbs_mutex_lock(&tls_stats_lock);
+									tls_stats.writetimeouts++;
+									bbs_mutex_unlock(&tls_stats_lock);
 									MARK_DEAD(ssl);
 									needcreate = 1;
 									break;
@@ -678,7 +810,7 @@ SSL *ssl_new_accept(struct bbs_node *node, int fd, int *rfd, int *wfd)
 #ifdef HAVE_OPENSSL
 	int res;
 	int readfd, writefd;
-	int attempts = 0;
+	struct timeval start;
 	SSL *ssl;
 
 	if (!ssl_is_available) {
@@ -691,6 +823,9 @@ SSL *ssl_new_accept(struct bbs_node *node, int fd, int *rfd, int *wfd)
 
 	/* No need to call SSL_CTX_set_session_cache_mode(ssl_ctx, SSL_SESS_CACHE_SERVER) - this is the default */
 
+	/* The cert lock only needs to be held until the SSL has its own reference to the context.
+	 * It must not be held for the handshake, since that depends on the client,
+	 * and a slow (or malicious) client would otherwise hold up certificate reloads. */
 	bbs_rwlock_rdlock(&ssl_cert_lock);
 	ssl = SSL_new(ssl_ctx);
 	if (!ssl) {
@@ -701,31 +836,38 @@ SSL *ssl_new_accept(struct bbs_node *node, int fd, int *rfd, int *wfd)
 	SSL_set_fd(ssl, fd);
 	SSL_CTX_set_min_proto_version(ssl_ctx, TLS1_VERSION); /* Minimum TLS 1.0 */
 	SSL_CTX_set_tlsext_servername_callback(ssl_ctx, ssl_servername_cb);
+	bbs_rwlock_unlock(&ssl_cert_lock);
 
-accept:
-	res = SSL_accept(ssl);
-	if (res != 1) {
-		int sslerr = SSL_get_error(ssl, res);
-		if (sslerr == SSL_ERROR_WANT_READ) {
-			if (++attempts > 3000) { /* 3 seconds */
-				bbs_rwlock_unlock(&ssl_cert_lock);
-				bbs_warning("SSL_accept timed out\n");
-				SSL_free(ssl);
-				return NULL;
-			}
-			usleep(1000);
-			goto accept; /* This just works out to be cleaner than using any kind of loop here */
+	/* If the socket is nonblocking, wait for the client between steps of the handshake, until the deadline */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Waggregate-return"
+	start = bbs_tvnow();
+#pragma GCC diagnostic pop
+	for (;;) {
+		int sslerr, waitres;
+		res = SSL_accept(ssl);
+		if (res == 1) {
+			break;
+		}
+		sslerr = SSL_get_error(ssl, res);
+		waitres = ssl_wait(ssl, sslerr, start, TLS_ACCEPT_TIMEOUT_MS);
+		if (waitres > 0) {
+			continue;
+		} else if (!waitres) {
+			bbs_warning("SSL_accept timed out\n");
+			record_handshake(1, 0, 1, start);
+		} else {
+			bbs_debug(1, "SSL error %d: %d (%s = %s)\n", res, sslerr, ssl_strerror(sslerr), ERR_error_string(ERR_get_error(), NULL));
+			record_handshake(1, 0, 0, start);
 		}
-		bbs_rwlock_unlock(&ssl_cert_lock);
-		bbs_debug(1, "SSL error %d: %d (%s = %s)\n", res, sslerr, ssl_strerror(sslerr), ERR_error_string(ERR_get_error(), NULL));
 		SSL_free(ssl);
 		/* If TLS setup fails, it's probably garbage traffic and safe to penalize: */
-		if (node) {
+		if (node && waitres < 0) {
 			bbs_event_dispatch(node, EVENT_NODE_ENCRYPTION_FAILED);
 		}
 		return NULL;
 	}
-	bbs_rwlock_unlock(&ssl_cert_lock);
+	record_handshake(1, 1, 0, start);
 
 	readfd = SSL_get_rfd(ssl);
 	writefd = SSL_get_wfd(ssl);
@@ -762,6 +904,8 @@ SSL *ssl_client_new(int fd, int *rfd, int *wfd, const char *snihostname)
 	X509 *server_cert;
 	long verify_result;
 	char *str;
+	struct timeval start;
+	int res;
 
 	if (rfd && wfd && bbs_unblock_fd(fd)) { /* Make the TLS reads from the client nonblocking */
 		return NULL;
@@ -808,17 +952,30 @@ SSL *ssl_client_new(int fd, int *rfd, int *wfd, const char *snihostname)
 		bbs_warning("No SNI provided, server may be unable to provide us its certificate!\n");
 	}
 
-connect:
-	if (SSL_connect(ssl) == -1) {
-		int sslerr = SSL_get_error(ssl, -1);
-		if (sslerr == SSL_ERROR_WANT_READ) {
-			usleep(1000);
-			goto connect;
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Waggregate-return"
+	start = bbs_tvnow();
+#pragma GCC diagnostic pop
+	for (;;) {
+		int sslerr, waitres;
+		res = SSL_connect(ssl);
+		if (res == 1) {
+			break;
 		}
-		bbs_debug(4, "SSL error: %s\n", ssl_strerror(sslerr));
-		bbs_error("Failed to connect SSL: %s\n", ERR_error_string(ERR_get_error(), NULL));
+		sslerr = SSL_get_error(ssl, res);
+		waitres = ssl_wait(ssl, sslerr, start, TLS_CONNECT_TIMEOUT_MS);
+		if (waitres > 0) {
+			continue;
+		} else if (!waitres) {
+			bbs_error("TLS handshake with %s timed out\n", S_IF(snihostname));
+		} else {
+			bbs_debug(4, "SSL error: %s\n", ssl_strerror(sslerr));
+			bbs_error("Failed to connect SSL: %s\n", ERR_error_string(ERR_get_error(), NULL));
+		}
+		record_handshake(0, 0, !waitres, start);
 		goto sslcleanup;
 	}
+	record_handshake(0, 1, 0, start);
 	/* Verify cert */
 #if defined(OPENSSL_VERSION_MAJOR) && OPENSSL_VERSION_MAJOR >= 3
 	server_cert = SSL_get1_peer_certificate(ssl);
@@ -1135,6 +1292,7 @@ static int tlsreload(int fd)
 
 static struct bbs_cli_entry cli_commands_tls[] = {
 	BBS_CLI_COMMAND(cli_tls, "tls", 1, "List all TLS sessions", NULL),
+	BBS_CLI_COMMAND(cli_tlsstats, "tlsstats", 1, "Show TLS handshake statistics", NULL),
 };
 
 static int setup_ssl_io(void)
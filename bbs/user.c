@@ -171,6 +171,7 @@ void username_cache_flush(void)
 	 * this would allow us to do so.
 	 * For now, this is only called on shutdown. */
 	RWLIST_WRLOCK_REMOVE_ALL(&username_mappings, entry, free);
+	bbs_user_cache_invalidate(0);
 }
 
 static void username_mapping_cache_add(unsigned int userid, const char *username)
@@ -319,74 +320,219 @@ int bbs_lowercase_username_from_userid(unsigned int userid, char *buf, size_t le
 	return 0;
 }
 
-int bbs_user_priv_from_userid(unsigned int userid)
-{
-	int priv = -1;
-	int index = 0;
-	struct bbs_user *user, **userlist;
+/*! \brief Default for how long user records are cached */
+#define USER_CACHE_TTL 60
 
-	/* We don't check the cache here, since privileges could change during runtime,
-	 * although user IDs and username mappings are not at all likely to change. */
+/*! \brief Maximum number of cached user records */
+#define USER_CACHE_MAX 64
 
-	userlist = bbs_user_list();
-	if (!userlist) {
-		return -1;
+/* Cache of user records by user ID.
+ * These are looked up frequently (e.g. for ACL checks and mail delivery),
+ * and each lookup would otherwise be a query to the auth provider. */
+struct cached_user {
+	struct bbs_user *user;
+	time_t expires;
+	RWLIST_ENTRY(cached_user) entry;
+};
+
+static RWLIST_HEAD_STATIC(cached_users, cached_user);
+static unsigned int user_cache_ttl = USER_CACHE_TTL;
+static unsigned int user_cache_generation = 0; /*!< Incremented whenever cached users are invalidated */
+
+static void cached_user_free(struct cached_user *c)
+{
+	bbs_user_destroy(c->user);
+	free(c);
+}
+
+#define STRDUP_FIELD(field) \
+	if (user->field) { \
+		dup->field = strdup(user->field); \
+		if (ALLOC_FAILURE(dup->field)) { \
+			goto cleanup; \
+		} \
 	}
 
-	/*! \todo FIXME This is a horrible implementation (linear instead of constant). Apparently,
-	 * we have no way to get a user by user ID (only by username) right now,
-	 * so that API needs to be added, and then this should be rewritten to use that.
-	 * Horrible kludge for now. */
-	while ((user = userlist[index++])) {
-		if (user->id == userid) {
-			priv = user->priv;
-			break;
-		}
+#define MEMDUP_FIELD(field) \
+	if (user->field) { \
+		dup->field = malloc(sizeof(*dup->field)); \
+		if (ALLOC_FAILURE(dup->field)) { \
+			goto cleanup; \
+		} \
+		memcpy(dup->field, user->field, sizeof(*dup->field)); \
 	}
 
-	bbs_user_list_destroy(userlist);
-	return priv;
+/*! \brief Duplicate a registered user */
+static struct bbs_user *user_dup(struct bbs_user *user)
+{
+	struct bbs_user *dup = bbs_user_request();
+
+	if (!dup) {
+		return NULL;
+	}
+	dup->id = user->id;
+	dup->priv = user->priv;
+	dup->gender = user->gender;
+	STRDUP_FIELD(username);
+	STRDUP_FIELD(email);
+	STRDUP_FIELD(fullname);
+	STRDUP_FIELD(phone);
+	STRDUP_FIELD(address);
+	STRDUP_FIELD(city);
+	STRDUP_FIELD(state);
+	STRDUP_FIELD(zip);
+	MEMDUP_FIELD(dob);
+	MEMDUP_FIELD(registered);
+	MEMDUP_FIELD(lastlogin);
+	return dup;
+
+cleanup:
+	bbs_user_destroy(dup);
+	return NULL;
 }
 
-static void bbs_user_list_destroy_except(struct bbs_user **userlist, struct bbs_user *except)
+#undef STRDUP_FIELD
+#undef MEMDUP_FIELD
+
+void bbs_user_cache_invalidate(unsigned int userid)
 {
-	int index = 0;
-	struct bbs_user *user;
-	while ((user = userlist[index++])) {
-		if (user != except) {
-			bbs_user_destroy(user);
+	struct cached_user *c;
+
+	RWLIST_WRLOCK(&cached_users);
+	user_cache_generation++;
+	RWLIST_TRAVERSE_SAFE_BEGIN(&cached_users, c, entry) {
+		if (!userid || c->user->id == userid) {
+			RWLIST_REMOVE_CURRENT(entry);
+			cached_user_free(c);
 		}
 	}
-	free(userlist); /* Free the list itself */
+	RWLIST_TRAVERSE_SAFE_END;
+	RWLIST_UNLOCK(&cached_users);
 }
 
-void bbs_user_list_destroy(struct bbs_user **userlist)
+unsigned int bbs_user_cache_set_ttl(unsigned int ttl)
 {
-	return bbs_user_list_destroy_except(userlist, NULL);
+	unsigned int oldttl;
+
+	RWLIST_WRLOCK(&cached_users);
+	oldttl = user_cache_ttl;
+	user_cache_ttl = ttl;
+	RWLIST_UNLOCK(&cached_users);
+
+	bbs_user_cache_invalidate(0); /* Existing entries were cached using the old TTL */
+	return oldttl;
 }
 
-struct bbs_user *bbs_user_from_userid(unsigned int userid)
+/*!
+ * \brief Get a user by user ID, from the cache if possible
+ * \param userid
+ * \return Copy of the user, which the caller must free, or NULL if not found
+ */
+static struct bbs_user *user_cache_get(unsigned int userid)
 {
-	int index = 0;
-	struct bbs_user *retuser = NULL;
-	struct bbs_user *user, **userlist = bbs_user_list();
-	if (!userlist) {
+	struct cached_user *c, *old;
+	struct bbs_user *user, *dup;
+	unsigned int generation;
+	int count = 0;
+	time_t now = time(NULL);
+
+	if (!userid) {
 		return NULL;
 	}
 
-	/*! \todo FIXME This is a horrible implementation (linear instead of constant). Apparently,
-	 * we have no way to get a user by user ID (only by username) right now,
-	 * so that API needs to be added, and then this should be rewritten to use that.
-	 * Horrible kludge for now. */
-	while ((user = userlist[index++])) {
-		if (user->id == userid) {
-			retuser = user;
+	RWLIST_WRLOCK(&cached_users);
+	RWLIST_TRAVERSE_SAFE_BEGIN(&cached_users, c, entry) {
+		if (c->user->id == userid) {
+			RWLIST_REMOVE_CURRENT(entry);
+			if (c->expires <= now) {
+				cached_user_free(c); /* Stale */
+				c = NULL;
+			}
 			break;
 		}
 	}
+	RWLIST_TRAVERSE_SAFE_END;
+	if (c) {
+		/* Move to the front, so the least recently used entries are at the end */
+		RWLIST_INSERT_HEAD(&cached_users, c, entry);
+		user = user_dup(c->user);
+		RWLIST_UNLOCK(&cached_users);
+		return user;
+	}
+	generation = user_cache_generation;
+	RWLIST_UNLOCK(&cached_users);
 
-	bbs_user_list_destroy_except(userlist, retuser); /* Free all users except the one we want */
-	return retuser;
+	/* Cache miss. Don't hold the lock while querying the auth provider. */
+	user = bbs_user_info_by_id(userid);
+	if (!user) {
+		return NULL;
+	}
+
+	dup = user_dup(user); /* The cache keeps its own copy */
+	if (!dup) {
+		return user;
+	}
+	c = calloc(1, sizeof(*c));
+	if (ALLOC_FAILURE(c)) {
+		bbs_user_destroy(dup);
+		return user;
+	}
+	c->user = dup;
+
+	RWLIST_WRLOCK(&cached_users);
+	if (generation != user_cache_generation) {
+		/* The cache was invalidated while we were querying, so what we got may already be outdated */
+		RWLIST_UNLOCK(&cached_users);
+		cached_user_free(c);
+		return user;
+	}
+	c->expires = now + (time_t) user_cache_ttl;
+	RWLIST_TRAVERSE_SAFE_BEGIN(&cached_users, old, entry) {
+		/* Someone else could have cached this user in the meantime */
+		if (old->user->id == userid || ++count >= USER_CACHE_MAX) {
+			RWLIST_REMOVE_CURRENT(entry);
+			cached_user_free(old);
+		}
+	}
+	RWLIST_TRAVERSE_SAFE_END;
+	RWLIST_INSERT_HEAD(&cached_users, c, entry);
+	RWLIST_UNLOCK(&cached_users);
+	return user;
+}
+
+int bbs_user_priv_from_userid(unsigned int userid)
+{
+	struct bbs_user *user;
+	int priv;
+
+	if (!userid) {
+		return -1;
+	}
+
+	/* Privileges can be changed at any time, and this is used for access control,
+	 * so always ask the auth provider rather than using a cached user record. */
+	user = bbs_user_info_by_id(userid);
+	if (!user) {
+		return -1;
+	}
+	priv = user->priv;
+	bbs_user_destroy(user);
+	return priv;
+}
+
+void bbs_user_list_destroy(struct bbs_user **userlist)
+{
+	int index = 0;
+	struct bbs_user *user;
+	while ((user = userlist[index++])) {
+		bbs_user_destroy(user);
+	}
+	free(userlist); /* Free the list itself */
+}
+
+struct bbs_user *bbs_user_from_userid(unsigned int userid)
+{
+	return user_cache_get(userid);
 }
 
 struct bbs_user *bbs_user_from_username(const char *username)
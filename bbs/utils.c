@@ -620,8 +620,72 @@ int bbs_dir_has_subdirs(const char *path)
 	return res;
 }
 
+/*! \brief A file with multiple hard links, which should only count once towards a directory's size */
+struct dir_size_link {
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+};
+
+struct dir_size_links {
+	struct dir_size_link *links;
+	size_t num;
+	size_t alloc;
+};
+
+static int dir_size_link_cmp(const void *a, const void *b)
+{
+	const struct dir_size_link *x = a, *y = b;
+
+	if (x->dev != y->dev) {
+		return x->dev < y->dev ? -1 : 1;
+	}
+	if (x->ino != y->ino) {
+		return x->ino < y->ino ? -1 : 1;
+	}
+	return 0;
+}
+
+static int dir_size_link_add(struct dir_size_links *links, struct stat *st)
+{
+	if (links->num == links->alloc) {
+		size_t newalloc = links->alloc ? links->alloc * 2 : 32;
+		struct dir_size_link *newlinks = realloc(links->links, newalloc * sizeof(*newlinks));
+		if (ALLOC_FAILURE(newlinks)) {
+			return -1;
+		}
+		links->links = newlinks;
+		links->alloc = newalloc;
+	}
+	links->links[links->num].dev = st->st_dev;
+	links->links[links->num].ino = st->st_ino;
+	links->links[links->num].size = st->st_size;
+	links->num++;
+	return 0;
+}
+
+/*! \brief Total size of all the hard linked files encountered, counting each inode only once */
+static long dir_size_links_total(struct dir_size_links *links)
+{
+	size_t i;
+	long size = 0;
+
+	if (!links->num) {
+		return 0;
+	}
+
+	qsort(links->links, links->num, sizeof(*links->links), dir_size_link_cmp);
+	for (i = 0; i < links->num; i++) {
+		if (i && !dir_size_link_cmp(&links->links[i - 1], &links->links[i])) {
+			continue; /* Another link to a file we already counted */
+		}
+		size += links->links[i].size;
+	}
+	return size;
+}
+
 /*! \note Skips using bbs_dir_traverse and does it directly since executing a callback for every single file is an expensive way to calculate the quota */
-static int __bbs_dir_size(const char *path, long *size, int max_depth)
+static int __bbs_dir_size(const char *path, long *size, int max_depth, struct dir_size_links *links)
 {
 	DIR *dir;
 	struct dirent *entry;
@@ -681,6 +745,9 @@ static int __bbs_dir_size(const char *path, long *size, int max_depth)
 #ifdef EXTRA_DEBUG
 				bbs_debug(10, "File %s is %ld bytes\n", fullname, st.st_size);
 #endif
+				if (st.st_nlink > 1 && !dir_size_link_add(links, &st)) {
+					continue; /* Count it once all the links have been seen */
+				}
 				*size = *size + st.st_size;
 			}
 			continue;
@@ -703,7 +770,7 @@ static int __bbs_dir_size(const char *path, long *size, int max_depth)
 #ifdef EXTRA_DEBUG
 			bbs_debug(4, "Recursing into %s\n", full_path);
 #endif
-			res = __bbs_dir_size(full_path, size, max_depth);
+			res = __bbs_dir_size(full_path, size, max_depth, links);
 			if (res) {
 				free(full_path);
 				break;
@@ -728,7 +795,14 @@ long bbs_dir_size(const char *path)
 {
 	int res;
 	long size = 0;
-	res = __bbs_dir_size(path, &size, 32);
+	struct dir_size_links links;
+
+	memset(&links, 0, sizeof(links));
+	res = __bbs_dir_size(path, &size, 32, &links);
+	if (!res) {
+		size += dir_size_links_total(&links);
+	}
+	free(links.links);
 	if (res) {
 		return res;
 	}
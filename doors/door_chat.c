@@ -23,9 +23,9 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <string.h>
-#include <unistd.h> /* use close */
 
 #include "include/module.h"
+#include "include/alertpipe.h"
 #include "include/node.h"
 #include "include/user.h"
 #include "include/door.h"
@@ -33,14 +33,42 @@
 #include "include/linkedlists.h"
 #include "include/utils.h"
 
+/*! \brief Number of messages retained per channel (must be a power of 2) */
+#define CHAT_RING_SIZE 64
+/*! \brief Maximum number of messages replayed to a participant when joining a channel */
+#define CHAT_SCROLLBACK 20
+/*! \brief Maximum length of a single chat message, including the timestamp */
+#define CHAT_MSG_MAXLEN 512
+/*! \brief Length of the timestamp prefix, mm-dd hh:mm:ssPP + space */
+#define CHAT_TIMESTAMP_LEN 17
+
+/*!
+ * \brief A single message slot in a channel's broadcast ring.
+ * The slot is protected by a sequence lock: seq is 0 while the slot is being written,
+ * and otherwise holds the message number + 1 of the message it currently contains.
+ * Readers copy the slot and then verify seq is unchanged, so they never block the sender.
+ */
+struct chat_msg {
+	unsigned long seq;
+	unsigned int sender;	/* Participant ID of sender, 0 if none */
+	size_t len;
+	char data[CHAT_MSG_MAXLEN + 1]; /* Timestamp followed by message, null terminated only in copies */
+};
+
 struct participant {
 	struct bbs_node *node;
 	/* Reference to our channel, for speed of finding it again (we can do pointer comparisons instead of string comparisons) */
 	struct channel *channel;
+	/* Unique participant ID, used to avoid relaying our own messages back to us */
+	unsigned int id;
 	/* Join time */
 	time_t jointime;
-	/* Pipe to store data */
-	int chatpipe[2];
+	/* Number of the next message in the channel ring to read */
+	unsigned long cursor;
+	/* Whether a wakeup is already pending on the alert pipe */
+	int pending;
+	/* Alert pipe, signaled when new messages are available */
+	int alertpipe[2];
 	/* Next participant */
 	RWLIST_ENTRY(participant) entry;
 };
@@ -49,10 +77,15 @@ RWLIST_HEAD(participants, participant);
 
 struct channel {
 	struct participants participants; /* List of participants */
+	bbs_mutex_t sendlock; /* Serializes senders, so the ring only ever has a single producer at a time */
+	unsigned long head; /* Number of messages ever sent to this channel */
+	struct chat_msg ring[CHAT_RING_SIZE]; /* Most recent messages */
 	RWLIST_ENTRY(channel) entry; /* Next channel */
 	char name[0]; /* Name of channel */
 };
 
+static unsigned int next_participant_id = 0;
+
 static RWLIST_HEAD_STATIC(channels, channel);
 
 static void leave_channel(struct channel *channel, struct participant *participant)
@@ -65,9 +98,7 @@ static void leave_channel(struct channel *channel, struct participant *participa
 	RWLIST_TRAVERSE_SAFE_BEGIN(&channel->participants, p, entry) {
 		if (p == participant) {
 			RWLIST_REMOVE_CURRENT(entry);
-			/* Close the pipe */
-			close(p->chatpipe[0]);
-			close(p->chatpipe[1]);
+			bbs_alertpipe_close(p->alertpipe);
 			/* Free */
 			free(p);
 			break;
@@ -90,6 +121,7 @@ static void leave_channel(struct channel *channel, struct participant *participa
 		c = RWLIST_REMOVE(&channels, channel, entry);
 		if (c) {
 			RWLIST_HEAD_DESTROY(&channel->participants);
+			bbs_mutex_destroy(&c->sendlock);
 			free(c);
 		} else {
 			bbs_error("Faled to remove channel %s?\n", channel->name);
@@ -132,9 +164,9 @@ static struct participant *join_channel(struct bbs_node *node, const char *name)
 	}
 	p->node = node;
 	p->channel = channel;
+	p->id = (unsigned int) bbs_atomic_add_fetch(&next_participant_id, 1, __ATOMIC_RELAXED);
 	p->jointime = time(NULL);
-	if (pipe(p->chatpipe)) {
-		bbs_error("Failed to create pipe\n");
+	if (bbs_alertpipe_create(p->alertpipe)) {
 		if (newchan) {
 			free(channel);
 		}
@@ -145,6 +177,11 @@ static struct participant *join_channel(struct bbs_node *node, const char *name)
 	/* Tail insert so participants show up in order */
 	if (newchan) {
 		RWLIST_HEAD_INIT(&channel->participants);
+		bbs_mutex_init(&channel->sendlock, NULL);
+	} else {
+		/* Replay recent messages to the newcomer */
+		unsigned long head = __atomic_load_n(&channel->head, __ATOMIC_ACQUIRE);
+		p->cursor = head > CHAT_SCROLLBACK ? head - CHAT_SCROLLBACK : 0;
 	}
 	RWLIST_INSERT_TAIL(&channel->participants, p, entry);
 	if (newchan) {
@@ -201,6 +238,8 @@ static int __chat_send(struct channel *channel, struct participant *sender, cons
 	struct tm sendtime;
 	char datestr[18];
 	size_t timelen;
+	unsigned long msgno;
+	struct chat_msg *slot;
 	struct participant *p;
 
 #ifdef INTEGRITY_CHECKS
@@ -228,7 +267,7 @@ static int __chat_send(struct channel *channel, struct participant *sender, cons
 	/* So, %P is lowercase and %p is uppercase. Just consult your local strftime(3) man page if you don't believe me. Good grief. */
 	strftime(datestr, sizeof(datestr), "%m-%d %I:%M:%S%P ", &sendtime); /* mm-dd hh:mm:ssPP + space at end (before message) = 17 chars */
 	timelen = strlen(datestr); /* Should be 17 */
-	bbs_assert(timelen == 17);
+	bbs_assert(timelen == CHAT_TIMESTAMP_LEN);
 
 	/* If sender is set, it's safe to use even with no locks, because the sender is a calling function of this one */
 	if (sender) {
@@ -237,34 +276,135 @@ static int __chat_send(struct channel *channel, struct participant *sender, cons
 		bbs_debug(7, "Broadcasting to %s: %s%.*s\n", channel->name, datestr, (int) len, msg);
 	}
 
-	/* Relay the message to everyone */
+	if (len > CHAT_MSG_MAXLEN - CHAT_TIMESTAMP_LEN) {
+		bbs_warning("Truncating %lu-byte message to %d bytes\n", len, CHAT_MSG_MAXLEN - CHAT_TIMESTAMP_LEN);
+		len = CHAT_MSG_MAXLEN - CHAT_TIMESTAMP_LEN;
+	}
+
+	/* Publish the message to the ring.
+	 * Senders are serialized, but readers never take this lock,
+	 * so a participant that isn't keeping up can't stall anyone else. */
+	bbs_mutex_lock(&channel->sendlock);
+	msgno = channel->head;
+	slot = &channel->ring[msgno & (CHAT_RING_SIZE - 1)];
+	__atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED); /* Mark slot as being written */
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	slot->sender = sender ? sender->id : 0;
+	slot->len = timelen + len;
+	memcpy(slot->data, datestr, timelen);
+	memcpy(slot->data + timelen, msg, len);
+	__atomic_store_n(&slot->seq, msgno + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&channel->head, msgno + 1, __ATOMIC_RELEASE);
+	bbs_mutex_unlock(&channel->sendlock);
+
+	/* Wake up everyone that doesn't already have a wakeup pending.
+	 * The alert pipe is non-blocking, so this never waits on a participant. */
 	RWLIST_RDLOCK(&channel->participants);
 	RWLIST_TRAVERSE(&channel->participants, p, entry) {
-		ssize_t res;
 		if (p == sender) {
 			continue; /* Don't send a sender's message back to him/herself */
 		}
-		/* A participant can only be in one channel, so we don't have to worry
-		 * about multiple people trying to write to the pipe at once.
-		 * Only one write can occur to a participant's pipe at any given time.
-		 * If participants were allowed to be in multiple channels,
-		 * then this would be different, we would need to have a mutex for each participant.
-		 * But this module is only single channel, I think the multi-channel stuff
-		 * can be reserved for the IRC module. Let's keep it simple here.
-		 */
-		if (!NODE_IS_TDD(p->node)) {
-			res = write(p->chatpipe[1], datestr, timelen); /* Don't send timestamps to TDDs, for brevity */
-		}
-		res = write(p->chatpipe[1], msg, len);
-		if (res <= 0) {
-			bbs_error("write failed: %s\n", strerror(errno));
-			continue; /* Even if one send fails, don't fail all of them */
+		if (!__atomic_exchange_n(&p->pending, 1, __ATOMIC_ACQ_REL)) {
+			bbs_alertpipe_write(p->alertpipe);
 		}
 	}
 	RWLIST_UNLOCK(&channel->participants);
 	return 0;
 }
 
+/*!
+ * \brief Copy a message out of a channel's ring
+ * \param channel
+ * \param msgno Message number to read
+ * \param[out] msg Copy of the message
+ * \retval 0 on success, -1 if the message has already been overwritten
+ */
+static int chat_ring_read(struct channel *channel, unsigned long msgno, struct chat_msg *msg)
+{
+	struct chat_msg *slot = &channel->ring[msgno & (CHAT_RING_SIZE - 1)];
+	unsigned long seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+	if (seq != msgno + 1) {
+		return -1; /* Overwritten (or being overwritten) by a newer message */
+	}
+	msg->sender = slot->sender;
+	msg->len = slot->len;
+	if (msg->len > CHAT_MSG_MAXLEN) {
+		return -1; /* Torn read of the length */
+	}
+	memcpy(msg->data, slot->data, msg->len);
+	msg->data[msg->len] = '\0';
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	/* If the sender lapped us while we were copying, the copy may be torn */
+	return __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq ? 0 : -1;
+}
+
+static int chat_missed(struct bbs_node *node, struct channel *c, unsigned long missed)
+{
+	bbs_debug(3, "Node %d missed %lu message%s in %s\n", node->id, missed, ESS(missed), c->name);
+	return bbs_node_writef(node, "%s*** Missed %lu message%s ***%s\n", COLOR(COLOR_RED), missed, ESS(missed), COLOR_RESET) < 0 ? -1 : 0;
+}
+
+/*!
+ * \brief Relay all messages in the channel ring that a participant hasn't yet seen
+ * \retval 0 on success, -1 if the node disconnected
+ */
+static int chat_ring_drain(struct bbs_node *node, struct participant *p)
+{
+	struct channel *c = p->channel;
+	unsigned long head, missed = 0;
+	struct chat_msg msg;
+
+	/* Clear the pending flag before reading, so a message published after we finish will wake us up again */
+	__atomic_store_n(&p->pending, 0, __ATOMIC_SEQ_CST);
+	bbs_alertpipe_read(p->alertpipe);
+
+	head = __atomic_load_n(&c->head, __ATOMIC_ACQUIRE);
+	while (p->cursor < head) {
+		/* If we've fallen behind by more than the size of the ring, skip ahead rather than holding up the sender */
+		if (head - p->cursor > CHAT_RING_SIZE) {
+			missed += head - p->cursor - CHAT_RING_SIZE;
+			p->cursor = head - CHAT_RING_SIZE;
+		}
+		if (chat_ring_read(c, p->cursor++, &msg)) {
+			/* Got lapped while reading, so this message is gone too */
+			missed++;
+			head = __atomic_load_n(&c->head, __ATOMIC_ACQUIRE);
+			continue;
+		}
+		if (missed) {
+			if (chat_missed(node, c, missed)) {
+				return -1;
+			}
+			missed = 0;
+		}
+		if (msg.sender == p->id) {
+			continue; /* Don't relay our own messages back to ourselves */
+		}
+		/* Don't send timestamps to TDDs, for brevity */
+		if (NODE_IS_TDD(node)) {
+			if (bbs_node_write(node, msg.data + CHAT_TIMESTAMP_LEN, msg.len - CHAT_TIMESTAMP_LEN) < 0) {
+				return -1;
+			}
+		} else if (bbs_node_write(node, msg.data, msg.len) < 0) {
+			return -1;
+		}
+		/* If the message contains our username, ring the bell.
+		 * (Most IRC clients also do this for mentions.) */
+		if (strcasestr(msg.data + CHAT_TIMESTAMP_LEN, bbs_username(node->user))) {
+			bbs_debug(3, "Message contains '%s', alerting user\n", bbs_username(node->user));
+			if (bbs_node_ring_bell(node) < 0) {
+				return -1;
+			}
+		}
+		head = __atomic_load_n(&c->head, __ATOMIC_ACQUIRE);
+	}
+	if (missed && chat_missed(node, c, missed)) {
+		return -1;
+	}
+	return 0;
+}
+
 /*
  * Forward declaration needed since __attribute__ can only be used with declarations, not definitions.
  * See http://www.unixwiz.net/techtips/gnu-c-attributes.html#compat
@@ -322,7 +462,7 @@ static int chat_run(struct bbs_node *node, struct participant *p)
 
 	for (;;) {
 		/* We need to poll both the node as well as the participant (chat) pipe */
-		res = bbs_node_poll2(node, SEC_MS(10), p->chatpipe[0]);
+		res = bbs_node_poll2(node, SEC_MS(10), p->alertpipe[0]);
 		if (res < 0) {
 			break;
 		} else if (res == 1) {
@@ -383,37 +523,17 @@ static int chat_run(struct bbs_node *node, struct participant *p)
 			 */
 			chat_send(c, p, "%s@%d: %s", bbs_username(node->user), node->id, buf2); /* buf already contains a newline from the user pressing ENTER, so don't add another one */
 		} else if (res == 2) {
-			/* Pipe has activity: Received a message */
-			/* The nice thing is since it's in a pipe, we won't
+			/* Alert pipe has activity: Received a message */
+			/* The nice thing is since messages are kept in the channel ring, we won't
 			 * lose messages if something is sent while we were typing,
-			 * they'll just be delayed a bit.
+			 * they'll just be delayed a bit (unless we fall too far behind).
 			 * The timestamp is created when the message is sent,
 			 * so THAT will be accurate, which is good!
 			 */
-			res = 0;
-			res = (int) read(p->chatpipe[0], buf, sizeof(buf) - 1);
-			if (res <= 0) {
+			res = chat_ring_drain(node, p);
+			if (res) {
 				break;
 			}
-			buf[res] = '\0'; /* Safe */
-			/* Don't add a trailing LF, the sent message should already had one.
-			 * Even if it doesn't, don't blindly add one. Because we write the time and message in 2 separate calls to write(),
-			 * in __chat_send, we could end up doing 2 disjoint reads here, and the first one will only have the timestamp.
-			 */
-			if (bbs_node_writef(node, "%.*s", (int) res, buf) < 0) {
-				res = -1;
-				break;
-			}
-			/* Since we null terminated the buffer, we can safely use strstr */
-			if (strcasestr(buf, bbs_username(node->user))) {
-				bbs_debug(3, "Message contains '%s', alerting user\n", bbs_username(node->user));
-				/* If the message contains our username, ring the bell.
-				 * (Most IRC clients also do this for mentions.) */
-				if (bbs_node_ring_bell(node) < 0) {
-					res = -1;
-					break;
-				}
-			}
 		}
 	}
 
@@ -497,6 +497,7 @@ static void command_cb(const char *clientname, enum irc_callback_msg_type type,
 #endif
 			break;
 		case CMD_PING:
+		case CMD_DISCONNECT:
 		case CMD_UNSUPPORTED:
 			break;
 	}
@@ -44,7 +44,6 @@ static int users_exec(struct bbs_node *node, const char *args)
 		activeonly = 1;
 	}
 
-	/* Don't be deceived: this is an O(n^2) operation, since we call bbs_user_online for each user */
 	bbs_node_clear_screen(node);
 	memset(&pginfo, 0, sizeof(pginfo));
 	while ((user = userlist[index++])) {
@@ -0,0 +1,551 @@
+/*
+ * LBBS -- The Lightweight Bulletin Board System
+ *
+ * Copyright (C) 2023, Naveen Albert
+ *
+ * Naveen Albert <bbs@phreaknet.org>
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Synthetic maildir and newsgroup spool generator
+ *
+ * \note Generates large, realistic mailboxes (or newsgroups) for benchmarking,
+ *       directly in the on-disk format used by mod_mail and net_nntp,
+ *       as if the messages had already been delivered and seen by a client.
+ *
+ * \author Naveen Albert <bbs@phreaknet.org>
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/stat.h>
+
+#define MAX_SIZE_BUCKETS 8
+
+struct size_bucket {
+	unsigned int weight;
+	size_t max;
+};
+
+static struct size_bucket buckets[MAX_SIZE_BUCKETS];
+static int num_buckets = 0;
+static unsigned int total_weight = 0;
+
+static unsigned int count = 1000;
+static unsigned int mime_pct = 20;
+static unsigned int thread_depth = 5;
+static unsigned int seen_pct = 80;
+static unsigned int expunge_pct = 5;
+static unsigned int new_count = 0;
+static unsigned long seed = 0;
+static const char *hostname = "example.com";
+static const char *newsgroup = NULL;
+
+static unsigned long rngstate = 88172645463325252UL;
+
+/*! \brief xorshift64, so output is reproducible for a given seed */
+static unsigned long rnd(void)
+{
+	rngstate ^= rngstate << 13;
+	rngstate ^= rngstate >> 7;
+	rngstate ^= rngstate << 17;
+	return rngstate;
+}
+
+/*! \brief Random number in [min, max] */
+static unsigned long rnd_range(unsigned long min, unsigned long max)
+{
+	return min + rnd() % (max - min + 1);
+}
+
+static int chance(unsigned int pct)
+{
+	return rnd() % 100 < pct;
+}
+
+static const char *words[] = {
+	"the", "meeting", "project", "update", "server", "weekly", "report", "question", "about", "release",
+	"schedule", "budget", "review", "invoice", "please", "urgent", "followup", "design", "draft", "notes",
+	"lunch", "tomorrow", "agenda", "minutes", "status", "deploy", "bug", "feature", "request", "thanks",
+	"mailing", "list", "digest", "newsletter", "account", "password", "reset", "order", "shipped", "receipt",
+	"conference", "travel", "photos", "weekend", "plans", "family", "board", "vote", "proposal", "patch",
+};
+
+#define NUM_WORDS (sizeof(words) / sizeof(*words))
+#define NUM_SENDERS 200
+
+static int parse_sizes(char *s)
+{
+	char *bucket;
+
+	num_buckets = 0;
+	total_weight = 0;
+	while ((bucket = strsep(&s, ","))) {
+		char *max = strchr(bucket, ':');
+		char *end;
+		if (!max || num_buckets >= MAX_SIZE_BUCKETS) {
+			return -1;
+		}
+		*max++ = '\0';
+		buckets[num_buckets].weight = (unsigned int) atoi(bucket);
+		buckets[num_buckets].max = strtoul(max, &end, 10);
+		if (*end == 'k' || *end == 'K') {
+			buckets[num_buckets].max *= 1024;
+		} else if (*end == 'm' || *end == 'M') {
+			buckets[num_buckets].max *= 1024 * 1024;
+		}
+		if (!buckets[num_buckets].max || (num_buckets && buckets[num_buckets].max <= buckets[num_buckets - 1].max)) {
+			return -1; /* Buckets must be in increasing order */
+		}
+		total_weight += buckets[num_buckets].weight;
+		num_buckets++;
+	}
+	return total_weight ? 0 : -1;
+}
+
+/*! \brief Pick a size from the configured distribution: choose a bucket by weight, then uniformly within the bucket */
+static size_t random_size(void)
+{
+	unsigned int w = (unsigned int) (rnd() % total_weight);
+	int i;
+
+	for (i = 0; i < num_buckets - 1; i++) {
+		if (w < buckets[i].weight) {
+			break;
+		}
+		w -= buckets[i].weight;
+	}
+	return rnd_range(i ? buckets[i - 1].max + 1 : 512, buckets[i].max);
+}
+
+struct buf {
+	char *s;
+	size_t len;
+	size_t alloc;
+};
+
+static void __attribute__ ((format (printf, 2, 3))) buf_append(struct buf *b, const char *fmt, ...)
+{
+	va_list ap;
+	int len;
+
+	for (;;) {
+		va_start(ap, fmt);
+		len = vsnprintf(b->s + b->len, b->alloc - b->len, fmt, ap);
+		va_end(ap);
+		if (len < 0) {
+			return;
+		}
+		if ((size_t) len < b->alloc - b->len) {
+			b->len += (size_t) len;
+			return;
+		}
+		b->alloc = 2 * b->alloc + (size_t) len;
+		b->s = realloc(b->s, b->alloc);
+		if (!b->s) {
+			fprintf(stderr, "Allocation failure\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+static void make_subject(char *subject, size_t len)
+{
+	snprintf(subject, len, "%s %s %s %lu", words[rnd() % NUM_WORDS], words[rnd() % NUM_WORDS], words[rnd() % NUM_WORDS], rnd_range(1, 9999));
+}
+
+/*! \brief Add lines of text until the body is (approximately) size bytes */
+static void add_text(struct buf *b, size_t size)
+{
+	size_t target = b->len + size;
+
+	while (b->len < target) {
+		int i, words_per_line = (int) rnd_range(6, 12);
+		for (i = 0; i < words_per_line; i++) {
+			buf_append(b, "%s%s", i ? " " : "", words[rnd() % NUM_WORDS]);
+		}
+		buf_append(b, "%s", chance(3) ? ".\r\n\r\n" : "\r\n");
+	}
+}
+
+/*! \brief Add random base64 data, in 76 character lines, until the body is (approximately) size bytes */
+static void add_base64(struct buf *b, size_t size)
+{
+	static const char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	size_t target = b->len + size;
+
+	while (b->len < target) {
+		char line[77];
+		int i;
+		for (i = 0; i < 76; i++) {
+			line[i] = table[rnd() % 64];
+		}
+		line[76] = '\0';
+		buf_append(b, "%s\r\n", line);
+	}
+}
+
+/*! \brief Generate a message (or article) of approximately size bytes */
+static void make_message(struct buf *b, unsigned int i, time_t when, const char *subject, int reply, const char *references, const char *parentid, size_t size)
+{
+	char date[64];
+	struct tm tm;
+	unsigned int sender = (unsigned int) rnd_range(1, NUM_SENDERS);
+
+	gmtime_r(&when, &tm);
+	strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S +0000", &tm);
+
+	b->len = 0;
+	buf_append(b, "Date: %s\r\n", date);
+	buf_append(b, "From: \"Sender %u\" <sender%u@%s>\r\n", sender, sender, hostname);
+	if (newsgroup) {
+		buf_append(b, "Newsgroups: %s\r\n", newsgroup);
+	} else {
+		buf_append(b, "To: <recipient@%s>\r\n", hostname);
+	}
+	buf_append(b, "Subject: %s%s\r\n", reply ? "Re: " : "", subject);
+	buf_append(b, "Message-ID: <%u.%lu@%s>\r\n", i, seed, hostname);
+	if (reply) {
+		buf_append(b, "In-Reply-To: %s\r\n", parentid);
+		buf_append(b, "References: %s\r\n", references);
+	}
+
+	if (!newsgroup && chance(mime_pct)) {
+		const char *boundary = "----=_NextPart_000_0000";
+		buf_append(b, "MIME-Version: 1.0\r\n");
+		if (chance(33)) {
+			/* Text with an attachment, which is where most of the bulk is */
+			buf_append(b, "Content-Type: multipart/mixed; boundary=\"%s\"\r\n\r\n", boundary);
+			buf_append(b, "This is a multi-part message in MIME format.\r\n\r\n");
+			buf_append(b, "--%s\r\nContent-Type: text/plain; charset=\"utf-8\"\r\n\r\n", boundary);
+			add_text(b, 512);
+			buf_append(b, "\r\n--%s\r\nContent-Type: application/octet-stream; name=\"file%u.bin\"\r\n", boundary, i);
+			buf_append(b, "Content-Transfer-Encoding: base64\r\nContent-Disposition: attachment; filename=\"file%u.bin\"\r\n\r\n", i);
+			add_base64(b, size > b->len ? size - b->len : 76);
+		} else {
+			/* Plain text and HTML versions of the same thing */
+			size_t half = size / 2;
+			buf_append(b, "Content-Type: multipart/alternative; boundary=\"%s\"\r\n\r\n", boundary);
+			buf_append(b, "--%s\r\nContent-Type: text/plain; charset=\"utf-8\"\r\n\r\n", boundary);
+			add_text(b, half);
+			buf_append(b, "\r\n--%s\r\nContent-Type: text/html; charset=\"utf-8\"\r\n\r\n<html><body><p>\r\n", boundary);
+			add_text(b, half);
+			buf_append(b, "</p></body></html>\r\n");
+		}
+		buf_append(b, "\r\n--%s--\r\n", boundary);
+	} else {
+		buf_append(b, "Content-Type: text/plain; charset=\"utf-8\"\r\n\r\n");
+		add_text(b, size > b->len ? size - b->len : 1);
+	}
+}
+
+static int write_file(const char *path, const char *data, size_t len)
+{
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		fprintf(stderr, "open(%s) failed: %s\n", path, strerror(errno));
+		return -1;
+	}
+	if (write(fd, data, len) != (ssize_t) len) {
+		fprintf(stderr, "write(%s) failed: %s\n", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	return 0;
+}
+
+static int make_dir(const char *path)
+{
+	if (mkdir(path, 0700) && errno != EEXIST) {
+		fprintf(stderr, "mkdir(%s) failed: %s\n", path, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+struct msginfo {
+	int parent; /* Index of parent message, -1 if none */
+	unsigned short depth;
+	char subject[64];
+};
+
+/*! \brief Choose a parent among recent messages, as replies usually follow shortly after the original */
+static int pick_parent(struct msginfo *msgs, unsigned int i)
+{
+	unsigned int tries;
+
+	if (!thread_depth || !i || !chance(50)) {
+		return -1;
+	}
+	for (tries = 0; tries < 5; tries++) {
+		unsigned int back = (unsigned int) rnd_range(1, i < 50 ? i : 50);
+		if (msgs[i - back].depth < thread_depth) {
+			return (int) (i - back);
+		}
+	}
+	return -1;
+}
+
+static void build_references(struct msginfo *msgs, int parent, char *buf, size_t len)
+{
+	int ancestors[256];
+	int n = 0, p;
+	size_t pos = 0;
+
+	for (p = parent; p != -1 && n < 256; p = msgs[p].parent) {
+		ancestors[n++] = p;
+	}
+	buf[0] = '\0';
+	/* Oldest first */
+	while (n-- > 0 && pos < len) {
+		int res = snprintf(buf + pos, len - pos, "%s<%d.%lu@%s>", pos ? " " : "", ancestors[n], seed, hostname);
+		if (res < 0) {
+			break;
+		}
+		pos += (size_t) res;
+	}
+}
+
+static int generate(const char *dir)
+{
+	struct buf b;
+	struct msginfo *msgs;
+	char path[512];
+	char references[4096], parentid[128];
+	unsigned int i, uid = 0, generated = 0;
+	unsigned long modseq = 0;
+	unsigned long long bytes = 0;
+	time_t start = time(NULL) - (time_t) count * 600; /* One message every 10 minutes, ending now */
+	FILE *modseqfp = NULL;
+	unsigned int marker = 0, version = 2;
+	unsigned long horizon = 0;
+
+	msgs = calloc(count ? count : 1, sizeof(*msgs));
+	b.alloc = 65536;
+	b.len = 0;
+	b.s = malloc(b.alloc);
+	if (!msgs || !b.s) {
+		fprintf(stderr, "Allocation failure\n");
+		return -1;
+	}
+
+	if (make_dir(dir)) {
+		return -1;
+	}
+	if (!newsgroup) {
+		snprintf(path, sizeof(path), "%s/cur", dir);
+		if (make_dir(path)) {
+			return -1;
+		}
+		snprintf(path, sizeof(path), "%s/new", dir);
+		if (make_dir(path)) {
+			return -1;
+		}
+		snprintf(path, sizeof(path), "%s/tmp", dir);
+		if (make_dir(path)) {
+			return -1;
+		}
+		/* HIGHESTMODSEQ is filled in at the end, followed by the version and horizon,
+		 * then the MODSEQ and UID range of every expunged message (as in mod_mail) */
+		snprintf(path, sizeof(path), "%s/.modseqs", dir);
+		modseqfp = fopen(path, "wb");
+		if (!modseqfp) {
+			fprintf(stderr, "fopen(%s) failed: %s\n", path, strerror(errno));
+			return -1;
+		}
+		fwrite(&modseq, sizeof(unsigned long), 1, modseqfp);
+		fwrite(&marker, sizeof(unsigned int), 1, modseqfp);
+		fwrite(&version, sizeof(unsigned int), 1, modseqfp);
+		fwrite(&horizon, sizeof(unsigned long), 1, modseqfp);
+	}
+
+	for (i = 0; i < count; i++) {
+		time_t when = start + (time_t) i * 600 + (time_t) rnd_range(0, 599);
+		size_t size = random_size();
+		int parent = pick_parent(msgs, i);
+
+		msgs[i].parent = parent;
+		if (parent != -1) {
+			msgs[i].depth = (unsigned short) (msgs[parent].depth + 1);
+			strcpy(msgs[i].subject, msgs[parent].subject); /* Safe */
+			build_references(msgs, parent, references, sizeof(references));
+			snprintf(parentid, sizeof(parentid), "<%d.%lu@%s>", parent, seed, hostname);
+		} else {
+			make_subject(msgs[i].subject, sizeof(msgs[i].subject));
+		}
+		make_message(&b, i, when, msgs[i].subject, parent != -1, references, parentid, size);
+
+		if (newsgroup) {
+			/* Filename format is ARTICLEID_MESSAGEID */
+			snprintf(path, sizeof(path), "%s/%u_%08lx-%04lx-%04lx@%s", dir, i + 1, rnd() & 0xffffffff, rnd() & 0xffff, rnd() & 0xffff, hostname);
+		} else if (i >= count - new_count) {
+			/* Delivered, but not yet seen by any client, so no UID assigned yet */
+			snprintf(path, sizeof(path), "%s/new/%lu%06u", dir, (unsigned long) when, i % 1000000);
+		} else {
+			char flags[8];
+			int f = 0;
+			while (chance(expunge_pct)) {
+				/* Leave a gap, as if this message had been expunged. Each expunge is a modification too. */
+				uid++;
+				modseq++;
+				fwrite(&modseq, sizeof(unsigned long), 1, modseqfp);
+				fwrite(&uid, sizeof(unsigned int), 1, modseqfp); /* First UID in range */
+				fwrite(&uid, sizeof(unsigned int), 1, modseqfp); /* Last UID in range */
+			}
+			uid++;
+			modseq++;
+			/* Flags must be in ASCII order */
+			if (chance(seen_pct / 10)) {
+				flags[f++] = 'F';
+			}
+			if (chance(seen_pct / 4)) {
+				flags[f++] = 'R';
+			}
+			if (i < count - new_count - 10 && chance(seen_pct)) { /* The most recent messages are always unseen */
+				flags[f++] = 'S';
+			}
+			flags[f] = '\0';
+			snprintf(path, sizeof(path), "%s/cur/%lu%06u,S=%lu,U=%u,M=%lu:2,%s", dir, (unsigned long) when, i % 1000000, b.len, uid, modseq, flags);
+		}
+		if (write_file(path, b.s, b.len)) {
+			return -1;
+		}
+		bytes += b.len;
+		generated++;
+		if (!(generated % 10000)) {
+			fprintf(stderr, "Generated %u/%u messages\n", generated, count);
+		}
+	}
+
+	if (!newsgroup) {
+		unsigned int uidvalidity = (unsigned int) start;
+		char c = 3; /* Binary format marker */
+		FILE *fp;
+
+		if (!modseq) {
+			modseq = 1; /* Must be at least 1 */
+		}
+		rewind(modseqfp);
+		fwrite(&modseq, sizeof(unsigned long), 1, modseqfp);
+		fclose(modseqfp);
+
+		/* UIDVALIDITY, then the last assigned UID */
+		snprintf(path, sizeof(path), "%s/.uidvalidity", dir);
+		fp = fopen(path, "wb");
+		if (!fp) {
+			fprintf(stderr, "fopen(%s) failed: %s\n", path, strerror(errno));
+			return -1;
+		}
+		fwrite(&uidvalidity, sizeof(unsigned int), 1, fp);
+		fwrite(&uid, sizeof(unsigned int), 1, fp);
+		fwrite(&c, sizeof(char), 1, fp);
+		fclose(fp);
+	}
+
+	printf("Generated %u %s (%llu bytes) in %s\n", generated, newsgroup ? "articles" : "messages", bytes, dir);
+	if (!newsgroup) {
+		printf("Last UID %u, HIGHESTMODSEQ %lu\n", uid, modseq);
+	}
+	free(b.s);
+	free(msgs);
+	return 0;
+}
+
+static void show_help(void)
+{
+	fprintf(stderr, "Usage: maildirgen [options] <directory>\n");
+	fprintf(stderr, "  -n <count>     Number of messages (default %u)\n", count);
+	fprintf(stderr, "  -s <sizes>     Size distribution, as comma-separated weight:maxsize buckets (default 60:4k,25:32k,10:256k,5:2m)\n");
+	fprintf(stderr, "  -m <percent>   Percentage of MIME multipart messages (default %u)\n", mime_pct);
+	fprintf(stderr, "  -t <depth>     Maximum thread depth, 0 for no replies (default %u)\n", thread_depth);
+	fprintf(stderr, "  -f <percent>   Flag density: percentage of messages that are \\Seen (default %u)\n", seen_pct);
+	fprintf(stderr, "  -x <percent>   Percentage of UIDs that have been expunged (default %u)\n", expunge_pct);
+	fprintf(stderr, "  -N <count>     Number of the most recent messages to leave in new (default %u)\n", new_count);
+	fprintf(stderr, "  -r <seed>      Random seed, for reproducible output\n");
+	fprintf(stderr, "  -H <hostname>  Hostname for addresses and message IDs (default %s)\n", hostname);
+	fprintf(stderr, "  -g <group>     Generate a newsgroup spool for the named newsgroup, instead of a maildir\n");
+	fprintf(stderr, "The directory is the maildir itself (e.g. <maildir>/<user ID>) or the newsgroup directory (e.g. <newsdir>/<group>)\n");
+}
+
+int main(int argc, char *argv[])
+{
+	static const char *getopt_settings = "?f:g:hH:m:n:N:r:s:t:x:";
+	char defaultsizes[] = "60:4k,25:32k,10:256k,5:2m";
+	int c;
+
+	parse_sizes(defaultsizes);
+
+	while ((c = getopt(argc, argv, getopt_settings)) != -1) {
+		switch (c) {
+		case 'f':
+			seen_pct = (unsigned int) atoi(optarg);
+			break;
+		case 'g':
+			newsgroup = optarg;
+			break;
+		case 'H':
+			hostname = optarg;
+			break;
+		case 'm':
+			mime_pct = (unsigned int) atoi(optarg);
+			break;
+		case 'n':
+			count = (unsigned int) atoi(optarg);
+			break;
+		case 'N':
+			new_count = (unsigned int) atoi(optarg);
+			break;
+		case 'r':
+			seed = strtoul(optarg, NULL, 10);
+			break;
+		case 's':
+			if (parse_sizes(optarg)) {
+				fprintf(stderr, "Invalid size distribution: %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 't':
+			thread_depth = (unsigned int) atoi(optarg);
+			break;
+		case 'x':
+			expunge_pct = (unsigned int) atoi(optarg);
+			break;
+		case '?':
+		case 'h':
+		default:
+			show_help();
+			return -1;
+		}
+	}
+
+	if (optind != argc - 1) {
+		show_help();
+		return -1;
+	}
+	if (new_count > count || expunge_pct >= 100) {
+		fprintf(stderr, "Invalid arguments\n");
+		return -1;
+	}
+
+	if (seed) {
+		rngstate ^= seed * 2654435761UL;
+		if (!rngstate) {
+			rngstate = 1;
+		}
+	}
+
+	return generate(argv[optind]) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
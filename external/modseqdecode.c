@@ -25,7 +25,7 @@ int main(int argc, char *argv[])
 {
 	FILE *fp;
 	int res;
-	unsigned int uid;
+	unsigned int uid, maxuid, version;
 	unsigned long modseq;
 
 	if (argc != 2) {
@@ -47,16 +47,42 @@ int main(int argc, char *argv[])
 
 	printf("HIGHESTMODSEQ: %lu\n", modseq);
 
-	for (;;) {
-		res = fread(&uid, sizeof(unsigned int), 1, fp);
-		if (res != 1) {
-			break;
+	/* The original format has a UID here, the current format has 0 followed by a version */
+	res = fread(&uid, sizeof(unsigned int), 1, fp);
+	if (res == 1 && !uid) {
+		res = fread(&version, sizeof(unsigned int), 1, fp);
+		if (res != 1 || fread(&modseq, sizeof(unsigned long), 1, fp) != 1) {
+			fprintf(stderr, "File corrupted: failed to read header\n");
+			exit(EXIT_FAILURE);
+		}
+		printf("Version: %u\n", version);
+		printf("Horizon: %lu\n", modseq);
+		for (;;) {
+			if (fread(&modseq, sizeof(unsigned long), 1, fp) != 1) {
+				break;
+			}
+			if (fread(&uid, sizeof(unsigned int), 1, fp) != 1 || fread(&maxuid, sizeof(unsigned int), 1, fp) != 1) {
+				fprintf(stderr, "Incomplete record at end of file\n");
+				break;
+			}
+			if (uid == maxuid) {
+				printf("UID - %8u          => MODSEQ %12lu\n", uid, modseq);
+			} else {
+				printf("UID - %8u:%-8u => MODSEQ %12lu\n", uid, maxuid, modseq);
+			}
 		}
+		fclose(fp);
+		return 0;
+	}
+
+	printf("Version: 1\n");
+	while (res == 1) {
 		res = fread(&modseq, sizeof(unsigned long), 1, fp);
 		if (res != 1) {
 			break;
 		}
 		printf("UID - %8u => MODSEQ %12lu\n", uid, modseq);
+		res = fread(&uid, sizeof(unsigned int), 1, fp);
 	}
 
 	fclose(fp);
@@ -114,6 +114,27 @@ int bbs_unregister_user_info_handler(struct bbs_user* (*handler)(const char *use
  */
 struct bbs_user *bbs_user_info_by_username(const char *username);
 
+/*!
+ * \brief Register a user info by ID handler
+ * \param handler Callback function to execute that will return a BBS user with details about the user with the specified user ID. The callback should return NULL if no such user or failure.
+ * \note Only one user info by ID handler may be registered system-wide.
+ */
+#define bbs_register_user_info_by_id_handler(handler) __bbs_register_user_info_by_id_handler(handler, BBS_MODULE_SELF)
+
+int __bbs_register_user_info_by_id_handler(struct bbs_user* (*handler)(unsigned int userid), void *mod);
+
+/*! \brief Unregister a previously registered user info by ID handler */
+int bbs_unregister_user_info_by_id_handler(struct bbs_user* (*handler)(unsigned int userid));
+
+/*!
+ * \brief Retrieve the bbs_user struct corresponding to a user ID, directly from the auth provider
+ * \param userid
+ * \retval user on success, NULL on failure. The returned struct must be freed using bbs_user_destroy.
+ * \note Falls back to searching the user list if no user info by ID handler is registered.
+ * \note Most callers should use bbs_user_from_userid instead, which is cached.
+ */
+struct bbs_user *bbs_user_info_by_id(unsigned int userid);
+
 /*!
  * \brief Register a user list handler
  * \param handler Callback function to execute that will return an array of BBS users.
@@ -42,6 +42,33 @@ int bbs_curl_get_file(struct bbs_curl *c, const char *filename);
 /*! \brief HTTP POST request */
 int bbs_curl_post(struct bbs_curl *c);
 
+/*!
+ * \brief Make an HTTP request asynchronously, without blocking the calling thread
+ * \param c Request. This must remain valid until the callback has been executed.
+ * \param post 1 for POST, 0 for GET
+ * \param callback Callback to execute once the request completes or fails. res is 0 on success and -1 on failure, as for the synchronous functions.
+ *                 This is executed from the cURL worker thread, so it should not block.
+ * \param data Custom callback data
+ * \retval 0 if the request was queued, -1 on failure (in which case the callback will not be executed)
+ */
+#define bbs_curl_request_async(c, post, callback, data) __bbs_curl_request_async(c, post, callback, data, BBS_MODULE_SELF)
+
+int __bbs_curl_request_async(struct bbs_curl *c, int post, void (*callback)(struct bbs_curl *c, int res, void *data), void *data, void *mod);
+
+struct bbs_curl_host_stats {
+	unsigned long requests;		/*!< Completed requests */
+	unsigned long reused;		/*!< Requests that reused an existing connection */
+	unsigned long failures;		/*!< Requests that failed */
+};
+
+/*!
+ * \brief Get request statistics for the host of a URL
+ * \param url
+ * \param[out] stats
+ * \retval 0 on success, -1 if no requests have been made to the host
+ */
+int bbs_curl_host_stats(const char *url, struct bbs_curl_host_stats *stats);
+
 /*! \brief Shut down cURL */
 int bbs_curl_shutdown(void);
 
@@ -59,6 +59,18 @@ struct bbs_node;
 
 int __bbs_register_event_consumer(int (*callback)(struct bbs_event *event), void *mod);
 
+/*!
+ * \brief Register an event consumer whose callback is executed asynchronously, from a dedicated thread
+ * \note Events are copied into a bounded queue for the consumer and delivered in the order they were broadcast.
+ *       If the queue is full, events are dropped (and counted). The return value of the callback is ignored.
+ * \note Asynchronous consumers do not receive EVENT_NODE_INTERACTIVE_START or EVENT_NODE_INTERACTIVE_LOGIN,
+ *       and the node is never set. Consumers that need to act on the node or veto an event must be synchronous.
+ */
+#define bbs_register_event_consumer_async(callback) __bbs_register_event_consumer_async(callback, BBS_MODULE_SELF)
+
+int __bbs_register_event_consumer_async(int (*callback)(struct bbs_event *event), void *mod);
+
+/*! \brief Unregister an event consumer. For asynchronous consumers, any events still queued are delivered first. */
 int bbs_unregister_event_consumer(int (*callback)(struct bbs_event *event));
 
 /*! \brief Get a string representation of an event type's name */
@@ -72,3 +84,6 @@ int bbs_event_dispatch(struct bbs_node *node, enum bbs_event_type type);
 
 /*! \brief Same as bbs_event_dispatch, but provide optional custom data, used depending on the type */
 int bbs_event_dispatch_custom(struct bbs_node *node, enum bbs_event_type type, const void *data);
+
+/*! \brief Initialize event bus */
+int bbs_init_events(void);
@@ -81,6 +81,7 @@ typedef struct bbs_rwlock bbs_rwlock_t;
 #define bbs_mutex_lock(lock) __bbs_mutex_lock(lock, __FILE__, __LINE__, __func__, #lock)
 #define bbs_mutex_trylock(lock) __bbs_mutex_trylock(lock, __FILE__, __LINE__, __func__, #lock)
 #define bbs_mutex_unlock(lock) __bbs_mutex_unlock(lock, __FILE__, __LINE__, __func__, #lock)
+#define bbs_cond_timedwait(cond, lock, abstime) __bbs_cond_timedwait(cond, lock, abstime, __FILE__, __LINE__, __func__, #lock)
 
 #define bbs_rwlock_init(lock, attr) __bbs_rwlock_init(lock, __FILE__, __LINE__, __func__, #lock)
 #define bbs_rwlock_destroy(lock) __bbs_rwlock_destroy(lock, __FILE__, __LINE__, __func__, #lock)
@@ -96,6 +97,15 @@ int __bbs_mutex_lock(bbs_mutex_t *t, const char *filename, int lineno, const cha
 int __bbs_mutex_trylock(bbs_mutex_t *t, const char *filename, int lineno, const char *func, const char *name);
 int __bbs_mutex_unlock(bbs_mutex_t *t, const char *filename, int lineno, const char *func, const char *name);
 
+/*!
+ * \brief Wait on a condition variable, with the mutex's bookkeeping kept consistent while it is released
+ * \param cond Condition variable
+ * \param t Mutex, which must be held by the caller
+ * \param abstime Absolute CLOCK_REALTIME deadline
+ * \retval Same as pthread_cond_timedwait
+ */
+int __bbs_cond_timedwait(pthread_cond_t *cond, bbs_mutex_t *t, const struct timespec *abstime, const char *filename, int lineno, const char *func, const char *name);
+
 int __bbs_rwlock_init(bbs_rwlock_t *t, const char *filename, int lineno, const char *func, const char *name);
 int __bbs_rwlock_destroy(bbs_rwlock_t *t, const char *filename, int lineno, const char *func, const char *name);
 int __bbs_rwlock_rdlock(bbs_rwlock_t *t, const char *filename, int lineno, const char *func, const char *name);
@@ -26,6 +26,7 @@ enum irc_callback_msg_type {
 	CMD_NICK,
 	CMD_MODE,
 	CMD_TOPIC,
+	CMD_DISCONNECT,		/* Not an IRC message: the client was disconnected from the server (no channel, prefix, or message) */
 	CMD_UNSUPPORTED,
 };
 
@@ -19,6 +19,7 @@ struct bbs_user;
 struct bbs_url;
 struct bbs_tcp_client;
 struct dirent;
+struct range_set;
 
 /*! \brief RFC 5423 Section 4 message store events */
 enum mailbox_event_type {
@@ -119,6 +120,18 @@ int __mailbox_register_watcher(void (*callback)(struct mailbox_event *event), vo
 /*! \brief Unregister a mailbox watching application */
 int mailbox_unregister_watcher(void (*callback)(struct mailbox_event *event));
 
+#define mailbox_register_trash_watcher(callback) __mailbox_register_trash_watcher(callback, BBS_MODULE_SELF)
+
+/*!
+ * \brief Register a callback for messages placed into a Trash folder (intended for Trash expiry)
+ * \param callback Callback that receives the Trash maildir, its UIDVALIDITY, and the UID of the message in it
+ * \retval 0 on success, -1 on failure (e.g. another callback already registered)
+ */
+int __mailbox_register_trash_watcher(void (*callback)(const char *maildir, unsigned int uidvalidity, unsigned int uid), void *mod);
+
+/*! \brief Unregister a previously registered Trash callback */
+int mailbox_unregister_trash_watcher(void (*callback)(const char *maildir, unsigned int uidvalidity, unsigned int uid));
+
 /*!
  * \brief Broadcast a mailbox event
  * \param event Mailbox event
@@ -327,8 +340,10 @@ int maildir_is_mailbox(const char *basename);
  * \param path Path to maildir
  * \param[out] buf Generated filename
  * \param len Size of buffer
- * \param[out] newbuf Generated filename for rename target
+ * \param[out] newbuf Generated filename for rename target. Must also be of size len.
  * \retval -1 on failure, file descriptor on success
+ * \note The name is unique across processes, threads, and hosts, so newbuf will not exist either.
+ * \note The maildir is created if it does not already exist.
  */
 int maildir_mktemp(const char *path, char *buf, size_t len, char *newbuf);
 
@@ -375,15 +390,14 @@ unsigned long maildir_max_modseq(struct mailbox *mbox, const char *directory);
  * \brief Retrieve all messages in a mailbox expunged since a certain MODSEQ
  * \param directory Full system path of the cur directory for this maildir
  * \param lastmodseq MODSEQ to use for comparisons
- * \param uidrangebuf A buffer that is the same size as uidrange, used as scratch space
  * \param minuid Minimum UID to match
  * \param uidrange Range of UIDs in request
  * \return NULL on failure or no results, list of UIDs otherwise
  */
-char *maildir_get_expunged_since_modseq_range(const char *directory, unsigned long lastmodseq, char *uidrangebuf, unsigned int minuid, const char *uidrange) __attribute__((nonnull (1, 3, 5)));
+char *maildir_get_expunged_since_modseq_range(const char *directory, unsigned long lastmodseq, unsigned int minuid, const struct range_set *uidrange) __attribute__((nonnull (1, 4)));
 
-/*! \brief Same as maildir_get_expunged_since_modseq_range, but uidrangebuf and uidrange may be NULL */
-char *maildir_get_expunged_since_modseq(const char *directory, unsigned long lastmodseq, char *uidrangebuf, unsigned int minuid, const char *uidrange) __attribute__((nonnull (1)));
+/*! \brief Same as maildir_get_expunged_since_modseq_range, but uidrange may be NULL */
+char *maildir_get_expunged_since_modseq(const char *directory, unsigned long lastmodseq, unsigned int minuid, const struct range_set *uidrange) __attribute__((nonnull (1)));
 
 /*!
  * \brief Get a modification sequence suitable for assigning to a new (e.g. APPEND, COPY, MOVE), new -> cur message
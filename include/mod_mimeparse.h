@@ -20,3 +20,14 @@
  * \returns NULL on failure, BODYSTRUCTURE text on success, which must be be freed using free()
  */
 char *mime_make_bodystructure(const char *itemname, const char *file);
+
+/*!
+ * \brief Generate a plain text preview of a message (RFC 8970)
+ * \param file File containing email message
+ * \param maxchars Maximum number of (UTF-8) characters in the preview
+ * \param maxbytes Maximum number of bytes in the preview, not including NUL terminator
+ * \returns NULL on failure, preview text (possibly empty) on success, which must be freed using free()
+ * \note The first text part that isn't an attachment is used, preferring text/plain over text/html.
+ *       The text is decoded, HTML markup is removed, and all whitespace is collapsed to single spaces.
+ */
+char *mime_make_preview(const char *file, size_t maxchars, size_t maxbytes);
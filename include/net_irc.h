@@ -123,7 +123,20 @@ enum channel_user_modes irc_get_channel_member_modes(const char *channel, const
  */
 const char *irc_channel_topic(const char *channel);
 
-#define irc_relay_register(relay_send, nicklist, privmsg) __irc_relay_register(relay_send, nicklist, privmsg, BBS_MODULE_SELF)
+/*! \brief Relay registration flags */
+enum irc_relay_flags {
+	/*! Deliver messages synchronously, in the thread of the sending user, rather than from the relay's own queue */
+	IRC_RELAY_SYNC = (1 << 0),
+	/*! Relay accepts multi-line messages. Bursts of queued messages from the same sender to the same channel
+	 * may be coalesced into a single message, with lines separated by LF. */
+	IRC_RELAY_COALESCE = (1 << 1),
+};
+
+/*! \brief Maximum length of a coalesced relay message */
+#define IRC_RELAY_COALESCE_MAXLEN 1800
+
+#define irc_relay_register(relay_send, nicklist, privmsg) __irc_relay_register(relay_send, nicklist, privmsg, 0, BBS_MODULE_SELF)
+#define irc_relay_register_flags(relay_send, nicklist, privmsg, flags) __irc_relay_register(relay_send, nicklist, privmsg, flags, BBS_MODULE_SELF)
 
 struct irc_relay_message {
 	const char *channel;
@@ -134,17 +147,20 @@ struct irc_relay_message {
 
 /*!
  * \brief Register a relay function that will be used to receive messages sent on IRC channels for rebroadcast on other protocols.
- * \param relay_send Callback function. The function should return 0 to continue processing any other relays and nonzero to stop immediately.
+ * \param relay_send Callback function. By default, this is called from a dedicated thread for this relay, which drains a bounded queue of messages,
+ *                   so slow relays do not delay delivery to other users. The return value is only used for IRC_RELAY_SYNC relays,
+ *                   for which the function should return 0 to continue processing any other relays and nonzero to stop immediately.
  * \param nicklist Callback function to obtain an IRC NAMES or WHO format of any users that should be displayed as channel members. NULL if not applicable.
  *                  If channel is non-NULL, function should return all members in channel. Otherwise, it should return the specified user.
  * \param privmsg  Callback function to relay a private message to a user on another network. NULL if not applicable.
+ * \param flags Any of enum irc_relay_flags
  * \param mod Module reference.
  * \retval 0 on success, -1 on failure
  */
 int __irc_relay_register(int (*relay_send)(struct irc_relay_message *rmsg),
 	int (*nicklist)(struct bbs_node *node, int fd, int numeric, const char *requsername, const char *channel, const char *user),
 	int (*privmsg)(const char *recipient, const char *sender, const char *user),
-	void *mod);
+	unsigned int flags, void *mod);
 
 /*! \brief Unregister a relay previously registered using irc_relay_register */
 int irc_relay_unregister(int (*relay_send)(struct irc_relay_message *rmsg));
@@ -54,6 +54,27 @@ int smtp_is_exempt_relay(struct smtp_session *smtp);
  */
 void smtp_timestamp(time_t received, char *buf, size_t len);
 
+/* == SMTP connection screening: these determine whether to accept a connection from an MTA, before the banner is sent == */
+
+enum smtp_screen_action {
+	SMTP_SCREEN_ACCEPT = 0,		/*!< Proceed normally */
+	SMTP_SCREEN_TARPIT,			/*!< Proceed, but slow the client down */
+	SMTP_SCREEN_REJECT,			/*!< Reject the connection */
+};
+
+/*!
+ * \brief Register an SMTP connection screener
+ * \param cb Callback function. ip is the client's IP address. If the connection is rejected, a reason may be written into buf.
+ * \retval 0 on success, -1 on failure
+ * \note Screeners are only run for connections from other MTAs, not for message submission
+ */
+#define smtp_register_screener(cb) __smtp_register_screener(cb, BBS_MODULE_SELF)
+
+int __smtp_register_screener(enum smtp_screen_action (*cb)(const char *ip, char *buf, size_t len), void *mod);
+
+/*! \brief Unregister an SMTP connection screener previously registered with smtp_register_screener */
+int smtp_unregister_screener(enum smtp_screen_action (*cb)(const char *ip, char *buf, size_t len));
+
 /* == SMTP filters: these modify the message itself, but (generally) do not determine what will happen to it == */
 
 enum smtp_filter_type {
@@ -72,6 +93,15 @@ enum smtp_direction {
 	SMTP_DIRECTION_OUT = (1 << 2),		/*!< Outgoing mail to another MTA */
 };
 
+/*! \brief Results that filters set in struct smtp_filter_data, for use by later filters */
+enum smtp_filter_result {
+	SMTP_FILTER_RESULT_SPF = (1 << 0),			/*!< spf */
+	SMTP_FILTER_RESULT_DKIM = (1 << 1),			/*!< dkim */
+	SMTP_FILTER_RESULT_ARC = (1 << 2),			/*!< arc */
+	SMTP_FILTER_RESULT_DMARC = (1 << 3),		/*!< dmarc, reject, quarantine */
+	SMTP_FILTER_RESULT_AUTHRESULTS = (1 << 4),	/*!< authresults */
+};
+
 struct smtp_filter_data {
 	struct smtp_session *smtp;		/*!< SMTP session */
 	int inputfd;					/*!< File descriptor from which message can be read */
@@ -100,6 +130,11 @@ struct smtp_filter_data {
 
 struct smtp_filter_provider {
 	int (*on_body)(struct smtp_filter_data *data);	/*!< Callback for SMTP_FILTER_PREPEND. Return 0 on success, -1 on failure (continue), 1 to abort further processing. */
+	enum smtp_filter_result provides;	/*!< Results set by this filter */
+	enum smtp_filter_result requires;	/*!< Results of other filters used by this filter */
+	/*! Whether this filter may run concurrently with other filters whose results it does not require.
+	 * Such filters must use smtp_message_body rather than inputfd, and may only modify the results they provide. */
+	unsigned int concurrent:1;
 };
 
 /*!
@@ -322,6 +322,12 @@ void bbs_node_interrupt_clear(struct bbs_node *node);
 
 void __bbs_node_interrupt_ack(struct bbs_node *node, const char *file, int line, const char *func);
 
+/*!
+ * \brief Add a node to the presence index, once it has logged in as a registered user
+ * \note This is called by the auth core, modules should not call this directly
+ */
+void bbs_node_presence_add(struct bbs_node *node);
+
 /*!
  * \brief Check whether a user is active on any nodes
  * \param userid User ID of user to check for activity
@@ -329,6 +335,46 @@ void __bbs_node_interrupt_ack(struct bbs_node *node, const char *file, int line,
  */
 int bbs_user_online(unsigned int userid);
 
+/*!
+ * \brief Get the number of nodes a user is logged in on
+ * \param userid
+ * \return Number of nodes
+ */
+unsigned int bbs_user_node_count(unsigned int userid);
+
+/*!
+ * \brief Get the node numbers of all nodes a user is logged in on
+ * \param userid
+ * \param[out] nodeids Array in which to store node numbers
+ * \param max Size of nodeids
+ * \return Number of node numbers stored in nodeids
+ * \note Since nodes may log out at any time, the nodes returned may no longer exist by the time they are used.
+ */
+unsigned int bbs_user_nodes(unsigned int userid, unsigned int *nodeids, unsigned int max);
+
+/*! \brief Get the number of distinct registered users currently online */
+unsigned int bbs_online_user_count(void);
+
+/*!
+ * \param userid
+ * \param nodeid The node that logged in or out
+ * \param online 1 if the node logged in, 0 if it logged out
+ * \param numnodes Number of nodes the user is now logged in on. The user is now offline if this is 0.
+ */
+#define PRESENCE_WATCHER_PARAMS unsigned int userid, unsigned int nodeid, int online, unsigned int numnodes
+
+/*!
+ * \brief Register a callback to be notified whenever a registered user logs in or out of a node
+ * \note The callback may be executed with the node in question locked, so it must not attempt to lock or access the node itself.
+ * \retval 0 on success, -1 on failure
+ */
+#define bbs_register_presence_watcher(watcher) __bbs_register_presence_watcher(watcher, BBS_MODULE_SELF)
+
+int __bbs_register_presence_watcher(void (*watcher)(PRESENCE_WATCHER_PARAMS), void *mod);
+
+/*! \brief Unregister a presence watcher previously registered using bbs_register_presence_watcher */
+int bbs_unregister_presence_watcher(void (*watcher)(PRESENCE_WATCHER_PARAMS));
+
 /*!
  * \brief Retrieve a node by node number
  * \param nodenum Node number
@@ -797,6 +843,14 @@ void bbs_node_net_begin(struct bbs_node *node);
  */
 void bbs_node_exit(struct bbs_node *node) __attribute__ ((nonnull (1)));
 
+/*!
+ * \brief Run a terminal session on a node, without cleaning up the node afterwards
+ * \param node
+ * \note For network drivers that need to tear down their own state while the node is still valid.
+ *       bbs_node_exit must be called afterwards.
+ */
+void bbs_node_term_session(struct bbs_node *node);
+
 /*!
  * \brief Top-level node handler for terminal protocols
  * \param varg BBS node
@@ -17,20 +17,34 @@
  *
  */
 
+/*! \brief A parsed list of ranges, e.g. an IMAP sequence set */
+struct range_set;
+
 /*!
- * \brief Determine whether a number is found in a list of ranges (e.g. 1,2,4:7,9:11)
- * \param s List of ranges
+ * \brief Parse a list of ranges (e.g. 1,2,4:7,9:11) into a sorted, merged set of intervals
+ * \param s List of ranges. * is the largest possible number (and * on its own matches everything).
+ * \return NULL on failure
+ * \return Parsed set, which must be freed using range_set_free
+ * \note Parse once and use range_set_contains for each number, rather than calling in_range repeatedly
+ */
+struct range_set *range_set_parse(const char *s);
+
+/*!
+ * \brief Determine whether a number is in a parsed set of ranges
+ * \param set
  * \param num Number to search for
- * \param sequences Temporary buffer at least as large as s
- * \note Direct use of this function is more efficient than in_range since we can reuse the same allocated buffer for all comparisons
+ * \retval 1 if in set, 0 if not
  */
-int in_range_allocated(const char *s, int num, char *sequences);
+int range_set_contains(const struct range_set *set, unsigned int num);
+
+/*! \brief Free a parsed set of ranges */
+void range_set_free(struct range_set *set);
 
 /*!
  * \brief Determine whether a number is found in a list of ranges (e.g. 1,2,4:7,9:11)
  * \param s List of ranges
  * \param num Number to search for
- * \note Memory is allocated for every call, which is not terribly efficient. Prefer using in_range_allocated directly.
+ * \note The list is parsed for every call. To check more than one number, use range_set_parse and range_set_contains.
  */
 int in_range(const char *s, int num);
 
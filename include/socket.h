@@ -160,6 +160,27 @@ int __bbs_start_tcp_listener3(int port, int port2, int port3, const char *name,
  */
 int bbs_stop_tcp_listener(int port);
 
+/*! \brief Events for which a TCP listener's triage callback is invoked */
+enum bbs_tcp_triage_event {
+	TCP_TRIAGE_CONNECT = 0,	/*!< Connection was just accepted */
+	TCP_TRIAGE_INPUT,		/*!< Client sent data, or disconnected, while being held */
+	TCP_TRIAGE_EXPIRE,		/*!< Hold time requested by the previous callback has elapsed */
+	TCP_TRIAGE_FULL,		/*!< Connection was just accepted, but too many connections are already held to hold this one */
+	TCP_TRIAGE_RELEASE,		/*!< Connection is no longer held, and is about to be closed or handed off */
+};
+
+/*!
+ * \brief Screen connections to a TCP listener before a node and thread are allocated for them
+ * \param port TCP port number of a listener registered using bbs_start_tcp_listener
+ * \param triage Callback to invoke, or NULL to remove. It is executed in the TCP listener thread, so it must never block.
+ *        It should return -1 to close the connection, 0 to hand it off to the listener's handler,
+ *        or a positive number of milliseconds to keep holding the connection until it sends something or the time elapses.
+ *        For TCP_TRIAGE_FULL, the connection cannot be held, so a positive return value is treated like 0.
+ *        For TCP_TRIAGE_RELEASE, which is invoked exactly once for every connection that was held, the return value is ignored.
+ * \retval 0 on success, -1 on failure
+ */
+int bbs_tcp_listener_set_triage(int port, int (*triage)(enum bbs_tcp_triage_event event, int fd, const char *ip));
+
 /*!
  * \brief Run a terminal services TCP network login service listener thread
  * \param socket Socket fd
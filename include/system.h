@@ -70,5 +70,37 @@ int bbs_execvp_fd_headless(struct bbs_node *node, int fdin, int fdout, const cha
 /*! \brief Same as bbs_execvp_fd_headless, but allow passing an envp */
 int bbs_execvpe_fd_headless(struct bbs_node *node, int fdin, int fdout, const char *filename, char *const argv[], char *const envp[]);
 
+/*!
+ * \brief Start a program without waiting for it to exit, for callers that need to interact with it while it runs
+ * \param fdin File descriptor to use for STDIN, or -1 for none
+ * \param fdout File descriptor to use for STDOUT, or -1 for none
+ * \param filename Filename of program to execute (path is optional)
+ * \param argv Arguments
+ * \param envp Environment
+ * \param[out] waitfd Must be passed to bbs_spawn_wait
+ * \note STDERR is inherited from the BBS
+ * \retval -1 on failure, PID of program otherwise
+ */
+pid_t bbs_spawn(int fdin, int fdout, const char *filename, char *const argv[], char *const envp[], int *waitfd);
+
+/*!
+ * \brief Wait for a program started using bbs_spawn to exit
+ * \param pid
+ * \param waitfd
+ * \param filename Filename of program, for logging
+ * \retval -1 on failure or if the program did not exit normally, exit status otherwise
+ */
+int bbs_spawn_wait(pid_t pid, int waitfd, const char *filename);
+
+/*!
+ * \brief Get a file descriptor that becomes readable when a process exits, regardless of whose child it is
+ * \param pid
+ * \retval -1 on failure or if not supported (errno is set), file descriptor otherwise
+ */
+int bbs_pidfd_open(pid_t pid);
+
 /*! \brief Load system.conf config at startup */
 int bbs_init_system(void);
+
+/*! \brief Stop the spawn helper at shutdown */
+void bbs_shutdown_system(void);
@@ -158,3 +158,16 @@ void bbs_user_destroy(struct bbs_user *user);
 
 /*! \brief Invalidate the user ID/username translation cache */
 void username_cache_flush(void);
+
+/*!
+ * \brief Invalidate a cached user record, e.g. after the user has been modified
+ * \param userid User ID, or 0 to invalidate all cached user records
+ */
+void bbs_user_cache_invalidate(unsigned int userid);
+
+/*!
+ * \brief Set how long user records are cached
+ * \param ttl Time, in seconds. 0 disables caching.
+ * \return Previous TTL
+ */
+unsigned int bbs_user_cache_set_ttl(unsigned int ttl);
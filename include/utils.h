@@ -211,6 +211,7 @@ int bbs_dir_has_subdirs(const char *path);
 
 /*!
  * \brief Get the size of all the files in a directory, recursively to all subdirectories (up to 32 levels)
+ * \note Files with multiple hard links within the directory are only counted once
  * \param path Directory to traverse recursively
  * \retval -1 on failure, size in bytes on success
  */
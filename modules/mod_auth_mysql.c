@@ -46,7 +46,7 @@ static int verifyregisteremail = 0;
 
 /*! \brief Common function to handle user authentication and info retrieval */
 #pragma GCC diagnostic ignored "-Wstack-protector"
-static struct bbs_user *fetch_user(struct bbs_user *myuser, const char *username, const char *password, struct bbs_user ***userlistptr)
+static struct bbs_user *fetch_user(struct bbs_user *myuser, const char *username, unsigned int userid, const char *password, struct bbs_user ***userlistptr)
 {
 	char sql[184];
 	MYSQL *mysql = NULL;
@@ -57,6 +57,7 @@ static struct bbs_user *fetch_user(struct bbs_user *myuser, const char *username
 	/* SQL SELECT */
 	const char *fmt = "dssdssssssssttt";
 	const size_t num_fields = strlen(fmt);
+	const int single = username || userid;
 
 	mysql = sql_connect();
 	if (!mysql) {
@@ -70,12 +71,14 @@ static struct bbs_user *fetch_user(struct bbs_user *myuser, const char *username
 
 	if (username) { /* Specific user */
 		snprintf(sql, sizeof(sql), "SELECT id, username, password, priv, email, name, phone, address, city, state, zip, gender, dob, date_registered, last_login FROM %s%susers WHERE username = ? LIMIT 1", DB_NAME_ARGS);
+	} else if (userid) { /* Specific user, by ID */
+		snprintf(sql, sizeof(sql), "SELECT id, username, password, priv, email, name, phone, address, city, state, zip, gender, dob, date_registered, last_login FROM %s%susers WHERE id = ? LIMIT 1", DB_NAME_ARGS);
 	} else { /* All users */
 		/* XXX We should really have a sql_exec function, but since we don't currently, just bind a dummy argument that will cause the query to return all records */
 		snprintf(sql, sizeof(sql), "SELECT id, username, password, priv, email, name, phone, address, city, state, zip, gender, dob, date_registered, last_login FROM %s%susers WHERE id > ?", DB_NAME_ARGS);
 	}
 
-	if ((username && sql_prep_bind_exec(stmt, sql, "s", username)) || (!username && sql_prep_bind_exec(stmt, sql, "i", 0))) {
+	if ((username && sql_prep_bind_exec(stmt, sql, "s", username)) || (!username && sql_prep_bind_exec(stmt, sql, "i", (int) userid))) {
 		goto cleanup;
 	} else {
 		/* Indented a block since we need num_fields */
@@ -97,7 +100,7 @@ static struct bbs_user *fetch_user(struct bbs_user *myuser, const char *username
 			goto stmtcleanup;
 		}
 
-		if (!username) { /* Only needed if fetching all users */
+		if (!single) { /* Only needed if fetching all users */
 			numrows = mysql_stmt_num_rows(stmt);
 			userlist = malloc((numrows + 1) * sizeof(*user)); /* The list will be NULL terminated, so add 1 */
 			if (ALLOC_FAILURE(userlist)) {
@@ -160,12 +163,13 @@ static struct bbs_user *fetch_user(struct bbs_user *myuser, const char *username
 					snprintf(sql, sizeof(sql), "UPDATE %s%susers SET last_login = NOW() WHERE username = ? LIMIT 1", DB_NAME_ARGS);
 					if (!sql_prep_bind_exec(stmt, sql, "s", username)) {
 						bbs_debug(6, "Updated last_login timestamp\n");
+						bbs_user_cache_invalidate(user->id);
 					} else {
 						bbs_warning("Failed to update last_login timestamp\n");
 					}
 				}
 				/* Store all users in a linked list (really just an array) */
-				if (!username) {
+				if (!single) {
 					userlist[rownum] = user;
 				}
 				rownum++;
@@ -174,7 +178,7 @@ static struct bbs_user *fetch_user(struct bbs_user *myuser, const char *username
 			}
 			sql_free_result_strings((int) num_fields, results, lengths, bind_strings); /* Call inside the while loop, since strings only need to be freed per row */
 		}
-		if (!username) {
+		if (!single) {
 			userlist[rownum] = NULL; /* NULL terminate the array of users */
 		}
 
@@ -194,7 +198,7 @@ stmtcleanup:
 
 cleanup:
 	mysql_close(mysql);
-	if (!username && userlistptr) {
+	if (!single && userlistptr) {
 		*userlistptr = userlist;
 	}
 	return user;
@@ -209,19 +213,24 @@ cleanup:
  */
 static int provider(AUTH_PROVIDER_PARAMS)
 {
-	struct bbs_user *myuser = fetch_user(user, username, password, NULL);
+	struct bbs_user *myuser = fetch_user(user, username, 0, password, NULL);
 	return myuser ? 0 : -1; /* Returns same user on success, NULL on failure */
 }
 
 static struct bbs_user *get_user_info(const char *username)
 {
-	return fetch_user(NULL, username, NULL, NULL);
+	return fetch_user(NULL, username, 0, NULL, NULL);
+}
+
+static struct bbs_user *get_user_info_by_id(unsigned int userid)
+{
+	return fetch_user(NULL, NULL, userid, NULL, NULL);
 }
 
 static struct bbs_user **get_users(void)
 {
 	struct bbs_user **userlist;
-	if (!fetch_user(NULL, NULL, NULL, &userlist)) {
+	if (!fetch_user(NULL, NULL, 0, NULL, &userlist)) {
 		return NULL;
 	}
 	return userlist;
@@ -576,6 +585,7 @@ static int unload_module(void)
 	bbs_unregister_user_registration_provider(user_register);
 	bbs_unregister_password_reset_handler(change_password);
 	bbs_unregister_user_info_handler(get_user_info);
+	bbs_unregister_user_info_by_id_handler(get_user_info_by_id);
 	bbs_unregister_user_list_handler(get_users);
 	return 0;
 }
@@ -589,6 +599,7 @@ static int load_module(void)
 	bbs_register_user_registration_provider(user_register);
 	bbs_register_password_reset_handler(change_password);
 	bbs_register_user_info_handler(get_user_info);
+	bbs_register_user_info_by_id_handler(get_user_info_by_id);
 	bbs_register_user_list_handler(get_users);
 	res = bbs_register_auth_provider("MySQL/MariaDB", provider);
 	REQUIRE_FULL_LOAD(res);
@@ -110,6 +110,22 @@ static struct bbs_user *get_user_info(const char *username)
 	return user;
 }
 
+static struct bbs_user *get_user_info_by_id(unsigned int userid)
+{
+	struct static_user *u;
+	struct bbs_user *user = NULL;
+
+	RWLIST_RDLOCK(&users);
+	RWLIST_TRAVERSE(&users, u, entry) {
+		if (u->id == userid) {
+			user = convert_user(u);
+			break;
+		}
+	}
+	RWLIST_UNLOCK(&users);
+	return user;
+}
+
 static struct bbs_user **get_users(void)
 {
 	struct static_user *u;
@@ -173,8 +189,10 @@ static int unload_module(void)
 {
 	bbs_unregister_auth_provider(provider);
 	bbs_unregister_user_info_handler(get_user_info);
+	bbs_unregister_user_info_by_id_handler(get_user_info_by_id);
 	bbs_unregister_user_list_handler(get_users);
 	RWLIST_WRLOCK_REMOVE_ALL(&users, entry, free_user);
+	bbs_user_cache_invalidate(0); /* User IDs are only meaningful while the module is loaded */
 	return 0;
 }
 
@@ -184,7 +202,9 @@ static int load_module(void)
 	if (load_config()) {
 		return -1;
 	}
+	bbs_user_cache_invalidate(0); /* Users are assigned IDs in config order, so any cached records may no longer match */
 	bbs_register_user_info_handler(get_user_info);
+	bbs_register_user_info_by_id_handler(get_user_info_by_id);
 	bbs_register_user_list_handler(get_users);
 	res = bbs_register_auth_provider("Static", provider);
 	REQUIRE_FULL_LOAD(res);
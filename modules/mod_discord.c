@@ -77,6 +77,16 @@ struct u64snowflake_entry {
 
 RWLIST_HEAD(u64snowflake_list, u64snowflake_entry);
 
+struct user;
+
+/*! \brief A user that can view a channel */
+struct chan_member {
+	struct user *u;
+	RWLIST_ENTRY(chan_member) entry;
+};
+
+RWLIST_HEAD(chan_members, chan_member);
+
 struct chan_pair {
 	u64snowflake guild_id;
 	u64snowflake guild_owner;		/* Not normalized, but we don't keep track of guilds separately */
@@ -88,6 +98,7 @@ struct chan_pair {
 	const char *irc_channel;		/* Should including leading # (or other prefix) */
 	struct u64snowflake_list members;	/* Members with permission to view channel */
 	struct u64snowflake_list roles;		/* Roles with permission to view channel */
+	struct chan_members memberset;		/* All users that can view the channel, maintained incrementally as users and permissions change */
 	RWLIST_ENTRY(chan_pair) entry;
 	char data[];
 };
@@ -128,8 +139,10 @@ static void free_cp(struct chan_pair *cp)
 {
 	RWLIST_WRLOCK_REMOVE_ALL(&cp->members, entry, free);
 	RWLIST_WRLOCK_REMOVE_ALL(&cp->roles, entry, free);
+	RWLIST_WRLOCK_REMOVE_ALL(&cp->memberset, entry, free);
 	RWLIST_HEAD_DESTROY(&cp->members);
 	RWLIST_HEAD_DESTROY(&cp->roles);
+	RWLIST_HEAD_DESTROY(&cp->memberset);
 	free(cp);
 }
 
@@ -189,6 +202,7 @@ static int add_pair(u64snowflake guild_id, const char *discord_channel, const ch
 	/* channel_id is not yet known. Once we call fetch_channels, we'll be able to get the channel_id if it matches a name. */
 	RWLIST_HEAD_INIT(&cp->members);
 	RWLIST_HEAD_INIT(&cp->roles);
+	RWLIST_HEAD_INIT(&cp->memberset);
 	RWLIST_INSERT_HEAD(&mappings, cp, entry);
 	RWLIST_UNLOCK(&mappings);
 	bbs_debug(2, "Adding 1:1 channel mapping for (%lu) %s <=> %s\n", guild_id, discord_channel, irc_channel);
@@ -280,12 +294,16 @@ static const char *status_str(enum user_status status)
 	__builtin_unreachable();
 }
 
+static void channels_update_member(struct user *u);
+static void channels_remove_member(struct user *u);
+
 static void remove_user(struct discord_user *user)
 {
 	struct user *u;
 
 	u = RWLIST_WRLOCK_REMOVE_BY_FIELD(&users, user_id, user->id, entry);
 	if (u) {
+		channels_remove_member(u);
 		free_user(u);
 	} else {
 		bbs_error("Failed to remove user %lu (%s)\n", user->id, user->username);
@@ -350,6 +368,31 @@ static struct user *add_user(struct discord_user *user, u64snowflake guild_id, c
 	return u;
 }
 
+/*!
+ * \brief Replace a user's roles
+ * \note Other threads may be checking the user's roles in channel_contains_user, so the swap is done with users locked
+ */
+static void set_user_roles(struct user *u, struct snowflakes *roles)
+{
+	u64snowflake *newroles = NULL, *oldroles;
+	int numroles = 0;
+
+	if (roles && roles->size > 0) {
+		newroles = calloc((size_t) roles->size, sizeof(*newroles));
+		if (ALLOC_SUCCESS(newroles)) {
+			numroles = roles->size;
+			memcpy(newroles, roles->array, (size_t) roles->size * sizeof(*newroles));
+		}
+	}
+
+	RWLIST_WRLOCK(&users);
+	oldroles = u->roles;
+	u->roles = newroles;
+	u->numroles = numroles;
+	RWLIST_UNLOCK(&users);
+	free_if(oldroles);
+}
+
 static int num_presence_failures(void)
 {
 	struct user *u;
@@ -428,11 +471,11 @@ static void on_guild_members_chunk(struct discord *client, const struct discord_
 				bbs_debug(10, "User has role %lu\n", roles->array[j]);
 			}
 #endif
-			u->roles = calloc((size_t) roles->size, sizeof(*u->roles));
-			if (ALLOC_SUCCESS(u->roles)) {
-				u->numroles = roles->size;
-				memcpy(u->roles, roles->array, sizeof(*u->roles));
-			}
+			set_user_roles(u, roles); /* Replaces the roles, if we're updating an existing user */
+		}
+		if (u) {
+			/* Now that we know the user's roles, update the channels the user can see */
+			channels_update_member(u);
 		}
 	}
 	if (presencefails) {
@@ -520,10 +563,29 @@ static void on_guild_members_chunk(struct discord *client, const struct discord_
 static void on_guild_member_add(struct discord *client, const struct discord_guild_member *event)
 {
 	struct discord_user *user = event->user;
+	struct user *u;
 
 	UNUSED(client);
 	bbs_debug(2, "User %lu (%s) has joined guild %lu\n", user->id, user->username, event->guild_id);
-	add_user(user, event->guild_id, "online", (u64unix_ms) time(NULL) * 1000);
+	u = add_user(user, event->guild_id, "online", (u64unix_ms) time(NULL) * 1000);
+	if (u) {
+		channels_update_member(u);
+	}
+}
+
+static void on_guild_member_update(struct discord *client, const struct discord_guild_member_update *event)
+{
+	struct discord_user *user = event->user;
+	struct user *u;
+
+	UNUSED(client);
+	bbs_debug(3, "User %lu (%s) has been updated in guild %lu\n", user->id, user->username, event->guild_id);
+	u = add_user(user, event->guild_id, NULL, event->joined_at);
+	if (u) {
+		/* Roles may have been granted or revoked, which changes which channels the user can see */
+		set_user_roles(u, event->roles);
+		channels_update_member(u);
+	}
 }
 
 static void on_guild_member_remove(struct discord *client, const struct discord_guild_member_remove *event)
@@ -657,6 +719,108 @@ static int channel_contains_user(struct chan_pair *cp, struct user *u)
 	return 0;
 }
 
+/*!
+ * \brief Add or remove a user from a channel's member set, as appropriate
+ * \note cp->memberset must be WRLOCKed
+ */
+static void channel_update_member_locked(struct chan_pair *cp, struct user *u)
+{
+	struct chan_member *m;
+	int contains = channel_contains_user(cp, u);
+
+	RWLIST_TRAVERSE_SAFE_BEGIN(&cp->memberset, m, entry) {
+		if (m->u == u) {
+			if (!contains) {
+				RWLIST_REMOVE_CURRENT(entry);
+				free(m);
+			}
+			return; /* Either it's still a member, or it no longer is */
+		}
+	}
+	RWLIST_TRAVERSE_SAFE_END;
+
+	if (!contains) {
+		return;
+	}
+	m = calloc(1, sizeof(*m));
+	if (ALLOC_FAILURE(m)) {
+		return;
+	}
+	m->u = u;
+	RWLIST_INSERT_TAIL(&cp->memberset, m, entry);
+}
+
+/*! \brief Update the member sets of all channels, after a user has been added or its roles/permissions have changed */
+static void channels_update_member(struct user *u)
+{
+	struct chan_pair *cp;
+
+	RWLIST_RDLOCK(&mappings);
+	RWLIST_TRAVERSE(&mappings, cp, entry) {
+		if (cp->guild_id != u->guild_id) {
+			continue;
+		}
+		RWLIST_WRLOCK(&cp->memberset);
+		RWLIST_RDLOCK(&users); /* The user's roles can't change while we check them */
+		channel_update_member_locked(cp, u);
+		RWLIST_UNLOCK(&users);
+		RWLIST_UNLOCK(&cp->memberset);
+	}
+	RWLIST_UNLOCK(&mappings);
+}
+
+/*! \brief Remove a user from all channel member sets. Must be called before the user is freed. */
+static void channels_remove_member(struct user *u)
+{
+	struct chan_pair *cp;
+
+	RWLIST_RDLOCK(&mappings);
+	RWLIST_TRAVERSE(&mappings, cp, entry) {
+		struct chan_member *m;
+		RWLIST_WRLOCK(&cp->memberset);
+		RWLIST_TRAVERSE_SAFE_BEGIN(&cp->memberset, m, entry) {
+			if (m->u == u) {
+				RWLIST_REMOVE_CURRENT(entry);
+				free(m);
+				break;
+			}
+		}
+		RWLIST_TRAVERSE_SAFE_END;
+		RWLIST_UNLOCK(&cp->memberset);
+	}
+	RWLIST_UNLOCK(&mappings);
+}
+
+/*!
+ * \brief Recompute a channel's member set from scratch, after its permissions have changed
+ * \note Must be called with mappings locked
+ */
+static void channel_rebuild_members(struct chan_pair *cp)
+{
+	struct user *u;
+	int num_users = 0;
+
+	RWLIST_WRLOCK(&cp->memberset);
+	RWLIST_REMOVE_ALL(&cp->memberset, entry, free);
+	RWLIST_RDLOCK(&users);
+	RWLIST_TRAVERSE(&users, u, entry) {
+		struct chan_member *m;
+		if (!channel_contains_user(cp, u)) {
+			continue;
+		}
+		m = calloc(1, sizeof(*m));
+		if (ALLOC_FAILURE(m)) {
+			break;
+		}
+		m->u = u;
+		RWLIST_INSERT_TAIL(&cp->memberset, m, entry);
+		num_users++;
+	}
+	RWLIST_UNLOCK(&users);
+	RWLIST_UNLOCK(&cp->memberset);
+	bbs_debug(3, "Channel %s has %d member%s\n", cp->discord_channel, num_users, ESS(num_users));
+}
+
 static void link_permissions(struct chan_pair *cp, struct discord_overwrites *overwrites)
 {
 	/* We can't directly link permissions to users, since users may not all exist yet.
@@ -793,6 +957,7 @@ static void fetch_channels(struct discord *client, u64snowflake guild_id, u64sno
 			}
 			bbs_debug(3, "Channel %s contains %d permissions and is owned by %lu\n", cp->discord_channel, overwrites->size, guild_owner);
 			link_permissions(cp, overwrites);
+			channel_rebuild_members(cp);
 		}
 	}
 	/* Make sure all channels have a channel ID */
@@ -809,6 +974,34 @@ static void fetch_channels(struct discord *client, u64snowflake guild_id, u64sno
 	discord_channels_cleanup(&channels);
 }
 
+static void on_channel_update(struct discord *client, const struct discord_channel *event)
+{
+	struct chan_pair *cp;
+
+	UNUSED(client);
+
+	RWLIST_RDLOCK(&mappings);
+	RWLIST_TRAVERSE(&mappings, cp, entry) {
+		if (cp->channel_id == event->id) {
+			break;
+		}
+	}
+	if (!cp) {
+		RWLIST_UNLOCK(&mappings);
+		return; /* Not a relayed channel */
+	}
+	bbs_debug(3, "Channel %lu (%s) has been updated\n", event->id, cp->discord_channel);
+	if (event->permission_overwrites) {
+		/* Permissions may have changed, so start over and recompute who can view the channel */
+		RWLIST_WRLOCK_REMOVE_ALL(&cp->members, entry, free);
+		RWLIST_WRLOCK_REMOVE_ALL(&cp->roles, entry, free);
+		cp->defaultdeny = 0;
+		link_permissions(cp, event->permission_overwrites);
+		channel_rebuild_members(cp);
+	}
+	RWLIST_UNLOCK(&mappings);
+}
+
 static void load_channels(struct discord *client, struct discord_guilds *guilds)
 {
 	int i, numguilds = guilds->size;
@@ -939,7 +1132,7 @@ static int nicklist(struct bbs_node *node, int fd, int numeric, const char *requ
 		bbs_debug(5, "Ignoring since exposemembers=no\n");
 		return 0;
 	} else if (channel && (numeric == 352 || numeric == 353)) { /* WHO or NAMES */
-		struct user *u;
+		struct chan_member *m;
 		char buf[500];
 		int len = 0;
 		struct chan_pair *cp = find_mapping_irc(channel);
@@ -948,15 +1141,11 @@ static int nicklist(struct bbs_node *node, int fd, int numeric, const char *requ
 			return 0;
 		}
 
-		RWLIST_RDLOCK(&users);
-		RWLIST_TRAVERSE(&users, u, entry) {
-			if (u->guild_id != cp->guild_id) {
-				continue; /* Not even the same guild ID */
-			}
-			if (!channel_contains_user(cp, u)) {
-				continue; /* User not in this channel */
-			}
-			/* User is in the same guild that the channel is in, just assume match for now */
+		/* The member set is kept up to date as users and permissions change,
+		 * so we don't need to check every user in the guild here. */
+		RWLIST_RDLOCK(&cp->memberset);
+		RWLIST_TRAVERSE(&cp->memberset, m, entry) {
+			struct user *u = m->u;
 #ifndef BUGGY_PRESENCE_FETCH
 			if (u->status == STATUS_NONE) {
 				bbs_debug(9, "Skipping user %s (no status information)\n", u->username);
@@ -973,7 +1162,7 @@ static int nicklist(struct bbs_node *node, int fd, int numeric, const char *requ
 				}
 			}
 		}
-		RWLIST_UNLOCK(&users);
+		RWLIST_UNLOCK(&cp->memberset);
 		if (len > 0) {
 			irc_relay_names_response(node, fd, requsername, cp->irc_channel, buf); /* Last one */
 		}
@@ -1049,7 +1238,7 @@ static int discord_send(struct irc_relay_message *rmsg)
 	} else if (!cp->relaysystem  && !sender) {
 		bbs_debug(3, "Dropping system-generated message since relaysystem=no\n");
 	} else {
-		char mbuf[564]; /* Max allowed is 2000, but IRC message can only be 512. Add some for the sender name */
+		char mbuf[IRC_RELAY_COALESCE_MAXLEN + 64]; /* Max allowed is 2000. Messages may be coalesced, so leave room for those, plus the sender name */
 		struct discord_create_message params = {
 			.content = mbuf,
 			.message_reference = &(struct discord_message_reference) {
@@ -1423,7 +1612,7 @@ static int cli_discord_channel(struct bbs_cli_args *a)
 {
 	int num_users = 0, roles = 0;
 	struct u64snowflake_entry *e;
-	struct user *u;
+	struct chan_member *m;
 	struct chan_pair *cp;
 
 	cp = find_mapping_irc(a->argv[2]); /* Look up by IRC channel name */
@@ -1433,17 +1622,14 @@ static int cli_discord_channel(struct bbs_cli_args *a)
 	}
 
 	/* Rather than iterating cp->members, which only contains explicit user and role memberships,
-	 * iterate over all users and use channel_contains_user, which checks by both explicit user membership,
+	 * iterate over the member set, which accounts for both explicit user membership,
 	 * and implicit via role membership. */
-	RWLIST_RDLOCK(&users);
-	RWLIST_TRAVERSE(&users, u, entry) {
-		if (!channel_contains_user(cp, u)) {
-			continue; /* User not in this channel */
-		}
-		bbs_dprintf(a->fdout, "User %lu: %s\n", u->user_id, u->username);
+	RWLIST_RDLOCK(&cp->memberset);
+	RWLIST_TRAVERSE(&cp->memberset, m, entry) {
+		bbs_dprintf(a->fdout, "User %lu: %s\n", m->u->user_id, m->u->username);
 		num_users++;
 	}
-	RWLIST_UNLOCK(&users);
+	RWLIST_UNLOCK(&cp->memberset);
 
 	RWLIST_RDLOCK(&cp->roles);
 	RWLIST_TRAVERSE(&cp->roles, e, entry) {
@@ -1642,6 +1828,9 @@ static int start_discord_relay(void)
 	/* JOIN, PART/QUIT/KICK */
 	discord_set_on_guild_member_add(discord_client, &on_guild_member_add);
 	discord_set_on_guild_member_remove(discord_client, &on_guild_member_remove);
+	/* Role and permission changes, which change who can see which channels */
+	discord_set_on_guild_member_update(discord_client, &on_guild_member_update);
+	discord_set_on_channel_update(discord_client, &on_channel_update);
 	/*! \todo Probably need on_user_update as well, for nick changes */
 
 	if (bbs_pthread_create(&discord_thread, NULL, discord_relay, discord_client)) {
@@ -1652,7 +1841,7 @@ static int start_discord_relay(void)
 		return -1;
 	}
 
-	irc_relay_register(discord_send, nicklist, privmsg);
+	irc_relay_register_flags(discord_send, nicklist, privmsg, IRC_RELAY_COALESCE); /* Discord is rate limited, so post bursts as a single message */
 
 #ifdef RELAY_RCV_EVENTUALLY_FAILS
 	if (!s_strlen_zero(echochannel)) {
@@ -451,6 +451,29 @@ static int interactive_login(struct bbs_node *node)
 	return 0;
 }
 
+/*! \brief Events that need to interact with the node directly, so they are handled synchronously */
+static int interactive_event_cb(struct bbs_event *event)
+{
+	switch (event->type) {
+		case EVENT_NODE_INTERACTIVE_START:
+			if (interactive_start(event->node)) {
+				/* Only the highest return value is kept,
+				 * so we should return 1, not -1 */
+				return 1;
+			}
+			break;
+		case EVENT_NODE_INTERACTIVE_LOGIN:
+			if (interactive_login(event->node)) {
+				return 1;
+			}
+			break;
+		default:
+			return 0;
+	}
+	return 0;
+}
+
+/*! \brief Everything else, which may be slow (e.g. blocking IPs, emailing the sysop), is handled asynchronously */
 static int event_cb(struct bbs_event *event)
 {
 	struct sockaddr_in sa;
@@ -492,20 +515,6 @@ static int event_cb(struct bbs_event *event)
 				event->username, event->userid, event->ipaddr);
 			/*! \todo Also send the user a new user greeting, to his/her BBS email account? (need to add API to/with net_smtp) */
 			return 1;
-		case EVENT_NODE_INTERACTIVE_START:
-			/* Since events callbacks are executed synchronously,
-			 * we can interact with the node directly here. */
-			if (interactive_start(event->node)) {
-				/* Only the highest return value is kept,
-				 * so we should return 1, not -1 */
-				return 1;
-			}
-			break;
-		case EVENT_NODE_INTERACTIVE_LOGIN:
-			if (interactive_login(event->node)) {
-				return 1;
-			}
-			break;
 		case EVENT_FILE_DOWNLOAD_COMPLETE:
 			/*! \todo In the future, add support here for download/upload quotas,
 			 * where uploading file increases allowance and downloading consumes that.
@@ -567,12 +576,24 @@ static int load_module(void)
 		return -1;
 	}
 	bbs_cli_register_multiple(cli_commands_events);
-	return bbs_register_event_consumer(event_cb);
+	if (bbs_register_event_consumer(interactive_event_cb)) {
+		bbs_cli_unregister_multiple(cli_commands_events);
+		stringlist_empty_destroy(&ip_whitelist);
+		return -1;
+	}
+	if (bbs_register_event_consumer_async(event_cb)) {
+		bbs_unregister_event_consumer(interactive_event_cb);
+		bbs_cli_unregister_multiple(cli_commands_events);
+		stringlist_empty_destroy(&ip_whitelist);
+		return -1;
+	}
+	return 0;
 }
 
 static int unload_module(void)
 {
-	int res = bbs_unregister_event_consumer(event_cb);
+	int res = bbs_unregister_event_consumer(interactive_event_cb);
+	res |= bbs_unregister_event_consumer(event_cb);
 	bbs_cli_unregister_multiple(cli_commands_events);
 	RWLIST_WRLOCK_REMOVE_ALL(&ipblocks, entry, free);
 	stringlist_empty_destroy(&ip_whitelist);
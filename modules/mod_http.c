@@ -34,7 +34,6 @@
 #include <sys/socket.h>
 #include <signal.h>
 #include <magic.h>
-#include <sys/wait.h>
 
 #include "include/tls.h"
 #include "include/module.h"
@@ -2334,6 +2333,7 @@ static int cgi_run(struct http_session *http, const char *filename, char *const
 {
 	int res = -1;
 	int stdin[2], stdout[2];
+	int waitfd = -1;
 	pid_t child_pid;
 #pragma GCC diagnostic ignored "-Wdiscarded-qualifiers"
 #pragma GCC diagnostic push
@@ -2343,8 +2343,7 @@ static int cgi_run(struct http_session *http, const char *filename, char *const
 #pragma GCC diagnostic pop /* -Wdiscarded-qualifiers */
 
 	/* Because we need to run our own logic while the child is running,
-	 * fork and wait on the child directly here, rather than using bbs_execvpe_fd_headless.
-	 * It's just easier in this case. */
+	 * start the child and wait on it separately here, rather than using bbs_execvpe_fd_headless. */
 
 	/* Create pipes for the CGI's STDIN and STDOUT */
 	if (pipe(stdin)) {
@@ -2356,42 +2355,12 @@ static int cgi_run(struct http_session *http, const char *filename, char *const
 		return -1;
 	}
 
-	child_pid = fork(); /* fork has an implicit SIGCHLD */
+	/* STDERR is inherited from the BBS - that shouldn't go to the HTTP client */
+	child_pid = bbs_spawn(stdin[0], stdout[1], filename, argv, envp, &waitfd);
 	if (child_pid == -1) {
-		bbs_error("fork failed: %s\n", strerror(errno));
 		goto cleanup;
-	}
-
-	if (child_pid == 0) {
-		int i;
-		/* Disable and reset signal handlers */
-		signal(SIGWINCH, SIG_DFL);
-		signal(SIGTERM, SIG_DFL);
-		signal(SIGINT, SIG_DFL);
-		signal(SIGPIPE, SIG_DFL);
-		/* Close all file descriptors except the pipes */
-		for (i = 3; i < 1024; i++) {
-			if (i != stdin[0] && i != stdout[1]) {
-				close(i);
-			}
-		}
-		/* Set STDIN and STDOUT */
-		dup2(stdin[0], STDIN_FILENO);
-		dup2(stdout[1], STDOUT_FILENO);
-		/* Ignore STDERR_FILENO - that shouldn't go to the HTTP client, at least, maybe to the BBS log? */
-		/* Execute the CGI script */
-#ifdef __FreeBSD__
-		/* See comments about execvpe on FreeBSD in bbs/system.c */
-		bbs_error("execvpe is not supported on FreeBSD\n");
-		UNUSED(envp);
-		res = execvp(filename, argv);
-#else
-		res = execvpe(filename, argv, envp);
-#endif
-		_exit(errno);
 	} else {
 		char buf[1024];
-		int status;
 		ssize_t bytes;
 		size_t total_bytes = 0;
 		int headers = 0, got_headers = 0;
@@ -2419,7 +2388,7 @@ static int cgi_run(struct http_session *http, const char *filename, char *const
 		 *
 		 * Note that because the pipe will close and wake up poll(),
 		 * we don't need to explicitly monitor for child exit.
-		 * We can just call waitpid when we're finished.
+		 * We can just wait for it when we're finished.
 		 */
 		bbs_verb(5, "Executing CGI %s\n", filename);
 		for (;;) {
@@ -2486,21 +2455,22 @@ static int cgi_run(struct http_session *http, const char *filename, char *const
 			 * but the default keepalive behavior will cause us to hang, so explicitly disable that. */
 			http->req->keepalive = 0;
 		}
-		if (waitpid(child_pid, &status, 0) == -1) { /* This should return immediately since child exited (pipe closed) */
-			bbs_error("waitpid failed: %s\n", strerror(errno));
-			goto cleanup;
-		}
-		if (WIFEXITED(status)) { /* Child terminated normally */
-			res = WEXITSTATUS(status);
-			bbs_debug(5, "Process %d (%s) exited, status %d\n", child_pid, filename, res);
-		} else {
+		/* This should return immediately since child exited (pipe closed) */
+		res = bbs_spawn_wait(child_pid, waitfd, filename);
+		if (res < 0) {
 			bbs_warning("Child process %d didn't exit normally?\n", child_pid);
 		}
+		child_pid = -1;
 	}
 
 cleanup:
 	PIPE_CLOSE(stdin);
 	PIPE_CLOSE(stdout);
+	if (child_pid > 0) {
+		/* Gave up on the CGI script, don't leave it behind */
+		kill(child_pid, SIGKILL);
+		bbs_spawn_wait(child_pid, waitfd, filename);
+	}
 	return res;
 }
 
@@ -331,6 +331,8 @@ static const char *callback_msg_type_name(enum irc_callback_msg_type type)
 			return "MODE";
 		case CMD_TOPIC:
 			return "TOPIC";
+		case CMD_DISCONNECT:
+			return "DISCONNECT";
 		case CMD_UNSUPPORTED:
 			return "UNSUPPORTED";
 	}
@@ -713,6 +715,18 @@ static void *client_relay(void *varg)
 
 	irc_loop(client->client, client->logfile, handle_irc_msg, client);
 
+	if (client->callbacks) {
+		struct irc_msg_callback *cb;
+		/* Let consumers know, so they can discard any state that's only valid while connected (e.g. channel membership) */
+		RWLIST_RDLOCK(&msg_callbacks);
+		RWLIST_TRAVERSE(&msg_callbacks, cb, entry) {
+			bbs_module_ref(cb->mod, 1);
+			cb->msg_cb(client->name, CMD_DISCONNECT, NULL, NULL, 0, NULL);
+			bbs_module_unref(cb->mod, 1);
+		}
+		RWLIST_UNLOCK(&msg_callbacks);
+	}
+
 	bbs_debug(3, "IRC client '%s' thread has exited\n", client->name);
 	return NULL;
 }
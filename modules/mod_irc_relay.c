@@ -53,14 +53,21 @@ struct chan_pair {
 	const char *channel2;
 	const char *ircuser;
 	unsigned int relaysystem:1;
-	unsigned int gotnames:2;	/* Have we queried the NAMES for this channel pair at least once? */
+	unsigned int gotnames:2;	/* Have we queried the NAMES for this channel pair at least once? (enum names_state) */
 	RWLIST_ENTRY(chan_pair) entry;
-	struct stringlist members;
+	struct stringlist members;	/* Nicknames of members of the remote channel, kept up to date by JOIN/PART/QUIT/NICK */
 	pthread_t names_thread;
 	bbs_mutex_t names_query_lock;
 	char data[0];
 };
 
+enum names_state {
+	NAMES_NONE = 0,			/* Haven't queried NAMES yet */
+	NAMES_PENDING,			/* Initial NAMES query in progress */
+	NAMES_SYNCED,			/* Member list is complete, and maintained incrementally from here on */
+	NAMES_FAILED,			/* Initial NAMES query failed, retry on next activity */
+};
+
 static RWLIST_HEAD_STATIC(mappings, chan_pair);
 
 static void chan_pair_cleanup(struct chan_pair *cp)
@@ -273,6 +280,14 @@ static void numeric_cb(const char *clientname, const char *prefix, int numeric,
 	bbs_write(nickpipe[1], mybuf, (size_t) len);
 }
 
+/*! \brief Get just the nickname portion of a prefix (nick!user@host) */
+static const char *prefix_nick(const char *prefix, char *buf, size_t len)
+{
+	safe_strncpy(buf, prefix, len);
+	bbs_strterm(buf, '!');
+	return buf;
+}
+
 static void cp_add_member(struct chan_pair *cp, const char *username)
 {
 	/* This is used to work around a particular limitation that we face.
@@ -288,7 +303,18 @@ static void cp_add_member(struct chan_pair *cp, const char *username)
 		bbs_error("NAMES username is empty?\n");
 		return;
 	}
-	stringlist_push(&cp->members, username); /* Keep track of the username without the client name prefixed */
+	RWLIST_WRLOCK(&cp->members);
+	if (!stringlist_contains_locked(&cp->members, username)) {
+		stringlist_push(&cp->members, username); /* Keep track of the username without the client name prefixed */
+	}
+	RWLIST_UNLOCK(&cp->members);
+}
+
+static void cp_rename_member(struct chan_pair *cp, const char *oldnick, const char *newnick)
+{
+	if (!stringlist_remove(&cp->members, oldnick)) {
+		cp_add_member(cp, newnick);
+	}
 }
 
 static const char *numeric_name(int numeric)
@@ -306,7 +332,7 @@ static const char *numeric_name(int numeric)
 	__builtin_unreachable();
 }
 
-/*! \todo This info should be cached locally for a while (there could be lots of these requests in a busy channel...) */
+/*! \todo WHO and WHOIS info should be cached locally for a while too (NAMES replies already are, once synced) */
 static int wait_response(struct bbs_node *node, int fd, const char *requsername, int numeric, struct chan_pair *cp, const char *clientname, const char *channel, const char *origchan, const char *fullnick, const char *nick)
 {
 	char buf[3092] = "";
@@ -369,7 +395,10 @@ static int wait_response(struct bbs_node *node, int fd, const char *requsername,
 
 	/* Now, parse the response, and send the results back. */
 	bufpos = buf;
-	stringlist_empty(&cp->members);
+	if (numeric == 353) {
+		/* A full NAMES reply is authoritative, so resync the member list from it */
+		stringlist_empty(&cp->members);
+	}
 	while ((line = strsep(&bufpos, "\n"))) {
 		const char *w1, *w2, *w3, *w4, *w5, *w6, *w7, *w8;
 		char *rest;
@@ -492,16 +521,31 @@ cleanup:
 	return res;
 }
 
-static int cp_contains_user(struct chan_pair *cp, const char *username)
+/*!
+ * \brief Generate a NAMES reply directly from the cached member list of a channel
+ * \return Number of members
+ */
+static int cp_names_response(struct bbs_node *node, int fd, const char *requsername, struct chan_pair *cp, const char *clientname, const char *origchan)
 {
-	int res;
-
-	/* XXX This is a global mutex (not even a rwlock), so this is not optimal */
-	bbs_mutex_lock(&nicklock);
-	res = stringlist_contains(&cp->members, username);
-	bbs_mutex_unlock(&nicklock);
-
-	return res;
+	char buf[500];
+	int len = 0, count = 0;
+	const char *s;
+	struct stringitem *i = NULL;
+
+	RWLIST_RDLOCK(&cp->members);
+	while ((s = stringlist_next(&cp->members, &i))) {
+		len += snprintf(buf + len, sizeof(buf) - (size_t) len, "%s%s/%s", len ? " " : "", clientname, s);
+		count++;
+		if (len >= 400) { /* Stop well short of the 512 character message limit and clear the buffer */
+			irc_relay_names_response(node, fd, requsername, origchan, buf);
+			len = 0;
+		}
+	}
+	RWLIST_UNLOCK(&cp->members);
+	if (len > 0) {
+		irc_relay_names_response(node, fd, requsername, origchan, buf); /* Last one */
+	}
+	return count;
 }
 
 static int cli_irc_relaymembers(struct bbs_cli_args *a)
@@ -543,6 +587,48 @@ static void notify_unauthorized(const char *sender, const char *channel, const c
 	irc_relay_send_notice(sender, CHANNEL_USER_MODE_NONE, "IRC", sender, NULL, notice, NULL); /* XXX This mask is not meaningful (IRC/sender) */
 }
 
+static void *names_query(void *varg)
+{
+	const char *channel, *origchan;
+	struct chan_pair *cp = varg;
+
+	channel = cp->client1 ? cp->channel1 : cp->channel2;
+	origchan = cp->client1 ? cp->channel2 : cp->channel1;
+	bbs_debug(3, "First activity for chanpair %s/%s %s/%s, fetching members of channel %s\n", S_IF(cp->client1), S_IF(cp->client2), cp->channel1, cp->channel2, channel);
+	if (wait_response(NULL, -1, NULL, 353, cp, S_OR(cp->client1, cp->client2), channel, origchan, NULL, NULL)) {
+		cp->gotnames = NAMES_FAILED; /* Do not lock names_query_lock here or we could deadlock if somebody waiting for us to exit has it locked. */
+	} else {
+		/* From here on, the member list is maintained from JOIN/PART/QUIT/NICK, and NAMES replies are served from it */
+		cp->gotnames = NAMES_SYNCED;
+	}
+	return NULL;
+}
+
+static void ensure_names_aware(struct chan_pair *cp)
+{
+	/* If we joined the channel with members already in it,
+	 * we're reliant on some user on the local IRC network issuing a "NAMES"
+	 * that allows us to piggyback on that and capture the list of channel members.
+	 * If that never happens and a user quits, then in our current state,
+	 * we're not aware that that user was ever in the channel, so we incorrectly decline to relay it.
+	 * To prevent this, this lazily loads the channel members the first time a chan_pair is referenced.
+	 * We do it lazily since we can't actually be sure that all IRC clients are ready when this module
+	 * loads, since this could load a split instant after mod_irc_client at startup, and if so,
+	 * it's not a good time to be making NAMES requests yet...
+	 */
+	bbs_mutex_lock(&cp->names_query_lock);
+	if ((cp->gotnames == NAMES_SYNCED || cp->gotnames == NAMES_FAILED) && cp->names_thread) {
+		/* It's done, join the thread */
+		bbs_pthread_join(cp->names_thread, NULL);
+		cp->names_thread = 0;
+	}
+	if (cp->gotnames == NAMES_NONE || cp->gotnames == NAMES_FAILED) {
+		cp->gotnames = NAMES_PENDING; /* Don't do it again if one is already in progress, so mark when we start, rather than when the job finishes */
+		bbs_pthread_create(&cp->names_thread, NULL, names_query, cp);
+	}
+	bbs_mutex_unlock(&cp->names_query_lock);
+}
+
 /*!
  * \param fd
  * \param numeric: 318 = WHOIS, 352 = WHO, 353 = NAMES
@@ -606,6 +692,7 @@ static int nicklist(struct bbs_node *node, int fd, int numeric, const char *requ
 	if (numeric != 318) {
 		channel = cp->client1 ? cp->channel1 : cp->channel2;
 		origchan = cp->client1 ? cp->channel2 : cp->channel1;
+		ensure_names_aware(cp); /* Start tracking members, so future NAMES queries can be answered locally */
 	}
 
 	/* This is IRC, so we can just do pass on the request, then pass back the response. Of course, easier said than done... */
@@ -628,6 +715,10 @@ static int nicklist(struct bbs_node *node, int fd, int numeric, const char *requ
 			bbs_warning("Both clients are NULL?\n");
 			return 0;
 		}
+		if (numeric == 353 && !user && cp->gotnames == NAMES_SYNCED) {
+			/* We already know who's in the channel, no need to ask */
+			return cp_names_response(node, fd, requsername, cp, cp->client2, origchan) ? 1 : 0;
+		}
 		/* Determine who's in the "real" channel using our client */
 		/* Only one request at a time, to prevent interleaving of responses */
 		if (wait_response(node, fd, requsername, numeric, cp, cp->client2, channel, origchan, fullnick, nick)) {
@@ -646,7 +737,11 @@ static int nicklist(struct bbs_node *node, int fd, int numeric, const char *requ
 			bbs_warning("Both clients are NULL?\n");
 			return 0; /* See comments above in first map case */
 		}
-		wait_response(node, fd, requsername, numeric, cp, cp->client1, channel, origchan, fullnick, nick);
+		if (numeric == 353 && !user && cp->gotnames == NAMES_SYNCED) {
+			cp_names_response(node, fd, requsername, cp, cp->client1, origchan);
+		} else {
+			wait_response(node, fd, requsername, numeric, cp, cp->client1, channel, origchan, fullnick, nick);
+		}
 		return 0; /* Even though we matched, there could be matches in other relays */
 	} else {
 		bbs_debug(8, "Case we don't care about\n");
@@ -776,53 +871,41 @@ static int netirc_cb(struct irc_relay_message *rmsg)
 	return 0;
 }
 
-static void *names_query(void *varg)
+/*! \brief Forget the members of all channels relayed using a client, after it has disconnected */
+static void relay_disconnect(const char *clientname)
 {
-	const char *channel, *origchan;
-	struct chan_pair *cp = varg;
-
-	channel = cp->client1 ? cp->channel1 : cp->channel2;
-	origchan = cp->client1 ? cp->channel2 : cp->channel1;
-	bbs_debug(3, "First activity for chanpair %s/%s %s/%s, fetching members of channel %s\n", S_IF(cp->client1), S_IF(cp->client2), cp->channel1, cp->channel2, channel);
-	wait_response(NULL, -1, NULL, 353, cp, S_OR(cp->client1, cp->client2), channel, origchan, NULL, NULL);
-
-	cp->gotnames = 2; /* Do not lock names_query_lock here or we could deadlock if somebody waiting for us to exit has it locked. */
-	return NULL;
-}
+	struct chan_pair *cp;
 
-static void ensure_names_aware(struct chan_pair *cp)
-{
-	/* If we joined the channel with members already in it,
-	 * we're reliant on some user on the local IRC network issuing a "NAMES"
-	 * that allows us to piggyback on that and capture the list of channel members.
-	 * If that never happens and a user quits, then in our current state,
-	 * we're not aware that that user was ever in the channel, so we incorrectly decline to relay it.
-	 * To prevent this, this lazily loads the channel members the first time a chan_pair is referenced.
-	 * We do it lazily since we can't actually be sure that all IRC clients are ready when this module
-	 * loads, since this could load a split instant after mod_irc_client at startup, and if so,
-	 * it's not a good time to be making NAMES requests yet...
-	 */
-	bbs_mutex_lock(&cp->names_query_lock);
-	if (cp->gotnames) {
-		if (cp->gotnames == 2 && cp->names_thread) {
-			/* It's done, join the thread */
-			bbs_pthread_join(cp->names_thread, NULL);
-			cp->names_thread = 0;
+	RWLIST_RDLOCK(&mappings);
+	RWLIST_TRAVERSE(&mappings, cp, entry) {
+		if (!EITHER_CLIENT_MATCH(cp, clientname)) {
+			continue;
 		}
-	} else {
-		cp->gotnames = 1; /* Don't do it again if one is already in progress, so mark completed when we start, rather than when the job finishes */
-		bbs_pthread_create(&cp->names_thread, NULL, names_query, cp);
+		bbs_debug(3, "Client %s disconnected, flushing members of %s/%s\n", clientname, cp->channel1, cp->channel2);
+		bbs_mutex_lock(&cp->names_query_lock);
+		if (cp->gotnames != NAMES_PENDING) {
+			if (cp->names_thread) {
+				bbs_pthread_join(cp->names_thread, NULL);
+				cp->names_thread = 0;
+			}
+			/* Query NAMES again on the next activity, once we've reconnected and rejoined */
+			cp->gotnames = NAMES_NONE;
+		} /* else, the pending query will fail and be retried */
+		bbs_mutex_unlock(&cp->names_query_lock);
+		stringlist_empty(&cp->members);
 	}
-	bbs_mutex_unlock(&cp->names_query_lock);
+	RWLIST_UNLOCK(&mappings);
 }
 
 static void relay_quit(const char *clientname, const char *username, const char *msg)
 {
 	char sysmsg[512];
+	char nick[64];
 	struct chan_pair *cp;
 
 	snprintf(sysmsg, sizeof(sysmsg), ":%s/%s QUIT :%s", clientname, username, S_IF(msg));
 	bbs_debug(3, "Intercepting QUIT by %s/%s\n", clientname, username);
+	prefix_nick(username, nick, sizeof(nick));
 	RWLIST_RDLOCK(&mappings);
 	RWLIST_TRAVERSE(&mappings, cp, entry) {
 		/* We're looking for a match on the remote side (the local side could be NULL). */
@@ -830,17 +913,19 @@ static void relay_quit(const char *clientname, const char *username, const char
 		if (!EITHER_CLIENT_MATCH(cp, clientname)) {
 			continue;
 		}
+		/* Regardless of whether we relay it, the user is no longer in the channel */
+		if (stringlist_remove(&cp->members, nick)) {
+			continue; /* User wasn't in this channel */
+		}
 		if (!cp->relaysystem) {
 			bbs_debug(8, "Not relaying system message for client %s/%s\n", S_IF(cp->client1), S_IF(cp->client2));
 			continue;
 		}
-		if (cp_contains_user(cp, username)) {
-			bbs_debug(6, "Client %s, channel %s contains user %s, relaying QUIT...\n", clientname, username, username);
-			if (!cp->channel2) { /* We're relaying from the remote client to the native network */
-				irc_relay_raw_send(cp->channel2, sysmsg);
-			} else {
-				irc_relay_raw_send(cp->channel1, sysmsg);
-			}
+		bbs_debug(6, "Client %s, channel %s contains user %s, relaying QUIT...\n", clientname, username, username);
+		if (!cp->channel2) { /* We're relaying from the remote client to the native network */
+			irc_relay_raw_send(cp->channel2, sysmsg);
+		} else {
+			irc_relay_raw_send(cp->channel1, sysmsg);
 		}
 	}
 	RWLIST_UNLOCK(&mappings);
@@ -854,7 +939,10 @@ static void command_cb(const char *clientname, enum irc_callback_msg_type type,
 	const char *ourchan;
 	struct chan_pair *cp;
 
-	if (type == CMD_QUIT) {
+	if (type == CMD_DISCONNECT) {
+		relay_disconnect(clientname);
+		return;
+	} else if (type == CMD_QUIT) {
 		/* Client quit messages don't have a channel associated with them (and there could be multiple).
 		 * Since relays are per channel, not per network, we need to determine what channels this user was in, and relay to those channels.
 		 * For this, we rely on clients on the network doing a periodic NAMES query,
@@ -862,6 +950,22 @@ static void command_cb(const char *clientname, enum irc_callback_msg_type type,
 		 * There could be multiple cp's to which we need to relay, but we only need to check all the chan pairs for this client. */
 		relay_quit(clientname, prefix, msg);
 		return;
+	} else if (type == CMD_NICK) {
+		/* Likewise, nick changes apply to all channels the user is in. Just keep our member lists up to date. */
+		char oldnick[64];
+		prefix_nick(prefix, oldnick, sizeof(oldnick));
+		if (strlen_zero(msg)) {
+			return;
+		}
+		bbs_debug(5, "%s/%s is now known as %s\n", clientname, oldnick, msg);
+		RWLIST_RDLOCK(&mappings);
+		RWLIST_TRAVERSE(&mappings, cp, entry) {
+			if (EITHER_CLIENT_MATCH(cp, clientname)) {
+				cp_rename_member(cp, oldnick, msg);
+			}
+		}
+		RWLIST_UNLOCK(&mappings);
+		return;
 	}
 
 	/* XXX In theory we should only need to do one traversal here. By the name alone, we should know if it's a channel or username */
@@ -952,11 +1056,7 @@ static void command_cb(const char *clientname, enum irc_callback_msg_type type,
 				irc_relay_raw_send(cp->channel1, sysmsg);
 			}
 			/* To keep our users list up to date, even if nobody on the network is issuing a NAMES query */
-			if (!cp_contains_user(cp, prefix)) {
-				bbs_mutex_lock(&nicklock);
-				stringlist_push(&cp->members, prefix);
-				bbs_mutex_unlock(&nicklock);
-			}
+			cp_add_member(cp, prefix_nick(prefix, nativenick, sizeof(nativenick)));
 			break;
 		case CMD_PART:
 			ourchan = MAP1_MATCH(cp, clientname, channel) ? cp->channel2 : cp->channel1;
@@ -972,10 +1072,37 @@ static void command_cb(const char *clientname, enum irc_callback_msg_type type,
 				irc_relay_raw_send(cp->channel1, sysmsg);
 			}
 			/* To keep our users list up to date, even if nobody on the network is issuing a NAMES query */
-			if (cp_contains_user(cp, prefix)) {
-				bbs_mutex_lock(&nicklock);
-				stringlist_remove(&cp->members, prefix);
-				bbs_mutex_unlock(&nicklock);
+			stringlist_remove(&cp->members, prefix_nick(prefix, nativenick, sizeof(nativenick)));
+			break;
+		case CMD_KICK:
+			{
+				/* The prefix is whoever did the kicking, the kicked user is the first argument */
+				char kickbuf[512];
+				char *victim, *reason = kickbuf;
+				safe_strncpy(kickbuf, S_IF(msg), sizeof(kickbuf));
+				victim = strsep(&reason, " ");
+				if (strlen_zero(victim)) {
+					bbs_debug(3, "KICK by %s/%s in %s without a target?\n", clientname, prefix, channel);
+					break;
+				}
+				if (reason && *reason == ':') {
+					reason++;
+				}
+				ourchan = MAP1_MATCH(cp, clientname, channel) ? cp->channel2 : cp->channel1;
+				/* The kicked user doesn't really exist on our side, so to everyone here, it just left */
+				snprintf(sysmsg, sizeof(sysmsg), ":%s/%s PART %s :Kicked by %s/%s (%s)", clientname, victim, ourchan, clientname, prefix_nick(prefix, nativenick, sizeof(nativenick)), S_IF(reason));
+				bbs_debug(3, "Intercepting KICK of %s/%s (%s -> %s)\n", clientname, victim, channel, ourchan);
+				if (strlen(victim) >= 64) {
+					bbs_warning("Potential IRC loop detected, dropping message\n");
+				} else if (!cp->relaysystem) {
+					bbs_debug(8, "Not relaying system message\n");
+				} else if (MAP1_MATCH(cp, clientname, channel)) {
+					irc_relay_raw_send(cp->channel2, sysmsg);
+				} else {
+					irc_relay_raw_send(cp->channel1, sysmsg);
+				}
+				/* To keep our users list up to date, even if nobody on the network is issuing a NAMES query */
+				stringlist_remove(&cp->members, victim);
 			}
 			break;
 		case CMD_QUIT: /* This is academic, as QUIT is handled above */
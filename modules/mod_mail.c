@@ -29,6 +29,11 @@
 #include <dirent.h>
 #include <libgen.h> /* use dirname */
 
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h> /* use FICLONE */
+#endif
+
 #include "include/linkedlists.h"
 #include "include/module.h"
 #include "include/config.h"
@@ -48,6 +53,7 @@
 static char root_maildir[248] = "";
 static char catchall[256] = "";
 static unsigned int maxquota = 10000000;
+static unsigned int maxexpunged = 0;
 
 struct stringlist local_domains;
 
@@ -361,6 +367,33 @@ int mailbox_has_activity(struct mailbox *mbox)
 	return res;
 }
 
+BBS_SINGULAR_CALLBACK_DECLARE(trash_watcher, void, const char *maildir, unsigned int uidvalidity, unsigned int uid);
+
+int __mailbox_register_trash_watcher(void (*callback)(const char *maildir, unsigned int uidvalidity, unsigned int uid), void *mod)
+{
+	return bbs_singular_callback_register(&trash_watcher, callback, mod);
+}
+
+int mailbox_unregister_trash_watcher(void (*callback)(const char *maildir, unsigned int uidvalidity, unsigned int uid))
+{
+	return bbs_singular_callback_unregister(&trash_watcher, callback);
+}
+
+/*! \brief Notify the Trash watcher if a message was just placed into a Trash folder */
+static void notify_trash(const char *maildir, unsigned int uidvalidity, unsigned int uid)
+{
+	const char *base = strrchr(maildir, '/');
+
+	if (!base || strcmp(base, "/.Trash")) {
+		return;
+	}
+	if (bbs_singular_callback_execute_pre(&trash_watcher)) {
+		return; /* Nobody cares */
+	}
+	BBS_SINGULAR_CALLBACK_EXECUTE(trash_watcher)(maildir, uidvalidity, uid);
+	bbs_singular_callback_execute_post(&trash_watcher);
+}
+
 BBS_SINGULAR_CALLBACK_DECLARE(sieve_validate, int, const char *filename, struct mailbox *mbox, char **errormsg);
 static char *sieve_capabilities = NULL; /* Additional callback data not handled by singular callback interface */
 
@@ -919,34 +952,62 @@ int mailbox_uniqueid(struct mailbox *mbox, char *buf, size_t len)
 	return 0;
 }
 
+/*! \brief This host's name, for unique maildir filenames */
+static char maildir_hostname[32] = "localhost";
+
+static void maildir_hostname_init(void)
+{
+	char host[256];
+	char *s;
+
+	if (gethostname(host, sizeof(host) - 1)) {
+		bbs_warning("gethostname failed: %s\n", strerror(errno));
+		return;
+	}
+	host[sizeof(host) - 1] = '\0';
+	/* The base name of a maildir file can't contain a slash, the flags separator (:), or the info separator (,).
+	 * Avoid periods too, since mail queue files store the retry count after the first one. */
+	for (s = host; *s; s++) {
+		if (*s == '/' || *s == ':' || *s == ',' || *s == '.') {
+			*s = '_';
+		}
+	}
+	safe_strncpy(maildir_hostname, host, sizeof(maildir_hostname));
+}
+
 int maildir_mktemp(const char *path, char *buf, size_t len, char *newbuf)
 {
+	static __thread unsigned int counter = 0;
 	struct timeval tvnow;
-	struct stat st;
-	int fd;
+	char name[96];
+	int fd, initialized = 0;
 
 	for (;;) {
 #pragma GCC diagnostic ignored "-Waggregate-return"
 		tvnow = bbs_tvnow();
 #pragma GCC diagnostic pop
-		snprintf(buf, len, "%s/tmp/%lu%06lu", path, tvnow.tv_sec, tvnow.tv_usec);
-		snprintf(newbuf, len, "%s/new/%lu%06lu", path, tvnow.tv_sec, tvnow.tv_usec);
-		if (stat(buf, &st) == -1 && errno == ENOENT) {
-			/* Error means it doesn't exist. */
-			if (stat(newbuf, &st) == -1 && errno == ENOENT) {
-				break;
+		/* The time comes first so that names still sort in order of arrival,
+		 * but the PID, thread ID, per-thread counter, and hostname are what make the name unique,
+		 * so there is no need to check if the name is already in use first, or to wait for the clock to tick. */
+		snprintf(name, sizeof(name), "%lu%06luP%dT%dQ%uH%s", tvnow.tv_sec, tvnow.tv_usec, getpid(), bbs_gettid(), ++counter, maildir_hostname);
+		snprintf(buf, len, "%s/tmp/%s", path, name);
+		/* O_EXCL, so that even if something else did create this file, we'll never share it */
+		fd = open(buf, O_WRONLY | O_CREAT | O_EXCL, 0600);
+		if (fd >= 0) {
+			break;
+		} else if (errno == ENOENT && !initialized) {
+			/* This maildir has never been accessed before */
+			initialized = 1;
+			if (mailbox_maildir_init(path)) {
+				return -1;
 			}
+		} else if (errno != EEXIST) {
+			bbs_error("open(%s) failed: %s\n", buf, strerror(errno));
+			return -1;
 		}
-		usleep(100 + (unsigned int) bbs_rand(1, 25));
 	}
 
-	/* In case this maildir has never been accessed before */
-	mailbox_maildir_init(path);
-
-	fd = open(buf, O_WRONLY | O_CREAT, 0600);
-	if (fd < 0) {
-		bbs_error("open(%s) failed: %s\n", buf, strerror(errno));
-	}
+	snprintf(newbuf, len, "%s/new/%s", path, name);
 	return fd;
 }
 
@@ -1154,11 +1215,276 @@ unsigned int mailbox_get_next_uid(struct mailbox *mbox, struct bbs_node *node, c
 	return uidnext;
 }
 
+/* The .modseqs file starts with HIGHESTMODSEQ, followed by the log of expunged messages.
+ *
+ * Originally, the log was just a (UID, MODSEQ) pair for every expunged message,
+ * which had to be read linearly and grew forever.
+ * Now, it begins with a 0 (which old versions treat as the end of the log),
+ * a version number, and the compaction horizon, followed by fixed size records,
+ * each of which is a run of consecutive UIDs expunged with the same MODSEQ.
+ * Records are appended in MODSEQ order, so they can be binary searched by MODSEQ.
+ *
+ * The horizon is the highest MODSEQ of any expunge that has been dropped from the log,
+ * i.e. the log is only complete for MODSEQs greater than this. */
+#define MODSEQ_LOG_VERSION 2
+
+struct modseq_header {
+	unsigned long highestmodseq;
+	unsigned int marker;	/* Always 0 */
+	unsigned int version;
+	unsigned long horizon;
+};
+
+struct expunge_record {
+	unsigned long modseq;
+	unsigned int minuid;
+	unsigned int maxuid;
+};
+
+#define MODSEQ_HEADER_SIZE sizeof(struct modseq_header)
+#define EXPUNGE_RECORD_SIZE sizeof(struct expunge_record)
+#define EXPUNGE_RECORD_OFFSET(i) (off_t) (MODSEQ_HEADER_SIZE + (size_t) (i) * EXPUNGE_RECORD_SIZE)
+
+static int write_modseq_header(int fd, unsigned long highestmodseq, unsigned long horizon)
+{
+	struct modseq_header hdr;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.highestmodseq = highestmodseq;
+	hdr.version = MODSEQ_LOG_VERSION;
+	hdr.horizon = horizon;
+	if (pwrite(fd, &hdr, sizeof(hdr), 0) != (ssize_t) sizeof(hdr)) {
+		bbs_error("pwrite failed: %s\n", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/*!
+ * \brief Read the header of a .modseqs file
+ * \param fd
+ * \param[out] hdr
+ * \param[out] records Number of expunge records in the log
+ * \retval -1 on failure, otherwise the version of the file (1 for the original format, where records is not set)
+ */
+static int read_modseq_header(int fd, struct modseq_header *hdr, size_t *records)
+{
+	struct stat st;
+	ssize_t res;
+
+	if (fstat(fd, &st)) {
+		bbs_error("fstat failed: %s\n", strerror(errno));
+		return -1;
+	}
+	memset(hdr, 0, sizeof(*hdr));
+	res = pread(fd, hdr, sizeof(*hdr), 0);
+	if (res < (ssize_t) sizeof(unsigned long)) {
+		return -1;
+	}
+	if (res < (ssize_t) sizeof(*hdr) || hdr->marker || hdr->version != MODSEQ_LOG_VERSION) {
+		return 1;
+	}
+	/* If a write was interrupted, there could be a partial record at the end. Just ignore it. */
+	*records = ((size_t) st.st_size - MODSEQ_HEADER_SIZE) / EXPUNGE_RECORD_SIZE;
+	return MODSEQ_LOG_VERSION;
+}
+
+static int uint_cmp(const void *a, const void *b)
+{
+	unsigned int x = *(const unsigned int*) a, y = *(const unsigned int*) b;
+	return x < y ? -1 : x > y ? 1 : 0;
+}
+
+/*! \brief Append records for a list of UIDs all expunged with the same MODSEQ, one record per run of consecutive UIDs */
+static int append_expunge_records(int fd, size_t *records, unsigned int *uids, int length, unsigned long modseq)
+{
+	int i;
+	struct expunge_record rec;
+
+	qsort(uids, (size_t) length, sizeof(unsigned int), uint_cmp);
+
+	rec.modseq = modseq;
+	rec.minuid = rec.maxuid = 0;
+	for (i = 0; i <= length; i++) {
+		if (i < length) {
+			if (!uids[i]) {
+				bbs_error("Invalid UID at index %d\n", i);
+				continue;
+			}
+			if (rec.minuid && uids[i] <= rec.maxuid + 1) {
+				rec.maxuid = MAX(rec.maxuid, uids[i]); /* Extends the current run (or is a duplicate) */
+				continue;
+			}
+		}
+		if (rec.minuid) {
+			/* Write at the offset for the next record, rather than just appending, in case there's a partial record at the end */
+			if (pwrite(fd, &rec, sizeof(rec), EXPUNGE_RECORD_OFFSET(*records)) != (ssize_t) sizeof(rec)) {
+				bbs_error("pwrite failed: %s\n", strerror(errno));
+				return -1;
+			}
+			bbs_debug(6, "Added %u:%u/%lu to expunge log\n", rec.minuid, rec.maxuid, modseq);
+			(*records)++;
+		}
+		if (i < length) {
+			rec.minuid = rec.maxuid = uids[i];
+		}
+	}
+	return 0;
+}
+
+/*!
+ * \brief Atomically replace a .modseqs file
+ * \param modseqfile
+ * \param hdr Header. The version is always set to the current version.
+ * \param recs Records to write
+ * \param numrecs Number of records
+ * \note Must be called with the mailbox UID lock held
+ */
+static int rewrite_modseq_file(const char *modseqfile, struct modseq_header *hdr, struct expunge_record *recs, size_t numrecs)
+{
+	char tmpfile[272];
+	int fd;
+	size_t len = numrecs * EXPUNGE_RECORD_SIZE;
+
+	snprintf(tmpfile, sizeof(tmpfile), "%s.tmp", modseqfile);
+	fd = open(tmpfile, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		bbs_error("open(%s) failed: %s\n", tmpfile, strerror(errno));
+		return -1;
+	}
+	if (write_modseq_header(fd, hdr->highestmodseq, hdr->horizon)
+		|| (len && pwrite(fd, recs, len, EXPUNGE_RECORD_OFFSET(0)) != (ssize_t) len)) {
+		close(fd);
+		unlink(tmpfile);
+		return -1;
+	}
+	close(fd);
+	/* Readers may have the old file open, but rename is atomic, so they'll see either the old or the new file, in its entirety */
+	if (rename(tmpfile, modseqfile)) {
+		bbs_error("rename(%s, %s) failed: %s\n", tmpfile, modseqfile, strerror(errno));
+		unlink(tmpfile);
+		return -1;
+	}
+	return 0;
+}
+
+/*! \brief Convert a .modseqs file in the original format (a UID/MODSEQ pair for every expunged message) to the current format */
+static int upgrade_modseq_file(const char *modseqfile)
+{
+	FILE *fp;
+	struct modseq_header hdr;
+	struct expunge_record *recs = NULL;
+	size_t numrecs = 0, allocrecs = 0;
+	unsigned int *uids = NULL;
+	int lengths = 0, allocsizes = 0;
+	unsigned long lastmodseq = 0;
+	int res = -1;
+
+	fp = fopen(modseqfile, "rb");
+	if (!fp) {
+		bbs_error("Failed to open %s\n", modseqfile);
+		return -1;
+	}
+	memset(&hdr, 0, sizeof(hdr));
+	if (fread(&hdr.highestmodseq, sizeof(unsigned long), 1, fp) != 1) {
+		fclose(fp);
+		return -1;
+	}
+
+	/* Records are in MODSEQ order, so collect all the UIDs for each MODSEQ, then convert them to runs */
+	for (;;) {
+		unsigned int uid;
+		unsigned long modseq = 0;
+		int eof = fread(&uid, sizeof(unsigned int), 1, fp) != 1 || !uid || fread(&modseq, sizeof(unsigned long), 1, fp) != 1;
+		if (lengths && (eof || modseq != lastmodseq)) {
+			int i;
+			qsort(uids, (size_t) lengths, sizeof(unsigned int), uint_cmp);
+			for (i = 0; i < lengths; i++) {
+				if (numrecs && recs[numrecs - 1].modseq == lastmodseq && uids[i] <= recs[numrecs - 1].maxuid + 1) {
+					recs[numrecs - 1].maxuid = MAX(recs[numrecs - 1].maxuid, uids[i]);
+					continue;
+				}
+				if (numrecs == allocrecs) {
+					struct expunge_record *newrecs;
+					allocrecs = allocrecs ? 2 * allocrecs : 64;
+					newrecs = realloc(recs, allocrecs * EXPUNGE_RECORD_SIZE);
+					if (ALLOC_FAILURE(newrecs)) {
+						goto cleanup;
+					}
+					recs = newrecs;
+				}
+				recs[numrecs].modseq = lastmodseq;
+				recs[numrecs].minuid = recs[numrecs].maxuid = uids[i];
+				numrecs++;
+			}
+			lengths = 0;
+		}
+		if (eof) {
+			break;
+		}
+		lastmodseq = modseq;
+		if (uintlist_append(&uids, &lengths, &allocsizes, uid)) {
+			goto cleanup;
+		}
+	}
+
+	res = rewrite_modseq_file(modseqfile, &hdr, recs, numrecs);
+	if (!res) {
+		bbs_debug(3, "Upgraded %s (%lu expunge record%s)\n", modseqfile, numrecs, ESS(numrecs));
+	}
+
+cleanup:
+	fclose(fp);
+	free_if(uids);
+	free_if(recs);
+	return res;
+}
+
+/*!
+ * \brief Drop the oldest expunge records from the log, if it's larger than allowed
+ * \note Must be called with the mailbox UID lock held
+ */
+static void compact_modseq_file(const char *modseqfile, int fd, size_t records)
+{
+	struct modseq_header hdr;
+	struct expunge_record *recs;
+	size_t keep, drop, len;
+
+	if (!maxexpunged || records <= maxexpunged) {
+		return;
+	}
+
+	/* Keep 3/4 of the max, so we don't have to compact again for a while */
+	keep = maxexpunged - maxexpunged / 4;
+	drop = records - keep;
+
+	if (read_modseq_header(fd, &hdr, &records) != MODSEQ_LOG_VERSION) {
+		return;
+	}
+	len = (keep + 1) * EXPUNGE_RECORD_SIZE;
+	recs = malloc(len);
+	if (ALLOC_FAILURE(recs)) {
+		return;
+	}
+	/* Read the last dropped record, too, since it determines the new horizon */
+	if (pread(fd, recs, len, EXPUNGE_RECORD_OFFSET(drop - 1)) != (ssize_t) len) {
+		bbs_error("pread failed: %s\n", strerror(errno));
+		free(recs);
+		return;
+	}
+	hdr.horizon = MAX(hdr.horizon, recs[0].modseq);
+	if (!rewrite_modseq_file(modseqfile, &hdr, recs + 1, keep)) {
+		bbs_debug(3, "Compacted expunge log %s, dropped %lu records (horizon now %lu)\n", modseqfile, drop, hdr.horizon);
+	}
+	free(recs);
+}
+
 static unsigned long __maildir_modseq(struct mailbox *mbox, const char *directory, int increment)
 {
 	unsigned long max_modseq = 0;
 	char modseqfile[256];
 	FILE *fp;
+	int fd;
 	long unsigned int res;
 
 	UNUSED(mbox); /* Not currently used, but could be useful for future caching strategies? */
@@ -1205,13 +1531,20 @@ static unsigned long __maildir_modseq(struct mailbox *mbox, const char *director
 			}
 		}
 		closedir(dir);
+		/* max_modseq is now the HIGHESTMODSEQ of the folder.
+		 * If the caller needs a new MODSEQ, it must be greater than that of every message, or clients
+		 * that already saw max_modseq (e.g. with a FETCH MODSEQ) wouldn't see this change with CHANGEDSINCE.
+		 * Either way, we return the value we write, so that subsequent calls continue from there. */
+		if (increment) {
+			max_modseq += 1;
+		}
 		if (!max_modseq) {
 			max_modseq = 1; /* Must be at least 1 */
 		}
-		fp = fopen(modseqfile, "wb");
-		if (likely(fp != NULL)) {
-			fwrite(&max_modseq, sizeof(unsigned long), 1, fp);
-			fclose(fp);
+		fd = open(modseqfile, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+		if (likely(fd >= 0)) {
+			write_modseq_header(fd, max_modseq, 0);
+			close(fd);
 		}
 		return max_modseq;
 	}
@@ -1242,34 +1575,112 @@ static unsigned long __maildir_modseq(struct mailbox *mbox, const char *director
 	return max_modseq;
 }
 
-char *maildir_get_expunged_since_modseq_range(const char *directory, unsigned long lastmodseq, char *uidrangebuf, unsigned int minuid, const char *uidrange)
+char *maildir_get_expunged_since_modseq_range(const char *directory, unsigned long lastmodseq, unsigned int minuid, const struct range_set *uidrange)
 {
-	return maildir_get_expunged_since_modseq(directory, lastmodseq, uidrangebuf, minuid, uidrange);
+	return maildir_get_expunged_since_modseq(directory, lastmodseq, minuid, uidrange);
 }
 
-char *maildir_get_expunged_since_modseq(const char *directory, unsigned long lastmodseq, char *uidrangebuf, unsigned int minuid, const char *uidrange)
+static inline void add_expunged_uids(unsigned int **a, int *lengths, int *allocsizes, unsigned int minuid, unsigned int maxuid, const struct range_set *uidrange)
 {
-	char modseqfile[256];
-	FILE *fp;
-	unsigned long modseq;
 	unsigned int uid;
-	size_t res;
-	unsigned int *a = NULL;
-	int lengths = 0, allocsizes = 0;
 
-	snprintf(modseqfile, sizeof(modseqfile), "%s/../.modseqs", directory);
-	fp = fopen(modseqfile, "rb");
+	for (uid = minuid; uid && uid <= maxuid; uid++) { /* uid becomes 0 if we wrap around */
+		if (!uidrange || range_set_contains(uidrange, uid)) {
+			uintlist_append(a, lengths, allocsizes, uid);
+		}
+	}
+}
+
+/*!
+ * \brief Get all UIDs that have ever been assigned in a mailbox that no longer exist, for when the expunge log is no longer complete
+ * \note Per RFC 7162 3.2.5.2, this may include UIDs that were never seen by the client, which is fine.
+ */
+static void get_all_expunged(const char *directory, unsigned int minuid, const struct range_set *uidrange, unsigned int **a, int *lengths, int *allocsizes)
+{
+	char uidfile[256];
+	FILE *fp;
+	DIR *dir;
+	struct dirent *entry;
+	unsigned int uidvalidity, lastuid, uid, prev;
+	unsigned int *existing = NULL;
+	int i, numexisting = 0, allocexisting = 0, ascii = 0;
+
+	snprintf(uidfile, sizeof(uidfile), "%s/../.uidvalidity", directory);
+	fp = fopen(uidfile, "r");
 	if (!fp) {
-		bbs_error("Failed to open %s\n", modseqfile);
-		return NULL;
+		return;
 	}
-	res = fread(&modseq, sizeof(unsigned long), 1, fp);
-	if (res != 1) {
-		bbs_error("Failed to read HIGHESTMODSEQ from %s\n", directory);
+	if (parse_uidfile(fp, uidfile, &uidvalidity, &lastuid, &ascii)) {
 		fclose(fp);
-		return NULL;
+		return;
+	}
+	fclose(fp);
+
+	if (!(dir = opendir(directory))) {
+		bbs_error("Error opening directory - %s: %s\n", directory, strerror(errno));
+		return;
+	}
+	while ((entry = readdir(dir)) != NULL) {
+		if (entry->d_type != DT_REG || maildir_parse_uid_from_filename(entry->d_name, &uid)) {
+			continue;
+		}
+		uintlist_append(&existing, &numexisting, &allocexisting, uid);
 	}
+	closedir(dir);
+	if (numexisting) {
+		qsort(existing, (size_t) numexisting, sizeof(unsigned int), uint_cmp);
+	}
+
+	/* Everything in the gaps between existing messages, up to the last assigned UID */
+	prev = minuid ? minuid - 1 : 0;
+	for (i = 0; i < numexisting && existing[i] <= lastuid; i++) {
+		if (existing[i] > prev + 1) {
+			add_expunged_uids(a, lengths, allocsizes, prev + 1, existing[i] - 1, uidrange);
+		}
+		prev = MAX(prev, existing[i]);
+	}
+	if (lastuid > prev) {
+		add_expunged_uids(a, lengths, allocsizes, prev + 1, lastuid, uidrange);
+	}
+	free_if(existing);
+}
+
+/*! \brief Find the first expunge record with a MODSEQ greater than modseq */
+static ssize_t expunge_record_search(int fd, size_t records, unsigned long modseq)
+{
+	size_t low = 0, high = records;
+
+	while (low < high) {
+		size_t mid = low + (high - low) / 2;
+		unsigned long midmodseq;
+		/* MODSEQ is the first field of each record */
+		if (pread(fd, &midmodseq, sizeof(midmodseq), EXPUNGE_RECORD_OFFSET(mid)) != (ssize_t) sizeof(midmodseq)) {
+			bbs_error("pread failed: %s\n", strerror(errno));
+			return -1;
+		}
+		if (midmodseq <= modseq) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	return (ssize_t) low;
+}
+
+/*! \brief maildir_get_expunged_since_modseq for files still in the original format */
+static void get_expunged_since_modseq_legacy(int fd, unsigned long lastmodseq, unsigned int minuid, const struct range_set *uidrange, unsigned int **a, int *lengths, int *allocsizes)
+{
+	FILE *fp;
+	unsigned long modseq;
+	unsigned int uid;
+	size_t res;
 
+	fp = fdopen(fd, "rb");
+	if (!fp) {
+		close(fd);
+		return;
+	}
+	fseek(fp, sizeof(unsigned long), SEEK_SET); /* Skip HIGHESTMODSEQ */
 	for (;;) {
 		/* Note that this file is sorted by MODSEQ, not be UID */
 		res = fread(&uid, sizeof(unsigned int), 1, fp);
@@ -1286,16 +1697,77 @@ char *maildir_get_expunged_since_modseq(const char *directory, unsigned long las
 		if (modseq <= lastmodseq) {
 			continue;
 		}
-		if (uidrange && !in_range_allocated(uidrange, (int) uid, uidrangebuf)) {
+		if (uidrange && !range_set_contains(uidrange, uid)) {
 			continue;
 		}
-		uintlist_append(&a, &lengths, &allocsizes, uid);
+		uintlist_append(a, lengths, allocsizes, uid);
 	}
+	fclose(fp); /* Also closes fd */
+}
 
-	fclose(fp);
+char *maildir_get_expunged_since_modseq(const char *directory, unsigned long lastmodseq, unsigned int minuid, const struct range_set *uidrange)
+{
+	char modseqfile[256];
+	struct modseq_header hdr;
+	size_t records = 0;
+	ssize_t start;
+	int fd, version;
+	unsigned int *a = NULL;
+	int lengths = 0, allocsizes = 0;
 
+	snprintf(modseqfile, sizeof(modseqfile), "%s/../.modseqs", directory);
+	fd = open(modseqfile, O_RDONLY);
+	if (fd < 0) {
+		bbs_error("Failed to open %s\n", modseqfile);
+		return NULL;
+	}
+	version = read_modseq_header(fd, &hdr, &records);
+	if (version < 0) {
+		bbs_error("Failed to read HIGHESTMODSEQ from %s\n", directory);
+		close(fd);
+		return NULL;
+	} else if (version == 1) {
+		get_expunged_since_modseq_legacy(fd, lastmodseq, minuid, uidrange, &a, &lengths, &allocsizes);
+		goto done;
+	}
+
+	if (lastmodseq < hdr.horizon) {
+		/* We no longer know exactly what was expunged since then,
+		 * so the client gets everything that was ever expunged, i.e. a full resync. */
+		bbs_debug(3, "MODSEQ %lu is older than expunge log horizon %lu\n", lastmodseq, hdr.horizon);
+		close(fd);
+		get_all_expunged(directory, minuid, uidrange, &a, &lengths, &allocsizes);
+		goto done;
+	}
+
+	start = expunge_record_search(fd, records, lastmodseq);
+	if (start >= 0 && (size_t) start < records) {
+		struct expunge_record recs[256];
+		off_t offset = EXPUNGE_RECORD_OFFSET(start);
+		for (;;) {
+			ssize_t i, num, res = pread(fd, recs, sizeof(recs), offset);
+			if (res <= 0) {
+				break;
+			}
+			num = res / (ssize_t) EXPUNGE_RECORD_SIZE;
+			if (!num) {
+				break;
+			}
+			for (i = 0; i < num; i++) {
+				if (recs[i].maxuid >= minuid) {
+					add_expunged_uids(&a, &lengths, &allocsizes, MAX(recs[i].minuid, minuid), recs[i].maxuid, uidrange);
+				}
+			}
+			offset += num * (ssize_t) EXPUNGE_RECORD_SIZE;
+		}
+	}
+	close(fd);
+
+done:
 	if (lengths) {
-		char *str = gen_uintlist(a, lengths);
+		char *str;
+		qsort(a, (size_t) lengths, sizeof(unsigned int), uint_cmp);
+		str = gen_uintlist(a, lengths);
 		free(a);
 		return str;
 	} else {
@@ -1333,104 +1805,89 @@ unsigned long maildir_indicate_expunged(enum mailbox_event_type type, struct bbs
 {
 	char modseqfile[256];
 	unsigned long maxmodseq;
-	FILE *fp;
-	long pos;
-	int created, i;
-#ifdef VERIFY_MODSEQ_INTEGRITY
-	int res;
-#endif
+	struct modseq_header hdr;
+	size_t records = 0;
+	unsigned int *sorted;
+	int fd, version;
 
 	/* Increment HIGHESTMODSEQ by 1.
 	 * We CAN use the same MODSEQ for all the expunged messages, if there are multiple. MODSEQ does not have to be unique. */
 	mailbox_uid_lock(mbox);
 	maxmodseq = __maildir_modseq(mbox, directory, 1); /* Must be atomic */
 
-	snprintf(modseqfile, sizeof(modseqfile), "%s/../.modseqs", directory);
-	fp = fopen(modseqfile, "ab");
-	if (!fp) {
-		bbs_error("Failed to open %s\n", modseqfile);
-		mailbox_uid_unlock(mbox);
-		return maxmodseq;
-	}
-
-	/* We need to also store all the expunged message UIDs and MODSEQs, indefinitely,
+	/* We need to also store all the expunged message UIDs and MODSEQs,
 	 * to fulfill RFC 7162 3.2.7
 	 * RFC 7162 Section 5.3 has some pertinent recommendations on this:
-	 * - this state should be persistent, but is not required to be (we make it persistent indefinitely)
+	 * - this state should be persistent, but is not required to be (we make it persistent, indefinitely unless maxexpunged is set)
 	 * - RFC cautions that indefinite storage could cause storage issues (64 GB in worst case, though this is far from likely)
-	 * - We could expire old MODSEQ values if needed to keep storage under control (subject to implementation, see the RFC)
+	 * - We can expire old MODSEQ values if needed to keep storage under control (see compact_modseq_file)
 	 */
-
-	/* Check if we created the file or opened an existing one by getting our position.
-	 * Per fopen(3), when appending, stream is positioned at end of file.
-	 * Thus, we can use the current file offset when opening the file to determine if we just created it
-	 * (this assumes that we didn't create an empty file early, i.e. if the file existed it was non-empty).
-	 * If the file is empty, write HIGHESTMODSEQ first, then the expunged messages.
-	 * Otherwise, append all the expunged messages, then seek back to the beginning and overwrite HIGHESTMODSEQ. */
-	if (fseek(fp, -1, SEEK_END)) {
-		bbs_warning("fseek(%s) failed: %s\n", modseqfile, strerror(errno));
-	}
-	pos = ftell(fp);
-	bbs_debug(7, "Current position is %ld\n", pos);
-	created = pos == 0;
-	if (created) {
-		fwrite(&maxmodseq, sizeof(unsigned long), 1, fp);
-	}
-	for (i = 0; i < length; i++) {
-		if (!uids[i]) {
-			bbs_error("Invalid UID at index %d\n", i);
-			continue;
+	snprintf(modseqfile, sizeof(modseqfile), "%s/../.modseqs", directory);
+	fd = open(modseqfile, O_RDWR);
+	if (fd < 0) {
+		bbs_error("Failed to open %s: %s\n", modseqfile, strerror(errno));
+		mailbox_uid_unlock(mbox);
+		return maxmodseq;
+	}
+	version = read_modseq_header(fd, &hdr, &records);
+	if (version == 1) {
+		/* Convert to the current format the first time we need to write to it */
+		close(fd);
+		fd = -1;
+		if (!upgrade_modseq_file(modseqfile)) {
+			fd = open(modseqfile, O_RDWR);
+			version = fd >= 0 ? read_modseq_header(fd, &hdr, &records) : -1;
 		}
-		fwrite(&uids[i], sizeof(unsigned int), 1, fp);
-		fwrite(&maxmodseq, sizeof(unsigned long), 1, fp);
-		bbs_debug(6, "Added %u/%lu to expunge log\n", uids[i], maxmodseq);
 	}
-	if (!created) {
-		rewind(fp);
-		fwrite(&maxmodseq, sizeof(unsigned long), 1, fp);
-		bbs_debug(6, "Updated HIGHESTMODSEQ to %lu\n", maxmodseq);
+	if (version != MODSEQ_LOG_VERSION) {
+		bbs_error("Failed to update expunge log %s\n", modseqfile);
+		if (fd >= 0) {
+			close(fd);
+		}
+		mailbox_uid_unlock(mbox);
+		return maxmodseq;
 	}
 
-	fclose(fp); /* Flush changes before releasing the lock */
+	/* Sort a copy, since the caller's UIDs correspond to seqnos */
+	sorted = malloc((size_t) length * sizeof(unsigned int) + 1);
+	if (!ALLOC_FAILURE(sorted)) {
+		memcpy(sorted, uids, (size_t) length * sizeof(unsigned int));
+		append_expunge_records(fd, &records, sorted, length, maxmodseq);
+		free(sorted);
+	}
+	compact_modseq_file(modseqfile, fd, records);
+
+	close(fd); /* Flush changes before releasing the lock */
 	mailbox_uid_unlock(mbox);
 
 /* Enable this to automatically check the file for corruption after writing */
 /* See also the standalone MODSEQ dump utility in external/modseqdecode */
 #ifdef VERIFY_MODSEQ_INTEGRITY
-	fp = fopen(modseqfile, "r");
-	if (!fp) {
+	fd = open(modseqfile, O_RDONLY);
+	if (fd < 0) {
 		return maxmodseq;
 	}
-	res = fread(&maxmodseq, sizeof(unsigned long), 1, fp);
-	if (res != 1 || !maxmodseq) {
-		bbs_error("MODSEQ corruption detected: missing HIGHESTMODSEQ\n");
-	}
-	for (;;) {
-		unsigned int uid;
-		res = fread(&uid, sizeof(unsigned int), 1, fp);
-		if (res != 1) {
-			break;
-		}
-		if (!uid) {
-			bbs_debug(6, "Detected UID %u, stopping\n", uid);
-			/* Sometimes (often), it seems that 0 can crop in at the end of a file,
-			 * even though we never wrote one explicitly.
-			 * Not really sure why that happens, but be tolerant of it. */
-			break; /* If we get a UID of 0, just stop */
-		}
-		res = fread(&modseq, sizeof(unsigned long), 1, fp);
-		if (res != 1) {
-			bbs_error("MODSEQ corruption detected: MODSEQ file contains UID %u with no corresponding MODSEQ (possible corruption)\n", uid);
-			break;
-		}
-		if (!uid) {
-			bbs_error("MODSEQ corruption detected: UID is 0 for MODSEQ %lu?\n", modseq);
-		}
-		if (!modseq) {
-			bbs_error("MODSEQ corruption detected: UID %u's MODSEQ is 0?\n", uid);
+	if (read_modseq_header(fd, &hdr, &records) != MODSEQ_LOG_VERSION || !hdr.highestmodseq) {
+		bbs_error("MODSEQ corruption detected: invalid header\n");
+	} else {
+		size_t i;
+		unsigned long lastmodseq = hdr.horizon;
+		for (i = 0; i < records; i++) {
+			struct expunge_record rec;
+			if (pread(fd, &rec, sizeof(rec), EXPUNGE_RECORD_OFFSET(i)) != (ssize_t) sizeof(rec)) {
+				bbs_error("MODSEQ corruption detected: failed to read record %lu\n", i);
+				break;
+			}
+			if (!rec.minuid || rec.minuid > rec.maxuid) {
+				bbs_error("MODSEQ corruption detected: invalid UID range %u:%u in record %lu\n", rec.minuid, rec.maxuid, i);
+			}
+			if (rec.modseq < lastmodseq || rec.modseq > hdr.highestmodseq) {
+				bbs_error("MODSEQ corruption detected: MODSEQ %lu out of order in record %lu\n", rec.modseq, i);
+			}
+			lastmodseq = rec.modseq;
 		}
 	}
-	fclose(fp);
+	close(fd);
 #endif
 
 	if (length) {
@@ -1537,6 +1994,7 @@ int maildir_move_new_to_cur_file(struct mailbox *mbox, struct bbs_node *node, co
 		safe_strncpy(newpath, newname, len);
 	}
 	bbs_debug(7, "Renamed %s -> %s%s\n", oldname, newname, markseen ? " (and auto-marked as Seen)" : "");
+	notify_trash(dir, newuidvalidity, uid);
 	return bytes;
 }
 
@@ -1599,12 +2057,16 @@ int maildir_move_msg(struct mailbox *mbox, struct bbs_node *node, const char *cu
 int maildir_move_msg_filename(struct mailbox *mbox, struct bbs_node *node, const char *curfile, const char *curfilename, const char *destmaildir, unsigned int *uidvalidity, unsigned int *uidnext, char *newfile, size_t len)
 {
 	char newpath[272];
+	unsigned int newuidvalidity;
 	int uid;
 
-	uid = gen_newname(mbox, node, curfilename, destmaildir, uidvalidity, uidnext, newpath, sizeof(newpath));
+	uid = gen_newname(mbox, node, curfilename, destmaildir, &newuidvalidity, uidnext, newpath, sizeof(newpath));
 	if (uid <= 0) {
 		return -1;
 	}
+	if (uidvalidity) {
+		*uidvalidity = newuidvalidity;
+	}
 	if (rename(curfile, newpath)) {
 		bbs_error("rename %s -> %s failed: %s\n", curfile, newpath, strerror(errno));
 		return -1;
@@ -1613,6 +2075,7 @@ int maildir_move_msg_filename(struct mailbox *mbox, struct bbs_node *node, const
 	if (newfile) {
 		safe_strncpy(newfile, newpath, len);
 	}
+	notify_trash(destmaildir, newuidvalidity, (unsigned int) uid);
 	return uid;
 }
 
@@ -1621,18 +2084,49 @@ int maildir_copy_msg(struct mailbox *mbox, struct bbs_node *node, const char *cu
 	return maildir_copy_msg_filename(mbox, node, curfile, curfilename, destmaildir, uidvalidity, uidnext, NULL, 0);
 }
 
+/*! \brief Whether a path is inside a mailbox's maildir */
+static int path_in_mailbox(struct mailbox *mbox, const char *path)
+{
+	const char *maildir = mailbox_maildir(mbox);
+	size_t len = strlen(maildir);
+
+	return !strncmp(path, maildir, len) && (path[len] == '/' || !path[len]);
+}
+
 int maildir_copy_msg_filename(struct mailbox *mbox, struct bbs_node *node, const char *curfile, const char *curfilename, const char *destmaildir, unsigned int *uidvalidity, unsigned int *uidnext, char *newfile, size_t len)
 {
 	char newpath[272];
 	unsigned int uid;
 	int origfd, newfd;
 	int size, copied;
+	struct stat st;
 
 	uid = (unsigned int) gen_newname(mbox, node, curfilename, destmaildir, uidvalidity, uidnext, newpath, sizeof(newpath));
 	if (!uid) {
 		return -1;
 	}
 
+	/* Messages are never modified in place (flag changes are renames),
+	 * so a copy can just be another link to the same file, which is much cheaper than copying the data. */
+	if (!link(curfile, newpath)) {
+		bbs_debug(6, "Linked %s -> %s\n", curfile, newpath);
+		if (newfile) {
+			safe_strncpy(newfile, newpath, len);
+		}
+		/* If the original is in the same mailbox, no additional space is used */
+		if (!path_in_mailbox(mbox, curfile) || !path_in_mailbox(mbox, destmaildir)) {
+			if (stat(newpath, &st)) {
+				mailbox_invalidate_quota_cache(mbox);
+			} else {
+				mailbox_quota_adjust_usage(mbox, (int) st.st_size);
+			}
+		}
+		notify_trash(destmaildir, *uidvalidity, uid);
+		return (int) uid;
+	} else if (errno != EXDEV && errno != EMLINK && errno != EPERM) {
+		bbs_debug(3, "link(%s, %s) failed: %s\n", curfile, newpath, strerror(errno));
+	}
+
 	newfd = open(newpath, O_WRONLY | O_CREAT, 0600);
 	if (newfd < 0) {
 		bbs_error("open(%s) failed: %s\n", newpath, strerror(errno));
@@ -1649,7 +2143,16 @@ int maildir_copy_msg_filename(struct mailbox *mbox, struct bbs_node *node, const
 	size = (int) lseek(origfd, 0, SEEK_END); /* Don't blindly trust the size in the filename's S= */
 	lseek(origfd, 0, SEEK_SET); /* rewind to beginning */
 
-	copied = bbs_copy_file(origfd, newfd, 0, size);
+#ifdef FICLONE
+	/* Can't link (e.g. a different filesystem), but the filesystem may still be able to share the data extents */
+	if (!ioctl(newfd, FICLONE, origfd)) {
+		copied = size;
+		bbs_debug(6, "Cloned %s -> %s\n", curfile, newpath);
+	} else
+#endif
+	{
+		copied = bbs_copy_file(origfd, newfd, 0, size);
+	}
 	close(origfd);
 	close(newfd);
 	if (copied != size) {
@@ -1664,6 +2167,7 @@ int maildir_copy_msg_filename(struct mailbox *mbox, struct bbs_node *node, const
 	}
 	/* Rather than invalidating quota usage for no reason, just update it so it stays in sync */
 	mailbox_quota_adjust_usage(mbox, copied);
+	notify_trash(destmaildir, *uidvalidity, uid);
 	return (int) uid;
 }
 
@@ -2068,6 +2572,7 @@ static int load_config(void)
 	}
 	bbs_config_val_set_str(cfg, "general", "catchall", catchall, sizeof(catchall));
 	bbs_config_val_set_uint(cfg, "general", "quota", &maxquota);
+	bbs_config_val_set_uint(cfg, "general", "maxexpunged", &maxexpunged);
 
 	if (eaccess(root_maildir, X_OK)) { /* This is a directory, so we better have execute permissions on it */
 		bbs_error("Directory %s does not exist\n", root_maildir);
@@ -2107,6 +2612,7 @@ static int load_module(void)
 	if (load_config()) {
 		return -1;
 	}
+	maildir_hostname_init();
 	bbs_username_reserved_callback_register(mailbox_exists_by_username);
 	bbs_cli_register_multiple(cli_commands_mailboxes);
 	return 0;
@@ -2118,6 +2624,7 @@ static int unload_module(void)
 	bbs_username_reserved_callback_unregister(mailbox_exists_by_username);
 	mailbox_cleanup();
 	bbs_singular_callback_destroy(&sieve_validate);
+	bbs_singular_callback_destroy(&trash_watcher);
 	return 0;
 }
 
@@ -14,6 +14,12 @@
  *
  * \brief E-Mail Trash Auto-Purge
  *
+ * \note Messages are indexed by expiry time as they are placed into the Trash,
+ *       so only the messages that are actually due need to be looked at.
+ *       Entries are removed as messages are expunged from the Trash, so the index stays authoritative.
+ *       Trash folders are only scanned to rebuild the index: all of them if the index is missing or corrupt,
+ *       or a single one if its UIDVALIDITY no longer matches the index.
+ *
  * \author Naveen Albert <bbs@phreaknet.org>
  */
 
@@ -25,12 +31,37 @@
 #include "include/config.h"
 #include "include/range.h"
 #include "include/utils.h"
+#include "include/linkedlists.h"
+#include "include/alertpipe.h"
 
 #include "include/mod_mail.h"
 
+/*! \brief Name of the expiry index, in the top-level maildir */
+#define TRASH_INDEX_FILE ".trashindex"
+
+/*! \brief Maximum number of due messages to expire in one pass */
+#define TRASH_BATCH_MAX 1000
+
 static unsigned int trashdays = 7;
 
 static pthread_t trash_thread = 0;
+static int trash_alertpipe[2] = { -1, -1 };
+static int unloading = 0;
+static int needscan = 0;
+
+struct trash_entry {
+	time_t expires;			/*!< When the message should be expunged */
+	unsigned int uidvalidity;	/*!< UIDVALIDITY of the Trash folder when the message was indexed */
+	unsigned int uid;		/*!< UID of message in the Trash folder */
+	RWLIST_ENTRY(trash_entry) entry;
+	char mboxdir[];			/*!< Name of the mailbox's directory in the top-level maildir */
+};
+
+static RWLIST_HEAD_STATIC(trash_entries, trash_entry);
+
+static FILE *indexfp = NULL;		/*!< Index file, open for appending */
+static unsigned int index_records = 0;	/*!< Number of records in the index file, including ones already expired */
+static unsigned int num_entries = 0;	/*!< Number of entries in trash_entries */
 
 struct trash_traversal {
 	unsigned int *a;	/* For UIDs */
@@ -38,8 +69,242 @@ struct trash_traversal {
 	int lengths;
 	int allocsizes;
 	struct mailbox *mbox;
+	const char *mboxdir;
+	unsigned int uidvalidity;	/* Current UIDVALIDITY of the Trash folder */
+	unsigned int *due;	/* Sorted UIDs that are due, or NULL if checking every message */
+	size_t numdue;
+	unsigned int *indexed;	/* For full scans, sorted UIDs that are already indexed */
+	int numindexed;
 };
 
+static void trash_index_path(char *buf, size_t len, const char *suffix)
+{
+	snprintf(buf, len, "%s/%s%s", mailbox_maildir(NULL), TRASH_INDEX_FILE, suffix);
+}
+
+/*! \note Must be called with trash_entries locked */
+static int trash_add(const char *mboxdir, unsigned int uidvalidity, unsigned int uid, time_t expires, int persist)
+{
+	struct trash_entry *e, *last;
+	size_t len = strlen(mboxdir);
+
+	e = calloc(1, sizeof(*e) + len + 1);
+	if (ALLOC_FAILURE(e)) {
+		return -1;
+	}
+	e->expires = expires;
+	e->uidvalidity = uidvalidity;
+	e->uid = uid;
+	strcpy(e->mboxdir, mboxdir); /* Safe */
+
+	/* Entries almost always arrive in expiry order, so check the end first */
+	last = RWLIST_LAST(&trash_entries);
+	if (!last || last->expires <= expires) {
+		RWLIST_INSERT_TAIL(&trash_entries, e, entry);
+	} else {
+		RWLIST_INSERT_SORTED(&trash_entries, e, entry, expires);
+	}
+	num_entries++;
+
+	if (persist && indexfp) {
+		fprintf(indexfp, "%" TIME_T_FMT " %s %u %u\n", expires, mboxdir, uidvalidity, uid);
+		fflush(indexfp);
+		index_records++;
+	}
+	return 0;
+}
+
+/*!
+ * \brief Get the name of a mailbox's directory from the path of its Trash folder
+ * \param maildir Full path to a folder, which is ROOT/mailbox/.Trash for a Trash folder
+ * \param[out] buf
+ * \param len Size of buf
+ * \retval 0 if maildir is a top-level Trash folder, -1 otherwise
+ */
+static int trash_mboxdir(const char *maildir, char *buf, size_t len)
+{
+	const char *root = mailbox_maildir(NULL);
+	size_t rootlen = strlen(root);
+	const char *start, *end;
+
+	if (strncmp(maildir, root, rootlen) || maildir[rootlen] != '/') {
+		bbs_warning("Folder %s is outside of the maildir\n", maildir);
+		return -1;
+	}
+	start = maildir + rootlen + 1;
+	end = strchr(start, '/');
+	if (!end || (size_t) (end - start) >= len || strcmp(end, "/.Trash")) {
+		return -1; /* Not a top-level Trash folder */
+	}
+	memcpy(buf, start, (size_t) (end - start));
+	buf[end - start] = '\0';
+	return 0;
+}
+
+/*! \brief Callback for messages placed into a Trash folder */
+static void on_trash(const char *maildir, unsigned int uidvalidity, unsigned int uid)
+{
+	char mboxdir[256];
+	int wake;
+
+	if (trash_mboxdir(maildir, mboxdir, sizeof(mboxdir))) {
+		return;
+	}
+
+	RWLIST_WRLOCK(&trash_entries);
+	wake = RWLIST_EMPTY(&trash_entries);
+	trash_add(mboxdir, uidvalidity, uid, time(NULL) + 86400 * (time_t) trashdays, 1);
+	RWLIST_UNLOCK(&trash_entries);
+
+	bbs_debug(5, "Message %s/%u will be expunged in %u day%s\n", mboxdir, uid, trashdays, ESS(trashdays));
+	if (wake) {
+		/* The thread wasn't waiting for anything, let it know when it needs to wake up */
+		bbs_alertpipe_write(trash_alertpipe);
+	}
+}
+
+/*! \brief Rewrite the index so it only contains entries that haven't expired yet */
+static void trash_index_compact(void)
+{
+	char path[256], tmppath[260];
+	struct trash_entry *e;
+	FILE *fp;
+
+	trash_index_path(path, sizeof(path), "");
+	trash_index_path(tmppath, sizeof(tmppath), ".tmp");
+
+	fp = fopen(tmppath, "w");
+	if (!fp) {
+		bbs_error("Failed to open %s: %s\n", tmppath, strerror(errno));
+		return;
+	}
+	RWLIST_TRAVERSE(&trash_entries, e, entry) {
+		fprintf(fp, "%" TIME_T_FMT " %s %u %u\n", e->expires, e->mboxdir, e->uidvalidity, e->uid);
+	}
+	if (fclose(fp) || rename(tmppath, path)) {
+		bbs_error("Failed to rewrite %s: %s\n", path, strerror(errno));
+		unlink(tmppath);
+		return;
+	}
+	if (indexfp) {
+		fclose(indexfp);
+	}
+	indexfp = fopen(path, "a");
+	if (!indexfp) {
+		bbs_error("Failed to open %s: %s\n", path, strerror(errno));
+	}
+	bbs_debug(4, "Compacted Trash expiry index from %u to %u records\n", index_records, num_entries);
+	index_records = num_entries;
+}
+
+/*! \note Must be called with trash_entries locked */
+static void trash_index_maybe_compact(void)
+{
+	if (index_records > 2 * num_entries + 64) {
+		trash_index_compact();
+	}
+}
+
+static int uint_cmp(const void *a, const void *b)
+{
+	unsigned int x = *(const unsigned int*) a, y = *(const unsigned int*) b;
+	return x < y ? -1 : x > y ? 1 : 0;
+}
+
+/*! \brief Callback for mailbox events, to remove messages expunged from a Trash folder from the index */
+static void on_mailbox_event(struct mailbox_event *event)
+{
+	char mboxdir[256];
+	struct trash_entry *e;
+	unsigned int *uids;
+	int removed = 0;
+
+	/* Our own expirations (EVENT_MESSAGE_EXPIRE) were already removed from the index */
+	if (event->type != EVENT_MESSAGE_EXPUNGE || !event->uids || !event->maildir) {
+		return;
+	}
+	if (trash_mboxdir(event->maildir, mboxdir, sizeof(mboxdir))) {
+		return;
+	}
+
+	uids = malloc((size_t) event->numuids * sizeof(unsigned int));
+	if (ALLOC_FAILURE(uids)) {
+		return; /* The entries will just be discarded once they're due */
+	}
+	memcpy(uids, event->uids, (size_t) event->numuids * sizeof(unsigned int));
+	qsort(uids, (size_t) event->numuids, sizeof(unsigned int), uint_cmp);
+
+	RWLIST_WRLOCK(&trash_entries);
+	RWLIST_TRAVERSE_SAFE_BEGIN(&trash_entries, e, entry) {
+		if (!strcmp(e->mboxdir, mboxdir) && bsearch(&e->uid, uids, (size_t) event->numuids, sizeof(unsigned int), uint_cmp)) {
+			RWLIST_REMOVE_CURRENT(entry);
+			free(e);
+			num_entries--;
+			removed++;
+		}
+	}
+	RWLIST_TRAVERSE_SAFE_END;
+	if (removed) {
+		trash_index_maybe_compact();
+	}
+	RWLIST_UNLOCK(&trash_entries);
+	free(uids);
+
+	if (removed) {
+		bbs_debug(5, "Removed %d expunged message%s in %s from Trash index\n", removed, ESS(removed), mboxdir);
+	}
+}
+
+/*!
+ * \brief Load the expiry index
+ * \retval 1 if the index doesn't exist yet or is corrupt and needs to be rebuilt, 0 on success, -1 on failure
+ */
+static int trash_index_load(void)
+{
+	char path[256];
+	char buf[300];
+	int exists, corrupt = 0;
+
+	trash_index_path(path, sizeof(path), "");
+	exists = bbs_file_exists(path);
+	if (exists) {
+		FILE *fp = fopen(path, "r");
+		if (!fp) {
+			bbs_error("Failed to open %s: %s\n", path, strerror(errno));
+			return -1;
+		}
+		RWLIST_WRLOCK(&trash_entries);
+		while (fgets(buf, sizeof(buf), fp)) {
+			char mboxdir[256];
+			long expires;
+			unsigned int uidvalidity, uid;
+			if (sscanf(buf, "%ld %255s %u %u", &expires, mboxdir, &uidvalidity, &uid) != 4) {
+				bbs_warning("Ignoring malformed Trash index record: %s", buf);
+				corrupt = 1;
+				continue;
+			}
+			trash_add(mboxdir, uidvalidity, uid, (time_t) expires, 0);
+			index_records++;
+		}
+		fclose(fp);
+		bbs_debug(3, "Loaded %u Trash expiry record%s\n", num_entries, ESS(num_entries));
+		if (corrupt) {
+			/* Drop the malformed records now, since whatever they referred to will be indexed again by the rebuild */
+			trash_index_compact();
+			RWLIST_UNLOCK(&trash_entries);
+			return indexfp ? 1 : -1;
+		}
+		RWLIST_UNLOCK(&trash_entries);
+	}
+
+	indexfp = fopen(path, "a");
+	if (!indexfp) {
+		bbs_error("Failed to open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	return !exists;
+}
+
 static int on_mailbox_trash(const char *dir_name, const char *filename, int seqno, void *obj)
 {
 	struct stat st;
@@ -48,39 +313,136 @@ static int on_mailbox_trash(const char *dir_name, const char *filename, int seqn
 	int trashsec = 86400 * (int) trashdays;
 	time_t elapsed;
 	time_t now = time(NULL);
-	unsigned int msguid;
+	unsigned int msguid = 0;
 	struct trash_traversal *traversal = obj;
 	struct mailbox *mbox = traversal->mbox;
 
 	/* For autopurging, we don't care if the Deleted flag is set or not.
 	 * (If it were set, an IMAP user already flagged it for permanent deletion and it would just be awaiting expunge) */
 
+	maildir_parse_uid_from_filename(filename, &msguid);
+	if (traversal->due && !bsearch(&msguid, traversal->due, traversal->numdue, sizeof(unsigned int), uint_cmp)) {
+		return 0; /* Not due yet */
+	}
+
 	snprintf(fullname, sizeof(fullname), "%s/%s", dir_name, filename);
 	if (stat(fullname, &st)) {
 		bbs_error("stat(%s) failed: %s\n", fullname, strerror(errno));
 		return 0;
 	}
-	tstamp = st.st_ctime;
-	elapsed = now - tstamp;
-	bbs_debug(7, "Encountered in trash: %s (%" TIME_T_FMT " s ago)\n", fullname, elapsed);
-	if (elapsed > trashsec) {
-		if (unlink(fullname)) {
-			bbs_error("unlink(%s) failed: %s\n", fullname, strerror(errno));
+	if (!traversal->due) {
+		/* Full scan: go by when the message was placed into the Trash, and index anything that isn't due yet */
+		tstamp = st.st_ctime;
+		elapsed = now - tstamp;
+		bbs_debug(7, "Encountered in trash: %s (%" TIME_T_FMT " s ago)\n", fullname, elapsed);
+		if (elapsed <= trashsec) {
+			if (!traversal->numindexed || !bsearch(&msguid, traversal->indexed, (size_t) traversal->numindexed, sizeof(unsigned int), uint_cmp)) {
+				RWLIST_WRLOCK(&trash_entries);
+				trash_add(traversal->mboxdir, traversal->uidvalidity, msguid, tstamp + trashsec, 1);
+				RWLIST_UNLOCK(&trash_entries);
+			}
+			return 0;
+		}
+	}
+	if (unlink(fullname)) {
+		bbs_error("unlink(%s) failed: %s\n", fullname, strerror(errno));
+	} else {
+		bbs_debug(4, "Permanently deleted %s\n", fullname);
+		if (st.st_nlink > 1) {
+			/* The message is still linked elsewhere (e.g. it was copied to the Trash), so no space may have been freed */
+			mailbox_invalidate_quota_cache(mbox);
 		} else {
-			bbs_debug(4, "Permanently deleted %s\n", fullname);
 			mailbox_quota_adjust_usage(mbox, (int) -st.st_size); /* Subtract file size from quota usage */
 		}
-		maildir_parse_uid_from_filename(filename, &msguid);
-		uintlist_append2(&traversal->a, &traversal->sa, &traversal->lengths, &traversal->allocsizes, msguid, (unsigned int) seqno);
 	}
+	uintlist_append2(&traversal->a, &traversal->sa, &traversal->lengths, &traversal->allocsizes, msguid, (unsigned int) seqno);
 	return 0;
 }
 
+/*!
+ * \brief Expunge messages from a mailbox's Trash folder
+ * \param mboxdir Name of mailbox's directory
+ * \param due Index entries for this mailbox that are due, sorted by UID, or NULL to check every message in the folder
+ * \param numdue Number of entries in due
+ */
+static void expire_trash(const char *mboxdir, struct trash_entry **due, size_t numdue)
+{
+	char trashmaildir[512], trashdir[PATH_MAX];
+	struct mailbox *mbox;
+	unsigned int mboxnum, uidnext;
+	unsigned int uids[TRASH_BATCH_MAX];
+	struct trash_traversal traversal;
+	size_t i;
+	int stale = 0;
+
+	snprintf(trashmaildir, sizeof(trashmaildir), "%s/%s/.Trash", mailbox_maildir(NULL), mboxdir);
+	snprintf(trashdir, sizeof(trashdir), "%s/cur", trashmaildir);
+	if (eaccess(trashdir, R_OK)) {
+		bbs_debug(2, "Directory %s doesn't exist?\n", trashdir); /* It should if it's a maildir we created, unless user has never accessed it yet. */
+		return;
+	}
+	mboxnum = (unsigned int) atoi(mboxdir);
+	mbox = mboxnum ? mailbox_get_by_userid(mboxnum) : mailbox_get_by_name(mboxdir, NULL);
+	if (!mbox) {
+		bbs_warning("No mailbox for %s\n", mboxdir);
+		return;
+	}
+	memset(&traversal, 0, sizeof(traversal));
+	traversal.mbox = mbox;
+	traversal.mboxdir = mboxdir;
+	mailbox_get_next_uid(mbox, NULL, trashmaildir, 0, &traversal.uidvalidity, &uidnext);
+
+	if (due) {
+		/* If the Trash folder's UIDVALIDITY changed since a message was indexed, its UID may now refer to a different message */
+		for (i = 0; i < numdue; i++) {
+			if (due[i]->uidvalidity != traversal.uidvalidity) {
+				bbs_debug(3, "Discarding stale Trash index entry %s/%u (UIDVALIDITY %u, now %u)\n", mboxdir, due[i]->uid, due[i]->uidvalidity, traversal.uidvalidity);
+				stale = 1;
+				continue;
+			}
+			uids[traversal.numdue++] = due[i]->uid;
+		}
+		traversal.due = uids;
+	} else {
+		struct trash_entry *e;
+		int allocsizes = 0;
+		/* Full scan: anything not already indexed will be indexed now */
+		RWLIST_RDLOCK(&trash_entries);
+		RWLIST_TRAVERSE(&trash_entries, e, entry) {
+			if (!strcmp(e->mboxdir, mboxdir) && e->uidvalidity == traversal.uidvalidity) {
+				uintlist_append(&traversal.indexed, &traversal.numindexed, &allocsizes, e->uid);
+			}
+		}
+		RWLIST_UNLOCK(&trash_entries);
+		if (traversal.numindexed) {
+			qsort(traversal.indexed, (size_t) traversal.numindexed, sizeof(unsigned int), uint_cmp);
+		}
+	}
+
+	if (!due || traversal.numdue) {
+		bbs_debug(3, "Analyzing trash folder %s\n", trashdir);
+		maildir_ordered_traverse(trashdir, on_mailbox_trash, &traversal); /* Traverse files in the Trash folder */
+		free_if(traversal.indexed);
+		if (traversal.lengths) {
+			/* One notification for the whole batch */
+			maildir_indicate_expunged(EVENT_MESSAGE_EXPIRE, NULL, mbox, trashdir, traversal.a, traversal.sa, traversal.lengths, 0);
+			free_if(traversal.a);
+			free_if(traversal.sa);
+		}
+	}
+
+	if (stale) {
+		/* The UIDs in this mailbox's part of the index can't be trusted anymore, so index its Trash folder again */
+		bbs_verb(4, "Rebuilding Trash expiry index for %s\n", mboxdir);
+		expire_trash(mboxdir, NULL, 0);
+	}
+}
+
+/*! \brief Check every mailbox's Trash folder, expiring anything that is overdue and indexing anything that isn't indexed yet. Only needed to rebuild the index. */
 static void scan_mailboxes(void)
 {
 	DIR *dir;
 	struct dirent *entry;
-	char trashdir[515];
 
 	/* Traverse each mailbox top-level maildir. The order of maildir traversal does not matter. */
 	if (!(dir = opendir(mailbox_maildir(NULL)))) {
@@ -88,45 +450,107 @@ static void scan_mailboxes(void)
 		return;
 	}
 	while ((entry = readdir(dir)) != NULL) {
-		struct mailbox *mbox;
-		unsigned int mboxnum;
-		struct trash_traversal traversal;
 		if (entry->d_type != DT_DIR || !strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) {
 			continue;
 		}
 		if (!maildir_is_mailbox(entry->d_name)) {
 			continue;
 		}
-		snprintf(trashdir, sizeof(trashdir), "%s/%s/.Trash/cur", mailbox_maildir(NULL), entry->d_name);
-		if (eaccess(trashdir, R_OK)) {
-			bbs_debug(2, "Directory %s doesn't exist?\n", trashdir); /* It should if it's a maildir we created, unless user has never accessed it yet. */
-			continue;
+		expire_trash(entry->d_name, NULL, 0);
+	}
+
+	closedir(dir);
+}
+
+static int trash_entry_cmp(const void *a, const void *b)
+{
+	const struct trash_entry *x = *(struct trash_entry * const *) a;
+	const struct trash_entry *y = *(struct trash_entry * const *) b;
+	int res = strcmp(x->mboxdir, y->mboxdir);
+
+	if (res) {
+		return res;
+	}
+	return x->uid < y->uid ? -1 : x->uid > y->uid ? 1 : 0;
+}
+
+/*!
+ * \brief Expunge everything that is due
+ * \returns Number of milliseconds until the next message is due, -1 if nothing is pending
+ */
+static int expire_due(void)
+{
+	struct trash_entry *batch[TRASH_BATCH_MAX];
+	struct trash_entry *e;
+	size_t i, start, num = 0;
+	time_t now = time(NULL);
+	time_t next = 0;
+
+	RWLIST_WRLOCK(&trash_entries);
+	while (num < TRASH_BATCH_MAX && (e = RWLIST_FIRST(&trash_entries)) && e->expires <= now) {
+		RWLIST_REMOVE_HEAD(&trash_entries, entry);
+		batch[num++] = e;
+		num_entries--;
+	}
+	if (num) {
+		trash_index_maybe_compact();
+	}
+	RWLIST_UNLOCK(&trash_entries);
+
+	if (num) {
+		bbs_debug(3, "%zu message%s in Trash due for expiry\n", num, ESS(num));
+		/* Group by mailbox, so each Trash folder is only traversed once */
+		qsort(batch, num, sizeof(struct trash_entry*), trash_entry_cmp);
+		for (start = 0; start < num; start = i) {
+			i = start + 1;
+			while (i < num && !strcmp(batch[i]->mboxdir, batch[start]->mboxdir)) {
+				i++;
+			}
+			expire_trash(batch[start]->mboxdir, batch + start, i - start);
 		}
-		bbs_debug(3, "Analyzing trash folder %s\n", trashdir);
-		mboxnum = (unsigned int) atoi(entry->d_name);
-		mbox = mboxnum ? mailbox_get_by_userid(mboxnum) : mailbox_get_by_name(entry->d_name, NULL);
-		memset(&traversal, 0, sizeof(traversal));
-		traversal.mbox = mbox;
-		maildir_ordered_traverse(trashdir, on_mailbox_trash, &traversal); /* Traverse files in the Trash folder */
-		if (traversal.lengths) {
-			maildir_indicate_expunged(EVENT_MESSAGE_EXPIRE, NULL, mbox, entry->d_name, traversal.a, traversal.sa, traversal.lengths, 0);
-			free_if(traversal.a);
-			free_if(traversal.sa);
+		for (i = 0; i < num; i++) {
+			free(batch[i]);
 		}
 	}
 
-	closedir(dir);
+	RWLIST_RDLOCK(&trash_entries);
+	e = RWLIST_FIRST(&trash_entries);
+	if (e) {
+		next = e->expires;
+	}
+	RWLIST_UNLOCK(&trash_entries);
+
+	if (!next) {
+		return -1;
+	}
+	now = time(NULL);
+	if (next <= now) {
+		return 0;
+	}
+	/* Wake up at least once a day, so the poll timeout can't overflow */
+	return (int) MIN(next - now, 86400) * 1000;
 }
 
 static void *trash_monitor(void *unused)
 {
+	int ms;
+
 	UNUSED(unused);
-	for (;;) {
-		bbs_pthread_disable_cancel();
+
+	if (needscan) {
+		/* No usable index, so find whatever is already in the Trash once, and index it */
+		bbs_verb(4, "Building Trash expiry index\n");
 		scan_mailboxes();
-		bbs_pthread_enable_cancel();
-		/* Not necessary to run more frequently than twice per day. */
-		sleep(60 * 60 * 12); /* use sleep instead of usleep since the argument to usleep would overflow an int */
+	}
+
+	for (;;) {
+		ms = expire_due();
+		if (bbs_alertpipe_poll(trash_alertpipe, ms) > 0) {
+			bbs_alertpipe_read(trash_alertpipe);
+		}
+		if (unloading) {
+			break;
+		}
 	}
 	return NULL;
 }
@@ -144,13 +568,56 @@ static int load_config(void)
 	return 0;
 }
 
+static void trash_cleanup(void)
+{
+	if (indexfp) {
+		fclose(indexfp);
+		indexfp = NULL;
+	}
+	RWLIST_WRLOCK_REMOVE_ALL(&trash_entries, entry, free);
+	bbs_alertpipe_close(trash_alertpipe);
+}
+
 static int load_module(void)
 {
+	int res;
+
 	if (load_config()) {
 		return -1;
 	}
 
-	if (trashdays && bbs_pthread_create(&trash_thread, NULL, trash_monitor, NULL)) {
+	if (!trashdays) {
+		return 0;
+	}
+
+	res = trash_index_load();
+	if (res < 0) {
+		trash_cleanup();
+		return -1;
+	}
+	needscan = res;
+
+	if (bbs_alertpipe_create(trash_alertpipe)) {
+		trash_cleanup();
+		return -1;
+	}
+	if (bbs_pthread_create(&trash_thread, NULL, trash_monitor, NULL)) {
+		trash_cleanup();
+		return -1;
+	}
+	if (mailbox_register_trash_watcher(on_trash)) {
+		unloading = 1;
+		bbs_alertpipe_write(trash_alertpipe);
+		bbs_pthread_join(trash_thread, NULL);
+		trash_cleanup();
+		return -1;
+	}
+	if (mailbox_register_watcher(on_mailbox_event)) {
+		mailbox_unregister_trash_watcher(on_trash);
+		unloading = 1;
+		bbs_alertpipe_write(trash_alertpipe);
+		bbs_pthread_join(trash_thread, NULL);
+		trash_cleanup();
 		return -1;
 	}
 
@@ -160,8 +627,12 @@ static int load_module(void)
 static int unload_module(void)
 {
 	if (trashdays) {
-		bbs_pthread_cancel_kill(trash_thread);
+		mailbox_unregister_watcher(on_mailbox_event);
+		mailbox_unregister_trash_watcher(on_trash);
+		unloading = 1;
+		bbs_alertpipe_write(trash_alertpipe);
 		bbs_pthread_join(trash_thread, NULL);
+		trash_cleanup();
 	}
 	return 0;
 }
@@ -28,6 +28,7 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <ctype.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -343,20 +344,13 @@ static void write_part_bodystructure(GMimeObject *part, GString *gs, int level)
 	g_string_append_c(gs, ')');
 }
 
-char *mime_make_bodystructure(const char *itemname, const char *file)
+static GMimeMessage *parse_message(const char *file)
 {
 	GMimeFormat format = GMIME_FORMAT_MESSAGE;
 	GMimeMessage *message;
 	GMimeParser *parser;
 	GMimeStream *stream;
-	GString *str;
-	gchar *result;
 	int fd;
-#ifdef CHECK_VALIDITY
-	int p = 0;
-	int in_quoted = 0;
-	char *s;
-#endif
 
 	fd = open(file, O_RDONLY, 0);
 	if (fd < 0) {
@@ -377,6 +371,23 @@ char *mime_make_bodystructure(const char *itemname, const char *file)
 
 	if (!message) {
 		bbs_error("Failed to parse message as MIME\n");
+	}
+	return message;
+}
+
+char *mime_make_bodystructure(const char *itemname, const char *file)
+{
+	GMimeMessage *message;
+	GString *str;
+	gchar *result;
+#ifdef CHECK_VALIDITY
+	int p = 0;
+	int in_quoted = 0;
+	char *s;
+#endif
+
+	message = parse_message(file);
+	if (!message) {
 		return NULL;
 	}
 
@@ -424,6 +435,193 @@ char *mime_make_bodystructure(const char *itemname, const char *file)
 	return result; /* gchar is just a typedef for char, so this returns a char */
 }
 
+/*! \brief Find the first inline text part of the given subtype, not descending into attached messages */
+static GMimeTextPart *find_text_part(GMimeObject *part, const char *subtype)
+{
+	if (GMIME_IS_MULTIPART(part)) {
+		GMimeMultipart *multipart = (GMimeMultipart *) part;
+		int i, count = g_mime_multipart_get_count(multipart);
+		for (i = 0; i < count; i++) {
+			GMimeTextPart *textpart = find_text_part(g_mime_multipart_get_part(multipart, i), subtype);
+			if (textpart) {
+				return textpart;
+			}
+		}
+	} else if (GMIME_IS_TEXT_PART(part)) {
+		GMimeContentDisposition *disposition = g_mime_object_get_content_disposition(part);
+		if (disposition && g_mime_content_disposition_is_attachment(disposition)) {
+			return NULL;
+		}
+		if (g_mime_content_type_is_type(g_mime_object_get_content_type(part), "text", subtype)) {
+			return (GMimeTextPart *) part;
+		}
+	}
+	return NULL;
+}
+
+/*! \brief Decode the handful of HTML entities likely to show up in a preview */
+static const char *html_entity(const char *s, size_t *len)
+{
+	static const struct {
+		const char *name;
+		const char *value;
+	} entities[] = {
+		{ "&amp;", "&" },
+		{ "&lt;", "<" },
+		{ "&gt;", ">" },
+		{ "&quot;", "\"" },
+		{ "&apos;", "'" },
+		{ "&#39;", "'" },
+		{ "&nbsp;", " " },
+	};
+	size_t i;
+
+	for (i = 0; i < ARRAY_LEN(entities); i++) {
+		size_t elen = strlen(entities[i].name);
+		if (!strncasecmp(s, entities[i].name, elen)) {
+			*len = elen;
+			return entities[i].value;
+		}
+	}
+	return NULL;
+}
+
+/*! \brief Append text to a preview, collapsing whitespace, until the limits are reached */
+static int preview_append(GString *gs, const char *s, size_t len, size_t *chars, size_t maxchars, size_t maxbytes)
+{
+	const char *end = s + len;
+
+	while (s < end) {
+		size_t clen = 1;
+		unsigned char c = (unsigned char) *s;
+		if (isspace(c) || iscntrl(c)) {
+			if (gs->len && gs->str[gs->len - 1] != ' ') {
+				if (*chars >= maxchars || gs->len >= maxbytes) {
+					return 1;
+				}
+				g_string_append_c(gs, ' ');
+				(*chars)++;
+			}
+			s++;
+			continue;
+		}
+		/* Don't split a UTF-8 sequence */
+		if (c >= 0xF0) {
+			clen = 4;
+		} else if (c >= 0xE0) {
+			clen = 3;
+		} else if (c >= 0xC0) {
+			clen = 2;
+		}
+		clen = MIN(clen, (size_t) (end - s));
+		if (*chars >= maxchars || gs->len + clen > maxbytes) {
+			return 1;
+		}
+		g_string_append_len(gs, s, (gssize) clen);
+		(*chars)++;
+		s += clen;
+	}
+	return 0;
+}
+
+/*! \brief Append the visible text of an HTML document to a preview */
+static void preview_append_html(GString *gs, const char *s, size_t maxchars, size_t maxbytes)
+{
+	size_t chars = 0;
+
+	while (*s) {
+		const char *text = s;
+		size_t elen;
+		const char *entity;
+		if (*s == '<') {
+			/* Skip the contents of elements that aren't displayed, not just the tags */
+			const char *hidden[] = { "head", "style", "script", "title" };
+			size_t i;
+			for (i = 0; i < ARRAY_LEN(hidden); i++) {
+				size_t hlen = strlen(hidden[i]);
+				if (!strncasecmp(s + 1, hidden[i], hlen) && (s[hlen + 1] == '>' || isspace(s[hlen + 1]))) {
+					char closetag[16];
+					const char *close;
+					snprintf(closetag, sizeof(closetag), "</%s", hidden[i]);
+					close = strcasestr(s, closetag);
+					if (close) {
+						s = close;
+					}
+					break;
+				}
+			}
+			s = strchr(s, '>');
+			if (!s) {
+				return;
+			}
+			s++;
+			/* Tags generally separate words (e.g. <br>, <p>, <td>) */
+			if (preview_append(gs, " ", 1, &chars, maxchars, maxbytes)) {
+				return;
+			}
+			continue;
+		} else if (*s == '&' && (entity = html_entity(s, &elen))) {
+			if (preview_append(gs, entity, strlen(entity), &chars, maxchars, maxbytes)) {
+				return;
+			}
+			s += elen;
+			continue;
+		}
+		while (*s && *s != '<' && *s != '&') {
+			s++;
+		}
+		if (s == text) {
+			s++; /* Lone & */
+		}
+		if (preview_append(gs, text, (size_t) (s - text), &chars, maxchars, maxbytes)) {
+			return;
+		}
+	}
+}
+
+char *mime_make_preview(const char *file, size_t maxchars, size_t maxbytes)
+{
+	GMimeMessage *message;
+	GMimeTextPart *textpart;
+	GString *gs;
+	char *text, *preview;
+	int html = 0;
+
+	message = parse_message(file);
+	if (!message) {
+		return NULL;
+	}
+
+	gs = g_string_new("");
+	textpart = find_text_part(message->mime_part, "plain");
+	if (!textpart) {
+		textpart = find_text_part(message->mime_part, "html");
+		html = 1;
+	}
+	if (textpart) {
+		/* Decodes the transfer encoding and converts the charset to UTF-8 */
+		text = g_mime_text_part_get_text(textpart);
+		if (text) {
+			if (html) {
+				preview_append_html(gs, text, maxchars, maxbytes);
+			} else {
+				size_t chars = 0;
+				preview_append(gs, text, strlen(text), &chars, maxchars, maxbytes);
+			}
+			g_free(text);
+		}
+	}
+	g_object_unref(message);
+
+	/* Trailing whitespace isn't part of the preview */
+	while (gs->len && gs->str[gs->len - 1] == ' ') {
+		g_string_truncate(gs, gs->len - 1);
+	}
+	preview = strdup(gs->str[0] == ' ' ? gs->str + 1 : gs->str);
+	g_string_free(gs, TRUE);
+	return preview;
+}
+
 static int load_module(void)
 {
 	g_mime_init();
@@ -21,6 +21,7 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 
 #include "include/module.h"
 #include "include/config.h"
@@ -31,6 +32,7 @@
 #include "include/oauth.h"
 #include "include/json.h"
 #include "include/transfer.h"
+#include "include/alertpipe.h"
 
 /* Helpful resources:
  * https://github.com/google/gmail-oauth2-tools/wiki/OAuth2DotPyRunThrough
@@ -47,20 +49,89 @@ struct oauth_client {
 	RWLIST_ENTRY(oauth_client) entry;
 	time_t tokentime;
 	time_t expires;
+	time_t refreshat;			/*!< When the token should be proactively refreshed */
+	time_t lastused;			/*!< When the token was last requested */
 	unsigned int userid;
-	bbs_mutex_t lock;
+	unsigned int refcount;		/*!< Number of references, including the one held by the clients list */
+	bbs_mutex_t lock;			/*!< Protects the token itself, only held briefly */
+	bbs_mutex_t refreshlock;	/*!< Held while refreshing the token, so only one refresh happens at a time */
 	char data[0];
 };
 
 static RWLIST_HEAD_STATIC(clients, oauth_client);
 
+/* Users' .oauth.conf files that have already been loaded */
+struct user_config {
+	unsigned int userid;
+	time_t mtime;
+	RWLIST_ENTRY(user_config) entry;
+};
+
+static RWLIST_HEAD_STATIC(user_configs, user_config);
+
+/*! \brief Tokens that haven't been used in this long are no longer refreshed proactively */
+#define REFRESH_IDLE_TIME 86400
+
+/*! \brief Maximum time to sleep between checks for tokens that need refreshing */
+#define REFRESH_MAX_SLEEP 60
+
+/*! \brief Tokens that expire sooner than this after being issued are only refreshed on demand, not proactively */
+#define REFRESH_MIN_LIFETIME 60
+
+static pthread_t refresh_thread = 0;
+static int refresh_alertpipe[2] = { -1, -1 };
+static int unloading = 0;
+
 static void free_client(struct oauth_client *client)
 {
 	free_if(client->accesstoken);
 	bbs_mutex_destroy(&client->lock);
+	bbs_mutex_destroy(&client->refreshlock);
 	free(client);
 }
 
+static void client_ref(struct oauth_client *client)
+{
+	bbs_mutex_lock(&client->lock);
+	client->refcount++;
+	bbs_mutex_unlock(&client->lock);
+}
+
+/*! \brief Release a reference to a client, freeing it once it's been removed from the list and nobody else is using it */
+static void client_unref(struct oauth_client *client)
+{
+	unsigned int refcount;
+
+	bbs_mutex_lock(&client->lock);
+	refcount = --client->refcount;
+	bbs_mutex_unlock(&client->lock);
+	if (!refcount) {
+		free_client(client);
+	}
+}
+
+/*!
+ * \brief Schedule the next proactive refresh of a token
+ * \note Must be called with client locked
+ */
+static void schedule_refresh(struct oauth_client *client)
+{
+	time_t margin;
+
+	if (client->expires < REFRESH_MIN_LIFETIME) {
+		/* Otherwise, we'd be refreshing it (almost) constantly while it's in use */
+		client->refreshat = 0;
+		return;
+	}
+	/* Refresh a little while before the token expires (a tenth of its lifetime, up to 5 minutes),
+	 * plus some jitter, so that tokens acquired at the same time aren't all refreshed at once. */
+	margin = MIN(client->expires / 10, 300);
+	if (margin > 1) {
+		margin += bbs_rand(0, (int) margin / 2);
+	}
+	client->refreshat = client->tokentime + MAX(client->expires - margin, 1);
+}
+
 static int add_oauth_client(const char *name, const char *clientid, const char *clientsecret, const char *refreshtoken, const char *accesstoken,
 	const char *posturl, int expires, unsigned int userid)
 {
@@ -86,7 +157,7 @@ static int add_oauth_client(const char *name, const char *clientid, const char *
 	}
 	RWLIST_TRAVERSE_SAFE_END;
 	if (client) {
-		free_client(client);
+		client_unref(client);
 	}
 	namelen = strlen(name);
 	idlen = strlen(clientid);
@@ -118,22 +189,55 @@ static int add_oauth_client(const char *name, const char *clientid, const char *
 	strcpy(pos, posturl);
 	client->posturl = pos;
 
+	client->expires = expires;
+	client->userid = userid;
+	client->refcount = 1;
+
 	/* Access token is optional */
 	if (accesstoken) {
 		client->accesstoken = strdup(accesstoken);
 		client->tokentime = time(NULL); /* Assumed to be valid as of now. */
+		schedule_refresh(client);
 	}
 
-	client->expires = expires;
-	client->userid = userid;
-
 	bbs_mutex_init(&client->lock, NULL);
+	bbs_mutex_init(&client->refreshlock, NULL);
 
 	RWLIST_INSERT_HEAD(&clients, client, entry);
 	return 0;
 }
 
-static int fetch_token(struct oauth_client *client, char *buf, size_t len)
+/*!
+ * \brief Copy the current token, if it's still valid
+ * \retval 0 on success, -1 if no valid token
+ */
+static int current_token(struct oauth_client *client, char *buf, size_t len)
+{
+	int res = -1;
+	time_t now = time(NULL);
+
+	bbs_mutex_lock(&client->lock);
+	/* tokentime is when the token was acquired.
+	 * expires is for how long the token is valid.
+	 * So tokentime + expires = when the token expires */
+	if (client->tokentime && now < client->tokentime + client->expires) {
+		safe_strncpy(buf, client->accesstoken, len);
+		res = 0;
+	}
+	client->lastused = now;
+	bbs_mutex_unlock(&client->lock);
+	return res;
+}
+
+/*!
+ * \brief Get a new access token using the refresh token
+ * \param client
+ * \param[out] buf Buffer for the new token, or NULL
+ * \param len Size of buf
+ * \param proactive Whether this is a scheduled refresh, rather than a caller that needs a valid token
+ * \retval 0 on success, -1 on failure
+ */
+static int fetch_token(struct oauth_client *client, char *buf, size_t len, int proactive)
 {
 	char postdata[512]; /* Luckily most OAuth providers seem to use the same OAuth parameters, but we could allow for custom POST data */
 	struct bbs_curl c = {
@@ -142,37 +246,39 @@ static int fetch_token(struct oauth_client *client, char *buf, size_t len)
 		.forcefail = 0, /* If there's an error, display it */
 	};
 	const char *newtoken;
-	json_t *json;
+	json_t *json = NULL;
 	json_error_t jansson_error = {};
-	time_t now = time(NULL);
+	time_t now;
 	int expires;
-	time_t expiretime;
 	int res = -1;
 
-	bbs_mutex_lock(&client->lock);
-
-	/* tokentime is when the token was acquired.
-	 * expires is for how long the token is valid.
-	 * So tokentime + expires = when the token expires */
-	expiretime = client->tokentime + client->expires;
+	if (proactive) {
+		if (bbs_mutex_trylock(&client->refreshlock)) {
+			return 0; /* Somebody else is already refreshing it */
+		}
+	} else {
+		/* If another thread is already refreshing this token, wait for it to finish,
+		 * and then use that token, rather than also refreshing it. */
+		bbs_mutex_lock(&client->refreshlock);
+		if (!current_token(client, buf, len)) {
+			bbs_mutex_unlock(&client->refreshlock);
+			return 0;
+		}
+	}
 
-	if (client->tokentime && now < expiretime) {
-		/* We already have a valid token and it hasn't expired yet. */
-		safe_strncpy(buf, client->accesstoken, len);
-		bbs_mutex_unlock(&client->lock);
-		return 0;
-	} else if (client->tokentime) {
-		time_t ago = now - expiretime;
+	now = time(NULL);
+	bbs_mutex_lock(&client->lock);
+	if (client->tokentime && now >= client->tokentime + client->expires) {
+		time_t ago = now - (client->tokentime + client->expires);
 		bbs_debug(5, "Token refresh required (expired %" TIME_T_FMT " seconds ago)\n", ago);
 	}
+	bbs_mutex_unlock(&client->lock);
 
 	/* Get a new token */
 	snprintf(postdata, sizeof(postdata), "client_id=%s&client_secret=%s&grant_type=refresh_token&refresh_token=%s", client->clientid, client->clientsecret, client->refreshtoken);
 	if (bbs_curl_post(&c) || c.http_code != 200) {
 		bbs_warning("Failed to refresh OAuth token '%s': %s\n", client->name, c.response);
-		bbs_mutex_unlock(&client->lock);
-		bbs_curl_free(&c);
-		return -1;
+		goto cleanup;
 	}
 
 #ifdef DEBUG_OAUTH
@@ -195,19 +301,28 @@ static int fetch_token(struct oauth_client *client, char *buf, size_t len)
 		goto cleanup;
 	}
 
+	bbs_mutex_lock(&client->lock);
 	if (expires) {
 		client->expires = expires; /* If they tell us when it'll expire, use that. */
 	}
-
 	client->tokentime = now;
 	REPLACE(client->accesstoken, newtoken);
-	safe_strncpy(buf, client->accesstoken, len);
+	if (buf) {
+		safe_strncpy(buf, client->accesstoken, len);
+	}
+	schedule_refresh(client);
+	bbs_mutex_unlock(&client->lock);
 	res = 0;
 
-	bbs_verb(4, "Refreshed OAuth token '%s' (good for %ds)\n", client->name, expires);
+	bbs_verb(4, "Refreshed OAuth token '%s' (good for %ds)%s\n", client->name, expires, proactive ? " ahead of expiry" : "");
 
 cleanup:
-	bbs_mutex_unlock(&client->lock);
+	if (res) {
+		bbs_mutex_lock(&client->lock);
+		client->refreshat = now + 30; /* Try again soon */
+		bbs_mutex_unlock(&client->lock);
+	}
+	bbs_mutex_unlock(&client->refreshlock);
 	if (json) {
 		json_decref(json);
 	}
@@ -215,6 +330,83 @@ cleanup:
 	return res;
 }
 
+static int get_token(struct oauth_client *client, char *buf, size_t len)
+{
+	if (!current_token(client, buf, len)) {
+		return 0; /* Common case, the token is refreshed ahead of time */
+	}
+	return fetch_token(client, buf, len, 0);
+}
+
+/*! \brief Maximum number of tokens refreshed per pass. Any others will be refreshed on the next pass. */
+#define REFRESH_MAX_BATCH 32
+
+/*!
+ * \brief Refresh any tokens that are in use and will expire soon
+ * \return Number of seconds until the next token will need to be refreshed
+ */
+static int refresh_due(void)
+{
+	struct oauth_client *client, *due[REFRESH_MAX_BATCH];
+	int i, numdue = 0;
+	time_t now = time(NULL);
+	time_t next = now + REFRESH_MAX_SLEEP;
+
+	/* Refreshing a token is a blocking HTTP request, so don't hold the list locked while doing that.
+	 * Instead, take a reference to each client that's due, and refresh them afterwards. */
+	RWLIST_RDLOCK(&clients);
+	RWLIST_TRAVERSE(&clients, client, entry) {
+		time_t refreshat;
+		int active;
+
+		bbs_mutex_lock(&client->lock);
+		refreshat = client->refreshat;
+		active = client->lastused && client->lastused > now - REFRESH_IDLE_TIME;
+		bbs_mutex_unlock(&client->lock);
+
+		if (!active || !refreshat) {
+			continue; /* Nobody is using this token, so don't bother keeping it fresh */
+		}
+		if (refreshat <= now && numdue < REFRESH_MAX_BATCH) {
+			client_ref(client);
+			due[numdue++] = client;
+			continue;
+		}
+		next = MIN(next, refreshat);
+	}
+	RWLIST_UNLOCK(&clients);
+
+	for (i = 0; i < numdue; i++) {
+		client = due[i];
+		if (!unloading) {
+			fetch_token(client, NULL, 0, 1);
+		}
+		bbs_mutex_lock(&client->lock);
+		next = MIN(next, client->refreshat);
+		bbs_mutex_unlock(&client->lock);
+		client_unref(client);
+	}
+
+	now = time(NULL);
+	return next > now ? (int) (next - now) : 1;
+}
+
+static void *refresh_tokens(void *unused)
+{
+	UNUSED(unused);
+
+	for (;;) {
+		int sec = refresh_due();
+		if (bbs_alertpipe_poll(refresh_alertpipe, SEC_MS(sec)) > 0) {
+			bbs_alertpipe_read(refresh_alertpipe);
+		}
+		if (unloading) {
+			break;
+		}
+	}
+	return NULL;
+}
+
 #define MAX_USER_OAUTH_TOKENS 50
 
 static int load_config_file(const char *filename, unsigned int forceuserid, const char *match)
@@ -287,11 +479,58 @@ static int load_config_file(const char *filename, unsigned int forceuserid, cons
 	return !match || namematch ? 0 : -1;
 }
 
-static int get_oauth_token(struct bbs_user *user, const char *name, char *buf, size_t len)
+/*!
+ * \brief Load a user's .oauth.conf, unless it's already been loaded and hasn't changed since
+ * \retval 0 if a section named match was loaded, -1 otherwise
+ */
+static int load_user_config(unsigned int userid, const char *match)
+{
+	char useroauthfile[256];
+	struct user_config *uc;
+	struct stat st;
+	int res;
+
+	if (bbs_transfer_home_config_file(userid, ".oauth.conf", useroauthfile, sizeof(useroauthfile))) {
+		return -1;
+	}
+	if (stat(useroauthfile, &st)) {
+		return -1;
+	}
+
+	RWLIST_WRLOCK(&user_configs);
+	RWLIST_TRAVERSE(&user_configs, uc, entry) {
+		if (uc->userid == userid) {
+			break;
+		}
+	}
+	if (uc && uc->mtime == st.st_mtime) {
+		/* Already loaded everything in this file, so if it wasn't found then, it's not there now */
+		RWLIST_UNLOCK(&user_configs);
+		return -1;
+	}
+	if (!uc) {
+		uc = calloc(1, sizeof(*uc));
+		if (ALLOC_FAILURE(uc)) {
+			RWLIST_UNLOCK(&user_configs);
+			return -1;
+		}
+		uc->userid = userid;
+		RWLIST_INSERT_HEAD(&user_configs, uc, entry);
+	}
+	uc->mtime = st.st_mtime;
+	res = load_config_file(useroauthfile, userid, match);
+	RWLIST_UNLOCK(&user_configs);
+	return res;
+}
+
+/*!
+ * \brief Find a client by name
+ * \return Client, with a reference that the caller must release with client_unref
+ * \retval NULL if no such client
+ */
+static struct oauth_client *find_client(const char *name, unsigned int userid)
 {
-	int res = -1;
 	struct oauth_client *client;
-	unsigned int userid = bbs_user_is_registered(user) ? user->id : 0;
 
 	RWLIST_RDLOCK(&clients);
 	RWLIST_TRAVERSE(&clients, client, entry) {
@@ -299,32 +538,41 @@ static int get_oauth_token(struct bbs_user *user, const char *name, char *buf, s
 		 * However, the name + user ID should be. So either it's the user's token,
 		 * or it's a token that anybody can use. */
 		if (!strcmp(client->name, name) && (!client->userid || client->userid == userid)) {
-			res = fetch_token(client, buf, len);
+			client_ref(client);
 			break;
 		}
 	}
 	RWLIST_UNLOCK(&clients);
+	return client;
+}
+
+static int get_oauth_token(struct bbs_user *user, const char *name, char *buf, size_t len)
+{
+	int res = -1, found = 0;
+	struct oauth_client *client;
+	unsigned int userid = bbs_user_is_registered(user) ? user->id : 0;
+
+	/* Getting a token may require a blocking HTTP request, so don't hold the list locked while doing that */
+	client = find_client(name, userid);
+	if (client) {
+		found = 1;
+		res = get_token(client, buf, len);
+		client_unref(client);
+	}
 
 	if (!user) {
 		return -1;
 	}
 
-	if (!client || res) { /* Didn't find a matching token, or it failed the first time */
+	if (!found || res) { /* Didn't find a matching token, or it failed the first time */
 		/* Didn't find any matching OAuth token. Look in the user's home directory and see if it's there. */
-		char useroauthfile[256];
-		if (bbs_transfer_home_config_file(userid, ".oauth.conf", useroauthfile, sizeof(useroauthfile))) {
-			return -1;
-		}
-		if (!load_config_file(useroauthfile, userid, name)) { /* Only counts if we specifically loaded a section with the given name */
+		if (!load_user_config(userid, name)) { /* Only counts if we specifically loaded a section with the given name */
 			/* Repeat, since we just now added a section named that */
-			RWLIST_RDLOCK(&clients);
-			RWLIST_TRAVERSE(&clients, client, entry) {
-				if (!strcmp(client->name, name) && (!client->userid || client->userid == userid)) {
-					res = fetch_token(client, buf, len);
-					break;
-				}
+			client = find_client(name, userid);
+			if (client) {
+				res = get_token(client, buf, len);
+				client_unref(client);
 			}
-			RWLIST_UNLOCK(&clients);
 		}
 	}
 
@@ -341,6 +589,15 @@ static int load_module(void)
 	if (load_config()) {
 		return -1;
 	}
+	if (bbs_alertpipe_create(refresh_alertpipe)) {
+		RWLIST_WRLOCK_REMOVE_ALL(&clients, entry, client_unref);
+		return -1;
+	}
+	if (bbs_pthread_create(&refresh_thread, NULL, refresh_tokens, NULL)) {
+		bbs_alertpipe_close(refresh_alertpipe);
+		RWLIST_WRLOCK_REMOVE_ALL(&clients, entry, client_unref);
+		return -1;
+	}
 	bbs_register_oauth_provider(get_oauth_token);
 	return 0;
 }
@@ -348,7 +605,12 @@ static int load_module(void)
 static int unload_module(void)
 {
 	bbs_unregister_oauth_provider(get_oauth_token);
-	RWLIST_WRLOCK_REMOVE_ALL(&clients, entry, free_client);
+	unloading = 1;
+	bbs_alertpipe_write(refresh_alertpipe);
+	bbs_pthread_join(refresh_thread, NULL);
+	bbs_alertpipe_close(refresh_alertpipe);
+	RWLIST_WRLOCK_REMOVE_ALL(&user_configs, entry, free);
+	RWLIST_WRLOCK_REMOVE_ALL(&clients, entry, client_unref);
 	return 0;
 }
 
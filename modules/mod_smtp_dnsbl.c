@@ -0,0 +1,550 @@
+/*
+ * LBBS -- The Lightweight Bulletin Board System
+ *
+ * Copyright (C) 2023, Naveen Albert
+ *
+ * Naveen Albert <bbs@phreaknet.org>
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief RFC5782 DNS Blocklist (DNSBL) and Allowlist (DNSWL) Connection Screening
+ *
+ * \author Naveen Albert <bbs@phreaknet.org>
+ */
+
+#include "include/bbs.h"
+
+#include <ctype.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <arpa/nameser.h>
+
+#ifdef __FreeBSD__
+/* Needed for sockaddr_in in resolv.h on FreeBSD */
+#include <netinet/in.h>
+#endif
+
+#include <resolv.h>
+
+#include "include/module.h"
+#include "include/config.h"
+#include "include/node.h" /* use bbs_poll */
+#include "include/utils.h"
+#include "include/cli.h"
+#include "include/stringlist.h"
+
+#include "include/net_smtp.h"
+
+/*! \brief Maximum number of zones that will be queried */
+#define MAX_ZONES 32
+
+#define CACHE_BUCKETS 256
+#define CACHE_MAX_ENTRIES 8192
+
+struct dnsbl_zone {
+	int weight;					/* Score added if listed. Negative for allowlists. */
+	struct stringlist matches;	/* Answers that count as listed. If empty, any answer in 127.0.0.0/8 does. */
+	unsigned int queries;		/* Number of queries sent */
+	unsigned int hits;			/* Number of listings */
+	RWLIST_ENTRY(dnsbl_zone) entry;
+	char name[];
+};
+
+static RWLIST_HEAD_STATIC(zones, dnsbl_zone);
+
+struct cached_result {
+	in_addr_t addr;
+	int score;
+	time_t expires;
+	struct cached_result *next;
+	char zone[128];				/* Zone that contributed the most to the score, for the rejection message */
+};
+
+static struct cached_result *cache[CACHE_BUCKETS];
+static unsigned int cache_entries = 0;
+static unsigned int cache_hits = 0, cache_misses = 0;
+static bbs_mutex_t cache_lock;
+
+static int reject_score = 10;
+static int tarpit_score = 5;
+static int query_timeout = 1500;
+static unsigned int negative_ttl = 300;
+static unsigned int max_ttl = 3600;
+static struct sockaddr_in nameserver;
+
+static inline unsigned int cache_bucket(in_addr_t addr)
+{
+	return (unsigned int) (ntohl(addr) % CACHE_BUCKETS);
+}
+
+static int cache_get(in_addr_t addr, int *score, char *zone, size_t zonelen)
+{
+	struct cached_result *r;
+	time_t now = time(NULL);
+
+	bbs_mutex_lock(&cache_lock);
+	for (r = cache[cache_bucket(addr)]; r; r = r->next) {
+		if (r->addr == addr && r->expires > now) {
+			*score = r->score;
+			safe_strncpy(zone, r->zone, zonelen);
+			cache_hits++;
+			bbs_mutex_unlock(&cache_lock);
+			return 0;
+		}
+	}
+	cache_misses++;
+	bbs_mutex_unlock(&cache_lock);
+	return -1;
+}
+
+static void cache_put(in_addr_t addr, int score, const char *zone, unsigned int ttl)
+{
+	struct cached_result *r, *prev = NULL, **bucket = &cache[cache_bucket(addr)];
+	time_t now = time(NULL);
+
+	bbs_mutex_lock(&cache_lock);
+	/* Prune expired entries in this bucket while we're here, and remove any stale entry for this address */
+	r = *bucket;
+	while (r) {
+		struct cached_result *next = r->next;
+		if (r->addr == addr || r->expires <= now) {
+			if (prev) {
+				prev->next = next;
+			} else {
+				*bucket = next;
+			}
+			free(r);
+			cache_entries--;
+		} else {
+			prev = r;
+		}
+		r = next;
+	}
+	if (cache_entries >= CACHE_MAX_ENTRIES) {
+		bbs_mutex_unlock(&cache_lock);
+		bbs_debug(3, "DNSBL cache is full, not caching result\n");
+		return;
+	}
+	r = calloc(1, sizeof(*r));
+	if (ALLOC_FAILURE(r)) {
+		bbs_mutex_unlock(&cache_lock);
+		return;
+	}
+	r->addr = addr;
+	r->score = score;
+	r->expires = now + MIN(ttl, max_ttl);
+	safe_strncpy(r->zone, zone, sizeof(r->zone));
+	r->next = *bucket;
+	*bucket = r;
+	cache_entries++;
+	bbs_mutex_unlock(&cache_lock);
+}
+
+static void cache_flush(void)
+{
+	int i;
+
+	bbs_mutex_lock(&cache_lock);
+	for (i = 0; i < CACHE_BUCKETS; i++) {
+		struct cached_result *r;
+		while ((r = cache[i])) {
+			cache[i] = r->next;
+			free(r);
+		}
+	}
+	cache_entries = 0;
+	bbs_mutex_unlock(&cache_lock);
+}
+
+struct zone_query {
+	struct dnsbl_zone *zone;
+	unsigned short id;
+	unsigned int done:1;
+	unsigned int listed:1;
+};
+
+/*!
+ * \brief Parse a DNS response for a DNSBL query
+ * \param zone
+ * \param answer
+ * \param len
+ * \param[out] listed Whether the address is listed
+ * \param[out] ttl Time for which the result may be cached
+ * \retval 0 on success, -1 on failure
+ */
+static int parse_response(struct dnsbl_zone *zone, const unsigned char *answer, int len, int *listed, unsigned int *ttl)
+{
+	ns_msg msg;
+	ns_rr rr;
+	int i, count;
+
+	if (ns_initparse(answer, len, &msg) < 0) {
+		bbs_warning("Failed to parse DNS response for %s\n", zone->name);
+		return -1;
+	}
+
+	*listed = 0;
+	*ttl = negative_ttl;
+
+	if (ns_msg_getflag(msg, ns_f_rcode) == ns_r_nxdomain) {
+		/* Not listed. RFC 2308: the negative TTL is the minimum of the SOA's TTL and MINIMUM field */
+		count = ns_msg_count(msg, ns_s_ns);
+		for (i = 0; i < count; i++) {
+			if (!ns_parserr(&msg, ns_s_ns, i, &rr) && ns_rr_type(rr) == ns_t_soa && ns_rr_rdlen(rr) >= 4) {
+				unsigned int minimum = (unsigned int) ns_get32(ns_rr_rdata(rr) + ns_rr_rdlen(rr) - 4);
+				*ttl = MIN(*ttl, MIN(ns_rr_ttl(rr), minimum)); /* Don't cache for longer than our own limit, either */
+				break;
+			}
+		}
+		return 0;
+	} else if (ns_msg_getflag(msg, ns_f_rcode) != ns_r_noerror) {
+		bbs_debug(3, "DNS query for %s failed with rcode %d\n", zone->name, ns_msg_getflag(msg, ns_f_rcode));
+		return -1;
+	}
+
+	count = ns_msg_count(msg, ns_s_an);
+	for (i = 0; i < count; i++) {
+		char addrbuf[INET_ADDRSTRLEN];
+		if (ns_parserr(&msg, ns_s_an, i, &rr) || ns_rr_type(rr) != ns_t_a || ns_rr_rdlen(rr) != 4) {
+			continue;
+		}
+		*ttl = MIN(*ttl, ns_rr_ttl(rr));
+		inet_ntop(AF_INET, ns_rr_rdata(rr), addrbuf, sizeof(addrbuf));
+		/* RFC 5782 2.3: Answers are in 127.0.0.0/8. Anything else likely means the list has been shut down
+		 * and is now listing the entire world, so ignore it. */
+		if (!STARTS_WITH(addrbuf, "127.")) {
+			bbs_warning("Ignoring invalid answer %s from %s\n", addrbuf, zone->name);
+			continue;
+		}
+		if (stringlist_is_empty(&zone->matches) || stringlist_contains(&zone->matches, addrbuf)) {
+			*listed = 1;
+		}
+	}
+	return 0;
+}
+
+/*!
+ * \brief Query all zones for an IP address at once and compute its score
+ * \param ip IPv4 address
+ * \param addr Same address, in network byte order
+ * \param[out] zonebuf Name of zone with the highest weight that listed the address
+ * \param zonelen
+ * \param[out] ttl Time for which the score may be cached
+ * \return Score
+ */
+static int query_zones(const char *ip, struct in_addr addr, char *zonebuf, size_t zonelen, unsigned int *ttl)
+{
+	struct zone_query queries[MAX_ZONES];
+	struct dnsbl_zone *zone;
+	unsigned char buf[512];
+	unsigned char *octets = (unsigned char *) &addr.s_addr;
+	int i, numqueries = 0, pending = 0;
+	int sfd, score = 0, maxweight = 0;
+	unsigned short baseid = (unsigned short) bbs_rand(0, 65535);
+	struct timeval start;
+
+	*ttl = max_ttl;
+	*zonebuf = '\0';
+
+	sfd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (sfd < 0) {
+		bbs_error("socket failed: %s\n", strerror(errno));
+		return 0;
+	}
+	if (connect(sfd, (struct sockaddr*) &nameserver, sizeof(nameserver))) {
+		bbs_error("connect failed: %s\n", strerror(errno));
+		close(sfd);
+		return 0;
+	}
+
+	/* Send every query up front, so the total time is that of the slowest zone, not the sum of all of them */
+	RWLIST_RDLOCK(&zones);
+	RWLIST_TRAVERSE(&zones, zone, entry) {
+		char qname[NS_MAXDNAME];
+		int len;
+		if (numqueries >= MAX_ZONES) {
+			bbs_warning("Too many DNSBL zones, only querying the first %d\n", MAX_ZONES);
+			break;
+		}
+		/* RFC 5782 2.1: Octets in reverse order, prepended to the zone */
+		snprintf(qname, sizeof(qname), "%u.%u.%u.%u.%s", octets[3], octets[2], octets[1], octets[0], zone->name);
+		len = res_mkquery(ns_o_query, qname, ns_c_in, ns_t_a, NULL, 0, NULL, buf, sizeof(buf));
+		if (len < 0) {
+			bbs_warning("Failed to build query for %s\n", qname);
+			continue;
+		}
+		queries[numqueries].zone = zone;
+		queries[numqueries].id = (unsigned short) (baseid + numqueries);
+		queries[numqueries].done = 0;
+		queries[numqueries].listed = 0;
+		((HEADER*) buf)->id = htons(queries[numqueries].id);
+		if (send(sfd, buf, (size_t) len, 0) != len) {
+			bbs_warning("Failed to send query for %s: %s\n", qname, strerror(errno));
+			continue;
+		}
+		bbs_atomic_fetchadd_int(&zone->queries, 1); /* Zones are only read locked, so concurrent checks may update these */
+		numqueries++;
+		pending++;
+	}
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Waggregate-return"
+	start = bbs_tvnow();
+#pragma GCC diagnostic pop
+	while (pending > 0) {
+		ssize_t res;
+		unsigned short id;
+		int listed;
+		unsigned int rttl;
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Waggregate-return"
+		int elapsed = (int) bbs_tvdiff_ms(bbs_tvnow(), start);
+#pragma GCC diagnostic pop
+
+		if (elapsed >= query_timeout) {
+			bbs_debug(3, "Timed out waiting for %d DNSBL response%s for %s\n", pending, ESS(pending), ip);
+			break;
+		}
+		if (bbs_poll(sfd, query_timeout - elapsed) <= 0) {
+			continue; /* Timeout will be caught above */
+		}
+		res = recv(sfd, buf, sizeof(buf), 0);
+		if (res < (ssize_t) sizeof(HEADER)) {
+			continue;
+		}
+		id = ntohs(((HEADER*) buf)->id);
+		for (i = 0; i < numqueries; i++) {
+			if (queries[i].id == id) {
+				break;
+			}
+		}
+		if (i == numqueries || queries[i].done) {
+			bbs_debug(3, "Ignoring unexpected DNS response (ID %u)\n", id);
+			continue;
+		}
+		queries[i].done = 1;
+		pending--;
+		if (parse_response(queries[i].zone, buf, (int) res, &listed, &rttl)) {
+			continue;
+		}
+		*ttl = MIN(*ttl, rttl);
+		if (listed) {
+			queries[i].listed = 1;
+			bbs_atomic_fetchadd_int(&queries[i].zone->hits, 1);
+			score += queries[i].zone->weight;
+			bbs_debug(3, "%s is listed in %s (weight %d)\n", ip, queries[i].zone->name, queries[i].zone->weight);
+			if (queries[i].zone->weight > maxweight) {
+				maxweight = queries[i].zone->weight;
+				safe_strncpy(zonebuf, queries[i].zone->name, zonelen);
+			}
+		}
+	}
+	RWLIST_UNLOCK(&zones);
+	close(sfd);
+
+	if (pending) {
+		/* Don't cache incomplete results for long, since a zone may have been temporarily unreachable */
+		*ttl = MIN(*ttl, 60);
+	}
+	return score;
+}
+
+static enum smtp_screen_action dnsbl_screen(const char *ip, char *buf, size_t len)
+{
+	struct in_addr addr;
+	char zone[128];
+	int score;
+
+	if (inet_pton(AF_INET, ip, &addr) != 1) {
+		return SMTP_SCREEN_ACCEPT; /* IPv6 lookups not currently supported */
+	}
+
+	if (cache_get(addr.s_addr, &score, zone, sizeof(zone))) {
+		unsigned int ttl;
+		score = query_zones(ip, addr, zone, sizeof(zone), &ttl);
+		cache_put(addr.s_addr, score, zone, ttl);
+	}
+
+	if (score >= reject_score) {
+		bbs_warning("Rejecting connection from %s (DNSBL score %d)\n", ip, score);
+		snprintf(buf, len, "5.7.1 Service unavailable; client [%s] blocked using %s", ip, zone);
+		return SMTP_SCREEN_REJECT;
+	} else if (score >= tarpit_score) {
+		bbs_debug(2, "Tarpitting connection from %s (DNSBL score %d)\n", ip, score);
+		return SMTP_SCREEN_TARPIT;
+	}
+	return SMTP_SCREEN_ACCEPT;
+}
+
+static int cli_dnsbl(struct bbs_cli_args *a)
+{
+	struct dnsbl_zone *zone;
+
+	bbs_dprintf(a->fdout, "%-40s %6s %8s %8s\n", "Zone", "Weight", "Queries", "Hits");
+	RWLIST_RDLOCK(&zones);
+	RWLIST_TRAVERSE(&zones, zone, entry) {
+		bbs_dprintf(a->fdout, "%-40s %6d %8u %8u\n", zone->name, zone->weight, zone->queries, zone->hits);
+	}
+	RWLIST_UNLOCK(&zones);
+
+	bbs_mutex_lock(&cache_lock);
+	bbs_dprintf(a->fdout, "Cache: %u entr%s, %u hit%s, %u miss%s\n", cache_entries, cache_entries == 1 ? "y" : "ies", cache_hits, ESS(cache_hits), cache_misses, cache_misses == 1 ? "" : "es");
+	bbs_mutex_unlock(&cache_lock);
+	return 0;
+}
+
+static int cli_dnsbl_flush(struct bbs_cli_args *a)
+{
+	cache_flush();
+	bbs_dprintf(a->fdout, "Flushed DNSBL cache\n");
+	return 0;
+}
+
+static struct bbs_cli_entry cli_commands_dnsbl[] = {
+	BBS_CLI_COMMAND(cli_dnsbl, "smtp dnsbl", 2, "List DNSBL/DNSWL zones and cache statistics", NULL),
+	BBS_CLI_COMMAND(cli_dnsbl_flush, "smtp dnsbl flush", 3, "Flush the DNSBL result cache", NULL),
+};
+
+static void zone_free(struct dnsbl_zone *zone)
+{
+	stringlist_empty_destroy(&zone->matches);
+	free(zone);
+}
+
+static int add_zone(struct bbs_config_section *section, const char *name)
+{
+	struct bbs_keyval *keyval = NULL;
+	struct dnsbl_zone *zone;
+
+	zone = calloc(1, sizeof(*zone) + strlen(name) + 1);
+	if (ALLOC_FAILURE(zone)) {
+		return -1;
+	}
+	strcpy(zone->name, name); /* Safe */
+	stringlist_init(&zone->matches);
+	while ((keyval = bbs_config_section_walk(section, keyval))) {
+		const char *key = bbs_keyval_key(keyval), *val = bbs_keyval_val(keyval);
+		if (!strcasecmp(key, "weight")) {
+			zone->weight = atoi(val);
+		} else if (!strcasecmp(key, "match")) {
+			char *s, *dup = strdup(val);
+			char *matches = dup;
+			if (ALLOC_FAILURE(dup)) {
+				continue;
+			}
+			while ((s = strsep(&matches, ","))) {
+				trim(s);
+				if (!strlen_zero(s)) {
+					stringlist_push(&zone->matches, s);
+				}
+			}
+			free(dup);
+		} else {
+			bbs_warning("Unknown setting '%s' for zone %s\n", key, name);
+		}
+	}
+	if (!zone->weight) {
+		bbs_warning("Zone %s has no weight, ignoring\n", name);
+		zone_free(zone);
+		return -1;
+	}
+	RWLIST_INSERT_TAIL(&zones, zone, entry);
+	return 0;
+}
+
+static int load_config(void)
+{
+	struct bbs_config *cfg;
+	struct bbs_config_section *section = NULL;
+	char ns[64] = "";
+
+	cfg = bbs_config_load("mod_smtp_dnsbl.conf", 1);
+	if (!cfg) {
+		bbs_error("mod_smtp_dnsbl.conf is missing, declining to load\n");
+		return -1;
+	}
+
+	bbs_config_val_set_int(cfg, "general", "reject", &reject_score);
+	bbs_config_val_set_int(cfg, "general", "tarpit", &tarpit_score);
+	bbs_config_val_set_int(cfg, "general", "timeout", &query_timeout);
+	bbs_config_val_set_uint(cfg, "general", "negativettl", &negative_ttl);
+	bbs_config_val_set_uint(cfg, "general", "maxttl", &max_ttl);
+	bbs_config_val_set_str(cfg, "general", "nameserver", ns, sizeof(ns));
+
+	memset(&nameserver, 0, sizeof(nameserver));
+	nameserver.sin_family = AF_INET;
+	nameserver.sin_port = htons(NAMESERVER_PORT);
+	if (!s_strlen_zero(ns)) {
+		char *port = strchr(ns, ':');
+		if (port) {
+			*port++ = '\0';
+			nameserver.sin_port = htons((unsigned short) atoi(port));
+		}
+		if (inet_pton(AF_INET, ns, &nameserver.sin_addr) != 1) {
+			bbs_error("Invalid nameserver address: %s\n", ns);
+			bbs_config_free(cfg);
+			return -1;
+		}
+	} else {
+		/* Use the system's first configured resolver */
+		struct __res_state state;
+		memset(&state, 0, sizeof(state));
+		if (res_ninit(&state) || !state.nscount) {
+			bbs_error("No nameservers configured\n");
+			bbs_config_free(cfg);
+			return -1;
+		}
+		nameserver = state.nsaddr_list[0];
+		res_nclose(&state);
+	}
+
+	RWLIST_WRLOCK(&zones);
+	while ((section = bbs_config_walk(cfg, section))) {
+		const char *name = bbs_config_section_name(section);
+		if (!strcmp(name, "general")) {
+			continue;
+		}
+		/* Every other section is a zone */
+		add_zone(section, name);
+	}
+	if (RWLIST_EMPTY(&zones)) {
+		RWLIST_UNLOCK(&zones);
+		bbs_error("No DNSBL zones configured, declining to load\n");
+		bbs_config_free(cfg);
+		return -1;
+	}
+	RWLIST_UNLOCK(&zones);
+	bbs_config_free(cfg);
+	return 0;
+}
+
+static int unload_module(void)
+{
+	smtp_unregister_screener(dnsbl_screen);
+	bbs_cli_unregister_multiple(cli_commands_dnsbl);
+	RWLIST_WRLOCK_REMOVE_ALL(&zones, entry, zone_free);
+	cache_flush();
+	bbs_mutex_destroy(&cache_lock);
+	return 0;
+}
+
+static int load_module(void)
+{
+	bbs_mutex_init(&cache_lock, NULL);
+	if (load_config()) {
+		RWLIST_WRLOCK_REMOVE_ALL(&zones, entry, zone_free);
+		bbs_mutex_destroy(&cache_lock);
+		return -1;
+	}
+	smtp_register_screener(dnsbl_screen);
+	bbs_cli_register_multiple(cli_commands_dnsbl);
+	return 0;
+}
+
+BBS_MODULE_INFO_DEPENDENT("DNSBL/DNSWL Connection Screening", "net_smtp.so");
@@ -149,6 +149,8 @@ struct smtp_filter_provider relay_filter = {
 
 struct smtp_filter_provider auth_filter = {
 	.on_body = auth_filter_cb,
+	.provides = SMTP_FILTER_RESULT_AUTHRESULTS,
+	.requires = SMTP_FILTER_RESULT_SPF | SMTP_FILTER_RESULT_DKIM | SMTP_FILTER_RESULT_ARC | SMTP_FILTER_RESULT_DMARC,
 };
 
 static int load_module(void)
@@ -279,10 +279,13 @@ cleanup:
 
 struct smtp_filter_provider arc_verify_filter = {
 	.on_body = arc_filter_verify_cb,
+	.provides = SMTP_FILTER_RESULT_ARC,
+	.concurrent = 1,
 };
 
 struct smtp_filter_provider arc_sign_filter = {
 	.on_body = arc_filter_sign_cb,
+	.requires = SMTP_FILTER_RESULT_AUTHRESULTS,
 };
 
 static int unload_module(void)
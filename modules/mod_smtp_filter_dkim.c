@@ -316,6 +316,8 @@ struct smtp_filter_provider dkim_sign_filter = {
 
 struct smtp_filter_provider dkim_verify_filter = {
 	.on_body = dkim_verify_filter_cb,
+	.provides = SMTP_FILTER_RESULT_DKIM,
+	.concurrent = 1,
 };
 
 static int load_config(void)
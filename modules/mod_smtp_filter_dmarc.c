@@ -574,6 +574,8 @@ static int dmarc_filter_cb(struct smtp_filter_data *f)
 
 struct smtp_filter_provider dmarc_filter = {
 	.on_body = dmarc_filter_cb,
+	.provides = SMTP_FILTER_RESULT_DMARC,
+	.requires = SMTP_FILTER_RESULT_SPF | SMTP_FILTER_RESULT_DKIM | SMTP_FILTER_RESULT_ARC,
 };
 
 static int load_config(void)
@@ -91,6 +91,8 @@ static int spf_filter_cb(struct smtp_filter_data *f)
 
 struct smtp_filter_provider spf_filter = {
 	.on_body = spf_filter_cb,
+	.provides = SMTP_FILTER_RESULT_SPF,
+	.concurrent = 1,
 };
 
 static int load_module(void)
@@ -142,6 +142,114 @@ cleanup:
 	return res;
 }
 
+static int test_http_connection_reuse(void)
+{
+	int i, mres, res = -1;
+	char url[84];
+	struct bbs_curl_host_stats before, after;
+	struct bbs_curl c = {
+		.url = url,
+		.forcefail = 0,
+	};
+
+	struct http_route_uri tests[] = {
+		{ NULL, DEFAULT_TEST_HTTP_PORT, "/test", HTTP_METHOD_GET, get_basic },
+	};
+	mres = register_uris(tests, ARRAY_LEN(tests));
+	bbs_test_assert_equals(mres, 0);
+
+	snprintf(url, sizeof(url), "http://127.0.0.1:%u/test", DEFAULT_TEST_HTTP_PORT);
+	memset(&before, 0, sizeof(before));
+	bbs_curl_host_stats(url, &before); /* May not exist yet */
+
+	/* Requests made back to back should all use the same connection */
+	for (i = 0; i < 3; i++) {
+		bbs_test_assert_equals(0, bbs_curl_get(&c));
+		bbs_test_assert_equals(200, c.http_code);
+		bbs_curl_free(&c);
+	}
+
+	bbs_test_assert_equals(0, bbs_curl_host_stats(url, &after));
+	bbs_test_assert_equals(3, (int) (after.requests - before.requests));
+	bbs_test_assert((int) (after.reused - before.reused) >= 2);
+
+	res = 0;
+
+cleanup:
+	bbs_curl_free(&c);
+	unregister_uris(tests, ARRAY_LEN(tests));
+	return res;
+}
+
+#define NUM_ASYNC_REQUESTS 6
+
+static int async_completed = 0;
+static int async_succeeded = 0;
+static bbs_mutex_t async_lock = BBS_MUTEX_INITIALIZER;
+
+/* Each request is on the heap and freed by its callback, so a request that completes after the test gives up waiting doesn't touch its stack */
+struct async_request {
+	struct bbs_curl c;
+	char url[84];
+};
+
+static void async_cb(struct bbs_curl *c, int res, void *data)
+{
+	struct async_request *req = data;
+
+	bbs_mutex_lock(&async_lock);
+	async_completed++;
+	if (!res && c->http_code == 200 && !strcmp(S_IF(c->response), "<h1>Hello world</h1>")) {
+		async_succeeded++;
+	}
+	bbs_mutex_unlock(&async_lock);
+	bbs_curl_free(c);
+	free(req);
+}
+
+static int test_http_get_async(void)
+{
+	int i, mres, queued = 0, completed = 0, res = -1;
+
+	struct http_route_uri tests[] = {
+		{ NULL, DEFAULT_TEST_HTTP_PORT, "/test", HTTP_METHOD_GET, get_basic },
+	};
+	mres = register_uris(tests, ARRAY_LEN(tests));
+	bbs_test_assert_equals(mres, 0);
+
+	async_completed = async_succeeded = 0;
+	for (i = 0; i < NUM_ASYNC_REQUESTS; i++) {
+		struct async_request *req = calloc(1, sizeof(*req));
+		if (ALLOC_FAILURE(req)) {
+			break;
+		}
+		snprintf(req->url, sizeof(req->url), "http://127.0.0.1:%u/test", DEFAULT_TEST_HTTP_PORT);
+		req->c.url = req->url;
+		if (bbs_curl_request_async(&req->c, 0, async_cb, req)) {
+			free(req); /* The callback won't be executed */
+			break;
+		}
+		queued++;
+	}
+
+	/* Wait for all the callbacks to execute */
+	for (i = 0; i < 500 && completed < queued; i++) {
+		usleep(10000);
+		bbs_mutex_lock(&async_lock);
+		completed = async_completed;
+		bbs_mutex_unlock(&async_lock);
+	}
+	bbs_test_assert_equals(NUM_ASYNC_REQUESTS, queued);
+	bbs_test_assert_equals(NUM_ASYNC_REQUESTS, completed);
+	bbs_test_assert_equals(NUM_ASYNC_REQUESTS, async_succeeded);
+
+	res = 0;
+
+cleanup:
+	unregister_uris(tests, ARRAY_LEN(tests));
+	return res;
+}
+
 static enum http_response_code post_basic(struct http_session *http)
 {
 	if (http->req->method & HTTP_METHOD_GET) {
@@ -769,6 +877,8 @@ cleanup:
 static struct bbs_unit_test tests[] =
 {
 	{ "HTTP GET Basic", test_http_get_basic },
+	{ "HTTP Connection Reuse", test_http_connection_reuse },
+	{ "HTTP GET Async", test_http_get_async },
 	{ "HTTP POST Basic", test_http_post_basic },
 	{ "HTTP POST Multipart Basic", test_http_post_multipart_basic },
 	{ "HTTP POST File Upload", test_http_post_file_upload },
@@ -43,6 +43,38 @@ cleanup:
 	return -1;
 }
 
+static int test_range_set(void)
+{
+	struct range_set *set;
+
+	/* Unordered, overlapping, adjacent, and reversed ranges */
+	set = range_set_parse("9,20:15,1:3,2:4,5,30:*");
+	bbs_test_assert(set != NULL);
+	bbs_test_assert_equals(0, range_set_contains(set, 0));
+	bbs_test_assert_equals(1, range_set_contains(set, 1));
+	bbs_test_assert_equals(1, range_set_contains(set, 5));
+	bbs_test_assert_equals(0, range_set_contains(set, 6));
+	bbs_test_assert_equals(1, range_set_contains(set, 9));
+	bbs_test_assert_equals(0, range_set_contains(set, 10));
+	bbs_test_assert_equals(1, range_set_contains(set, 15));
+	bbs_test_assert_equals(1, range_set_contains(set, 20));
+	bbs_test_assert_equals(0, range_set_contains(set, 21));
+	bbs_test_assert_equals(1, range_set_contains(set, 30));
+	bbs_test_assert_equals(1, range_set_contains(set, 4000000000U));
+	range_set_free(set);
+
+	/* Empty set matches nothing */
+	set = range_set_parse("");
+	bbs_test_assert(set != NULL);
+	bbs_test_assert_equals(0, range_set_contains(set, 1));
+	range_set_free(set);
+	return 0;
+
+cleanup:
+	range_set_free(set);
+	return -1;
+}
+
 static int test_range_generation(void)
 {
 	char *ranges;
@@ -104,6 +136,7 @@ cleanup:
 static struct bbs_unit_test tests[] =
 {
 	{ "IMAP FETCH Sequence Ranges", test_sequence_in_range },
+	{ "IMAP Parsed Sequence Sets", test_range_set },
 	{ "IMAP Sequence Range Generation", test_range_generation },
 	{ "IMAP COPYUID Generation", test_copyuid_generation },
 };
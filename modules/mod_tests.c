@@ -28,6 +28,9 @@
 #include "include/ansi.h"
 #include "include/utils.h"
 #include "include/curl.h"
+#include "include/event.h"
+#include "include/auth.h"
+#include "include/user.h"
 
 static int test_parensep(void)
 {
@@ -691,6 +694,154 @@ cleanup:
 	return -1;
 }
 
+static int async_events_received = 0;
+static int async_events_misordered = 0;
+
+static int async_event_cb(struct bbs_event *event)
+{
+	const struct bbs_file_transfer_event *transfer = event->cdata;
+	char expected[32];
+
+	if (event->type != EVENT_FILE_UPLOAD_COMPLETE || !transfer || strncmp(transfer->userpath, "/asynctest/", STRLEN("/asynctest/"))) {
+		return 0; /* Some other event, not ours */
+	}
+	/* The transfer data was on the broadcaster's stack, so this also checks that it was copied */
+	snprintf(expected, sizeof(expected), "/asynctest/%d", async_events_received);
+	if (strcmp(transfer->userpath, expected) || transfer->size != (size_t) async_events_received || event->node) {
+		async_events_misordered++;
+	}
+	async_events_received++;
+	return 1;
+}
+
+static int test_event_async(void)
+{
+	int i;
+	int registered = 0;
+	int res = -1;
+
+	async_events_received = async_events_misordered = 0;
+	bbs_test_assert_equals(0, bbs_register_event_consumer_async(async_event_cb));
+	registered = 1;
+
+	for (i = 0; i < 50; i++) {
+		struct bbs_event event;
+		struct bbs_file_transfer_event transfer;
+		char userpath[32];
+
+		snprintf(userpath, sizeof(userpath), "/asynctest/%d", i);
+		memset(&transfer, 0, sizeof(transfer));
+		transfer.userpath = userpath;
+		transfer.diskpath = userpath;
+		transfer.size = (size_t) i;
+		memset(&event, 0, sizeof(event));
+		event.type = EVENT_FILE_UPLOAD_COMPLETE;
+		event.cdata = &transfer;
+		bbs_event_broadcast(&event);
+	}
+
+	/* Unregistering delivers anything still queued */
+	bbs_unregister_event_consumer(async_event_cb);
+	registered = 0;
+	bbs_test_assert_equals(50, async_events_received);
+	bbs_test_assert_equals(0, async_events_misordered);
+	res = 0;
+
+cleanup:
+	if (registered) {
+		bbs_unregister_event_consumer(async_event_cb);
+	}
+	return res;
+}
+
+#define CACHE_TEST_USERID 424242
+
+static int user_lookups = 0;
+
+static struct bbs_user *cache_test_user_by_id(unsigned int userid)
+{
+	struct bbs_user *user;
+
+	if (userid != CACHE_TEST_USERID) {
+		return NULL;
+	}
+	user = bbs_user_request();
+	if (!user) {
+		return NULL;
+	}
+	user->id = userid;
+	user->username = strdup("cachetest");
+	user->priv = ++user_lookups; /* Changes on every lookup, so we can tell fresh records from cached ones */
+	return user;
+}
+
+static int test_user_cache(void)
+{
+	struct bbs_user *user = NULL, *user2 = NULL;
+	unsigned int oldttl = 0;
+	int res = -1;
+
+	if (bbs_register_user_info_by_id_handler(cache_test_user_by_id)) {
+		bbs_warning("An auth provider is already loaded, skipping user cache test\n");
+		return 0;
+	}
+	user_lookups = 0;
+	bbs_user_cache_invalidate(CACHE_TEST_USERID);
+
+	/* Second lookup should be a cache hit */
+	user = bbs_user_from_userid(CACHE_TEST_USERID);
+	bbs_test_assert_exists(user);
+	bbs_test_assert_str_equals(bbs_username(user), "cachetest");
+	user2 = bbs_user_from_userid(CACHE_TEST_USERID);
+	bbs_test_assert_exists(user2);
+	bbs_test_assert(user != user2); /* Caller gets its own copy */
+	bbs_test_assert_equals(1, user_lookups);
+	bbs_test_assert_equals(1, user2->priv);
+	bbs_user_destroy(user2);
+	user2 = NULL;
+
+	/* Invalidating forces a fresh lookup */
+	bbs_user_cache_invalidate(CACHE_TEST_USERID);
+	user2 = bbs_user_from_userid(CACHE_TEST_USERID);
+	bbs_test_assert_exists(user2);
+	bbs_test_assert_equals(2, user_lookups);
+	bbs_test_assert_equals(2, user2->priv);
+	bbs_user_destroy(user2);
+	user2 = NULL;
+
+	/* With a TTL of 0, entries are expired immediately */
+	oldttl = bbs_user_cache_set_ttl(0);
+	user2 = bbs_user_from_userid(CACHE_TEST_USERID);
+	bbs_test_assert_exists(user2);
+	bbs_user_destroy(user2);
+	user2 = bbs_user_from_userid(CACHE_TEST_USERID);
+	bbs_test_assert_exists(user2);
+	bbs_test_assert_equals(4, user_lookups);
+	bbs_user_destroy(user2);
+	user2 = NULL;
+	bbs_user_cache_set_ttl(oldttl);
+	oldttl = 0;
+
+	/* Privilege lookups are never cached */
+	bbs_test_assert_equals(5, bbs_user_priv_from_userid(CACHE_TEST_USERID));
+	bbs_test_assert_equals(6, bbs_user_priv_from_userid(CACHE_TEST_USERID));
+	res = 0;
+
+cleanup:
+	if (oldttl) {
+		bbs_user_cache_set_ttl(oldttl);
+	}
+	if (user) {
+		bbs_user_destroy(user);
+	}
+	if (user2) {
+		bbs_user_destroy(user2);
+	}
+	bbs_unregister_user_info_by_id_handler(cache_test_user_by_id);
+	bbs_user_cache_invalidate(CACHE_TEST_USERID);
+	return res;
+}
+
 #ifdef EXTRA_TESTS
 static int test_curl_failure(void)
 {
@@ -739,6 +890,8 @@ static struct bbs_unit_test tests[] =
 	{ "URL Decoding", test_url_decoding },
 	{ "Quoted Printable Decode", test_quoted_printable_decode },
 	{ "UTF8 Remove Invalid", test_utf8_remove_invalid },
+	{ "Asynchronous Event Delivery", test_event_async },
+	{ "User Record Cache", test_user_cache },
 #ifdef EXTRA_TESTS
 	{ "cURL Failure", test_curl_failure },
 #endif
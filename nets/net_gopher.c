@@ -21,6 +21,7 @@
 
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <signal.h>
@@ -29,6 +30,7 @@
 #include "include/config.h"
 #include "include/utils.h"
 #include "include/node.h"
+#include "include/linkedlists.h"
 
 #define DEFAULT_GOPHER_PORT 70
 
@@ -48,17 +50,258 @@ static char gopher_root[256] = "";
 #define GOPHER_ERROR '3'
 #define GOPHER_INFO 'i'
 
+#define GOPHERMAP "gophermap"
+
+/*! \brief Maximum number of rendered menus to keep around */
+#define MAX_CACHED_MENUS 512
+
+/*! \brief A rendered directory menu, ready to be sent as is */
+struct gopher_menu {
+	struct timespec mtime;		/*!< Directory mtime when rendered */
+	struct timespec mapmtime;	/*!< gophermap mtime when rendered, zero if there wasn't one */
+	unsigned int refcount;		/*!< Number of requests currently sending this menu */
+	unsigned int cached:1;		/*!< Whether the menu is still in the cache */
+	char *data;
+	size_t len;
+	RWLIST_ENTRY(gopher_menu) entry;
+	char path[];
+};
+
+/*! \note Kept in most recently used order, so the least recently used menu is the one evicted when full */
+static RWLIST_HEAD_STATIC(menus, gopher_menu);
+static int num_menus = 0;
+
+static void menu_free(struct gopher_menu *menu)
+{
+	free_if(menu->data);
+	free(menu);
+}
+
+/*! \brief Remove a menu from the cache. It is freed once no requests are using it anymore. Must be called with menus locked. */
+static void menu_uncache(struct gopher_menu *menu)
+{
+	RWLIST_REMOVE(&menus, menu, entry);
+	num_menus--;
+	menu->cached = 0;
+	if (!menu->refcount) {
+		menu_free(menu);
+	}
+}
+
+static void menu_unref(struct gopher_menu *menu)
+{
+	RWLIST_WRLOCK(&menus);
+	menu->refcount--;
+	if (!menu->refcount && !menu->cached) {
+		menu_free(menu);
+	}
+	RWLIST_UNLOCK(&menus);
+}
+
+#define timespec_equal(a, b) ((a)->tv_sec == (b)->tv_sec && (a)->tv_nsec == (b)->tv_nsec)
+
+/*! \brief Get a reference to the cached menu for a directory, if it's still current */
+static struct gopher_menu *menu_get(const char *path, struct timespec *mtime, struct timespec *mapmtime)
+{
+	struct gopher_menu *menu;
+
+	RWLIST_WRLOCK(&menus);
+	RWLIST_TRAVERSE(&menus, menu, entry) {
+		if (!strcmp(menu->path, path)) {
+			break;
+		}
+	}
+	if (menu) {
+		if (!timespec_equal(&menu->mtime, mtime) || !timespec_equal(&menu->mapmtime, mapmtime)) {
+			bbs_debug(5, "Cached menu for %s is stale\n", path);
+			menu_uncache(menu);
+			menu = NULL;
+		} else {
+			menu->refcount++;
+			RWLIST_REMOVE(&menus, menu, entry);
+			RWLIST_INSERT_HEAD(&menus, menu, entry);
+		}
+	}
+	RWLIST_UNLOCK(&menus);
+	return menu;
+}
+
+/*! \brief Add a newly rendered menu to the cache, replacing any other version of it */
+static void menu_cache(struct gopher_menu *menu)
+{
+	struct gopher_menu *existing;
+
+	RWLIST_WRLOCK(&menus);
+	RWLIST_TRAVERSE(&menus, existing, entry) {
+		if (!strcmp(existing->path, menu->path)) {
+			break;
+		}
+	}
+	if (existing) {
+		menu_uncache(existing); /* Somebody else rendered it concurrently */
+	} else if (num_menus >= MAX_CACHED_MENUS) {
+		menu_uncache(RWLIST_LAST(&menus));
+	}
+	menu->cached = 1;
+	RWLIST_INSERT_HEAD(&menus, menu, entry);
+	num_menus++;
+	RWLIST_UNLOCK(&menus);
+}
+
+static void menus_purge(void)
+{
+	struct gopher_menu *menu;
+
+	RWLIST_WRLOCK(&menus);
+	while ((menu = RWLIST_REMOVE_HEAD(&menus, entry))) {
+		menu->cached = 0;
+		if (!menu->refcount) {
+			menu_free(menu);
+		}
+	}
+	num_menus = 0;
+	RWLIST_UNLOCK(&menus);
+}
+
 static int directory_menu(const char *dir_name, const char *filename, int dir, void *obj)
 {
-	struct bbs_node *node = obj;
+	struct dyn_str *dynstr = obj;
 	const char *parent = dir_name + strlen(gopher_root);
 
+	if (!dir && !strcmp(filename, GOPHERMAP)) {
+		return 0; /* This is what generated the menu, not something to list in it */
+	}
+
 	/* Format is <type><display string>\t<selector string>\t<hostname>\t<port>\r\n */
-	bbs_node_fd_writef(node, node->fd, "%c%s\t%s/%s\t%s\t%d\r\n", dir ? GOPHER_DIRECTORY : GOPHER_FILE, filename, parent, filename, bbs_hostname(), gopher_port);
-	bbs_debug(4, "%c%s\t%s/%s\t%s\t%d\r\n", dir ? GOPHER_DIRECTORY : GOPHER_FILE, filename, parent, filename, bbs_hostname(), gopher_port);
+	dyn_str_append_fmt(dynstr, "%c%s\t%s/%s\t%s\t%d\r\n", dir ? GOPHER_DIRECTORY : GOPHER_FILE, filename, parent, filename, bbs_hostname(), gopher_port);
+	return 0;
+}
+
+/*!
+ * \brief Compile a hand-authored gophermap into a menu
+ * \note Each line is one of the following:
+ *       - <type><display string>\t<selector>[\t<hostname>[\t<port>]]
+ *         Selectors that don't start with '/' are relative to this directory, and an empty selector refers to the display string.
+ *         The hostname and port default to our own.
+ *       - A line without any tabs, which is displayed as an informational message.
+ *       - A line containing only '*', which is replaced with the listing of this directory.
+ *       - A line containing only '.', which ends the gophermap.
+ */
+static int gophermap_compile(const char *dirpath, const char *mappath, struct dyn_str *dynstr)
+{
+	char linebuf[512];
+	const char *parent = dirpath + strlen(gopher_root);
+	FILE *fp;
+
+	fp = fopen(mappath, "r");
+	if (!fp) {
+		bbs_error("Failed to open %s: %s\n", mappath, strerror(errno));
+		return -1;
+	}
+
+	while (fgets(linebuf, sizeof(linebuf), fp)) {
+		char *line = linebuf;
+		char *display, *selector, *host, *port;
+
+		bbs_term_line(line);
+
+		if (!strcmp(line, ".")) {
+			break;
+		} else if (!strcmp(line, "*")) {
+			bbs_dir_traverse_items(dirpath, directory_menu, dynstr);
+			continue;
+		} else if (!strchr(line, '\t')) {
+			dyn_str_append_fmt(dynstr, "%c%s\t\t%s\t%d\r\n", GOPHER_INFO, line, bbs_hostname(), gopher_port);
+			continue;
+		}
+
+		display = strsep(&line, "\t");
+		selector = strsep(&line, "\t");
+		host = strsep(&line, "\t");
+		port = strsep(&line, "\t");
+
+		if (!*display || (!*(display + 1) && strlen_zero(selector))) {
+			bbs_warning("Invalid gophermap line in %s\n", mappath);
+			continue;
+		}
+
+		if (!strlen_zero(host)) {
+			/* Selector on a different server, leave it alone */
+			dyn_str_append_fmt(dynstr, "%s\t%s\t%s\t%s\r\n", display, S_IF(selector), host, S_OR(port, "70"));
+		} else if (strlen_zero(selector)) {
+			dyn_str_append_fmt(dynstr, "%s\t%s/%s\t%s\t%d\r\n", display, parent, display + 1, bbs_hostname(), gopher_port);
+		} else if (*selector == '/' || STARTS_WITH(selector, "URL:")) {
+			dyn_str_append_fmt(dynstr, "%s\t%s\t%s\t%d\r\n", display, selector, bbs_hostname(), gopher_port);
+		} else {
+			dyn_str_append_fmt(dynstr, "%s\t%s/%s\t%s\t%d\r\n", display, parent, selector, bbs_hostname(), gopher_port);
+		}
+	}
+
+	fclose(fp);
 	return 0;
 }
 
+/*! \brief Render the menu for a directory */
+static struct gopher_menu *menu_render(const char *path, struct timespec *mtime, struct timespec *mapmtime, const char *mappath)
+{
+	struct gopher_menu *menu;
+	struct dyn_str dynstr;
+
+	memset(&dynstr, 0, sizeof(dynstr));
+	if (mappath) {
+		gophermap_compile(path, mappath, &dynstr);
+	} else {
+		bbs_dir_traverse_items(path, directory_menu, &dynstr);
+	}
+	/* XXX Lynx gopher client seems to display the period. Not sure why, but not all Gopher servers send the trailing period. */
+	if (dyn_str_append(&dynstr, ".\r\n", STRLEN(".\r\n")) < 0) { /* End with period on a line by itself */
+		dyn_str_reset(&dynstr);
+		return NULL;
+	}
+
+	menu = calloc(1, sizeof(*menu) + strlen(path) + 1);
+	if (ALLOC_FAILURE(menu)) {
+		dyn_str_reset(&dynstr);
+		return NULL;
+	}
+	strcpy(menu->path, path); /* Safe */
+	menu->mtime = *mtime;
+	menu->mapmtime = *mapmtime;
+	menu->data = dynstr.buf; /* Steal the buffer */
+	menu->len = dynstr.used;
+	menu->refcount = 1;
+	bbs_debug(4, "Rendered %lu-byte menu for %s\n", menu->len, path);
+	return menu;
+}
+
+static void send_directory(struct bbs_node *node, const char *path, struct stat *st)
+{
+	char mappath[600];
+	struct timespec mapmtime = { 0, 0 };
+	struct gopher_menu *menu;
+	struct stat mapst;
+	int havemap;
+
+	snprintf(mappath, sizeof(mappath), "%s/%s", path, GOPHERMAP);
+	/* Editing the gophermap doesn't change the directory's mtime, so check both */
+	havemap = !stat(mappath, &mapst) && S_ISREG(mapst.st_mode);
+	if (havemap) {
+		mapmtime = mapst.st_mtim;
+	}
+
+	menu = menu_get(path, &st->st_mtim, &mapmtime);
+	if (!menu) {
+		menu = menu_render(path, &st->st_mtim, &mapmtime, havemap ? mappath : NULL);
+		if (!menu) {
+			return;
+		}
+		menu_cache(menu);
+	}
+
+	bbs_node_fd_write(node, node->fd, menu->data, menu->len); /* The whole menu in one go */
+	menu_unref(menu);
+}
+
 static void *gopher_handler(void *varg)
 {
 	char fullpath[512];
@@ -82,36 +325,33 @@ static void *gopher_handler(void *varg)
 		goto cleanup; /* Request is incomplete */
 	}
 	*tmp = '\0';
+	/* Strip any trailing slash, so there is only one cached menu per directory */
+	if (tmp > buf && *(tmp - 1) == '/') {
+		*(--tmp) = '\0';
+	}
 	snprintf(fullpath, sizeof(fullpath), "%s%s", gopher_root, buf); /* selectors should start with a '/' */
 	bbs_debug(1, "Gopher request from %s: %s => %s\n", node->ip, buf, fullpath);
 
 	/* Dangerous path request or nonexistent file */
-	if (strstr(buf, "..") || stat(fullpath, &st)) {
-		bbs_node_fd_writef(node, node->fd, "%c'%s' doesn't exist!\r\n", GOPHER_ERROR, buf);
-		bbs_node_fd_writef(node, node->fd, "%c'This resource cannot be located.\r\n", GOPHER_INFO);
+	if (strstr(buf, "..") || stat(fullpath, &st) || (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode))) {
+		/* Anything that isn't a file or directory doesn't exist as far as the user is concerned */
+		bbs_node_fd_writef(node, node->fd, "%c'%s' doesn't exist!\r\n%c'This resource cannot be located.\r\n.\r\n", GOPHER_ERROR, buf, GOPHER_INFO);
 		goto cleanup;
 	}
 
 	if (S_ISDIR(st.st_mode)) {
-		bbs_dir_traverse_items(fullpath, directory_menu, node); /* Dump the directory */
-	} else if (S_ISREG(st.st_mode)) {
-		FILE *fp = fopen(fullpath, "r");
-		if (fp) {
+		send_directory(node, fullpath, &st); /* Includes the terminating period */
+		goto cleanup;
+	} else {
+		int fd = open(fullpath, O_RDONLY);
+		if (fd >= 0) {
 			off_t offset = 0;
-			int size;
-
-			fseek(fp, 0L, SEEK_END); /* Go to EOF to determine how big the file is. */
-			size = (int) ftell(fp);
-			rewind(fp); /* Be kind, rewind */
-
-			res = (int) bbs_sendfile(node->fd, fileno(fp), &offset, (size_t) size); /* We must manually tell it the offset or it will be at the EOF, even with rewind() */
-			fclose(fp);
+			/* We already know how big the file is from stat */
+			res = (int) bbs_sendfile(node->fd, fd, &offset, (size_t) st.st_size);
+			close(fd);
 		} else {
-			bbs_error("fopen failed: %s\n", strerror(errno));
+			bbs_error("open(%s) failed: %s\n", fullpath, strerror(errno));
 		}
-	} else { /* Anything else doesn't exist as far as the user is concerned */
-		bbs_node_fd_writef(node, node->fd, "%c'%s' doesn't exist!\r\n", GOPHER_ERROR, buf);
-		bbs_node_fd_writef(node, node->fd, "%c'This resource cannot be located.\r\n", GOPHER_INFO);
 	}
 
 	/* XXX Lynx gopher client seems to display the period. Not sure why, but not all Gopher servers send the trailing period. */
@@ -149,6 +389,7 @@ static int load_module(void)
 static int unload_module(void)
 {
 	bbs_stop_tcp_listener(gopher_port);
+	menus_purge();
 	return 0;
 }
 
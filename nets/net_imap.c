@@ -44,6 +44,7 @@
  * \note Supports RFC 7889 APPENDLIMIT
  * \note Supports RFC 8437 UNAUTHENTICATE
  * \note Supports RFC 8438 STATUS=SIZE
+ * \note Supports RFC 8970 PREVIEW
  * \note Supports RFC 9208 QUOTA
  *
  * \note STARTTLS is not supported for cleartext IMAP, as proposed in RFC2595, as this guidance
@@ -75,7 +76,6 @@
  * - RFC 8474 OBJECTID
  * - RFC 8508 REPLACE
  * - RFC 8514 SAVEDATE
- * - RFC 8970 PREVIEW
  * - RFC 9394 PARTIAL
  * - CLIENTID: https://datatracker.ietf.org/doc/html/draft-yu-imap-client-id-10
  *             https://datatracker.ietf.org/doc/html/draft-storey-smtp-client-id-15
@@ -87,7 +87,7 @@
 /* List of capabilities: https://www.iana.org/assignments/imap-capabilities/imap-capabilities.xml */
 /* XXX IDLE is advertised here even if disabled (although if disabled, it won't work if a client tries to use it) */
 /* XXX URLAUTH is advertised so that SMTP BURL will function in Trojita, even though we don't need URLAUTH since we have a direct trust */
-#define IMAP_CAPABILITIES IMAP_REV " AUTH=PLAIN UNSELECT UNAUTHENTICATE SPECIAL-USE LIST-EXTENDED LIST-STATUS XLIST CHILDREN IDLE NOTIFY NAMESPACE QUOTA QUOTA=RES-STORAGE ID SASL-IR ACL SORT THREAD=ORDEREDSUBJECT THREAD=REFERENCES URLAUTH ESEARCH ESORT SEARCHRES UIDPLUS LITERAL+ MULTIAPPEND APPENDLIMIT MOVE WITHIN ENABLE CONDSTORE QRESYNC STATUS=SIZE"
+#define IMAP_CAPABILITIES IMAP_REV " AUTH=PLAIN UNSELECT UNAUTHENTICATE SPECIAL-USE LIST-EXTENDED LIST-STATUS XLIST CHILDREN IDLE NOTIFY NAMESPACE QUOTA QUOTA=RES-STORAGE ID SASL-IR ACL SORT THREAD=ORDEREDSUBJECT THREAD=REFERENCES URLAUTH ESEARCH ESORT SEARCHRES UIDPLUS LITERAL+ MULTIAPPEND APPENDLIMIT MOVE WITHIN ENABLE CONDSTORE QRESYNC STATUS=SIZE PREVIEW"
 
 /* Capabilities advertised by popular mail providers, for reference/comparison, both pre and post authentication:
  * - Office 365
@@ -808,6 +808,7 @@ static void imap_destroy(struct imap_session *imap)
 {
 	imap_shutdown_clients(imap);
 	RWLIST_HEAD_DESTROY(&imap->clients);
+	imap_client_mappings_destroy(imap);
 	stringlist_empty_destroy(&imap->remotemailboxes);
 	if (imap->mbox != imap->mymbox) {
 		if (imap->mbox) {
@@ -973,6 +974,8 @@ static int imap_expunge(struct imap_session *imap, int silent)
 	unsigned long size;
 	unsigned int uid;
 	unsigned long modseq;
+	struct stat st;
+	int linked;
 	unsigned int *expunged = NULL, *expungedseqs = NULL;
 	int exp_lengths = 0, exp_allocsizes = 0;
 
@@ -1018,11 +1021,13 @@ static int imap_expunge(struct imap_session *imap, int silent)
 		snprintf(fullpath, sizeof(fullpath), "%s/%s", dir_name, filename);
 		imap_debug(4, "Permanently removing message %s\n", fullpath);
 
+		/* If the message was copied by linking it, removing this link may not free any space */
+		linked = !stat(fullpath, &st) && st.st_nlink > 1;
 		if (unlink(fullpath)) {
 			bbs_error("Failed to delete %s: %s\n", fullpath, strerror(errno));
 		}
 
-		if (parse_size_from_filename(filename, &size)) {
+		if (linked || parse_size_from_filename(filename, &size)) {
 			/* It's too late to stat now as a fallback, the file's gone, who knows how big it was now. */
 			mailbox_invalidate_quota_cache(imap->mbox);
 		} else {
@@ -1084,14 +1089,14 @@ static void do_qresync(struct imap_session *imap, unsigned long lastmodseq, cons
 	unsigned int uid;
 	unsigned int seqno = 0;
 	unsigned int minuid = 0;
-	char *uidrangebuf = NULL;
+	struct range_set *uidset = NULL;
 	char *expunged;
 
 	bbs_assert(imap->qresync == 1);
 
 	if (uidrange) {
-		uidrangebuf = malloc(strlen(uidrange) + 1); /* We could use strdup, but in_range_allocated always calls strcpy, so malloc avoids unnecessary copying here */
-		if (ALLOC_FAILURE(uidrangebuf)) {
+		uidset = range_set_parse(uidrange);
+		if (!uidset) {
 			return;
 		}
 	}
@@ -1100,7 +1105,7 @@ static void do_qresync(struct imap_session *imap, unsigned long lastmodseq, cons
 	files = scandir(imap->curdir, &entries, NULL, imap_uidsort);
 	if (files < 0) {
 		bbs_error("scandir(%s) failed: %s\n", imap->curdir, strerror(errno));
-		free_if(uidrangebuf);
+		range_set_free(uidset);
 		return;
 	}
 
@@ -1162,10 +1167,10 @@ static void do_qresync(struct imap_session *imap, unsigned long lastmodseq, cons
 	}
 
 	/* First, send any expunges since last time */
-	if (uidrange) {
-		expunged = maildir_get_expunged_since_modseq_range(imap->curdir, lastmodseq, uidrangebuf, minuid, uidrange);
+	if (uidset) {
+		expunged = maildir_get_expunged_since_modseq_range(imap->curdir, lastmodseq, minuid, uidset);
 	} else { /* Arguments are exactly the same. This just allows nonnull to be enforced for _range variant. */
-		expunged = maildir_get_expunged_since_modseq(imap->curdir, lastmodseq, uidrangebuf, minuid, uidrange);
+		expunged = maildir_get_expunged_since_modseq(imap->curdir, lastmodseq, minuid, uidset);
 	}
 	imap_send(imap, "VANISHED (EARLIER) %s", S_IF(expunged));
 	free_if(expunged);
@@ -1181,7 +1186,7 @@ static void do_qresync(struct imap_session *imap, unsigned long lastmodseq, cons
 		if (maildir_parse_uid_from_filename(entry->d_name, &uid)) {
 			goto next;
 		}
-		if (uidrange && !in_range_allocated(uidrange, (int) uid, uidrangebuf)) {
+		if (uidset && !range_set_contains(uidset, uid)) {
 			goto next;
 		}
 		/* seqrange is only used for EXPUNGE, not fetching flag changes */
@@ -1204,7 +1209,7 @@ next:
 		free(entry);
 	}
 	free(entries);
-	free_if(uidrangebuf);
+	range_set_free(uidset);
 }
 
 static void close_mailbox(struct imap_session *imap)
@@ -1907,32 +1912,35 @@ cleanup:
 	return -1;
 }
 
-int imap_in_range(struct imap_session *imap, const char *s, int num)
+struct range_set *imap_sequence_set(struct imap_session *imap, const char *sequences, int *usinguid)
 {
-	if (!strcmp(s, "$")) {
-		int res = 0;
-		/* The caller already accounts for savedsearchuid (don't need to, and can't, do that here) */
-		bbs_mutex_lock(&imap->lock); /* Lock the session to prevent somebody from freeing the savedsearch from under us */
-		if (!imap->savedsearch) {
-			bbs_warning("No saved search available\n");
-		} else {
-			res = in_range(imap->savedsearch, num);
-		}
-		bbs_mutex_unlock(&imap->lock);
-		return res;
+	struct range_set *set;
+
+	if (strcmp(sequences, "$")) {
+		return range_set_parse(sequences);
 	}
 
-	return in_range(s, num);
+	bbs_mutex_lock(&imap->lock); /* Prevent saved search from disappearing underneath us while we're using it */
+	if (!imap->savedsearch) {
+		bbs_mutex_unlock(&imap->lock);
+		bbs_warning("Client referred to nonexistent saved search\n");
+		return NULL;
+	}
+	set = range_set_parse(imap->savedsearch); /* Empty string means nothing matches */
+	if (usinguid) {
+		*usinguid = imap->savedsearchuid; /* So that we're consistent with what the saved search actually refers to. */
+	}
+	bbs_mutex_unlock(&imap->lock);
+	return set;
 }
 
-/*! \retval 0 if not in range, UID if in range */
-static unsigned int msg_in_range(int seqno, const char *filename, const char *sequences, int usinguid)
+unsigned int imap_msg_in_range(const struct range_set *set, int seqno, const char *filename, int usinguid)
 {
 	unsigned int msguid = 0;
 
 	if (!usinguid) {
 		/* XXX UIDs aren't guaranteed to be in order (see comment below), so we can't break if seqno > max */
-		if (!in_range(sequences, seqno)) {
+		if (!range_set_contains(set, (unsigned int) seqno)) {
 			return 0;
 		}
 	}
@@ -1945,42 +1953,13 @@ static unsigned int msg_in_range(int seqno, const char *filename, const char *se
 		return 0;
 	}
 	if (usinguid) {
-		if (!in_range(sequences, (int) msguid)) {
+		if (!range_set_contains(set, msguid)) {
 			return 0;
 		}
 	}
 	return msguid;
 }
 
-unsigned int imap_msg_in_range(struct imap_session *imap, int seqno, const char *filename, const char *sequences, int usinguid, int *error)
-{
-	unsigned int res;
-	int use_saved_search = !strcmp(sequences, "$") ? 1 : 0;
-
-	if (use_saved_search) {
-		if (!imap->savedsearch) {
-			bbs_warning("Client referred to nonexistent saved search\n");
-			*error = 1;
-			return 0;
-		}
-		bbs_mutex_lock(&imap->lock); /* Prevent saved search from disappearing underneath us while we're using it */
-		if (strlen_zero(imap->savedsearch)) {
-			/* Empty string means nothing matches */
-			bbs_mutex_unlock(&imap->lock);
-			return 0;
-		}
-		sequences = imap->savedsearch;
-		usinguid = imap->savedsearchuid; /* So that we're consistent with what the saved search actually refers to. */
-	}
-
-	res = msg_in_range(seqno, filename, sequences, usinguid);
-
-	if (use_saved_search) {
-		bbs_mutex_unlock(&imap->lock);
-	}
-	return res;
-}
-
 static int handle_fetch(struct imap_session *imap, char *s, int usinguid)
 {
 	bbs_assert_exists(imap->mbox);
@@ -2011,7 +1990,7 @@ static int handle_copy(struct imap_session *imap, const char *sequences, const c
 	char *olduidstr = NULL, *newuidstr = NULL;
 	long quotaleft;
 	int destacl;
-	int error = 0;
+	struct range_set *set;
 	char newfile[256];
 
 	/* We'll be moving into the cur directory. Don't specify here, maildir_copy_msg tacks on the /cur implicitly. */
@@ -2024,10 +2003,17 @@ static int handle_copy(struct imap_session *imap, const char *sequences, const c
 
 	IMAP_REQUIRE_ACL(destacl, IMAP_ACL_INSERT); /* Must be able to copy to dest dir */
 
+	set = imap_sequence_set(imap, sequences, &usinguid);
+	if (!set) {
+		imap_reply(imap, "BAD Invalid saved search");
+		return 0;
+	}
+
 	/* use scandir instead of opendir/readdir since we need ordering, even for message sequence numbers */
 	files = scandir(imap->curdir, &entries, NULL, imap_uidsort);
 	if (files < 0) {
 		bbs_error("scandir(%s) failed: %s\n", imap->curdir, strerror(errno));
+		range_set_free(set);
 		return -1;
 	}
 	while (fno < files && (entry = entries[fno++])) {
@@ -2037,7 +2023,7 @@ static int handle_copy(struct imap_session *imap, const char *sequences, const c
 		if (entry->d_type != DT_REG || !strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) {
 			continue;
 		}
-		msguid = imap_msg_in_range(imap, ++seqno, entry->d_name, sequences, usinguid, &error);
+		msguid = imap_msg_in_range(set, ++seqno, entry->d_name, usinguid);
 		if (!msguid) {
 			continue;
 		}
@@ -2046,7 +2032,9 @@ static int handle_copy(struct imap_session *imap, const char *sequences, const c
 		if (stat(srcfile, &st)) {
 			bbs_error("stat(%s) failed: %s\n", srcfile, strerror(errno));
 		} else {
-			quotaleft -= st.st_size; /* Determine if we would be about to exceed our current quota. */
+			/* Determine if we would be about to exceed our current quota.
+			 * Recheck each time, since copies that end up as links to the same file don't use any more space. */
+			quotaleft = (long int) mailbox_quota_remaining(imap->mbox) - st.st_size;
 			if (quotaleft <= 0) {
 				bbs_verb(5, "Mailbox %d has insufficient quota remaining for COPY operation\n", mailbox_id(imap->mbox));
 				break; /* Insufficient quota remaining */
@@ -2063,6 +2051,7 @@ static int handle_copy(struct imap_session *imap, const char *sequences, const c
 	}
 	bbs_free_scandir_entries(entries, files);
 	free(entries);
+	range_set_free(set);
 	/* UIDVALIDITY of dest mailbox, src UIDs, dest UIDs (in same order as src messages) */
 	if (olduids || newuids) {
 		olduidstr = gen_uintlist(olduids, lengths);
@@ -2070,9 +2059,7 @@ static int handle_copy(struct imap_session *imap, const char *sequences, const c
 		free_if(olduids);
 		free_if(newuids);
 	}
-	if (error) {
-		imap_reply(imap, "BAD Invalid saved search");
-	} else if (!numcopies && quotaleft <= 0) {
+	if (!numcopies && quotaleft <= 0) {
 		imap_reply(imap, "NO [OVERQUOTA] Insufficient quota remaining");
 	} else {
 		if (IMAP_HAS_ACL(imap->acl, IMAP_ACL_READ)) {
@@ -2101,7 +2088,7 @@ static int handle_move(struct imap_session *imap, const char *sequences, const c
 	unsigned int uidvalidity = 0, uidnext, uidres;
 	char *olduidstr = NULL, *newuidstr = NULL;
 	int destacl;
-	int error = 0;
+	struct range_set *set;
 	char newname[256];
 
 	/* We'll be moving into the cur directory. Don't specify here, maildir_move_msg_filename tacks on the /cur implicitly. */
@@ -2116,11 +2103,19 @@ static int handle_move(struct imap_session *imap, const char *sequences, const c
 	/* Since an implicit EXPUNGE is done from the current directory, we must lock the mailbox to avoid confusing POP3 clients. */
 	MAILBOX_TRYRDLOCK(imap);
 
+	set = imap_sequence_set(imap, sequences, &usinguid);
+	if (!set) {
+		mailbox_unlock(imap->mbox);
+		imap_reply(imap, "BAD Invalid saved search");
+		return 0;
+	}
+
 	/* use scandir instead of opendir/readdir since we need ordering, even for message sequence numbers */
 	files = scandir(imap->curdir, &entries, NULL, imap_uidsort);
 	if (files < 0) {
 		bbs_error("scandir(%s) failed: %s\n", imap->curdir, strerror(errno));
 		mailbox_unlock(imap->mbox);
+		range_set_free(set);
 		return -1;
 	}
 	while (fno < files && (entry = entries[fno++])) {
@@ -2132,7 +2127,7 @@ static int handle_move(struct imap_session *imap, const char *sequences, const c
 		}
 		++seqno;
 		++expunge_seqno;
-		msguid = imap_msg_in_range(imap, seqno, entry->d_name, sequences, usinguid, &error);
+		msguid = imap_msg_in_range(set, seqno, entry->d_name, usinguid);
 		if (!msguid) {
 			goto cleanup;
 		}
@@ -2170,6 +2165,7 @@ cleanup:
 		free(entry);
 	}
 	free(entries);
+	range_set_free(set);
 	/* UIDVALIDITY of dest mailbox, src UIDs, dest UIDs (in same order as src messages) */
 	if (olduids || newuids) {
 		olduidstr = gen_uintlist(olduids, lengths);
@@ -2177,12 +2173,8 @@ cleanup:
 		free_if(olduids);
 		free_if(newuids);
 	}
-	if (error) {
-		imap_reply(imap, "BAD Invalid saved search");
-	} else {
-		/* Yes, the MOVE response sends COPYUID. See RFC 6851 4.3 */
-		imap_reply(imap, "OK [COPYUID %u %s %s] MOVE completed", uidvalidity, S_IF(olduidstr), S_IF(newuidstr));
-	}
+	/* Yes, the MOVE response sends COPYUID. See RFC 6851 4.3 */
+	imap_reply(imap, "OK [COPYUID %u %s %s] MOVE completed", uidvalidity, S_IF(olduidstr), S_IF(newuidstr));
 
 	/* EXPUNGE untagged responses are sent in realtime (already done), just update HIGHESTMODSEQ now */
 	if (expunged) {
@@ -2546,7 +2538,7 @@ cleanup2:
 struct copy_append {
 	struct imap_session *imap;
 	struct imap_client *appendclient;
-	const char *sequences;
+	const struct range_set *set;
 	const char *remotename;
 	const char *tagged_resp;
 	unsigned int usinguid:1;
@@ -2560,12 +2552,8 @@ static int copy_append_move_cb(const char *dir_name, const char *filename, int s
 	struct copy_append *ca = obj;
 	unsigned int msguid;
 	char fullname[256];
-	int error = 0;
 
-	msguid = imap_msg_in_range(ca->imap, seqno, filename, ca->sequences, ca->usinguid, &error);
-	if (error) {
-		return -1;
-	}
+	msguid = imap_msg_in_range(ca->set, seqno, filename, ca->usinguid);
 	if (!msguid) {
 		return 0; /* Not in range */
 	}
@@ -2582,7 +2570,6 @@ static int copy_append_cb(const char *dir_name, const char *filename, int seqno,
 	struct copy_append *ca = obj;
 	unsigned int msguid;
 	char fullname[256];
-	int error = 0;
 	struct stat st;
 	struct tm modtime;
 	char timebuf[40];
@@ -2593,10 +2580,7 @@ static int copy_append_cb(const char *dir_name, const char *filename, int seqno,
 	size_t size;
 	ssize_t wres;
 
-	msguid = imap_msg_in_range(ca->imap, seqno, filename, ca->sequences, ca->usinguid, &error);
-	if (error) {
-		return -1;
-	}
+	msguid = imap_msg_in_range(ca->set, seqno, filename, ca->usinguid);
 	if (!msguid) {
 		return 0; /* Not in range */
 	}
@@ -2687,6 +2671,7 @@ static int handle_remote_move(struct imap_session *imap, char *dest, const char
 	int appended = 0;
 	char tagged_resp[64];
 	unsigned int uidvalidity = 0, uidnext = 0;
+	struct range_set *set = NULL;
 
 	/* Whether we're doing MOVE or COPY, we always copy first, since there is no way to "move" between servers.
 	 * We'll purge if the copy succeeds to emulate move, just like when the MOVE extension isn't supported.
@@ -2902,11 +2887,17 @@ static int handle_remote_move(struct imap_session *imap, char *dest, const char
 	} else { /* Source is local, destination is definitely remote */
 		struct copy_append ca;
 
+		set = imap_sequence_set(imap, sequences, &usinguid);
+		if (!set) {
+			imap_reply(imap, "BAD Invalid saved search");
+			goto done;
+		}
+
 		/* No memset needed, everything is explicitly initialized */
 		ca.imap = imap;
 		ca.appendclient = destclient;
 		ca.remotename = remotename;
-		ca.sequences = sequences;
+		ca.set = set;
 		ca.tagged_resp = tagged_resp;
 		SET_BITFIELD(ca.usinguid, usinguid);
 		SET_BITFIELD(ca.synchronizing, synchronizing);
@@ -2932,6 +2923,7 @@ static int handle_remote_move(struct imap_session *imap, char *dest, const char
 		}
 	}
 
+done:
 	if (destclient) {
 		if (destclient->virtcapabilities & IMAP_CAPABILITY_IDLE) {
 			imap_client_idle_start(destclient);
@@ -2941,6 +2933,7 @@ static int handle_remote_move(struct imap_session *imap, char *dest, const char
 	free_if(flags);
 	free_if(idate);
 	free_if(a);
+	range_set_free(set);
 	return 0;
 
 cleanup:
@@ -2948,6 +2941,7 @@ cleanup:
 	free_if(flags);
 	free_if(idate);
 	free_if(a);
+	range_set_free(set);
 	return -1;
 }
 
@@ -3046,7 +3040,7 @@ static int process_flags(struct imap_session *imap, char *s, int usinguid, const
 	int seqno = 0;
 	int opflags = 0;
 	int oldflags, flagpermsdenied = 0;
-	int error = 0;
+	struct range_set *set;
 	int matches = 0;
 	int was_silent = silent;
 	unsigned int *aseen = NULL, *atrash = NULL, *aflagsset = NULL;
@@ -3069,10 +3063,17 @@ static int process_flags(struct imap_session *imap, char *s, int usinguid, const
 		imap->numappendkeywords = 0;
 	}
 
+	set = imap_sequence_set(imap, sequences, &usinguid);
+	if (!set) {
+		imap_reply(imap, "BAD Invalid saved search");
+		return 0;
+	}
+
 	/* use scandir instead of opendir/readdir since we need ordering, even for message sequence numbers */
 	files = scandir(imap->curdir, &entries, NULL, imap_uidsort);
 	if (files < 0) {
 		bbs_error("scandir(%s) failed: %s\n", imap->curdir, strerror(errno));
+		range_set_free(set);
 		return -1;
 	}
 
@@ -3088,7 +3089,7 @@ static int process_flags(struct imap_session *imap, char *s, int usinguid, const
 			if (entry->d_type != DT_REG || !strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) {
 				continue;
 			}
-			msguid = imap_msg_in_range(imap, ++seqno, entry->d_name, sequences, usinguid, &error);
+			msguid = imap_msg_in_range(set, ++seqno, entry->d_name, usinguid);
 			if (!msguid) {
 				continue;
 			}
@@ -3128,7 +3129,7 @@ static int process_flags(struct imap_session *imap, char *s, int usinguid, const
 		if (entry->d_type != DT_REG || !strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) {
 			continue;
 		}
-		msguid = imap_msg_in_range(imap, ++seqno, entry->d_name, sequences, usinguid, &error);
+		msguid = imap_msg_in_range(set, ++seqno, entry->d_name, usinguid);
 		if (!msguid) {
 			continue;
 		}
@@ -3313,6 +3314,7 @@ static int process_flags(struct imap_session *imap, char *s, int usinguid, const
 	}
 	bbs_free_scandir_entries(entries, files);
 	free(entries);
+	range_set_free(set);
 
 	if (seenlength) {
 		mailbox_initialize_event(&e, EVENT_MESSAGE_READ, imap->node, imap->mbox, imap->dir);
@@ -3351,8 +3353,6 @@ static int process_flags(struct imap_session *imap, char *s, int usinguid, const
 
 	if (!matches) {
 		imap_reply(imap, "NO No messages in range");
-	} else if (error) {
-		imap_reply(imap, "BAD Invalid saved search");
 	} else {
 		imap_reply(imap, "OK %sSTORE Completed", usinguid ? "UID " : "");
 	}
@@ -3361,6 +3361,7 @@ static int process_flags(struct imap_session *imap, char *s, int usinguid, const
 done:
 	bbs_free_scandir_entries(entries, files);
 	free(entries);
+	range_set_free(set);
 	return 0;
 }
 
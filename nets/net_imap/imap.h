@@ -47,6 +47,8 @@ struct imap_client {
 RWLIST_HEAD(imap_client_list, imap_client);
 
 struct imap_notify;
+struct imap_remote_map;
+struct range_set;
 
 struct imap_session {
 	int rfd;
@@ -65,6 +67,7 @@ struct imap_session {
 	struct imap_client *client;			/* Current IMAP client for proxied connections to remote servers (if any) */
 	struct imap_client_list clients;	/* List of all IMAP clients to remote servers */
 	struct stringlist remotemailboxes;	/* List of remote mailboxes */
+	struct imap_remote_map *remotemap;	/* Compiled .imapremote mappings */
 	unsigned int uidvalidity;
 	unsigned int uidnext;
 	unsigned long highestmodseq;	/* Cached HIGHESTMODSEQ for current folder */
@@ -183,8 +186,17 @@ extern int imap_debug_level;
 
 void send_untagged_fetch(struct imap_session *imap, int seqno, unsigned int uid, unsigned long modseq, const char *newflags);
 
-int imap_in_range(struct imap_session *imap, const char *s, int num);
+/*!
+ * \brief Parse a sequence set (or $, for the saved search) once, for matching against each message in a command
+ * \param imap
+ * \param sequences Sequence set
+ * \param[out] usinguid If sequences is $, set to whether the saved search consists of UIDs. May be NULL.
+ * \return NULL if the saved search does not exist or on allocation failure
+ * \return Parsed sequence set, which must be freed using range_set_free
+ */
+struct range_set *imap_sequence_set(struct imap_session *imap, const char *sequences, int *usinguid);
 
-unsigned int imap_msg_in_range(struct imap_session *imap, int seqno, const char *filename, const char *sequences, int usinguid, int *error);
+/*! \retval 0 if not in range, UID if in range */
+unsigned int imap_msg_in_range(const struct range_set *set, int seqno, const char *filename, int usinguid);
 
 int local_status(struct imap_session *imap, struct imap_traversal *traversal, const char *mailbox, const char *items);
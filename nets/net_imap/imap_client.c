@@ -20,6 +20,8 @@
 #include "include/bbs.h"
 
 #include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "include/node.h"
 #include "include/user.h"
@@ -814,12 +816,338 @@ int imap_client_mapping_file(struct imap_session *imap, char *buf, size_t len)
 	return bbs_transfer_home_config_file(imap->node->user->id, ".imapremote", buf, len);
 }
 
-static struct imap_client *__load_virtual_mailbox(struct imap_session *imap, const char *path, int *exists, int load, int prefixonly)
+/*! \brief A single line in a .imapremote file */
+struct remote_mapping {
+	char *url;							/* Remote URL, including credentials (in the map's locked memory) */
+	struct remote_mapping *next;		/* Next mapping, in file order */
+	char prefix[];						/* Local (virtual) mailbox prefix */
+};
+
+/*! \brief Prefix trie node. Every node lies on the path to at least one mapping. */
+struct remote_trie_node {
+	struct remote_trie_node *children;	/* First child */
+	struct remote_trie_node *next;		/* Next sibling */
+	struct remote_mapping *mapping;		/* Mapping whose prefix ends at this node, if any */
+	char c;
+};
+
+/*! \brief Compiled .imapremote file */
+struct imap_remote_map {
+	struct remote_trie_node root;
+	struct remote_mapping *mappings;	/* All mappings, in file order */
+	char *secure;						/* Locked memory holding all the URLs */
+	size_t securelen;
+	time_t mtime;						/* mtime of file when loaded */
+	off_t size;							/* Size of file when loaded */
+	int refcount;
+};
+
+/*! \brief Protects imap->remotemap and map refcounts. Only held briefly. */
+static bbs_mutex_t remotemap_lock = BBS_MUTEX_INITIALIZER;
+
+/*! \brief Allocate memory that won't be swapped out or included in core dumps, for holding credentials */
+static char *secure_alloc(size_t len, size_t *restrict alloclen)
+{
+	char *buf;
+	size_t pagesize = (size_t) sysconf(_SC_PAGESIZE);
+
+	len = (len + pagesize - 1) & ~(pagesize - 1); /* Round up to a multiple of the page size */
+	buf = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buf == MAP_FAILED) {
+		bbs_error("mmap failed: %s\n", strerror(errno));
+		return NULL;
+	}
+	if (mlock(buf, len)) {
+		/* Not fatal, RLIMIT_MEMLOCK may be too low */
+		bbs_debug(3, "mlock failed: %s\n", strerror(errno));
+	}
+#ifdef MADV_DONTDUMP
+	madvise(buf, len, MADV_DONTDUMP);
+#endif
+	*alloclen = len;
+	return buf;
+}
+
+static void secure_free(char *buf, size_t len)
+{
+	bbs_memzero(buf, len);
+	munlock(buf, len);
+	munmap(buf, len);
+}
+
+static void remote_trie_free(struct remote_trie_node *node)
+{
+	while (node) {
+		struct remote_trie_node *next = node->next;
+		remote_trie_free(node->children);
+		free(node);
+		node = next;
+	}
+}
+
+static void remote_map_free(struct imap_remote_map *map)
+{
+	struct remote_mapping *mapping;
+
+	remote_trie_free(map->root.children);
+	while ((mapping = map->mappings)) {
+		map->mappings = mapping->next;
+		free(mapping);
+	}
+	if (map->secure) {
+		secure_free(map->secure, map->securelen);
+	}
+	free(map);
+}
+
+static inline struct remote_trie_node *remote_trie_child(struct remote_trie_node *node, char c)
+{
+	for (node = node->children; node; node = node->next) {
+		if (node->c == c) {
+			break;
+		}
+	}
+	return node;
+}
+
+static int remote_map_insert(struct imap_remote_map *map, struct remote_mapping *mapping)
+{
+	const char *s;
+	struct remote_trie_node *node = &map->root;
+
+	for (s = mapping->prefix; *s; s++) {
+		struct remote_trie_node *child = remote_trie_child(node, *s);
+		if (!child) {
+			child = calloc(1, sizeof(*child));
+			if (ALLOC_FAILURE(child)) {
+				return -1;
+			}
+			child->c = *s;
+			child->next = node->children;
+			node->children = child;
+		}
+		node = child;
+	}
+	if (node->mapping) {
+		/* Like before, the first mapping in the file wins */
+		bbs_debug(3, "Ignoring duplicate mapping for '%s'\n", mapping->prefix);
+	} else {
+		node->mapping = mapping;
+	}
+	return 0;
+}
+
+/*!
+ * \brief Find the mapping for a mailbox
+ * \param map
+ * \param path Mailbox name
+ * \return Mapping with the longest prefix of path, or NULL if none
+ */
+static struct remote_mapping *remote_map_match(struct imap_remote_map *map, const char *path)
+{
+	struct remote_mapping *match = NULL;
+	struct remote_trie_node *node = &map->root;
+
+	for (; *path; path++) {
+		node = remote_trie_child(node, *path);
+		if (!node) {
+			break;
+		}
+		if (node->mapping) {
+			match = node->mapping;
+		}
+	}
+	return match;
+}
+
+/*! \brief Whether any mapping starts with path */
+static int remote_map_has_prefix(struct imap_remote_map *map, const char *path)
+{
+	struct remote_trie_node *node = &map->root;
+
+	for (; *path; path++) {
+		node = remote_trie_child(node, *path);
+		if (!node) {
+			return 0;
+		}
+	}
+	return node != &map->root || node->children;
+}
+
+static struct imap_remote_map *remote_map_load(const char *filename, struct stat *st)
 {
 	FILE *fp;
-	char virtcachefile[256];
 	char buf[256];
-	size_t pathlen;
+	size_t urlbytes = 0, used = 0;
+	struct remote_mapping *tail = NULL;
+	struct imap_remote_map *map;
+
+	fp = fopen(filename, "r");
+	if (!fp) {
+		bbs_error("Failed to open %s: %s\n", filename, strerror(errno));
+		return NULL;
+	}
+
+	map = calloc(1, sizeof(*map));
+	if (ALLOC_FAILURE(map)) {
+		fclose(fp);
+		return NULL;
+	}
+	map->mtime = st->st_mtime;
+	map->size = st->st_size;
+
+	/* First pass: figure out how much locked memory we need for all the URLs */
+	while ((fgets(buf, sizeof(buf), fp))) {
+		char *urlstr = strchr(buf, '|');
+		if (urlstr) {
+			urlbytes += strlen(urlstr); /* Includes room for NUL terminator in place of the pipe */
+		}
+	}
+	bbs_memzero(buf, sizeof(buf)); /* Contains password */
+	if (!urlbytes) {
+		fclose(fp);
+		return map; /* No mappings */
+	}
+	map->secure = secure_alloc(urlbytes, &map->securelen);
+	if (!map->secure) {
+		fclose(fp);
+		remote_map_free(map);
+		return NULL;
+	}
+
+	rewind(fp);
+	while ((fgets(buf, sizeof(buf), fp))) {
+		struct remote_mapping *mapping;
+		char *mpath, *urlstr = buf;
+		size_t urlstrlen;
+
+		mpath = strsep(&urlstr, "|");
+		if (strlen_zero(mpath) || strlen_zero(urlstr) || !strncmp(mpath, "# ", 2)) {
+			continue; /* Illegitimate, or commented out */
+		}
+		bbs_strterm(urlstr, '\r');
+		bbs_strterm(urlstr, '\n');
+		urlstrlen = strlen(urlstr);
+		if (used + urlstrlen + 1 > map->securelen) {
+			bbs_warning("%s modified while being read\n", filename); /* Will get reloaded next time, since the mtime changed */
+			bbs_memzero(urlstr, urlstrlen);
+			break;
+		}
+		mapping = calloc(1, sizeof(*mapping) + strlen(mpath) + 1);
+		if (ALLOC_FAILURE(mapping)) {
+			bbs_memzero(urlstr, urlstrlen);
+			continue;
+		}
+		strcpy(mapping->prefix, mpath); /* Safe */
+		mapping->url = map->secure + used;
+		memcpy(mapping->url, urlstr, urlstrlen + 1);
+		used += urlstrlen + 1;
+		bbs_memzero(urlstr, urlstrlen); /* Contains password */
+		if (remote_map_insert(map, mapping)) {
+			free(mapping);
+			continue;
+		}
+		if (tail) {
+			tail->next = mapping;
+		} else {
+			map->mappings = mapping;
+		}
+		tail = mapping;
+	}
+	fclose(fp);
+	return map;
+}
+
+static void remote_map_unref(struct imap_remote_map *map)
+{
+	int refcount;
+
+	bbs_mutex_lock(&remotemap_lock);
+	refcount = --map->refcount;
+	bbs_mutex_unlock(&remotemap_lock);
+	if (!refcount) {
+		remote_map_free(map);
+	}
+}
+
+/*!
+ * \brief Get a reference to the session's compiled .imapremote mapping, (re)loading it if needed
+ * \param imap
+ * \return Map, which must be released using remote_map_unref
+ * \retval NULL if no mappings
+ */
+static struct imap_remote_map *remote_map_ref(struct imap_session *imap)
+{
+	char filename[256];
+	struct stat st;
+	struct imap_remote_map *map, *oldmap = NULL;
+
+	if (imap_client_mapping_file(imap, filename, sizeof(filename)) || stat(filename, &st)) {
+		/* No mappings (anymore) */
+		bbs_mutex_lock(&remotemap_lock);
+		oldmap = imap->remotemap;
+		imap->remotemap = NULL;
+		bbs_mutex_unlock(&remotemap_lock);
+		if (oldmap) {
+			remote_map_unref(oldmap);
+		}
+		return NULL;
+	}
+
+	bbs_mutex_lock(&remotemap_lock);
+	map = imap->remotemap;
+	if (!map || map->mtime != st.st_mtime || map->size != st.st_size) {
+		/* Reparse the file only if it's changed since we last loaded it */
+		oldmap = map;
+		map = imap->remotemap = remote_map_load(filename, &st);
+		if (map) {
+			map->refcount = 1; /* Session's reference */
+			bbs_debug(5, "Loaded remote mailbox mappings from %s\n", filename);
+		}
+	}
+	if (map) {
+		map->refcount++;
+	}
+	bbs_mutex_unlock(&remotemap_lock);
+
+	if (oldmap) {
+		remote_map_unref(oldmap);
+	}
+	return map;
+}
+
+void imap_client_mappings_destroy(struct imap_session *imap)
+{
+	if (imap->remotemap) {
+		remote_map_unref(imap->remotemap);
+		imap->remotemap = NULL;
+	}
+}
+
+int imap_client_mappings_traverse(struct imap_session *imap, int (*cb)(const char *prefix, const char *url, void *data), void *data)
+{
+	int res = 0;
+	struct remote_mapping *mapping;
+	struct imap_remote_map *map = remote_map_ref(imap);
+
+	if (!map) {
+		return -1;
+	}
+	for (mapping = map->mappings; mapping; mapping = mapping->next) {
+		res = cb(mapping->prefix, mapping->url, data);
+		if (res) {
+			break;
+		}
+	}
+	remote_map_unref(map);
+	return res;
+}
+
+static struct imap_client *__load_virtual_mailbox(struct imap_session *imap, const char *path, int *exists, int load, int prefixonly)
+{
+	struct imap_remote_map *map;
+	struct remote_mapping *mapping;
+	struct imap_client *client = NULL;
 
 	if (imap->client) {
 		/* Reuse the same connection if it's the same account. */
@@ -838,69 +1166,37 @@ static struct imap_client *__load_virtual_mailbox(struct imap_session *imap, con
 		 */
 	}
 
-	if (prefixonly) {
-		pathlen = strlen(path);
-	}
-
 	*exists = 0;
-	if (imap_client_mapping_file(imap, virtcachefile, sizeof(virtcachefile))) {
+	map = remote_map_ref(imap);
+	if (!map) {
 		return NULL;
 	}
-	fp = fopen(virtcachefile, "r");
-	if (!fp) {
+
+	if (prefixonly) {
+		*exists = remote_map_has_prefix(map, path);
+		remote_map_unref(map);
 		return NULL;
 	}
-	while ((fgets(buf, sizeof(buf), fp))) {
-		char *mpath, *urlstr = buf;
-		size_t prefixlen, urlstrlen;
-		mpath = strsep(&urlstr, "|");
-		/* We are not looking for an exact match.
-		 * Essentially, the user defines a "subtree" in the .imapremote file,
-		 * and anything under this subtree should match.
-		 * It doesn't matter if the actual desired mailbox doesn't exist on the remote server,
-		 * that's not our problem, and the client will discover that when doing a SELECT.
-		 */
-
-		if (strlen_zero(urlstr)) {
-			continue; /* Illegitimate */
-		}
-
-		/* Instead of doing prefixlen = strlen(mpath), we can just subtract the pointers */
-		prefixlen = (size_t) (urlstr - mpath - 1); /* Subtract 1 for the space between. */
-		urlstrlen = strlen(urlstr);
-		if (prefixonly && !strncmp(path, mpath, pathlen)) {
-			fclose(fp);
-			*exists = 1;
-			return NULL;
-		}
-		if (!strncmp(mpath, path, prefixlen)) {
-			struct imap_client *client = NULL;
-
-			/* XXX This is most strange.
-			 * This shouldn't matter, but if this fclose occurs AFTER imap_client_get_by_url,
-			 * and we end up recreating the client (because it's stale, connection timed out, etc.)
-			 * it will mess up the new client's TCP connection, and the next time we try to use the
-			 * socket, we'll get a POLLHUP.
-			 * i.e. before fclose it works perfectly fine, and after fclose, the socket returns POLLHUP.
-			 * Mind you, this is a shiny, brand new socket that we just created and successfully read from and wrote to!
-			 * This is pretty obvious code smell, but valgrind doesn't pick anything up,
-			 * and in theory we can do an fclose immediately too, so this works fine,
-			 * I'm not just not satisfied that I can't explain why we need to do this here.
-			 */
-			fclose(fp);
 
-			*exists = 1;
-			if (load) {
-				client = imap_client_get_by_url(imap, mpath, urlstr);
-			}
-			bbs_memzero(urlstr, urlstrlen); /* Contains password */
-			return client;
-		} else {
-			bbs_memzero(urlstr, urlstrlen); /* Contains password */
+	/* We are not looking for an exact match.
+	 * Essentially, the user defines a "subtree" in the .imapremote file,
+	 * and anything under this subtree should match.
+	 * It doesn't matter if the actual desired mailbox doesn't exist on the remote server,
+	 * that's not our problem, and the client will discover that when doing a SELECT.
+	 */
+	mapping = remote_map_match(map, path);
+	if (mapping) {
+		*exists = 1;
+		if (load) {
+			char urlstr[256];
+			/* Parsing the URL modifies it, so use a copy */
+			safe_strncpy(urlstr, mapping->url, sizeof(urlstr));
+			client = imap_client_get_by_url(imap, mapping->prefix, urlstr);
+			bbs_memzero(urlstr, sizeof(urlstr)); /* Contains password */
 		}
 	}
-	fclose(fp);
-	return NULL;
+	remote_map_unref(map);
+	return client;
 }
 
 struct imap_client *load_virtual_mailbox(struct imap_session *imap, const char *path, int *exists)
@@ -102,6 +102,20 @@ int imap_substitute_remote_command(struct imap_client *client, char *s);
  */
 int imap_client_mapping_file(struct imap_session *imap, char *buf, size_t len);
 
+/*! \brief Release the session's compiled .imapremote mappings */
+void imap_client_mappings_destroy(struct imap_session *imap);
+
+/*!
+ * \brief Run a callback for each mapping in the .imapremote file, in file order
+ * \param imap
+ * \param cb Callback function. prefix is the local mailbox prefix and url the remote URL. Return nonzero to stop traversal.
+ * \param data Callback data
+ * \note url contains credentials and must not be modified. Copy it if needed, and zero the copy afterwards.
+ * \retval -1 if no mappings
+ * \return Otherwise, last return value of the callback
+ */
+int imap_client_mappings_traverse(struct imap_session *imap, int (*cb)(const char *prefix, const char *url, void *data), void *data);
+
 /*!
  * \brief Load a remote mailbox
  * \param imap
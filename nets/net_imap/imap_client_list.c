@@ -314,13 +314,31 @@ static int remote_list_parallel(struct bbs_parallel *p, const char *restrict pre
 /*! \brief Mutex to prevent recursion */
 static bbs_mutex_t virt_lock = BBS_MUTEX_INITIALIZER; /* XXX Should most definitely be per mailbox struct, not global */
 
+struct list_virtual_info {
+	struct bbs_parallel *p;
+	struct list_command *lcmd;
+	struct imap_session *imap;
+};
+
+static int list_virtual_mapping(const char *prefix, const char *url, void *data)
+{
+	char server[256];
+	struct list_virtual_info *info = data;
+
+	/* If the task runs serially, it zeroes the URL afterwards, so pass a copy */
+	safe_strncpy(server, url, sizeof(server));
+	/* We don't actually create the client here,
+	 * since TCP and IMAP setup time takes a while,
+	 * we do it inside the job itself! */
+	remote_list_parallel(info->p, prefix, info->lcmd, info->imap, server);
+	bbs_memzero(server, sizeof(server)); /* Contains password */
+	return 0;
+}
+
 int list_virtual(struct imap_session *imap, struct list_command *lcmd)
 {
-	FILE *fp;
-	char virtfile[256];
-	char line[256];
-	int l = 0;
 	struct bbs_parallel p;
+	struct list_virtual_info info;
 
 	/* Folders from the proxied mailbox will need to be translated back and forth */
 	if (bbs_mutex_trylock(&virt_lock)) {
@@ -328,11 +346,7 @@ int list_virtual(struct imap_session *imap, struct list_command *lcmd)
 		return -1;
 	}
 
-	if (imap_client_mapping_file(imap, virtfile, sizeof(virtfile))) {
-		bbs_mutex_unlock(&virt_lock);
-		return -1;
-	}
-	bbs_debug(3, "Checking virtual mailboxes in %s\n", virtfile);
+	bbs_debug(3, "Checking virtual mailboxes\n");
 
 	/* It turns out that we can't just send the cached LIST response from when we first built the cache file,
 	 * because the assumption that mailbox attributes do not change is wrong.
@@ -345,32 +359,17 @@ int list_virtual(struct imap_session *imap, struct list_command *lcmd)
 	 *
 	 * For now, we still keep a cached folder list, but that isn't used anymore at the moment,
 	 * and .imapremote.cache could possibly be removed in the future if there's no good use case for it. */
-	fp = fopen(virtfile, "r");
-	if (!fp) {
-		bbs_mutex_unlock(&virt_lock);
-		return -1;
-	}
-
 	stringlist_empty(&imap->remotemailboxes);
 	bbs_parallel_init(&p, 2, maxuserproxies);
 
+	info.p = &p;
+	info.lcmd = lcmd;
+	info.imap = imap;
 	/* Note that we cache all the directories on all servers at once, since we truncate the file. */
-	while ((fgets(line, sizeof(line), fp))) {
-		char *prefix, *server;
-
-		l++;
-		server = line;
-		prefix = strsep(&server, "|"); /* Use pipe in case mailbox name contains spaces */
-		if (!strncmp(prefix, "# ", 2)) {
-			continue; /* Skip commented lines */
-		}
-
-		/* We don't actually create the client here,
-		 * since TCP and IMAP setup time takes a while,
-		 * we do it inside the job itself! */
-		remote_list_parallel(&p, prefix, lcmd, imap, server);
+	if (imap_client_mappings_traverse(imap, list_virtual_mapping, &info) < 0) {
+		bbs_mutex_unlock(&virt_lock);
+		return -1;
 	}
-	fclose(fp);
 
 	bbs_parallel_join(&p);
 	bbs_mutex_unlock(&virt_lock);
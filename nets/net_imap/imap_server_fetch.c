@@ -23,6 +23,7 @@
 #include <dirent.h>
 
 #include "include/node.h"
+#include "include/range.h"
 
 #include "include/mod_mail.h"
 #include "include/mod_mimeparse.h"
@@ -271,6 +272,218 @@ static int process_fetch_rfc822header(const char *fullname, char *response, size
 	return 0;
 }
 
+/*! \brief RFC 8970 3.1: previews are at most 256 characters */
+#define PREVIEW_MAX_CHARS 256
+
+/*! \brief Limit on bytes, since characters may be multibyte */
+#define PREVIEW_MAX_BYTES 512
+
+struct preview {
+	unsigned int uid;
+	unsigned int keep:1;
+	const char *text;
+};
+
+/*!
+ * \brief Previews are generated once and stored in the .previews file in the maildir root,
+ *        one "UID text" line per message, so listing a mailbox doesn't need to parse every message.
+ */
+struct preview_store {
+	char filename[272];
+	char *data;					/*!< Contents of the file */
+	struct preview *previews;	/*!< Sorted by UID */
+	size_t num;
+	FILE *fp;					/*!< For appending newly generated previews */
+};
+
+static int preview_cmp(const void *a, const void *b)
+{
+	const struct preview *x = a, *y = b;
+	return x->uid < y->uid ? -1 : x->uid > y->uid ? 1 : 0;
+}
+
+/*! \brief Rewrite the store with only the entries marked to keep */
+static int preview_store_rewrite(struct preview_store *store)
+{
+	char tmpfile[sizeof(store->filename) + 4];
+	size_t i;
+	FILE *fp;
+
+	snprintf(tmpfile, sizeof(tmpfile), "%s.tmp", store->filename);
+	fp = fopen(tmpfile, "w");
+	if (!fp) {
+		bbs_error("fopen(%s) failed: %s\n", tmpfile, strerror(errno));
+		return -1;
+	}
+	for (i = 0; i < store->num; i++) {
+		if (store->previews[i].keep) {
+			fprintf(fp, "%u %s\n", store->previews[i].uid, store->previews[i].text);
+		}
+	}
+	fclose(fp);
+	if (rename(tmpfile, store->filename)) {
+		bbs_error("rename(%s) failed: %s\n", tmpfile, strerror(errno));
+		unlink(tmpfile);
+		return -1;
+	}
+	return 0;
+}
+
+static void preview_store_load(struct imap_session *imap, struct preview_store *store)
+{
+	char *s, *line;
+	int length;
+	size_t i, lines;
+	int partial = 0;
+
+	memset(store, 0, sizeof(*store));
+	snprintf(store->filename, sizeof(store->filename), "%s/.previews", imap->dir);
+	if (!bbs_file_exists(store->filename)) {
+		return;
+	}
+	store->data = bbs_file_to_string(store->filename, 0, &length);
+	if (!store->data) {
+		return;
+	}
+	/* If a write was cut short (e.g. crash or disk full), the last line is incomplete.
+	 * Ignore it, since the preview may be truncated, and it'll get generated again if needed. */
+	s = strrchr(store->data, '\n');
+	if (*store->data && (!s || *(s + 1))) {
+		partial = 1;
+		if (s) {
+			*(s + 1) = '\0';
+		}
+	}
+	lines = (size_t) bbs_str_count(store->data, '\n');
+	if (lines) {
+		store->previews = malloc(lines * sizeof(*store->previews));
+		if (ALLOC_FAILURE(store->previews)) {
+			return;
+		}
+	}
+	s = store->data;
+	while (store->num < lines && (line = strsep(&s, "\n"))) {
+		char *uid = strsep(&line, " ");
+		if (!line || !atoi(uid)) {
+			continue; /* Blank line */
+		}
+		store->previews[store->num].uid = (unsigned int) atoi(uid);
+		store->previews[store->num].keep = 1;
+		store->previews[store->num].text = line;
+		store->num++;
+	}
+
+	if (partial) {
+		/* Get rid of the incomplete line now, or anything appended later would be glued onto it */
+		bbs_warning("%s ends with an incomplete line, discarding it\n", store->filename);
+		preview_store_rewrite(store);
+	}
+	for (i = 0; i < store->num; i++) {
+		store->previews[i].keep = 0;
+	}
+	qsort(store->previews, store->num, sizeof(*store->previews), preview_cmp);
+}
+
+static struct preview *preview_store_find(struct preview_store *store, unsigned int uid)
+{
+	struct preview key;
+
+	if (!store->num) {
+		return NULL;
+	}
+	key.uid = uid;
+	return bsearch(&key, store->previews, store->num, sizeof(*store->previews), preview_cmp);
+}
+
+/*! \brief Rewrite the store without entries for messages that no longer exist, if they make up most of it */
+static void preview_store_compact(struct preview_store *store, struct dirent **entries, int files)
+{
+	size_t i, kept = 0;
+
+	if (store->num < 32 || store->num < 2 * (size_t) files) {
+		return;
+	}
+	for (i = 0; i < (size_t) files; i++) {
+		unsigned int uid;
+		struct preview *preview;
+		if (entries[i]->d_type != DT_REG || maildir_parse_uid_from_filename(entries[i]->d_name, &uid)) {
+			continue;
+		}
+		preview = preview_store_find(store, uid);
+		if (preview) {
+			preview->keep = 1;
+			kept++;
+		}
+	}
+
+	if (preview_store_rewrite(store)) {
+		return;
+	}
+	bbs_debug(4, "Compacted %s from %lu to %lu previews\n", store->filename, store->num, kept);
+}
+
+static void preview_store_cleanup(struct preview_store *store)
+{
+	if (store->fp) {
+		fclose(store->fp);
+	}
+	free_if(store->previews);
+	free_if(store->data);
+}
+
+/*! \brief Append a preview as a quoted string, or a literal if it can't be quoted */
+static void append_preview(const char *text, char *response, size_t responselen, char **buf, int *len)
+{
+	const char *s;
+
+	for (s = text; *s; s++) {
+		if (*s == '"' || *s == '\\' || (unsigned char) *s >= 0x80) {
+			SAFE_FAST_COND_APPEND(response, responselen, *buf, *len, 1, "PREVIEW {%lu}\r\n%s", strlen(text), text);
+			return;
+		}
+	}
+	SAFE_FAST_COND_APPEND(response, responselen, *buf, *len, 1, "PREVIEW \"%s\"", text);
+}
+
+static int process_fetch_preview(struct fetch_request *fetchreq, struct preview_store *store, unsigned int uid, const char *fullname, char *response, size_t responselen, char **buf, int *len)
+{
+	struct preview *preview = preview_store_find(store, uid);
+	char *text;
+
+	if (preview) {
+		append_preview(preview->text, response, responselen, buf, len);
+		return 0;
+	} else if (fetchreq->previewlazy) {
+		/* RFC 8970 3.2: client will ask again without LAZY if it really wants it */
+		SAFE_FAST_COND_APPEND(response, responselen, *buf, *len, 1, "PREVIEW NIL");
+		return 0;
+	}
+
+	text = mime_make_preview(fullname, PREVIEW_MAX_CHARS, PREVIEW_MAX_BYTES);
+	if (!text) {
+		SAFE_FAST_COND_APPEND(response, responselen, *buf, *len, 1, "PREVIEW NIL");
+		return 0;
+	}
+	append_preview(text, response, responselen, buf, len);
+
+	/* Store it so we never have to do this again for this message */
+	if (!store->fp) {
+		store->fp = fopen(store->filename, "a");
+		if (!store->fp) {
+			bbs_error("fopen(%s) failed: %s\n", store->filename, strerror(errno));
+		} else {
+			/* Each line is written at once, so concurrent sessions appending to the same file don't interleave.
+			 * This must be done before any other operation on the stream. */
+			setvbuf(store->fp, NULL, _IOLBF, 0);
+		}
+	}
+	if (store->fp) {
+		fprintf(store->fp, "%u %s\n", uid, text);
+	}
+	free(text);
+	return 0;
+}
+
 static int process_fetch_finalize(struct imap_session *imap, struct fetch_request *fetchreq, int seqno, const char *fullname, char *response, size_t responselen, char **buf, int *len)
 {
 	char headers[10000] = ""; /* XXX Large enough for all headers, etc.? Better might be sendfile, no buffering */
@@ -577,29 +790,40 @@ static int process_fetch(struct imap_session *imap, int usinguid, struct fetch_r
 	struct dirent *entry, **entries;
 	int files, fno = 0;
 	int seqno = 0;
-	int error = 0;
 	int fetched = 0;
+	struct range_set *set;
+	struct preview_store previews;
+
+	set = imap_sequence_set(imap, sequences, &usinguid);
+	if (!set) {
+		if (tagged) {
+			imap_reply(imap, "BAD Invalid saved search");
+		}
+		return 0;
+	}
 
 	/* use scandir instead of opendir/readdir since we need ordering, even for message sequence numbers */
 	files = scandir(imap->curdir, &entries, NULL, imap_uidsort);
 	if (files < 0) {
 		bbs_error("scandir(%s) failed: %s\n", imap->curdir, strerror(errno));
+		range_set_free(set);
 		return -1;
 	}
 
+	if (fetchreq->preview) {
+		preview_store_load(imap, &previews);
+		preview_store_compact(&previews, entries, files);
+	}
+
 	if (fetchreq->vanished) { /* First, send any VANISHED responses if needed */
-		char *uidrangebuf = malloc(strlen(sequences) + 1);
-		if (uidrangebuf) {
-			/* Since VANISHED is only with UID FETCH, the sequences are in fact UID sequences, perfect! */
-			char *expunged = maildir_get_expunged_since_modseq(imap->curdir, fetchreq->changedsince, uidrangebuf, 0, sequences);
-			free(uidrangebuf);
-			imap_send(imap, "VANISHED (EARLIER) %s", S_IF(expunged));
-			free_if(expunged);
-		}
+		/* Since VANISHED is only with UID FETCH, the sequences are in fact UID sequences, perfect! */
+		char *expunged = maildir_get_expunged_since_modseq(imap->curdir, fetchreq->changedsince, 0, set);
+		imap_send(imap, "VANISHED (EARLIER) %s", S_IF(expunged));
+		free_if(expunged);
 	}
 
 	while (fno < files && (entry = entries[fno++])) {
-		char response[1024];
+		char response[1024 + PREVIEW_MAX_BYTES];
 		char *buf = response;
 		int len = sizeof(response);
 		unsigned int msguid;
@@ -610,7 +834,7 @@ static int process_fetch(struct imap_session *imap, int usinguid, struct fetch_r
 		if (entry->d_type != DT_REG || !strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) {
 			goto cleanup;
 		}
-		msguid = imap_msg_in_range(imap, ++seqno, entry->d_name, sequences, usinguid, &error);
+		msguid = imap_msg_in_range(set, ++seqno, entry->d_name, usinguid);
 		if (!msguid) {
 			goto cleanup;
 		}
@@ -668,6 +892,9 @@ static int process_fetch(struct imap_session *imap, int usinguid, struct fetch_r
 		if (fetchreq->envelope && process_fetch_envelope(fullname, response, sizeof(response), &buf, &len)) {
 			goto cleanup;
 		}
+		if (fetchreq->preview && process_fetch_preview(fetchreq, &previews, msguid, fullname, response, sizeof(response), &buf, &len)) {
+			goto cleanup;
+		}
 
 		/* Handle the header/body stuff and actually send the response. */
 		if (process_fetch_finalize(imap, fetchreq, seqno, fullname, response, sizeof(response), &buf, &len)) {
@@ -683,15 +910,15 @@ cleanup:
 		free(entry);
 	}
 	free(entries);
+	range_set_free(set);
+	if (fetchreq->preview) {
+		preview_store_cleanup(&previews);
+	}
 	if (!fetched) {
 		bbs_debug(6, "FETCH command did not return any matching results\n");
 	}
 	if (tagged) {
-		if (error) {
-			imap_reply(imap, "BAD Invalid saved search");
-		} else {
-			imap_reply(imap, "OK %sFETCH Completed", usinguid ? "UID " : "");
-		}
+		imap_reply(imap, "OK %sFETCH Completed", usinguid ? "UID " : "");
 	}
 	return 0;
 }
@@ -881,6 +1108,20 @@ int handle_fetch_full(struct imap_session *imap, char *s, int usinguid, int tagg
 			fetchreq.uid = 1;
 		} else if (!strcmp(item, "MODSEQ")) {
 			fetchreq.modseq = 1;
+		} else if (!strcmp(item, "PREVIEW")) {
+			fetchreq.preview = 1;
+			/* RFC 8970 3.2: optional modifiers, of which LAZY is the only one */
+			if (items && *items == '(') {
+				char *mod, *mods = parensep(&items);
+				while ((mod = strsep(&mods, " "))) {
+					if (!strcasecmp(mod, "LAZY")) {
+						fetchreq.previewlazy = 1;
+					} else if (!strlen_zero(mod)) {
+						imap_reply(imap, "BAD [CLIENTBUG] Unsupported PREVIEW modifier");
+						return 0;
+					}
+				}
+			}
 		/* Special macros, defined in RFC 3501. They must only be used by themselves, which makes their usage easy for us. Just expand them. */
 		} else if (!strcmp(item, "ALL")) { /* FLAGS INTERNALDATE RFC822.SIZE ENVELOPE */
 			fetchreq.flags = item;
@@ -31,6 +31,8 @@ struct fetch_request {
 	unsigned int uid:1;
 	unsigned int modseq:1;
 	unsigned int vanished:1;
+	unsigned int preview:1;
+	unsigned int previewlazy:1;		/*!< PREVIEW (LAZY): don't generate previews that aren't stored yet */
 };
 
 /*! \brief strsep-like FETCH items tokenizer */
@@ -177,6 +177,8 @@ struct imap_search_key {
 		const char *string;
 		struct imap_search_keys *keys;			/* Child key (if any) */
 	} child;
+	struct range_set *set;					/* Parsed sequence set, for UID and sequence number set keys */
+	unsigned int setfailed:1;				/* Sequence set could not be parsed */
 	RWLIST_ENTRY(imap_search_key) entry;	/* Next key at this level */
 };
 
@@ -204,6 +206,9 @@ static void imap_search_free(struct imap_search_keys *skeys)
 			imap_search_free(skey->child.keys);
 			free(skey->child.keys);
 		}
+		if (skey->set) {
+			range_set_free(skey->set);
+		}
 		free(skey);
 	}
 }
@@ -512,7 +517,7 @@ static int parse_search_query(struct imap_session *imap, struct imap_search_keys
 			if (!nk) {
 				return -1;
 			}
-			nk->child.string = next; /* We store the literal '$' here, but this will get resolved in imap_in_range */
+			nk->child.string = next; /* We store the literal '$' here, but this will get resolved in search_in_range */
 			listsize++;
 		} else {
 			bbs_warning("Foreign IMAP search key: %s\n", next);
@@ -744,6 +749,23 @@ static int search_sent_date(struct imap_search *search, struct tm *tm)
 
 #define TM_DATE_EQUAL(tm1, tm2) (tm1.tm_year == tm1.tm_year && tm1.tm_mon == tm2.tm_mon && tm1.tm_mday == tm2.tm_mday)
 
+/*! \brief Check if a sequence number or UID matches a sequence set key, parsing the set the first time it's needed */
+static int search_in_range(struct imap_session *imap, struct imap_search_key *skey, unsigned int num)
+{
+	if (!skey->set) {
+		if (skey->setfailed) {
+			return 0;
+		}
+		/* The key type already accounts for savedsearchuid (don't need to, and can't, do that here) */
+		skey->set = imap_sequence_set(imap, skey->child.string, NULL);
+		if (!skey->set) {
+			SET_BITFIELD(skey->setfailed, 1); /* Don't try again for every message */
+			return 0;
+		}
+	}
+	return range_set_contains(skey->set, num);
+}
+
 /*! \brief Recursively evaluate if a message matches a tree of search expressions */
 static int search_keys_eval(struct imap_search_keys *skeys, enum imap_search_type type, struct imap_search *search)
 {
@@ -811,7 +833,7 @@ static int search_keys_eval(struct imap_search_keys *skeys, enum imap_search_typ
 			case IMAP_SEARCH_UID:
 				if (!search->new) {
 					maildir_parse_uid_from_filename(search->filename, &uid);
-					retval = imap_in_range(search->imap, skey->child.string, (int) uid);
+					retval = search_in_range(search->imap, skey, uid);
 				} else {
 					/* XXX messages in new don't have a UID, so by definition it can't match */
 					retval = 0;
@@ -827,7 +849,7 @@ static int search_keys_eval(struct imap_search_keys *skeys, enum imap_search_typ
 				}
 				break;
 			case IMAP_SEARCH_SEQUENCE_NUMBER_SET:
-				retval = imap_in_range(search->imap, skey->child.string, search->seqno);
+				retval = search_in_range(search->imap, skey, (unsigned int) search->seqno);
 				break;
 			case IMAP_SEARCH_BCC:
 				SEARCH_HEADER_MATCH("Bcc");
@@ -103,6 +103,8 @@ static char irc_hostname[84];
 static char motd_file[256];
 static char *motdstring = NULL;
 
+static unsigned int relay_queue_max = 500;
+
 static int load_config(void);
 
 /* ChatZilla/Ambassador interface guide: http://chatzilla.hacksrus.com/intro */
@@ -274,11 +276,34 @@ struct irc_channel {
 
 static RWLIST_HEAD_STATIC(channels, irc_channel);	/* Container for all channels */
 
+/*! \brief A message pending asynchronous delivery to a relay */
+struct relay_queued_msg {
+	struct irc_relay_message rmsg;
+	size_t msglen;
+	RWLIST_ENTRY(relay_queued_msg) entry;
+	char data[];
+};
+
+RWLIST_HEAD(relay_queue, relay_queued_msg);
+
 struct irc_relay {
 	int (*relay_send)(struct irc_relay_message *rmsg);
 	int (*nicklist)(struct bbs_node *node, int fd, int numeric, const char *requsername, const char *channel, const char *user);
 	int (*privmsg)(const char *recipient, const char *sender, const char *user);
 	void *mod;
+	unsigned int flags;				/* enum irc_relay_flags */
+	/* Asynchronous delivery */
+	struct relay_queue queue;		/* Messages pending delivery. The list lock also protects the counters below. */
+	pthread_t thread;				/* Worker thread draining the queue */
+	int alertpipe[2];				/* Signaled when the queue becomes non-empty */
+	unsigned int queued;			/* Current queue depth */
+	unsigned int highwater;			/* Maximum queue depth */
+	unsigned long enqueued;			/* Total messages queued */
+	unsigned long delivered;		/* Total messages delivered */
+	unsigned long coalesced;		/* Total messages merged into a previous message */
+	unsigned long batches;			/* Total times the queue was drained */
+	unsigned long dropped;			/* Total messages dropped because the queue was full */
+	unsigned int shutdown:1;		/* Relay is being unregistered */
 	RWLIST_ENTRY(irc_relay) entry;
 };
 
@@ -329,10 +354,159 @@ static int add_operator(const char *name, const char *password)
  * in modules.conf to guarantee things will work properly. So, whatever...
  */
 
+/*! \brief Whether a queued message can be appended to the previous one as a multi-line message */
+static int relay_msg_coalescable(struct relay_queued_msg *prev, struct relay_queued_msg *next)
+{
+	if (!prev->rmsg.sender || !next->rmsg.sender) {
+		return 0; /* Don't merge system messages (joins, parts, etc.) */
+	} else if (*prev->rmsg.msg == 0x01 || *next->rmsg.msg == 0x01) {
+		return 0; /* CTCP messages must be relayed individually */
+	}
+	return prev->rmsg.sendingmod == next->rmsg.sendingmod && !strcmp(prev->rmsg.channel, next->rmsg.channel) && !strcmp(prev->rmsg.sender, next->rmsg.sender);
+}
+
+static void relay_deliver_batch(struct irc_relay *relay, struct relay_queued_msg *qmsg)
+{
+	char buf[IRC_RELAY_COALESCE_MAXLEN + 1];
+	unsigned long delivered = 0, coalesced = 0;
+
+	bbs_module_ref(relay->mod, 4);
+	while (qmsg) {
+		struct relay_queued_msg *next = RWLIST_NEXT(qmsg, entry);
+		struct irc_relay_message rmsg = qmsg->rmsg;
+		if (relay->flags & IRC_RELAY_COALESCE && next && relay_msg_coalescable(qmsg, next) && qmsg->msglen + 1 + next->msglen <= IRC_RELAY_COALESCE_MAXLEN) {
+			size_t len = qmsg->msglen;
+			memcpy(buf, qmsg->rmsg.msg, len);
+			do {
+				struct relay_queued_msg *merged = next;
+				buf[len++] = '\n';
+				memcpy(buf + len, merged->rmsg.msg, merged->msglen);
+				len += merged->msglen;
+				next = RWLIST_NEXT(merged, entry);
+				free(merged);
+				coalesced++;
+			} while (next && relay_msg_coalescable(qmsg, next) && len + 1 + next->msglen <= IRC_RELAY_COALESCE_MAXLEN);
+			buf[len] = '\0';
+			rmsg.msg = buf;
+		}
+		relay->relay_send(&rmsg);
+		delivered++;
+		free(qmsg);
+		qmsg = next;
+	}
+	bbs_module_unref(relay->mod, 4);
+
+	RWLIST_WRLOCK(&relay->queue);
+	relay->delivered += delivered + coalesced;
+	relay->coalesced += coalesced;
+	relay->batches++;
+	RWLIST_UNLOCK(&relay->queue);
+}
+
+/*! \brief Thread to deliver queued messages to a single relay */
+static void *relay_worker(void *varg)
+{
+	struct irc_relay *relay = varg;
+	int shutdown = 0;
+
+	while (!shutdown) {
+		struct relay_queued_msg *batch;
+		if (bbs_alertpipe_poll(relay->alertpipe, -1) < 0) {
+			break;
+		}
+		bbs_alertpipe_read(relay->alertpipe);
+		/* Take everything that's pending at once, so senders only contend with us briefly */
+		RWLIST_WRLOCK(&relay->queue);
+		batch = RWLIST_FIRST(&relay->queue);
+		RWLIST_FIRST(&relay->queue) = RWLIST_LAST(&relay->queue) = NULL;
+		relay->queued = 0;
+		shutdown = relay->shutdown;
+		RWLIST_UNLOCK(&relay->queue);
+		if (batch) {
+			relay_deliver_batch(relay, batch);
+		}
+	}
+	return NULL;
+}
+
+/*!
+ * \brief Queue a message for delivery to a relay
+ * \note Must be called with the relays list locked
+ * \retval 0 if queued, or dropped because the queue is full
+ * \retval -1 if the message could not be queued at all
+ */
+static int relay_enqueue(struct irc_relay *relay, struct irc_relay_message *rmsg)
+{
+	struct relay_queued_msg *qmsg;
+	size_t chanlen, senderlen, msglen;
+	char *pos;
+
+	chanlen = strlen(rmsg->channel);
+	senderlen = rmsg->sender ? strlen(rmsg->sender) : 0;
+	msglen = strlen(rmsg->msg);
+
+	qmsg = malloc(sizeof(*qmsg) + chanlen + senderlen + msglen + 3);
+	if (ALLOC_FAILURE(qmsg)) {
+		return -1;
+	}
+	memset(qmsg, 0, sizeof(*qmsg));
+	pos = qmsg->data;
+	strcpy(pos, rmsg->channel); /* Safe */
+	qmsg->rmsg.channel = pos;
+	pos += chanlen + 1;
+	if (rmsg->sender) {
+		strcpy(pos, rmsg->sender); /* Safe */
+		qmsg->rmsg.sender = pos;
+		pos += senderlen + 1;
+	}
+	strcpy(pos, rmsg->msg); /* Safe */
+	qmsg->rmsg.msg = pos;
+	qmsg->rmsg.sendingmod = rmsg->sendingmod;
+	qmsg->msglen = msglen;
+
+	RWLIST_WRLOCK(&relay->queue);
+	if (relay->queued >= relay_queue_max) {
+		/* Apply backpressure by shedding load, rather than blocking the sender or growing without bound */
+		if (!(relay->dropped++ % 100)) {
+			bbs_warning("Relay queue for %s is full (%u messages), dropping message (%lu dropped so far)\n", bbs_module_name(relay->mod), relay->queued, relay->dropped);
+		}
+		RWLIST_UNLOCK(&relay->queue);
+		free(qmsg);
+		return 0;
+	}
+	RWLIST_INSERT_TAIL(&relay->queue, qmsg, entry);
+	relay->enqueued++;
+	if (++relay->queued > relay->highwater) {
+		relay->highwater = relay->queued;
+	}
+	if (relay->queued == 1) {
+		/* Queue was empty, so the worker may be idle. If not, it'll pick this up when it drains the queue next. */
+		bbs_alertpipe_write(relay->alertpipe);
+	}
+	RWLIST_UNLOCK(&relay->queue);
+	return 0;
+}
+
+static void relay_free(struct irc_relay *relay)
+{
+	if (!(relay->flags & IRC_RELAY_SYNC)) {
+		/* Let the worker deliver anything still pending, then exit */
+		RWLIST_WRLOCK(&relay->queue);
+		relay->shutdown = 1;
+		RWLIST_UNLOCK(&relay->queue);
+		bbs_alertpipe_write(relay->alertpipe);
+		bbs_pthread_join(relay->thread, NULL);
+		bbs_alertpipe_close(relay->alertpipe);
+		RWLIST_WRLOCK_REMOVE_ALL(&relay->queue, entry, free);
+		RWLIST_HEAD_DESTROY(&relay->queue);
+	}
+	free(relay);
+}
+
 int __irc_relay_register(int (*relay_send)(struct irc_relay_message *rmsg),
 	int (*nicklist)(struct bbs_node *node, int fd, int numeric, const char *requsername, const char *channel, const char *user),
 	int (*privmsg)(const char *recipient, const char *sender, const char *user),
-	void *mod)
+	unsigned int flags, void *mod)
 {
 	struct irc_relay *relay;
 
@@ -356,6 +530,23 @@ int __irc_relay_register(int (*relay_send)(struct irc_relay_message *rmsg),
 	relay->nicklist = nicklist;
 	relay->privmsg = privmsg;
 	relay->mod = mod;
+	relay->flags = flags;
+	if (!(flags & IRC_RELAY_SYNC)) {
+		RWLIST_HEAD_INIT(&relay->queue);
+		if (bbs_alertpipe_create(relay->alertpipe)) {
+			RWLIST_HEAD_DESTROY(&relay->queue);
+			free(relay);
+			RWLIST_UNLOCK(&relays);
+			return -1;
+		}
+		if (bbs_pthread_create(&relay->thread, NULL, relay_worker, relay)) {
+			bbs_alertpipe_close(relay->alertpipe);
+			RWLIST_HEAD_DESTROY(&relay->queue);
+			free(relay);
+			RWLIST_UNLOCK(&relays);
+			return -1;
+		}
+	}
 	RWLIST_INSERT_HEAD(&relays, relay, entry);
 	bbs_module_ref(BBS_MODULE_SELF, 1); /* Bump our module ref count */
 	RWLIST_UNLOCK(&relays);
@@ -370,7 +561,8 @@ int irc_relay_unregister(int (*relay_send)(struct irc_relay_message *rmsg))
 
 	relay = RWLIST_WRLOCK_REMOVE_BY_FIELD(&relays, relay_send, relay_send, entry);
 	if (relay) {
-		free(relay);
+		/* Now that the relay is no longer in the list, nothing else can be queued to it */
+		relay_free(relay);
 		bbs_module_unref(BBS_MODULE_SELF, 1); /* And decrement the module ref count back again */
 	} else {
 		bbs_error("Relay %p was not previously registered\n", relay_send);
@@ -899,6 +1091,13 @@ static void relay_broadcast(struct irc_channel *channel, struct irc_user *user,
 #endif
 				continue;
 			}
+			if (!(relay->flags & IRC_RELAY_SYNC)) {
+				/* Don't make the sender (and everyone else) wait on slow relays */
+				if (!relay_enqueue(relay, &rmsg)) {
+					continue;
+				}
+				bbs_warning("Failed to queue message for %s, relaying synchronously\n", bbs_module_name(relay->mod));
+			}
 			bbs_module_ref(relay->mod, 4);
 			if (relay->relay_send(&rmsg)) {
 				bbs_module_unref(relay->mod, 4);
@@ -3805,11 +4004,35 @@ static int cli_irc_members(struct bbs_cli_args *a)
 	return 0;
 }
 
+static int cli_irc_relays(struct bbs_cli_args *a)
+{
+	int i = 0;
+	struct irc_relay *relay;
+
+	bbs_dprintf(a->fdout, "%-25s %5s %5s %5s %9s %9s %9s %7s %7s\n", "Module", "Mode", "Queue", "Max", "Queued", "Delivered", "Coalesced", "Batches", "Dropped");
+	RWLIST_RDLOCK(&relays);
+	RWLIST_TRAVERSE(&relays, relay, entry) {
+		i++;
+		if (relay->flags & IRC_RELAY_SYNC) {
+			bbs_dprintf(a->fdout, "%-25s %5s\n", bbs_module_name(relay->mod), "Sync");
+			continue;
+		}
+		RWLIST_RDLOCK(&relay->queue);
+		bbs_dprintf(a->fdout, "%-25s %5s %5u %5u %9lu %9lu %9lu %7lu %7lu\n",
+			bbs_module_name(relay->mod), "Async", relay->queued, relay->highwater, relay->enqueued, relay->delivered, relay->coalesced, relay->batches, relay->dropped);
+		RWLIST_UNLOCK(&relay->queue);
+	}
+	RWLIST_UNLOCK(&relays);
+	bbs_dprintf(a->fdout, "%d relay%s registered\n", i, ESS(i));
+	return 0;
+}
+
 static struct bbs_cli_entry cli_commands_irc[] = {
 	BBS_CLI_COMMAND(cli_irc_users, "irc users", 2, "List all IRC users", NULL),
 	BBS_CLI_COMMAND(cli_irc_whowas, "irc whowas", 2, "List all former IRC users", NULL),
 	BBS_CLI_COMMAND(cli_irc_channels, "irc chans", 2, "List all IRC channels", NULL),
 	BBS_CLI_COMMAND(cli_irc_members, "irc members", 3, "List all members in an IRC channel", "irc members <channel>"),
+	BBS_CLI_COMMAND(cli_irc_relays, "irc relays", 2, "List all IRC relays and their queue statistics", NULL),
 };
 
 /*! \brief Thread to handle a single IRC/IRCS client */
@@ -3898,6 +4121,7 @@ static int load_config(void)
 	motd_file[0] = '\0';
 	bbs_config_val_set_str(cfg, "general", "motdfile", motd_file, sizeof(motd_file));
 	motd_last_read = 0; /* Force rereading MOTD from disk */
+	bbs_config_val_set_uint(cfg, "general", "relayqueuesize", &relay_queue_max);
 
 	if (s_strlen_zero(irc_hostname)) {
 		safe_strncpy(irc_hostname, bbs_hostname(), sizeof(irc_hostname)); /* Default to BBS hostname */
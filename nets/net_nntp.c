@@ -28,6 +28,7 @@
 #include <signal.h>
 #include <unistd.h>
 #include <dirent.h>
+#include <limits.h>
 
 #include "include/tls.h"
 
@@ -701,6 +702,10 @@ cleanup2:
 	return 0;
 }
 
+/*!
+ * \brief Parse an article range (RFC 3977 3.1.1), i.e. a single number, N- or N-M
+ * \note For N-, the range extends through the last article, so max is set to INT_MAX
+ */
 static int parse_min_max(char *s, int *min, int *max, char sep)
 {
 	char *tmp;
@@ -712,7 +717,7 @@ static int parse_min_max(char *s, int *min, int *max, char sep)
 	}
 	*tmp++ = '\0';
 	*min = atoi(s);
-	*max = atoi(tmp);
+	*max = strlen_zero(tmp) ? INT_MAX : atoi(tmp);
 	return 0;
 }
 
@@ -1041,8 +1046,8 @@ static int nntp_process(struct nntp_session *nntp, char *s, size_t len)
 		scan_newsgroup(group, &min, &max, &total);
 		nntp_send(nntp, 211, "%d %d %d %s", total, min, max, s);
 		nntp->currentarticle = min;
-	} else if (nntp->mode == NNTP_MODE_READER && !strcasecmp(command, "XOVER")) {
-		/* RFC 2980 XOVER */
+	} else if (nntp->mode == NNTP_MODE_READER && (!strcasecmp(command, "OVER") || !strcasecmp(command, "XOVER"))) {
+		/* RFC 2980 XOVER, standardized as OVER in RFC 3977 */
 		/* Thunderbird-based clients prefer XOVER to HEAD, and will only issue a HEAD if XOVER is not available. */
 		/* XXX For some reason, Thunderbird-based clients bork on HEAD and don't show any body (and don't ask for it),
 		 * but with XOVER, no matter how complete/incomplete the response, it'll issue an ARTICLE and get the whole thing properly.
@@ -1051,7 +1056,7 @@ static int nntp_process(struct nntp_session *nntp, char *s, size_t len)
 		int min, max;
 
 		REQUIRE_GROUP();
-		if (strlen_zero(s)) {
+		if (!strlen_zero(s)) {
 			parse_min_max(s, &min, &max, '-');
 		} else {
 			if (!nntp->currentarticle) {
@@ -63,6 +63,7 @@
 #include "include/mail.h"
 #include "include/cli.h"
 #include "include/callback.h"
+#include "include/parallel.h"
 
 #include "include/mod_mail.h"
 #include "include/net_smtp.h"
@@ -87,6 +88,12 @@ static int validatespf = 1;
 static int add_received_msa = 0;
 static int archivelists = 1;
 
+/* Pre-greeting triage of MTA connections */
+static int triage_enabled = 0;
+static unsigned int triage_wait = 3000;
+static unsigned int triage_max_per_ip = 10;
+static unsigned int triage_pass_ttl = 86400;
+
 static struct stringlist trusted_relays;
 static struct stringlist starttls_exempt;
 
@@ -418,9 +425,204 @@ static int fcrdns_check(struct smtp_session *smtp)
 	return 0;
 }
 
+/*! \brief A client that has been seen by the pre-greeting triage */
+struct triage_client {
+	struct triage_client *next;
+	time_t passed;			/*!< Time at which the client last passed triage, 0 if never */
+	unsigned int sessions;	/*!< Number of SMTP sessions in progress from this client */
+	unsigned int held;		/*!< Number of connections from this client currently held by triage */
+	char ip[];
+};
+
+#define TRIAGE_BUCKETS 256
+
+static struct triage_client *triage_clients[TRIAGE_BUCKETS];
+static bbs_mutex_t triage_lock = BBS_MUTEX_INITIALIZER;
+
+static unsigned int triage_bucket(const char *ip)
+{
+	unsigned int hash = 0;
+
+	while (*ip) {
+		hash = hash * 31 + (unsigned char) *ip++;
+	}
+	return hash % TRIAGE_BUCKETS;
+}
+
+/*!
+ * \brief Find a client's triage entry, pruning stale entries in the same bucket along the way
+ * \param ip
+ * \param create Whether to create the entry if it doesn't exist
+ * \note Must be called with triage_lock held
+ */
+static struct triage_client *triage_client_get(const char *ip, int create)
+{
+	struct triage_client *c, *next, *prev = NULL, **bucket = &triage_clients[triage_bucket(ip)];
+	time_t now = time(NULL);
+
+	for (c = *bucket; c; c = next) {
+		next = c->next;
+		if (!strcmp(c->ip, ip)) {
+			return c;
+		}
+		if (!c->sessions && !c->held && c->passed + (time_t) triage_pass_ttl < now) {
+			if (prev) {
+				prev->next = next;
+			} else {
+				*bucket = next;
+			}
+			free(c);
+			continue;
+		}
+		prev = c;
+	}
+
+	if (!create) {
+		return NULL;
+	}
+	c = calloc(1, sizeof(*c) + strlen(ip) + 1);
+	if (ALLOC_FAILURE(c)) {
+		return NULL;
+	}
+	strcpy(c->ip, ip); /* Safe */
+	c->next = *bucket;
+	*bucket = c;
+	return c;
+}
+
+/*! \brief Whether a client passed triage recently enough that it doesn't need to be checked again */
+static int triage_passed(const char *ip)
+{
+	struct triage_client *c;
+	int passed;
+
+	bbs_mutex_lock(&triage_lock);
+	c = triage_client_get(ip, 0);
+	passed = c && c->passed && c->passed + (time_t) triage_pass_ttl >= time(NULL);
+	bbs_mutex_unlock(&triage_lock);
+	return passed;
+}
+
+/*! \brief Adjust the number of SMTP sessions in progress from a client */
+static void triage_session_count(const char *ip, int delta)
+{
+	struct triage_client *c;
+
+	bbs_mutex_lock(&triage_lock);
+	c = triage_client_get(ip, delta > 0);
+	if (c) {
+		if (delta > 0) {
+			c->sessions++;
+		} else if (c->sessions) {
+			c->sessions--;
+		}
+	}
+	bbs_mutex_unlock(&triage_lock);
+}
+
+static void triage_purge(void)
+{
+	int i;
+
+	bbs_mutex_lock(&triage_lock);
+	for (i = 0; i < TRIAGE_BUCKETS; i++) {
+		struct triage_client *c;
+		while ((c = triage_clients[i])) {
+			triage_clients[i] = c->next;
+			free(c);
+		}
+	}
+	bbs_mutex_unlock(&triage_lock);
+}
+
+struct smtp_screener {
+	enum smtp_screen_action (*cb)(const char *ip, char *buf, size_t len);
+	void *mod;
+	RWLIST_ENTRY(smtp_screener) entry;
+};
+
+static RWLIST_HEAD_STATIC(screeners, smtp_screener);
+
+int __smtp_register_screener(enum smtp_screen_action (*cb)(const char *ip, char *buf, size_t len), void *mod)
+{
+	struct smtp_screener *s;
+
+	s = calloc(1, sizeof(*s));
+	if (ALLOC_FAILURE(s)) {
+		return -1;
+	}
+
+	s->cb = cb;
+	s->mod = mod;
+
+	RWLIST_WRLOCK(&screeners);
+	RWLIST_INSERT_TAIL(&screeners, s, entry);
+	RWLIST_UNLOCK(&screeners);
+	return 0;
+}
+
+int smtp_unregister_screener(enum smtp_screen_action (*cb)(const char *ip, char *buf, size_t len))
+{
+	struct smtp_screener *s;
+
+	s = RWLIST_WRLOCK_REMOVE_BY_FIELD(&screeners, cb, cb, entry);
+	if (!s) {
+		bbs_error("Couldn't remove screener %p\n", cb);
+		return -1;
+	}
+	free(s);
+	return 0;
+}
+
+/*!
+ * \brief Run all connection screeners for a connection
+ * \retval -1 if connection should be dropped, 0 otherwise
+ */
+static int screen_connection(struct smtp_session *smtp)
+{
+	struct smtp_screener *s;
+	enum smtp_screen_action action = SMTP_SCREEN_ACCEPT;
+	char reason[256] = "";
+
+	RWLIST_RDLOCK(&screeners);
+	RWLIST_TRAVERSE(&screeners, s, entry) {
+		enum smtp_screen_action res;
+		bbs_module_ref(s->mod, 7);
+		res = s->cb(smtp->node->ip, reason, sizeof(reason));
+		bbs_module_unref(s->mod, 7);
+		if (res > action) {
+			action = res;
+			if (action == SMTP_SCREEN_REJECT) {
+				break;
+			}
+		}
+	}
+	RWLIST_UNLOCK(&screeners);
+
+	switch (action) {
+		case SMTP_SCREEN_REJECT:
+			bbs_smtp_log(2, smtp, "Connection from %s rejected by screening\n", smtp->node->ip);
+			/* RFC 5321 3.1: A 554 greeting means no SMTP service here. The client may then QUIT, but we don't need to wait for that. */
+			smtp_reply_nostatus(smtp, 554, "%s", S_OR(reason, "Connection refused"));
+			return -1;
+		case SMTP_SCREEN_TARPIT:
+			bbs_debug(3, "Connection from %s will be tarpitted\n", smtp->node->ip);
+			smtp->failures += 5; /* Same penalty as a failed FCrDNS check */
+			break;
+		case SMTP_SCREEN_ACCEPT:
+			break;
+	}
+	return 0;
+}
+
 static int handle_connect(struct smtp_session *smtp)
 {
 	if (!smtp->msa) {
+		/* Screen the connection before sending anything at all, so a rejected client never sees the banner */
+		if (screen_connection(smtp)) {
+			return -1;
+		}
+
 		/* We're allowed to send multiple banner lines, just with any other SMTP response.
 		 * This is something that postscreen does for postfix (PREGREET check).
 		 * After sending a line, if we get any input from the client, that is invalid.
@@ -448,7 +650,9 @@ static int handle_connect(struct smtp_session *smtp)
 		/* This works even with TLS, because of the TLS I/O thread, it's either socket or pipe activity.
 		 * Then again, that doesn't matter because for MTAs, TLS isn't yet set up at this point in the connection,
 		 * so the SMTP file descriptor refers to the actual node socket, not a pipe. */
-		if (bbs_poll(smtp->rfd, 100)) { /* Guarantees up to a minimum 100ms sleep */
+		if (triage_enabled && triage_passed(smtp->node->ip)) {
+			/* Already vetted by the pre-greeting triage, which waited much longer than we would here */
+		} else if (bbs_poll(smtp->rfd, 100)) { /* Guarantees up to a minimum 100ms sleep */
 			/* We don't know what was received (or even how many bytes) since we haven't called read() yet, but we could peek: */
 			size_t bytes = 0;
 			if (ioctl(smtp->rfd, FIONREAD, &bytes)) {
@@ -1358,11 +1562,212 @@ static const char *smtp_filter_direction_name(enum smtp_direction dir)
 	}
 }
 
+/*! \brief Whether a filter should run for a particular message */
+static int filter_applicable(struct smtp_filter *f, struct smtp_filter_data *fdata)
+{
+	if (!(f->direction & fdata->dir)) {
+		bbs_debug(5, "Ignoring %s SMTP filter %s %p (wrong direction)...\n", smtp_filter_direction_name(f->direction), smtp_filter_type_name(f->type), f);
+		return 0;
+	}
+
+	/*! \todo SMTP_SCOPE_COMBINED is not currently supported for SMTP_DIRECTION_OUT.
+	 * That is treated as SMTP_SCOPE_INDIVIDUAL for now, for the sake of transparency. */
+	if (fdata->dir == SMTP_DIRECTION_OUT && f->scope == SMTP_SCOPE_COMBINED) {
+		bbs_debug(3, "Treating COMBINED filter as individual due to current lack of native COMBINED/OUT support\n");
+	} else
+
+	/* Filter applicable to this direction */
+	if (f->scope == SMTP_SCOPE_INDIVIDUAL) {
+		if (!fdata->recipient) {
+			bbs_debug(5, "Ignoring %s SMTP filter %s %p (wrong scope)...\n", smtp_filter_direction_name(f->direction), smtp_filter_type_name(f->type), f);
+			return 0;
+		}
+	} else {
+		if (fdata->recipient) {
+			bbs_debug(5, "Ignoring %s SMTP filter %s %p (wrong scope)...\n", smtp_filter_direction_name(f->direction), smtp_filter_type_name(f->type), f);
+			return 0;
+		}
+	}
+	if (fdata->dir == SMTP_DIRECTION_IN && !fdata->node) {
+		/* Something like a Delivery Status Notification or other injected mail without a node... filters don't apply anyways.
+		 * Unless, it's simply adding the Received header, in which case, still do it,
+		 * for things like mailing lists which involve using smtp_inject. */
+		if (f->priority != 0) {
+			bbs_debug(5, "Ignoring %s SMTP filter %s %p (no node)...\n", smtp_filter_direction_name(f->direction), smtp_filter_type_name(f->type), f);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static int run_filter(struct smtp_filter *f, struct smtp_filter_data *fdata)
+{
+	int res = 0;
+
+	bbs_debug(4, "Executing %s SMTP filter %s %p...\n", smtp_filter_direction_name(f->direction), smtp_filter_type_name(f->type), f);
+	bbs_module_ref(f->mod, 2);
+	if (f->type == SMTP_FILTER_PREPEND) {
+		bbs_assert_exists(f->provider);
+		res = f->provider->on_body(fdata);
+	} else {
+		bbs_error("Filter type %d not supported\n", f->type);
+	}
+	bbs_module_unref(f->mod, 2);
+	if (res < 0) {
+		bbs_warning("%s SMTP filter %s %p failed to execute\n", smtp_filter_direction_name(f->direction), smtp_filter_type_name(f->type), f);
+	}
+	return res;
+}
+
+/*! \brief Maximum number of filters that will be run concurrently */
+#define MAX_CONCURRENT_FILTERS 8
+
+struct filter_task {
+	struct smtp_filter *f;
+	struct smtp_filter_data fdata;	/*!< Private copy of filter data for this filter */
+	int res;
+};
+
+/*! \brief A group of filters that don't depend on each other's results */
+struct filter_batch {
+	struct filter_task tasks[MAX_CONCURRENT_FILTERS];
+	int numtasks;
+	enum smtp_filter_result provides;	/*!< Results being computed by filters in the batch */
+	enum smtp_filter_result requires;	/*!< Results needed by filters in the batch */
+};
+
+/*! \brief Whether a filter can be added to the current batch */
+static int batch_compatible(struct filter_batch *b, struct smtp_filter *f)
+{
+	if (!f->provider->concurrent || b->numtasks >= MAX_CONCURRENT_FILTERS) {
+		return 0;
+	}
+	/* Can't use results that aren't available yet, and can't compute results that other filters in the batch are using or computing */
+	if (f->provider->requires & b->provides || f->provider->provides & (b->provides | b->requires)) {
+		return 0;
+	}
+	return 1;
+}
+
+static void batch_add(struct filter_batch *b, struct smtp_filter *f)
+{
+	b->tasks[b->numtasks++].f = f;
+	b->provides |= f->provider->provides;
+	b->requires |= f->provider->requires;
+}
+
+static int filter_task_cb(void *data)
+{
+	struct filter_task *t = data;
+	t->res = run_filter(t->f, &t->fdata);
+	return 0;
+}
+
+/*! \brief Merge the results of a filter that ran concurrently back into the parent filter data */
+static void filter_task_merge(struct smtp_filter_data *fdata, const struct smtp_filter_data *orig, struct filter_task *t)
+{
+	struct smtp_filter_data *tdata = &t->fdata;
+
+	if (tdata->outputfd != -1) {
+		/* Prepend the filter's output in priority order, same as if the filters ran serially */
+		off_t len = lseek(tdata->outputfd, 0, SEEK_END);
+		if (len > 0) {
+			if (fdata->outputfd == -1) {
+				strcpy(fdata->outputfile, "/tmp/smtpXXXXXX");
+				fdata->outputfd = mkstemp(fdata->outputfile);
+				if (fdata->outputfd < 0) {
+					bbs_error("mkstemp failed: %s\n", strerror(errno));
+				}
+			}
+			if (fdata->outputfd != -1) {
+				bbs_copy_file(tdata->outputfd, fdata->outputfd, 0, (int) len);
+			}
+		}
+		close(tdata->outputfd);
+		if (unlink(tdata->outputfile)) {
+			bbs_error("Failed to delete %s: %s\n", tdata->outputfile, strerror(errno));
+		}
+	}
+
+	/* Filters replace (and free) any previous values of the results they provide, so just take ownership of the new ones */
+#define MERGE_RESULT(field) \
+	if (tdata->field != orig->field) { \
+		fdata->field = tdata->field; \
+	}
+	MERGE_RESULT(spf);
+	MERGE_RESULT(dkim);
+	MERGE_RESULT(dmarc);
+	MERGE_RESULT(arc);
+	MERGE_RESULT(authresults);
+#undef MERGE_RESULT
+	fdata->reject |= tdata->reject;
+	fdata->quarantine |= tdata->quarantine;
+}
+
+/*!
+ * \brief Run all filters in a batch
+ * \retval 1 if further filter processing should be aborted, 0 otherwise
+ */
+static int batch_run(struct filter_batch *b, struct smtp_filter_data *fdata)
+{
+	struct bbs_parallel p;
+	struct smtp_filter_data orig;
+	int i, res = 0;
+
+	if (!b->numtasks) {
+		return 0;
+	}
+
+	/* The body is loaded on demand, which isn't safe to do from multiple threads,
+	 * so if we're going to run filters concurrently, load it up front. */
+	if (b->numtasks == 1 || !smtp_message_body(fdata)) {
+		for (i = 0; i < b->numtasks; i++) {
+			res = run_filter(b->tasks[i].f, fdata);
+			lseek(fdata->inputfd, 0, SEEK_SET); /* Rewind to beginning of file */
+			if (res == 1) {
+				break;
+			}
+		}
+		goto done;
+	}
+
+	bbs_debug(4, "Running %d SMTP filters concurrently\n", b->numtasks);
+	orig = *fdata;
+	bbs_parallel_init(&p, 2, (unsigned int) b->numtasks);
+	for (i = 0; i < b->numtasks; i++) {
+		struct filter_task *t = &b->tasks[i];
+		char prefix[32];
+		t->fdata = orig;
+		t->fdata.outputfd = -1;
+		t->fdata.outputfile[0] = '\0';
+		t->res = 0;
+		snprintf(prefix, sizeof(prefix), "%p", t->f); /* Each filter is its own task */
+		bbs_parallel_schedule_task(&p, prefix, t, filter_task_cb, NULL, NULL);
+	}
+	bbs_parallel_join(&p);
+
+	for (i = 0; i < b->numtasks; i++) {
+		filter_task_merge(fdata, &orig, &b->tasks[i]);
+		if (b->tasks[i].res == 1) {
+			res = 1;
+		}
+	}
+
+done:
+	b->numtasks = 0;
+	b->provides = b->requires = 0;
+	if (res == 1) {
+		bbs_debug(5, "Aborting filter execution\n");
+	}
+	return res;
+}
+
 /*! \note This is currently only executed once the entire message has been received.
  * If milter support is added, we'll need hooks at each stage of the delivery process (MAIL FROM, RCPT TO, etc.) */
 void smtp_run_filters(struct smtp_filter_data *fdata, enum smtp_direction dir)
 {
 	struct smtp_filter *f;
+	struct filter_batch batch;
 	int total = 0, run = 0;
 	enum smtp_filter_scope scope = fdata->recipient ? SMTP_SCOPE_INDIVIDUAL : SMTP_SCOPE_COMBINED;
 
@@ -1378,61 +1783,41 @@ void smtp_run_filters(struct smtp_filter_data *fdata, enum smtp_direction dir)
 
 	bbs_debug(4, "Running %s (%s) filters\n", scope == SMTP_SCOPE_COMBINED ? "COMBINED" : "INDIVIDUAL", smtp_filter_direction_name(dir));
 
+	/* Filters that are mostly waiting on DNS or other I/O (SPF, DKIM, ARC, etc.) can run concurrently,
+	 * as long as they don't depend on each other's results.
+	 * Consecutive compatible filters are grouped into a batch, and the batch is run (and joined)
+	 * before any filter that needs the results of filters in it, or that can't run concurrently. */
+	memset(&batch, 0, sizeof(batch));
+
 	RWLIST_RDLOCK(&filters);
 	RWLIST_TRAVERSE(&filters, f, entry) {
-		int res = 0;
+		int res;
 		total++;
-		if (!(f->direction & fdata->dir)) {
-			bbs_debug(5, "Ignoring %s SMTP filter %s %p (wrong direction)...\n", smtp_filter_direction_name(f->direction), smtp_filter_type_name(f->type), f);
+		if (!filter_applicable(f, fdata)) {
 			continue;
 		}
-
-		/*! \todo SMTP_SCOPE_COMBINED is not currently supported for SMTP_DIRECTION_OUT.
-		 * That is treated as SMTP_SCOPE_INDIVIDUAL for now, for the sake of transparency. */
-		if (fdata->dir == SMTP_DIRECTION_OUT && f->scope == SMTP_SCOPE_COMBINED) {
-			bbs_debug(3, "Treating COMBINED filter as individual due to current lack of native COMBINED/OUT support\n");
-		} else
-
-		/* Filter applicable to this direction */
-		if (f->scope == SMTP_SCOPE_INDIVIDUAL) {
-			if (!fdata->recipient) {
-				bbs_debug(5, "Ignoring %s SMTP filter %s %p (wrong scope)...\n", smtp_filter_direction_name(f->direction), smtp_filter_type_name(f->type), f);
-				continue;
-			}
-		} else {
-			if (fdata->recipient) {
-				bbs_debug(5, "Ignoring %s SMTP filter %s %p (wrong scope)...\n", smtp_filter_direction_name(f->direction), smtp_filter_type_name(f->type), f);
-				continue;
-			}
+		run++;
+		if (batch_compatible(&batch, f)) {
+			batch_add(&batch, f);
+			continue;
 		}
-		if (fdata->dir == SMTP_DIRECTION_IN && !fdata->node) {
-			/* Something like a Delivery Status Notification or other injected mail without a node... filters don't apply anyways.
-			 * Unless, it's simply adding the Received header, in which case, still do it,
-			 * for things like mailing lists which involve using smtp_inject. */
-			if (f->priority != 0) {
-				bbs_debug(5, "Ignoring %s SMTP filter %s %p (no node)...\n", smtp_filter_direction_name(f->direction), smtp_filter_type_name(f->type), f);
-				continue;
-			}
+		if (batch_run(&batch, fdata)) {
+			break;
 		}
-		/* Filter applicable to scope */
-		bbs_debug(4, "Executing %s SMTP filter %s %p...\n", smtp_filter_direction_name(f->direction), smtp_filter_type_name(f->type), f);
-		bbs_module_ref(f->mod, 2);
-		if (f->type == SMTP_FILTER_PREPEND) {
-			bbs_assert_exists(f->provider);
-			res = f->provider->on_body(fdata);
-			run++;
-		} else {
-			bbs_error("Filter type %d not supported\n", f->type);
+		if (f->provider->concurrent) {
+			batch_add(&batch, f); /* Start a new batch */
+			continue;
 		}
-		bbs_module_unref(f->mod, 2);
+		res = run_filter(f, fdata);
 		lseek(fdata->inputfd, 0, SEEK_SET); /* Rewind to beginning of file */
 		if (res == 1) {
 			bbs_debug(5, "Aborting filter execution\n");
 			break;
-		} else if (res < 0) {
-			bbs_warning("%s SMTP filter %s %p failed to execute\n", smtp_filter_direction_name(f->direction), smtp_filter_type_name(f->type), f);
 		}
 	}
+	if (!f) {
+		batch_run(&batch, fdata);
+	}
 	RWLIST_UNLOCK(&filters);
 
 	bbs_debug(6, "Ran %d/%d filter%s (skipped %d)\n", run, total, ESS(total), total - run);
@@ -2933,15 +3318,117 @@ static void smtp_handler(struct bbs_node *node, int msa, int secure)
 	smtp_destroy(&smtp);
 }
 
+/*!
+ * \brief Pre-greeting triage of MTA connections, run in the TCP listener thread before any node exists.
+ * \note Clients must not send anything before the banner (RFC 5321 4.3.1), but spambots often do,
+ *       since they don't bother waiting. Clients that wait the full time are remembered for a while,
+ *       so they aren't delayed again on subsequent connections.
+ */
+static int smtp_triage(enum bbs_tcp_triage_event event, int fd, const char *ip)
+{
+	struct triage_client *c;
+	int passed;
+	char ch;
+
+#define TRIAGE_TOO_MANY "421 4.7.0 Too many concurrent connections from your address\r\n"
+#define TRIAGE_BUSY "421 4.3.2 Too busy, try again later\r\n"
+
+	switch (event) {
+		case TCP_TRIAGE_CONNECT:
+			if (is_trusted_relay(ip)) {
+				return 0;
+			}
+			bbs_mutex_lock(&triage_lock);
+			c = triage_client_get(ip, 1);
+			if (c && triage_max_per_ip && c->sessions + c->held >= triage_max_per_ip) {
+				bbs_mutex_unlock(&triage_lock);
+				bbs_debug(3, "Rejecting connection from %s (%u connections already in progress)\n", ip, triage_max_per_ip);
+				bbs_write(fd, TRIAGE_TOO_MANY, STRLEN(TRIAGE_TOO_MANY));
+				return -1;
+			}
+			passed = c && c->passed && c->passed + (time_t) triage_pass_ttl >= time(NULL);
+			if (!passed && c) {
+				c->held++; /* Until TCP_TRIAGE_RELEASE */
+			}
+			bbs_mutex_unlock(&triage_lock);
+			return passed ? 0 : (int) triage_wait;
+		case TCP_TRIAGE_FULL:
+			if (is_trusted_relay(ip)) {
+				return 0;
+			}
+			/* Clients that already passed triage wouldn't have been held anyways, so let them through */
+			bbs_mutex_lock(&triage_lock);
+			c = triage_client_get(ip, 0);
+			if (c && triage_max_per_ip && c->sessions + c->held >= triage_max_per_ip) {
+				bbs_mutex_unlock(&triage_lock);
+				bbs_debug(3, "Rejecting connection from %s (%u connections already in progress)\n", ip, triage_max_per_ip);
+				bbs_write(fd, TRIAGE_TOO_MANY, STRLEN(TRIAGE_TOO_MANY));
+				return -1;
+			}
+			passed = c && c->passed && c->passed + (time_t) triage_pass_ttl >= time(NULL);
+			bbs_mutex_unlock(&triage_lock);
+			if (passed) {
+				return 0;
+			}
+			bbs_debug(3, "Rejecting connection from %s (too many connections held for triage)\n", ip);
+			bbs_write(fd, TRIAGE_BUSY, STRLEN(TRIAGE_BUSY));
+			return -1;
+		case TCP_TRIAGE_INPUT:
+			if (recv(fd, &ch, 1, MSG_PEEK) <= 0) {
+				return -1; /* Client gave up and disconnected */
+			}
+			bbs_warning("Pregreet: %s sent data before the banner\n", ip);
+			bbs_write(fd, "554 5.5.1 Protocol error\r\n", STRLEN("554 5.5.1 Protocol error\r\n"));
+			return -1;
+		case TCP_TRIAGE_EXPIRE:
+			bbs_mutex_lock(&triage_lock);
+			c = triage_client_get(ip, 1);
+			if (c) {
+				c->passed = time(NULL);
+				/* Sessions may have started while we were holding this connection (e.g. from connections that were already exempt),
+				 * so check again now that it would become one. The held count includes this connection. */
+				if (triage_max_per_ip && c->sessions + c->held > triage_max_per_ip) {
+					bbs_mutex_unlock(&triage_lock);
+					bbs_debug(3, "Rejecting connection from %s (%u connections already in progress)\n", ip, triage_max_per_ip);
+					bbs_write(fd, TRIAGE_TOO_MANY, STRLEN(TRIAGE_TOO_MANY));
+					return -1;
+				}
+			}
+			bbs_mutex_unlock(&triage_lock);
+			bbs_debug(5, "%s passed pre-greeting triage\n", ip);
+			return 0;
+		case TCP_TRIAGE_RELEASE:
+			bbs_mutex_lock(&triage_lock);
+			c = triage_client_get(ip, 0);
+			if (c && c->held) {
+				c->held--;
+			}
+			bbs_mutex_unlock(&triage_lock);
+			return 0;
+	}
+#undef TRIAGE_TOO_MANY
+#undef TRIAGE_BUSY
+	return 0;
+}
+
 static void *__smtp_handler(void *varg)
 {
 	struct bbs_node *node = varg;
 	int secure = !strcmp(node->protname, "SMTPS") ? 1 : 0;
+	int counted = triage_enabled && !strcmp(node->protname, "SMTP");
 
 	bbs_node_net_begin(node);
 
+	if (counted) {
+		triage_session_count(node->ip, 1);
+	}
+
 	/* If it's secure, it's for message submission agent, MTAs are never secure by default. */
 	smtp_handler(node, secure || !strcmp(node->protname, "SMTP (MSA)"), secure); /* Actually handle the SMTP/SMTPS/message submission agent client */
+
+	if (counted) {
+		triage_session_count(node->ip, -1);
+	}
 	bbs_node_exit(node);
 	return NULL;
 }
@@ -2981,8 +3468,14 @@ static int load_config(void)
 	bbs_config_val_set_port(cfg, "msa", "port", &msa_port);
 	bbs_config_val_set_true(cfg, "msa", "requirestarttls", &require_starttls);
 
+	/* Pre-greeting triage */
+	bbs_config_val_set_true(cfg, "triage", "enabled", &triage_enabled);
+	bbs_config_val_set_uint(cfg, "triage", "wait", &triage_wait);
+	bbs_config_val_set_uint(cfg, "triage", "maxperip", &triage_max_per_ip);
+	bbs_config_val_set_uint(cfg, "triage", "passttl", &triage_pass_ttl);
+
 /*! \brief Section names that are valid but not parsed in the loop */
-#define VALID_SECT_NAME(s) (!strcmp(s, "general") || !strcmp(s, "logging") || !strcmp(s, "privs") || !strcmp(s, "smtp") || !strcmp(s, "smtps") || !strcmp(s, "msa") || !strcmp(s, "static_relays"))
+#define VALID_SECT_NAME(s) (!strcmp(s, "general") || !strcmp(s, "logging") || !strcmp(s, "privs") || !strcmp(s, "smtp") || !strcmp(s, "smtps") || !strcmp(s, "msa") || !strcmp(s, "triage") || !strcmp(s, "static_relays"))
 
 	while ((section = bbs_config_walk(cfg, section))) {
 		struct bbs_keyval *keyval = NULL;
@@ -3067,6 +3560,9 @@ static int load_module(void)
 		bbs_singular_callback_destroy(&smtp_queue_processor);
 		goto cleanup;
 	}
+	if (smtp_enabled && triage_enabled) {
+		bbs_tcp_listener_set_triage(smtp_port, smtp_triage);
+	}
 
 	bbs_register_tests(tests);
 	bbs_register_mailer(injectmail_simple, injectmail_full, 1);
@@ -3105,6 +3601,7 @@ static int unload_module(void)
 		fclose(smtplogfp);
 	}
 	bbs_singular_callback_destroy(&smtp_queue_processor);
+	triage_purge();
 	return 0;
 }
 
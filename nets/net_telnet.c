@@ -20,6 +20,7 @@
  * \note Supports RFC 1079 Terminal Speed
  * \note Supports RFC 1091 Terminal Type
  * \note Supports RFC 1116 Line Mode (disabling only)
+ * \note Supports MCCP2 (Mud Client Compression Protocol v2) output compression
  *
  * \author Naveen Albert <bbs@phreaknet.org>
  */
@@ -34,6 +35,9 @@
 #include <sys/socket.h>
 #include <netinet/in.h> /* use sockaddr_in */
 
+#define ZLIB_CONST /* next_in is const */
+#include <zlib.h>
+
 /* Expose the telcmds and telopts string arrays */
 #define TELCMDS
 #define TELOPTS
@@ -46,6 +50,7 @@
 #include "include/config.h"
 #include "include/net.h"
 #include "include/tls.h"
+#include "include/alertpipe.h"
 
 static int telnet_socket = -1, telnets_socket = -1, tty_socket = -1, ttys_socket = -1; /*!< TCP Socket for allowing incoming network connections */
 static pthread_t telnet_thread, telnets_thread, tty_thread;
@@ -61,206 +66,452 @@ static int telnets_port = DEFAULT_TELNETS_PORT;
 static int telnets_enabled = 0;
 static int tty_port = 0, ttys_port = 0; /* Disabled by default */
 
-static int telnet_send_command(int fd, unsigned char cmd, unsigned char opt)
+/*! \brief RFC 854 doesn't define MCCP2, it's option 86 */
+#define TELOPT_COMPRESS2 86
+
+/*! \brief Max time to wait for the client to respond to option negotiation, if it doesn't answer everything */
+#define TELNET_NEGOTIATE_MAX_MS 1000
+
+/*! \brief Once the client goes quiet for this long during negotiation, assume it won't answer the rest */
+#define TELNET_NEGOTIATE_IDLE_MS 250
+
+#define TELNET_BUFSIZE 4096
+
+/* Negotiation replies we're still waiting for during the handshake */
+#define PEND_ECHO (1U << 0)
+#define PEND_SGA (1U << 1)
+#define PEND_NAWS (1U << 2)
+#define PEND_NAWS_SIZE (1U << 3)
+#define PEND_TTYPE (1U << 4)
+#define PEND_TTYPE_IS (1U << 5)
+#define PEND_TSPEED (1U << 6)
+#define PEND_TSPEED_IS (1U << 7)
+#define PEND_COMPRESS2 (1U << 8)
+
+enum telnet_state {
+	TS_DATA = 0,	/*!< Regular data */
+	TS_IAC,			/*!< Got IAC */
+	TS_OPT,			/*!< Got IAC WILL/WONT/DO/DONT, waiting for option */
+	TS_SB,			/*!< In subnegotiation */
+	TS_SB_IAC,		/*!< Got IAC in subnegotiation */
+};
+
+struct telnet_session {
+	struct bbs_node *node;
+	int netrfd;					/*!< Network side (socket or TLS pipe) */
+	int netwfd;
+	int relay[2];				/*!< [0] is the node's end, [1] is ours */
+	unsigned int pending;		/*!< PEND_* replies still expected */
+	enum telnet_state state;
+	unsigned char cmd;			/*!< WILL/WONT/DO/DONT for TS_OPT */
+	unsigned char sb[64];		/*!< Subnegotiation buffer, starting with the option */
+	size_t sblen;
+	unsigned char refused[2][32];	/*!< Options we already refused (WONT, DONT), so we don't reply again */
+	unsigned char inbuf[TELNET_BUFSIZE];	/*!< Data for the node, with Telnet commands removed */
+	size_t inlen;
+	unsigned char *outbuf;		/*!< Data for the network, escaped and possibly compressed */
+	size_t outlen;
+	size_t outsize;
+	z_stream zs;
+	int pfd;					/*!< Index into relay thread's pollfds, -1 if not yet polled */
+	unsigned int handshake:1;	/*!< Still in initial negotiation */
+	unsigned int rcv_noecho:1;	/*!< Client acknowledged WILL ECHO */
+	unsigned int naws:1;		/*!< Client agreed to send window size updates */
+	unsigned int compress:1;	/*!< MCCP2 compression is active */
+	unsigned int dead:1;		/*!< Network side is gone */
+	unsigned int nodeclosed:1;	/*!< Node side is gone */
+	unsigned int owned:1;		/*!< netrfd and netwfd are our own duplicates */
+	RWLIST_ENTRY(telnet_session) entry;
+};
+
+static RWLIST_HEAD_STATIC(sessions, telnet_session);
+
+static int relay_alert_pipe[2] = { -1, -1 };
+static pthread_t relay_thread;
+static int relay_shutting_down = 0;
+
+static int compression_enabled = 1;
+
+static const char *telnet_opt_name(unsigned char opt)
 {
-	unsigned char ctl[] = {IAC, cmd, opt};
-	ssize_t res = write(fd, ctl, ARRAY_LEN(ctl));
-	if (res <= 0) {
-		if (errno != EPIPE) { /* Ignore if client just closed connection immediately */
-			bbs_error("Failed to set telnet echo: %s\n", strerror(errno));
+	if (TELOPT_OK(opt)) {
+		return telopts[opt];
+	}
+	return opt == TELOPT_COMPRESS2 ? "COMPRESS2" : "UNKNOWN";
+}
+
+static const char *telnet_cmd_name(unsigned char cmd)
+{
+	/* telcmds[0] is EOF (236), so normalize the index to 236 */
+	return TELCMD_OK(cmd) ? telcmds[cmd - xEOF] : "UNKNOWN";
+}
+
+static int outbuf_reserve(struct telnet_session *s, size_t len)
+{
+	if (s->outlen + len > s->outsize) {
+		size_t newsize = MAX(s->outsize * 2, s->outlen + len);
+		unsigned char *newbuf = realloc(s->outbuf, newsize);
+		if (ALLOC_FAILURE(newbuf)) {
+			return -1;
 		}
-	} else {
-		/* telcmds[0] is EOF (236), so normalize the index to 236 */
-		/* telopts[0] is simply 0, so no modification needed */
-		bbs_debug(5, "Sent Telnet command: %s %s %s\n", telcmds[IAC - xEOF], telcmds[cmd - xEOF], telopts[opt]);
+		s->outbuf = newbuf;
+		s->outsize = newsize;
 	}
-	return res <= 0 ? -1 : 0;
+	return 0;
 }
 
-static int telnet_send_command6(int fd, unsigned char cmd, unsigned char opt, unsigned char opt2, unsigned char opt3, unsigned char opt4)
+/*! \brief Queue raw bytes for the network, compressing them if MCCP2 is active */
+static int telnet_queue(struct telnet_session *s, const unsigned char *buf, size_t len)
 {
-	unsigned char ctl[] = {IAC, cmd, opt, opt2, opt3, opt4};
-	ssize_t res = write(fd, ctl, ARRAY_LEN(ctl));
-	if (res <= 0) {
-		if (errno != EPIPE) { /* Ignore if client just closed connection immediately */
-			bbs_error("Failed to set telnet echo: %s\n", strerror(errno));
+	if (!s->compress) {
+		if (outbuf_reserve(s, len)) {
+			return -1;
 		}
-	} else {
-		/* telcmds[0] is EOF (236), so normalize the index to 236 */
-		/* telopts[0] is simply 0, so no modification needed */
-		bbs_debug(5, "Sent Telnet command: %s %s %s %s %s %s\n", telcmds[IAC - xEOF], telcmds[cmd - xEOF], telopts[opt], telopts[opt2], telcmds[opt3 - xEOF], telcmds[opt4 - xEOF]);
+		memcpy(s->outbuf + s->outlen, buf, len);
+		s->outlen += len;
+		return 0;
 	}
-	return res <= 0 ? -1 : 0;
+
+	s->zs.next_in = buf;
+	s->zs.avail_in = (unsigned int) len;
+	do {
+		if (outbuf_reserve(s, deflateBound(&s->zs, s->zs.avail_in) + 16)) {
+			return -1;
+		}
+		s->zs.next_out = s->outbuf + s->outlen;
+		s->zs.avail_out = (unsigned int) (s->outsize - s->outlen);
+		/* Flush every time, since this is interactive output and the client needs to see it now */
+		if (deflate(&s->zs, Z_SYNC_FLUSH) == Z_STREAM_ERROR) {
+			bbs_error("deflate failed\n");
+			return -1;
+		}
+		s->outlen = s->outsize - s->zs.avail_out;
+	} while (s->zs.avail_in || !s->zs.avail_out);
+	return 0;
 }
 
-struct telnet_settings {
-	unsigned int rcv_noecho:1;
-	unsigned int sent_winsize:1;
-};
+/*! \brief Queue data for the network, escaping IAC bytes */
+static int telnet_queue_data(struct telnet_session *s, const unsigned char *buf, size_t len)
+{
+	unsigned char escaped[2 * TELNET_BUFSIZE];
+	size_t i, elen = 0;
 
-static int telnet_read_command(int fd, unsigned char *buf, size_t len)
-{
-	ssize_t res = bbs_poll(fd, 150);
-	if (res <= 0) {
-		bbs_debug(4, "poll returned %ld: %s\n", res, strerror(errno));
-		return (int) res;
-	}
-	res = read(fd, buf, len - 1);
-	/* Process the command */
-	if (res <= 0) {
-		bbs_debug(4, "read returned %ld: %s\n", res, strerror(errno));
-		return (int) res;
-	} else if (res >= 3) {
-		int a, b, c;
-		buf[res] = '\0'; /* Don't read uninitialized memory later */
-		if (buf[0] != IAC) {
-			/* Got something that wasn't the beginning of a telnet command */
-			bbs_debug(3, "Read %d %d %d, aborting handshake\n", buf[0], buf[1], buf[2])
-			return 0;
-		}
-		/* Don't let the client make us index out of bounds */
-		if (!IN_BOUNDS(buf[0], xEOF, IAC) || !IN_BOUNDS(buf[1], xEOF, IAC) || !IN_BOUNDS(buf[2], TELOPT_BINARY, TELOPT_EXOPL)) {
-			bbs_warning("Got out of bounds command: %d %d %d\n", buf[0], buf[1], buf[2]);
-			return 0;
-		}
-		a = buf[0] - xEOF; /* We know this is IAC */
-		b = buf[1] - xEOF;
-		c = buf[2];
-		bbs_debug(3, "Received Telnet command %s %s %s\n", telcmds[a], telcmds[b], telopts[c]);
-		return (int) res;
-	} else {
-		bbs_warning("Read %ld bytes, not enough to do anything with, discarding\n", res);
-		return 0;
+	for (i = 0; i < len; i++) {
+		escaped[elen++] = buf[i];
+		if (buf[i] == IAC) {
+			escaped[elen++] = IAC;
+		}
+		if (elen >= sizeof(escaped) - 1) {
+			if (telnet_queue(s, escaped, elen)) {
+				return -1;
+			}
+			elen = 0;
+		}
 	}
+	return elen ? telnet_queue(s, escaped, elen) : 0;
 }
 
-#define telnet_process_command(node, settings, buf, len, res) __telnet_process_command(node, settings, buf, len, res, depth + 1)
+static int telnet_queue_command(struct telnet_session *s, unsigned char cmd, unsigned char opt)
+{
+	unsigned char ctl[] = {IAC, cmd, opt};
+	bbs_debug(5, "Sending Telnet command: IAC %s %s\n", telnet_cmd_name(cmd), telnet_opt_name(opt));
+	return telnet_queue(s, ctl, ARRAY_LEN(ctl));
+}
 
-static int __telnet_process_command(struct bbs_node *node, struct telnet_settings *settings, unsigned char *buf, size_t len, int res, int depth)
+static int telnet_queue_subneg_send(struct telnet_session *s, unsigned char opt)
 {
-	if (depth > 3) {
-		/* Prevent infinite recursion if the client replies with the same thing that triggered another command */
-		bbs_warning("Exceeded command stack depth %d\n", depth);
-		return 0;
-	}
+	unsigned char ctl[] = {IAC, SB, opt, TELQUAL_SEND, IAC, SE};
+	bbs_debug(5, "Sending Telnet command: IAC SB %s SEND IAC SE\n", telnet_opt_name(opt));
+	return telnet_queue(s, ctl, ARRAY_LEN(ctl));
+}
 
-	if (buf[1] == DO && buf[2] == TELOPT_ECHO) {
-		settings->rcv_noecho = 1;
-		bbs_debug(3, "Client acknowledged local echo disable\n");
-	} else if (buf[1] == WILL && buf[2] == TELOPT_NAWS) {
-		if (!settings->sent_winsize) {
-			if (telnet_send_command(node->wfd, DO, TELOPT_NAWS)) {
-				return -1;
+/*! \brief Write as much queued output to the network as possible without blocking */
+static int telnet_flush(struct telnet_session *s)
+{
+	while (s->outlen) {
+		ssize_t res = write(s->netwfd, s->outbuf, s->outlen);
+		if (res <= 0) {
+			if (res < 0 && errno == EAGAIN) {
+				return 0;
+			}
+			if (errno != EPIPE) { /* Ignore if client just closed connection */
+				bbs_debug(3, "write failed: %s\n", strerror(errno));
 			}
-			settings->sent_winsize = 1;
-		}
-		/* Read terminal type, coming up next */
-		res = telnet_read_command(node->rfd, buf, len);
-		if (res > 0) {
-			res = telnet_process_command(node, settings, buf, len, res);
-		}
-	} else if (buf[1] == WONT && buf[2] == TELOPT_NAWS) {
-		/* Client disabled NAWS, at our request, good. */
-		res = 1;
-	} else if (buf[1] == SB && buf[2] == TELOPT_NAWS) {
-		/* Get the window size
-		 * IAC SB NAWS WIDTH[1] WIDTH[0] HEIGHT[1] HEIGHT[0] IAC SE
-		 * According to RFC 1073, there are 2 bytes for the width and the height each,
-		 * to support clients with a window height/width of up to 65536 rows/cols.
-		 * I'm sorry, there's no way there are any clients with screens that large.
-		 * Here's what these bytes would look for a standard 80x24 terminal:
-		 * 0 80 0 24 255 240
-		 * So we can simply ignore WIDTH[1] and HEIGHT[1] altogether.
-		 */
-		if (res >= 9) {
-			bbs_debug(7, "Got %d %d %d %d %d %d\n", buf[3], buf[4], buf[5], buf[6], buf[7], buf[8]);
-			bbs_node_update_winsize(node, buf[4], buf[6]);
-		} else {
-			bbs_warning("Received window subnegotiation, but only got %d bytes?\n", res);
-		}
-
-		/* XXX Now, tell the client not to send window updates
-		 * Because we're going to step out of the way and all socket I/O is going to
-		 * go right into the PTY master, we won't be able to intercept future Telnet
-		 * commands, so if a window update is sent, we won't be able to process it.
-		 * It would probably be better to add an intermediate layer here to handle that
-		 * (similar to what the SSH module does).
-		 * Or, the PTY thread could handle telnet commands (beginning with IAC),
-		 * if node->protname == "Telnet", but that would break the abstraction
-		 * that the BBS has from the communications protocol.
-		 *
-		 * Either way, for now, we don't support window updates.
-		 */
-		if (telnet_send_command(node->wfd, DONT, TELOPT_NAWS)) {
 			return -1;
 		}
-		res = telnet_read_command(node->rfd, buf, len);
-		if (res > 0) {
-			res = telnet_process_command(node, settings, buf, len, res);
+		s->outlen -= (size_t) res;
+		memmove(s->outbuf, s->outbuf + res, s->outlen);
+	}
+	return 0;
+}
+
+static int compress_start(struct telnet_session *s)
+{
+	const unsigned char ctl[] = {IAC, SB, TELOPT_COMPRESS2, IAC, SE};
+
+	if (s->compress) {
+		return 0;
+	}
+	/* Everything after IAC SE is compressed */
+	if (telnet_queue(s, ctl, ARRAY_LEN(ctl))) {
+		return -1;
+	}
+	memset(&s->zs, 0, sizeof(s->zs));
+	/* Smaller window and memLevel than the defaults, since there's a stream per node:
+	 * about 32 KB instead of 256 KB per session, which barely affects ratio for terminal output. */
+	if (deflateInit2(&s->zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 12, 5, Z_DEFAULT_STRATEGY) != Z_OK) {
+		bbs_error("Failed to initialize compression for node %d\n", s->node->id);
+		return -1;
+	}
+	s->compress = 1;
+	bbs_debug(3, "Enabled MCCP2 compression on node %d\n", s->node->id);
+	return 0;
+}
+
+static void compress_stop(struct telnet_session *s)
+{
+	if (!s->compress) {
+		return;
+	}
+	s->zs.next_in = NULL;
+	s->zs.avail_in = 0;
+	for (;;) {
+		int res;
+		if (outbuf_reserve(s, 64)) {
+			break;
 		}
-	} else if (buf[1] == WILL && buf[2] == TELOPT_TTYPE) {
-		/* Client supports sending terminal type */
-		if (telnet_send_command6(node->wfd, SB, TELOPT_TTYPE, TELQUAL_SEND, IAC, SE)) {
-			return -1;
+		s->zs.next_out = s->outbuf + s->outlen;
+		s->zs.avail_out = (unsigned int) (s->outsize - s->outlen);
+		res = deflate(&s->zs, Z_FINISH);
+		s->outlen = s->outsize - s->zs.avail_out;
+		if (res != Z_OK) {
+			break;
 		}
-		res = telnet_read_command(node->rfd, buf, len);
-		if (res < 0) {
-			return res;
-		} else if (res > 0) {
-			if (buf[1] == SB && buf[2] == TELOPT_TTYPE && buf[3] == TELQUAL_IS && res >= 6) {
-				bbs_debug(3, "Terminal type is %.*s\n", (int) res - 6, buf + 4); /* First 4 bytes are command, and last two are IAC SE */
-				if (res - 6 < (int) len - 1) {
-					memcpy(buf, buf + 4, (size_t) res - 6);
-					buf[res - 6] = '\0';
-					REPLACE(node->term, (char*) buf);
-				}
-			} else {
-				bbs_warning("Foreign %d-byte response received in response to terminal type\n", res);
+	}
+	deflateEnd(&s->zs);
+	s->compress = 0;
+	bbs_debug(3, "Disabled MCCP2 compression on node %d\n", s->node->id);
+}
+
+/*! \brief Refuse an option once. Replying every time could loop with a client that does the same. */
+static int telnet_refuse(struct telnet_session *s, unsigned char cmd, unsigned char opt)
+{
+	int i = cmd == WONT ? 0 : 1;
+	if (s->refused[i][opt / 8] & (1 << (opt % 8))) {
+		return 0;
+	}
+	s->refused[i][opt / 8] |= (unsigned char) (1 << (opt % 8));
+	return telnet_queue_command(s, cmd, opt);
+}
+
+static int telnet_option(struct telnet_session *s, unsigned char cmd, unsigned char opt)
+{
+	bbs_debug(3, "Received Telnet command IAC %s %s\n", telnet_cmd_name(cmd), telnet_opt_name(opt));
+
+	switch (cmd) {
+		case WILL:
+		case WONT:
+			/* The client's options */
+			switch (opt) {
+				case TELOPT_NAWS:
+					if (s->pending & PEND_NAWS) {
+						/* Reply to our DO */
+						s->pending &= ~PEND_NAWS;
+						SET_BITFIELD(s->naws, (cmd == WILL));
+						if (cmd == WILL && s->handshake) {
+							s->pending |= PEND_NAWS_SIZE;
+						}
+						return 0;
+					} else if ((cmd == WILL) == s->naws) {
+						return 0; /* No change */
+					}
+					SET_BITFIELD(s->naws, (cmd == WILL));
+					return telnet_queue_command(s, cmd == WILL ? DO : DONT, opt);
+				case TELOPT_TTYPE:
+				case TELOPT_TSPEED:
+					if (!s->handshake || !(s->pending & (opt == TELOPT_TTYPE ? PEND_TTYPE : PEND_TSPEED))) {
+						/* Only asked for during the handshake */
+						return cmd == WILL ? telnet_refuse(s, DONT, opt) : 0;
+					}
+					s->pending &= (unsigned int) ~(opt == TELOPT_TTYPE ? PEND_TTYPE : PEND_TSPEED);
+					if (cmd == WILL) {
+						s->pending |= opt == TELOPT_TTYPE ? PEND_TTYPE_IS : PEND_TSPEED_IS;
+						return telnet_queue_subneg_send(s, opt);
+					}
+					return 0;
+				default:
+					break;
 			}
-		}
-	} else if (buf[1] == WILL && buf[2] == TELOPT_TSPEED) {
-		/* Client supports sending terminal speed */
-		if (telnet_send_command6(node->wfd, SB, TELOPT_TSPEED, TELQUAL_SEND, IAC, SE)) {
-			return -1;
-		}
-		res = telnet_read_command(node->rfd, buf, len);
-		if (res < 0) {
-			return res;
-		} else if (res > 0) {
-			if (buf[1] == SB && buf[2] == TELOPT_TSPEED && buf[3] == TELQUAL_IS && res >= 3) {
-				bbs_debug(3, "Terminal speed is %.*s\n", (int) res - 6, buf + 4); /* First 4 bytes are command, and last two are IAC SE */
-				if (res - 6 < (int) len - 1) {
-					memcpy(buf, buf + 4, (size_t) res - 6);
-					buf[res - 6] = '\0';
-					node->reportedbps = (unsigned int) atoi((char*) buf);
-				}
+			return cmd == WILL ? telnet_refuse(s, DONT, opt) : 0;
+		case DO:
+		case DONT:
+			/* Our options */
+			switch (opt) {
+				case TELOPT_ECHO:
+					s->pending &= ~PEND_ECHO;
+					if (cmd == DO) {
+						s->rcv_noecho = 1;
+						bbs_debug(3, "Client acknowledged local echo disable\n");
+					}
+					return 0;
+				case TELOPT_SGA:
+					s->pending &= ~PEND_SGA;
+					return 0;
+				case TELOPT_LINEMODE:
+					return 0; /* We sent WONT, so DONT is just the acknowledgment */
+				case TELOPT_COMPRESS2:
+					if (compression_enabled) {
+						s->pending &= ~PEND_COMPRESS2;
+						if (cmd == DO) {
+							return compress_start(s);
+						}
+						compress_stop(s);
+						return 0;
+					}
+					break;
+				default:
+					break;
+			}
+			return cmd == DO ? telnet_refuse(s, WONT, opt) : 0;
+		default:
+			break;
+	}
+	return 0;
+}
+
+static void telnet_subnegotiation(struct telnet_session *s)
+{
+	unsigned char opt;
+	int len;
+
+	if (!s->sblen) {
+		return;
+	}
+	opt = s->sb[0];
+	len = (int) s->sblen - 1;
+	bbs_debug(3, "Received Telnet subnegotiation %s (%d bytes)\n", telnet_opt_name(opt), len);
+
+	switch (opt) {
+		case TELOPT_NAWS:
+			/* IAC SB NAWS WIDTH[1] WIDTH[0] HEIGHT[1] HEIGHT[0] IAC SE
+			 * According to RFC 1073, there are 2 bytes for the width and the height each.
+			 * Clients send this again whenever the window is resized. */
+			if (len != 4) {
+				bbs_warning("Received %d-byte window subnegotiation?\n", len);
+				return;
+			}
+			s->pending &= ~(PEND_NAWS | PEND_NAWS_SIZE);
+			bbs_node_update_winsize(s->node, s->sb[1] << 8 | s->sb[2], s->sb[3] << 8 | s->sb[4]);
+			break;
+		case TELOPT_TTYPE:
+		case TELOPT_TSPEED:
+			if (len < 1 || s->sb[1] != TELQUAL_IS) {
+				bbs_warning("Foreign %d-byte response received in %s subnegotiation\n", len, telnet_opt_name(opt));
+				return;
+			} else if (!s->handshake) {
+				/* The node thread may be using these, so they can only be set up front */
+				bbs_debug(3, "Ignoring late %s subnegotiation\n", telnet_opt_name(opt));
+				return;
+			}
+			s->sb[s->sblen] = '\0'; /* sb is always 1 byte larger than what we fill */
+			if (opt == TELOPT_TTYPE) {
+				s->pending &= ~PEND_TTYPE_IS;
+				bbs_debug(3, "Terminal type is %s\n", s->sb + 2);
+				REPLACE(s->node->term, (char*) s->sb + 2);
 			} else {
-				bbs_warning("Foreign %d-byte response received in response to terminal type\n", res);
+				s->pending &= ~PEND_TSPEED_IS;
+				bbs_debug(3, "Terminal speed is %s\n", s->sb + 2);
+				s->node->reportedbps = (unsigned int) atoi((char*) s->sb + 2);
 			}
-		}
-	} else {
-		bbs_debug(3, "Ignoring unhandled response %d %d %d\n", buf[0], buf[1], buf[2]);
+			break;
+		default:
+			bbs_debug(3, "Ignoring unhandled %s subnegotiation\n", telnet_opt_name(opt));
 	}
-	return 1;
 }
 
-static int read_and_process_command(struct bbs_node *node, struct telnet_settings *settings, unsigned char *buf, size_t len)
+/*!
+ * \brief Process data received from the network
+ * \note Commands are handled (in any order) as they complete, regular data is appended to inbuf
+ * \note There must be room in inbuf for len bytes
+ */
+static int telnet_process(struct telnet_session *s, const unsigned char *buf, size_t len)
 {
-	int depth = 0;
-	int res = telnet_read_command(node->rfd, buf, len);
-	if (res > 0) {
-		res = telnet_process_command(node, settings, buf, len, res);
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		unsigned char c = buf[i];
+		switch (s->state) {
+			case TS_DATA:
+				if (c == IAC) {
+					s->state = TS_IAC;
+				} else {
+					s->inbuf[s->inlen++] = c;
+				}
+				break;
+			case TS_IAC:
+				s->state = TS_DATA;
+				switch (c) {
+					case IAC: /* Escaped 255 */
+						s->inbuf[s->inlen++] = c;
+						break;
+					case WILL:
+					case WONT:
+					case DO:
+					case DONT:
+						s->cmd = c;
+						s->state = TS_OPT;
+						break;
+					case SB:
+						s->sblen = 0;
+						s->state = TS_SB;
+						break;
+					default:
+						/* NOP, AYT, GA, etc. None of these need a response */
+						bbs_debug(5, "Ignoring Telnet command %s\n", telnet_cmd_name(c));
+				}
+				break;
+			case TS_OPT:
+				s->state = TS_DATA;
+				if (telnet_option(s, s->cmd, c)) {
+					return -1;
+				}
+				break;
+			case TS_SB:
+				if (c == IAC) {
+					s->state = TS_SB_IAC;
+					break;
+				}
+				/* Fall through */
+			case TS_SB_IAC:
+				if (s->state == TS_SB_IAC && c != IAC) {
+					s->state = TS_DATA; /* Should be SE */
+					if (c == SE) {
+						telnet_subnegotiation(s);
+					}
+					break;
+				}
+				s->state = TS_SB;
+				if (s->sblen < sizeof(s->sb) - 1) {
+					s->sb[s->sblen++] = c;
+				}
+				break;
+		}
 	}
-	return res;
+	return 0;
 }
 
-static int telnet_handshake(struct bbs_node *node)
+/*!
+ * \brief Negotiate options up front
+ * \note Everything is sent at once, and replies are handled in whatever order they arrive,
+ *       so clients that answer everything are done in a round trip.
+ *       Anything that arrives after we stop waiting is handled by the relay.
+ */
+static int telnet_handshake(struct telnet_session *s)
 {
-	int res;
-	struct telnet_settings settings;
-	unsigned char buf[32];
+	unsigned char buf[256];
+	struct timeval start, last;
 
-	memset(&settings, 0, sizeof(settings));
+	s->handshake = 1;
 
 	/* RFC 857 Disable Telnet echo or we'll get double echo when slave echo is on and single echo when it's off. */
 
@@ -272,76 +523,295 @@ static int telnet_handshake(struct bbs_node *node)
 	 *
 	 * Might seem backwards to do WILL echo to turn local echo off, but think of it as
 	 * us saying that WE'LL do the echoing so local echo, please stop. */
-	if (telnet_send_command(node->wfd, WILL, TELOPT_ECHO)) {
-		return -1;
-	}
+	telnet_queue_command(s, WILL, TELOPT_ECHO);
 
 	/* Send the following to disable line buffering and make the terminal "uncooked" from a Telnet perspective.
 	 * In particular, this is needed to get PuTTY to work properly, since it will assume cooked by default. */
-	if (telnet_send_command(node->wfd, WILL, TELOPT_SGA)) { /* Suppress Go Ahead */
-		return -1;
-	} else if (telnet_send_command(node->wfd, WONT, TELOPT_LINEMODE)) { /* Disable line mode */
-		return -1;
+	telnet_queue_command(s, WILL, TELOPT_SGA); /* Suppress Go Ahead */
+	telnet_queue_command(s, WONT, TELOPT_LINEMODE); /* Disable line mode */
+
+	telnet_queue_command(s, DO, TELOPT_NAWS); /* RFC 1073 Request window size */
+	telnet_queue_command(s, DO, TELOPT_TTYPE); /* RFC 1091 Terminal Type */
+	telnet_queue_command(s, DO, TELOPT_TSPEED); /* RFC 1079 Terminal Speed */
+	s->pending = PEND_ECHO | PEND_SGA | PEND_NAWS | PEND_TTYPE | PEND_TSPEED;
+
+	if (compression_enabled) {
+		telnet_queue_command(s, WILL, TELOPT_COMPRESS2);
+		s->pending |= PEND_COMPRESS2;
 	}
 
-	/* Read anything the client sends upon connect, if anything.
-	 * For example, some clients, like SyncTERM, will acknowledge everything with a response,
-	 * while others, like PuTTY, will not. */
-	do {
-		res = read_and_process_command(node, &settings, buf, sizeof(buf));
-	} while (res > 0);
-	if (res < 0) {
+	if (telnet_flush(s)) {
 		return -1;
 	}
 
-	/* RFC 1073 Request window size */
-	if (!settings.sent_winsize) {
-		settings.sent_winsize = 1;
-		if (telnet_send_command(node->wfd, DO, TELOPT_NAWS)) {
-			return -1;
+	/* Some clients, like SyncTERM, will acknowledge everything with a response,
+	 * while others, like PuTTY, will not, so we can't just wait for all the replies. */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Waggregate-return"
+	start = last = bbs_tvnow();
+#pragma GCC diagnostic pop
+	while (s->pending) {
+		ssize_t res;
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Waggregate-return"
+		int ms = TELNET_NEGOTIATE_MAX_MS - (int) bbs_tvdiff_ms(bbs_tvnow(), start);
+		ms = MIN(ms, TELNET_NEGOTIATE_IDLE_MS - (int) bbs_tvdiff_ms(bbs_tvnow(), last));
+#pragma GCC diagnostic pop
+		if (ms <= 0) {
+			bbs_debug(3, "Finishing Telnet negotiation with replies outstanding (%#x)\n", s->pending);
+			break;
 		}
-		res = read_and_process_command(node, &settings, buf, sizeof(buf));
+		res = bbs_poll(s->netrfd, ms);
 		if (res < 0) {
-			return res;
+			return -1;
+		} else if (!res) {
+			continue;
+		}
+		/* Leave room in case the user is already typing */
+		res = read(s->netrfd, buf, MIN(sizeof(buf), sizeof(s->inbuf) - s->inlen));
+		if (res <= 0) {
+			bbs_debug(4, "read returned %ld: %s\n", res, strerror(errno));
+			return -1;
+		}
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Waggregate-return"
+		last = bbs_tvnow();
+#pragma GCC diagnostic pop
+		if (telnet_process(s, buf, (size_t) res) || telnet_flush(s)) {
+			return -1;
+		}
+		if (s->inlen == sizeof(s->inbuf)) {
+			break;
 		}
 	}
 
-	/* RFC 1091 Terminal Type */
-	if (telnet_send_command(node->wfd, DO, TELOPT_TTYPE)) {
-		return -1;
-	}
-	res = read_and_process_command(node, &settings, buf, sizeof(buf));
-	if (res < 0) {
-		return res;
+	if (!s->rcv_noecho) {
+		bbs_debug(3, "Request to enable ECHO not yet acknowledged, retrying\n");
+		telnet_queue_command(s, WONT, TELOPT_ECHO);
+		telnet_queue_command(s, WILL, TELOPT_ECHO);
+		if (telnet_flush(s)) {
+			return -1;
+		}
 	}
 
-	/* RFC 1079 Terminal Speed */
-	if (telnet_send_command(node->wfd, DO, TELOPT_TSPEED)) {
-		return -1;
+	s->handshake = 0;
+	return 0;
+}
+
+/*!
+ * \brief Relay traffic between the network and the node
+ * \note This is a single thread for all Telnet nodes, like the TLS I/O thread,
+ *       so nothing here may block.
+ */
+static void *telnet_relay(void *unused)
+{
+	struct pollfd *pfds = NULL;
+	int numfds = 0;
+	unsigned char buf[TELNET_BUFSIZE];
+
+	UNUSED(unused);
+
+	for (;;) {
+		struct telnet_session *s;
+		int i = 1, res;
+
+		RWLIST_RDLOCK(&sessions);
+		if (relay_shutting_down) {
+			RWLIST_UNLOCK(&sessions);
+			break;
+		}
+		res = 1 + 3 * RWLIST_SIZE(&sessions, s, entry); /* Network read, network write, node */
+		if (res > numfds) {
+			struct pollfd *newpfds = realloc(pfds, (size_t) res * sizeof(*pfds));
+			if (ALLOC_FAILURE(newpfds)) {
+				RWLIST_UNLOCK(&sessions);
+				break;
+			}
+			pfds = newpfds;
+		}
+		numfds = res;
+		pfds[0].fd = relay_alert_pipe[0];
+		pfds[0].events = POLLIN;
+		RWLIST_TRAVERSE(&sessions, s, entry) {
+			s->pfd = i;
+			/* Stop reading from one side while the other side can't keep up */
+			pfds[i].fd = !s->dead && !s->inlen ? s->netrfd : -1;
+			pfds[i++].events = POLLIN;
+			pfds[i].fd = !s->dead && s->outlen ? s->netwfd : -1;
+			pfds[i++].events = POLLOUT;
+			/* If the network is gone, keep reading and discarding, so the node doesn't block writing */
+			pfds[i].fd = s->nodeclosed ? -1 : s->relay[1];
+			pfds[i++].events = (short) ((s->outlen && !s->dead ? 0 : POLLIN) | (s->inlen ? POLLOUT : 0));
+		}
+		RWLIST_UNLOCK(&sessions);
+
+		for (i = 0; i < numfds; i++) {
+			pfds[i].revents = 0;
+		}
+		res = poll(pfds, (nfds_t) numfds, -1);
+		if (res < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			bbs_error("poll failed: %s\n", strerror(errno));
+			break;
+		}
+		if (pfds[0].revents) {
+			bbs_alertpipe_read(relay_alert_pipe);
+		}
+
+		RWLIST_RDLOCK(&sessions);
+		RWLIST_TRAVERSE(&sessions, s, entry) {
+			struct pollfd *pfd;
+			ssize_t bytes;
+			if (s->pfd < 0) {
+				continue; /* Added since we polled */
+			}
+			pfd = &pfds[s->pfd];
+			if (pfd[0].revents) {
+				/* Network -> node */
+				bytes = read(s->netrfd, buf, sizeof(buf));
+				if (bytes <= 0 && !(bytes < 0 && errno == EAGAIN)) {
+					bbs_debug(3, "Node %d disconnected\n", s->node->id);
+					s->dead = 1;
+					s->inlen = s->outlen = 0;
+					shutdown(s->relay[1], SHUT_WR); /* Node will see EOF */
+					continue;
+				} else if (bytes > 0 && telnet_process(s, buf, (size_t) bytes)) {
+					s->dead = 1;
+					shutdown(s->relay[1], SHUT_WR);
+					continue;
+				}
+			}
+			if (pfd[2].revents & ~POLLOUT) {
+				/* Node -> network */
+				bytes = read(s->relay[1], buf, sizeof(buf));
+				if (bytes <= 0 && !(bytes < 0 && errno == EAGAIN)) {
+					s->nodeclosed = 1;
+					s->inlen = 0;
+				} else if (bytes > 0 && !s->dead) {
+					telnet_queue_data(s, buf, (size_t) bytes);
+				}
+			}
+			if (s->inlen && !s->nodeclosed) {
+				bytes = write(s->relay[1], s->inbuf, s->inlen);
+				if (bytes > 0) {
+					s->inlen -= (size_t) bytes;
+					memmove(s->inbuf, s->inbuf + bytes, s->inlen);
+				}
+			}
+			if (s->outlen && !s->dead && telnet_flush(s)) {
+				s->dead = 1;
+				s->outlen = 0;
+				shutdown(s->relay[1], SHUT_WR);
+			}
+		}
+		RWLIST_UNLOCK(&sessions);
 	}
-	res = read_and_process_command(node, &settings, buf, sizeof(buf));
-	if (res < 0) {
-		return res;
+
+	free_if(pfds);
+	return NULL;
+}
+
+static struct telnet_session *telnet_session_new(struct bbs_node *node)
+{
+	struct telnet_session *s = calloc(1, sizeof(*s));
+
+	if (ALLOC_FAILURE(s)) {
+		return NULL;
 	}
+	s->node = node;
+	s->netrfd = node->rfd;
+	s->netwfd = node->wfd;
+	s->relay[0] = s->relay[1] = -1;
+	s->pfd = -1;
+	return s;
+}
 
-	if (!settings.rcv_noecho) {
-		bbs_debug(3, "Request to enable ECHO not yet acknowledged, retrying\n");
-		if (telnet_send_command(node->wfd, WONT, TELOPT_ECHO) || telnet_send_command(node->wfd, WILL, TELOPT_ECHO)) {
-			return -1;
+static void telnet_session_free(struct telnet_session *s)
+{
+	if (s->compress) {
+		deflateEnd(&s->zs);
+	}
+	close_if(s->relay[0]);
+	close_if(s->relay[1]);
+	if (s->owned) {
+		if (s->netwfd != s->netrfd) {
+			close_if(s->netwfd);
 		}
+		close_if(s->netrfd);
 	}
+	free_if(s->outbuf);
+	free(s);
+}
 
-	/* Read anything leftover, if anything */
-	do {
-		res = read_and_process_command(node, &settings, buf, sizeof(buf));
-	} while (res > 0);
-	if (res < 0) {
+/*! \brief Interpose the relay between the network and the node, for the rest of the session */
+static int telnet_relay_start(struct telnet_session *s)
+{
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, s->relay)) {
+		bbs_error("socketpair failed: %s\n", strerror(errno));
 		return -1;
 	}
+	/* Use our own references, so if the node is kicked and its socket closed,
+	 * we can't end up polling some other connection that reused the fd. */
+	s->netrfd = dup(s->netrfd);
+	s->netwfd = s->netwfd == s->node->rfd ? s->netrfd : dup(s->netwfd);
+	if (s->netrfd < 0 || s->netwfd < 0) {
+		bbs_error("dup failed: %s\n", strerror(errno));
+		return -1;
+	}
+	s->owned = 1;
+	/* Only the relay thread uses these now, and it can't block */
+	bbs_unblock_fd(s->netrfd);
+	if (s->netwfd != s->netrfd) {
+		bbs_unblock_fd(s->netwfd);
+	}
+	bbs_unblock_fd(s->relay[1]);
+
+	s->node->rfd = s->node->wfd = s->relay[0];
 
+	RWLIST_WRLOCK(&sessions);
+	RWLIST_INSERT_HEAD(&sessions, s, entry);
+	RWLIST_UNLOCK(&sessions);
+	bbs_alertpipe_write(relay_alert_pipe);
 	return 0;
 }
 
+static void telnet_relay_stop(struct telnet_session *s)
+{
+	RWLIST_WRLOCK_REMOVE_BY_FIELD(&sessions, node, s->node, entry);
+	bbs_alertpipe_write(relay_alert_pipe);
+	/* The PTY thread may still be reading from the node's end until the node exits, so just close ours for now */
+	close_if(s->relay[1]);
+}
+
+/* Yikes... a TELNETS client needs 3 threads:
+ * the network thread, the PTY thread,
+ * and the actual application thread.
+ * Telnet commands that arrive mid-session are handled by a
+ * single relay thread shared by all Telnet nodes, rather than a fourth thread per node. */
+static void telnet_run(struct bbs_node *node)
+{
+	struct telnet_session *s = telnet_session_new(node);
+
+	if (!s) {
+		bbs_node_exit(node); /* Since we're not calling bbs_node_handler, we're responsible for manually cleaning the node up */
+		return;
+	}
+
+	if (telnet_handshake(s) || telnet_relay_start(s)) {
+		bbs_node_exit(node); /* Manual cleanup */
+		telnet_session_free(s);
+		return;
+	}
+
+	bbs_node_term_session(node);
+	/* The relay must be done with the node before it goes away */
+	telnet_relay_stop(s);
+	bbs_node_exit(node);
+	telnet_session_free(s);
+}
+
 static int tty_handshake(struct bbs_node *node)
 {
 	/* Not really a handshake, just use this as a callback to set a few things */
@@ -357,10 +827,17 @@ static int tty_handshake(struct bbs_node *node)
 	return 0;
 }
 
+static void *telnet_handler(void *varg)
+{
+	telnet_run(varg);
+	return NULL;
+}
+
 static void *telnet_listener(void *unused)
 {
 	UNUSED(unused);
-	bbs_tcp_comm_listener(telnet_socket, "TELNET", telnet_handshake, BBS_MODULE_SELF);
+	/* Negotiate in the node thread, not the listener thread, so slow clients don't hold up other connections */
+	bbs_tcp_listener(telnet_socket, "TELNET", telnet_handler, BBS_MODULE_SELF);
 	return NULL;
 }
 
@@ -376,12 +853,6 @@ static void *telnets_handler(void *varg)
 	struct bbs_node *node = varg;
 	SSL *ssl = NULL;
 
-	/* Yikes... a TELNETS client needs 3 threads:
-	 * the network thread, the PTY thread,
-	 * and the actual application thread.
-	 * Please don't implement proper Telnet support
-	 * as another intermediary layer that looks for 255 bytes,
-	 * and add yet a fourth thread! */
 	/* Set up TLS, then do the handshake, then proceed as normal. */
 	ssl = ssl_node_new_accept(node, &node->rfd, &node->wfd);
 	if (!ssl) {
@@ -389,11 +860,7 @@ static void *telnets_handler(void *varg)
 		return NULL;
 	}
 
-	if (!telnet_handshake(node)) {
-		bbs_node_handler(node); /* Run the normal node handler */
-	} else {
-		bbs_node_exit(node); /* Manual cleanup */
-	}
+	telnet_run(node);
 
 	ssl_close(ssl);
 	return NULL;
@@ -455,6 +922,9 @@ static int load_config(void)
 	bbs_config_val_set_port(cfg, "telnets", "port", &telnets_port);
 	bbs_config_val_set_true(cfg, "telnets", "enabled", &telnets_enabled);
 
+	compression_enabled = 1;
+	bbs_config_val_set_true(cfg, "telnet", "compression", &compression_enabled);
+
 	if (telnets_enabled && !ssl_available()) {
 		bbs_error("TLS is not available, TELNETS cannot be used\n");
 		return -1;
@@ -467,17 +937,37 @@ static int load_config(void)
 	return 0;
 }
 
+static void relay_stop(void)
+{
+	RWLIST_WRLOCK(&sessions);
+	relay_shutting_down = 1;
+	RWLIST_UNLOCK(&sessions);
+	bbs_alertpipe_write(relay_alert_pipe);
+	bbs_pthread_join(relay_thread, NULL);
+	bbs_alertpipe_close(relay_alert_pipe);
+}
+
 static int load_module(void)
 {
 	if (load_config()) {
 		return -1;
 	}
+	if (bbs_alertpipe_create(relay_alert_pipe)) {
+		return -1;
+	}
+	relay_shutting_down = 0;
+	if (bbs_pthread_create(&relay_thread, NULL, telnet_relay, NULL)) {
+		bbs_alertpipe_close(relay_alert_pipe);
+		return -1;
+	}
 	/* If we can't start the TCP listener, decline to load */
 	if (bbs_make_tcp_socket(&telnet_socket, telnet_port)) {
+		relay_stop();
 		return -1;
 	}
 	if (telnets_enabled && bbs_make_tcp_socket(&telnets_socket, telnets_port)) {
 		close(telnet_socket);
+		relay_stop();
 		return -1;
 	}
 	bbs_assert(telnet_socket >= 0);
@@ -485,22 +975,26 @@ static int load_module(void)
 		close(telnet_socket);
 		close_if(telnets_socket);
 		telnet_socket = -1;
+		relay_stop();
 		return -1;
 	}
 	if (telnets_enabled && bbs_pthread_create(&telnets_thread, NULL, telnets_listener, NULL)) {
 		close_if(telnets_socket);
 		bbs_socket_thread_shutdown(&telnet_socket, telnet_thread);
+		relay_stop();
 		return -1;
 	}
 	if (tty_port || ttys_port) {
 		if (tty_port) {
 			if (bbs_make_tcp_socket(&tty_socket, tty_port)) {
+				relay_stop();
 				return -1;
 			}
 		}
 		if (ttys_port) {
 			if (bbs_make_tcp_socket(&ttys_socket, ttys_port)) {
 				close_if(tty_socket);
+				relay_stop();
 				return -1;
 			}
 		}
@@ -511,6 +1005,7 @@ static int load_module(void)
 			}
 			close_if(tty_socket);
 			close_if(ttys_socket);
+			relay_stop();
 			return -1;
 		}
 	}
@@ -544,6 +1039,7 @@ static int unload_module(void)
 	} else {
 		bbs_error("Telnet socket already closed at unload?\n");
 	}
+	relay_stop();
 	return 0;
 }
 
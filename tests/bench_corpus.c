@@ -0,0 +1,287 @@
+/*
+ * LBBS -- The Lightweight Bulletin Board System
+ *
+ * Copyright (C) 2023, Naveen Albert
+ *
+ * Naveen Albert <bbs@phreaknet.org>
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Large mailbox and newsgroup benchmarks
+ *
+ * \note The corpora are created by external/maildirgen, which must be built first
+ *
+ * \author Naveen Albert <bbs@phreaknet.org>
+ */
+
+#include "test.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/stat.h>
+
+/*! \brief Path to the corpus generator, relative to the tests directory */
+#define MAILDIRGEN "../external/maildirgen"
+
+/*! \brief Mostly small messages, so that the 100k corpus doesn't take up too much disk space */
+#define CORPUS_SIZES "90:4k,9:32k,1:256k"
+
+struct corpus {
+	const char *name;		/* Suffix for profile names */
+	unsigned int messages;	/* Number of messages in the corpus */
+	const char *user;		/* User that owns this mailbox */
+	const char *pass;
+	int userid;				/* User ID, i.e. name of maildir */
+	const char *newsgroup;	/* Newsgroup with the same number of articles */
+};
+
+/* Each size gets its own user and newsgroup, so the corpora only need to be generated once */
+static struct corpus corpora[] = {
+	{ "1k", 1000, TEST_USER, TEST_PASS, 1, "misc.1k" },
+	{ "10k", 10000, TEST_USER2, TEST_PASS2, 2, "misc.10k" },
+	{ "100k", 100000, TEST_USER3, TEST_PASS3, 3, "misc.100k" },
+};
+
+/*! \brief The corpus being benchmarked. Profiles run one at a time, so the ops can just check this. */
+static struct corpus *corpus = NULL;
+
+static int generate(const char *args, const char *dir, unsigned int messages)
+{
+	char cmd[512];
+
+	snprintf(cmd, sizeof(cmd), "%s %s -r 1 -n %u -s %s %s > /dev/null", MAILDIRGEN, args, messages, CORPUS_SIZES, dir);
+	bbs_debug(1, "Generating corpus: %s\n", cmd);
+	if (system(cmd)) {
+		bbs_error("Failed to generate corpus in %s\n", dir);
+		return -1;
+	}
+	return 0;
+}
+
+static int pre(void)
+{
+	size_t i;
+
+	test_preload_module("mod_mail.so");
+	test_preload_module("mod_mimeparse.so");
+	test_load_module("net_imap.so");
+	test_load_module("net_pop3.so");
+	test_load_module("net_nntp.so");
+
+	TEST_ADD_CONFIG("mod_mail.conf");
+	TEST_ADD_CONFIG("net_imap.conf");
+	TEST_ADD_CONFIG("net_pop3.conf");
+	TEST_ADD_CONFIG("net_nntp.conf");
+
+	if (access(MAILDIRGEN, X_OK)) {
+		bbs_error("%s does not exist (run 'make' in the external directory first)\n", MAILDIRGEN);
+		return -1;
+	}
+
+	system("rm -rf " TEST_MAIL_DIR " " TEST_NEWS_DIR); /* Purge the contents of the directories, if they existed. */
+	mkdir(TEST_MAIL_DIR, 0700);
+	mkdir(TEST_NEWS_DIR, 0700);
+
+	for (i = 0; i < ARRAY_LEN(corpora); i++) {
+		char dir[256];
+		snprintf(dir, sizeof(dir), TEST_MAIL_DIR "/%d", corpora[i].userid);
+		if (generate("-H " TEST_EXTERNAL_DOMAIN, dir, corpora[i].messages)) {
+			return -1;
+		}
+		snprintf(dir, sizeof(dir), TEST_NEWS_DIR "/%s", corpora[i].newsgroup);
+		if (generate("-H " TEST_HOSTNAME " -g", dir, corpora[i].messages)) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int imap_login(struct test_bench_client *c)
+{
+	BENCH_EXPECT(c, "* OK");
+	BENCH_SEND(c, "a1 LOGIN \"%s\" \"%s\"" ENDL, corpus->user, corpus->pass);
+	BENCH_EXPECT(c, "a1 OK");
+	return 0;
+
+cleanup:
+	return -1;
+}
+
+static int imap_login_select(struct test_bench_client *c)
+{
+	if (imap_login(c)) {
+		return -1;
+	}
+	BENCH_SEND(c, "a2 SELECT \"INBOX\"" ENDL);
+	BENCH_EXPECT(c, "a2 OK");
+	return 0;
+
+cleanup:
+	return -1;
+}
+
+static void imap_logout(struct test_bench_client *c)
+{
+	if (test_bench_send(c, "z LOGOUT" ENDL) > 0) {
+		test_bench_expect(c, "z OK");
+	}
+}
+
+/*! \brief Opening the mailbox, which requires scanning the whole maildir */
+static int op_imap_select(struct test_bench_client *c)
+{
+	BENCH_SEND(c, "b SELECT \"INBOX\"" ENDL);
+	BENCH_EXPECT(c, "b OK");
+	return 0;
+
+cleanup:
+	return -1;
+}
+
+static int op_imap_status(struct test_bench_client *c)
+{
+	BENCH_SEND(c, "b STATUS \"INBOX\" (MESSAGES UIDNEXT UNSEEN SIZE)" ENDL);
+	BENCH_EXPECT(c, "b OK");
+	return 0;
+
+cleanup:
+	return -1;
+}
+
+/*! \brief Flag resynchronization of the entire mailbox, which clients without CONDSTORE do frequently */
+static int op_imap_fetch_flags(struct test_bench_client *c)
+{
+	BENCH_SEND(c, "b FETCH 1:* (UID FLAGS)" ENDL);
+	BENCH_EXPECT(c, "b OK");
+	return 0;
+
+cleanup:
+	return -1;
+}
+
+static int op_imap_search(struct test_bench_client *c)
+{
+	BENCH_SEND(c, "b SEARCH SUBJECT \"budget\"" ENDL);
+	BENCH_EXPECT(c, "b OK");
+	return 0;
+
+cleanup:
+	return -1;
+}
+
+static int op_imap_sort(struct test_bench_client *c)
+{
+	BENCH_SEND(c, "b SORT (REVERSE DATE) UTF-8 ALL" ENDL);
+	BENCH_EXPECT(c, "b OK");
+	return 0;
+
+cleanup:
+	return -1;
+}
+
+static int op_imap_thread(struct test_bench_client *c)
+{
+	BENCH_SEND(c, "b THREAD REFERENCES UTF-8 ALL" ENDL);
+	BENCH_EXPECT(c, "b OK");
+	return 0;
+
+cleanup:
+	return -1;
+}
+
+static void pop3_quit(struct test_bench_client *c)
+{
+	if (test_bench_send(c, "QUIT" ENDL) > 0) {
+		test_bench_expect(c, "+OK");
+	}
+}
+
+/*! \brief Log in and list the maildrop, as a POP3 client polling for new mail does */
+static int op_pop3_list(struct test_bench_client *c)
+{
+	BENCH_EXPECT(c, "+OK");
+	BENCH_SEND(c, "USER %s" ENDL, corpus->user);
+	BENCH_EXPECT(c, "+OK");
+	BENCH_SEND(c, "PASS %s" ENDL, corpus->pass);
+	BENCH_EXPECT(c, "+OK");
+	BENCH_SEND(c, "STAT" ENDL);
+	BENCH_EXPECT(c, "+OK");
+	BENCH_SEND(c, "UIDL" ENDL);
+	BENCH_EXPECT(c, "+OK");
+	BENCH_EXPECT_END(c);
+	return 0;
+
+cleanup:
+	return -1;
+}
+
+static int nntp_banner(struct test_bench_client *c)
+{
+	BENCH_EXPECT(c, "200 ");
+	return 0;
+
+cleanup:
+	return -1;
+}
+
+static void nntp_quit(struct test_bench_client *c)
+{
+	if (test_bench_send(c, "QUIT" ENDL) > 0) {
+		test_bench_expect(c, "205");
+	}
+}
+
+/*! \brief Select the group and get an overview of the newest articles, as a newsreader does when it opens a group */
+static int op_nntp_over(struct test_bench_client *c)
+{
+	BENCH_SEND(c, "GROUP %s" ENDL, corpus->newsgroup);
+	BENCH_EXPECT(c, "211 ");
+	BENCH_SEND(c, "OVER %u-%u" ENDL, corpus->messages - 99, corpus->messages);
+	BENCH_EXPECT(c, "224");
+	BENCH_EXPECT_END(c);
+	return 0;
+
+cleanup:
+	return -1;
+}
+
+/*! \brief Operations to benchmark against each corpus. The corpus size is appended to each name. */
+static const struct test_bench_profile corpus_ops[] = {
+	{ .name = "imap_select", .port = 143, .setup = imap_login, .op = op_imap_select, .cleanup = imap_logout },
+	{ .name = "imap_status", .port = 143, .setup = imap_login, .op = op_imap_status, .cleanup = imap_logout },
+	{ .name = "imap_fetch_flags", .port = 143, .setup = imap_login_select, .op = op_imap_fetch_flags, .cleanup = imap_logout },
+	{ .name = "imap_search", .port = 143, .setup = imap_login_select, .op = op_imap_search, .cleanup = imap_logout },
+	{ .name = "imap_sort", .port = 143, .setup = imap_login_select, .op = op_imap_sort, .cleanup = imap_logout },
+	{ .name = "imap_thread", .port = 143, .setup = imap_login_select, .op = op_imap_thread, .cleanup = imap_logout },
+	/* POP3 locks the maildrop, so only one client at a time */
+	{ .name = "pop3_list", .port = 110, .maxclients = 1, .op = op_pop3_list, .cleanup = pop3_quit, .reconnect = 1 },
+	{ .name = "nntp_over", .port = 119, .setup = nntp_banner, .op = op_nntp_over, .cleanup = nntp_quit },
+};
+
+static int run(void)
+{
+	size_t i, j;
+	int res = 0;
+
+	for (i = 0; i < ARRAY_LEN(corpora); i++) {
+		corpus = &corpora[i];
+		for (j = 0; j < ARRAY_LEN(corpus_ops); j++) {
+			char name[64];
+			struct test_bench_profile profile = corpus_ops[j];
+
+			snprintf(name, sizeof(name), "%s_%s", corpus_ops[j].name, corpus->name);
+			profile.name = name;
+			res |= test_bench_run(&profile);
+		}
+	}
+	return res;
+}
+
+TEST_MODULE_INFO_STANDARD("Large Mailbox and Newsgroup Benchmarks");
@@ -0,0 +1,129 @@
+/*
+ * LBBS -- The Lightweight Bulletin Board System
+ *
+ * Copyright (C) 2023, Naveen Albert
+ *
+ * Naveen Albert <bbs@phreaknet.org>
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Gopher Benchmarks
+ *
+ * \author Naveen Albert <bbs@phreaknet.org>
+ */
+
+#include "test.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#define TEST_GOPHER_DIR "/tmp/test_lbbs/gopherdir"
+
+/*! \brief Number of entries in the large directory */
+#define BENCH_DIR_ENTRIES 1000
+
+/*! \brief Number of lines in the large file (about 256 KB) */
+#define BENCH_FILE_LINES 4096
+
+static int make_file(const char *path, const char *line, int lines)
+{
+	int i;
+	FILE *fp = fopen(path, "w");
+
+	if (!fp) {
+		bbs_error("fopen(%s) failed: %s\n", path, strerror(errno));
+		return -1;
+	}
+	for (i = 0; i < lines; i++) {
+		fprintf(fp, "%s %d\r\n", line, i);
+	}
+	fclose(fp);
+	return 0;
+}
+
+static int pre(void)
+{
+	char path[256];
+	int i;
+
+	test_load_module("net_gopher.so");
+
+	TEST_ADD_CONFIG("net_gopher.conf");
+
+	system("rm -rf " TEST_GOPHER_DIR); /* Purge the contents of the directory, if it existed. */
+	mkdir(TEST_GOPHER_DIR, 0700);
+	mkdir(TEST_GOPHER_DIR "/big", 0700);
+	mkdir(TEST_GOPHER_DIR "/mapped", 0700);
+
+	/* A large, automatically generated menu */
+	for (i = 0; i < BENCH_DIR_ENTRIES; i++) {
+		snprintf(path, sizeof(path), TEST_GOPHER_DIR "/big/file%04d.txt", i);
+		if (make_file(path, "Small file", 1)) {
+			return -1;
+		}
+	}
+
+	/* A hand-authored menu */
+	if (make_file(TEST_GOPHER_DIR "/mapped/gophermap", "This is an informational line in a gophermap", 64)) {
+		return -1;
+	}
+	system("printf '0The big file\\t/large.txt\\n1The big directory\\t/big\\n1Elsewhere\\t/\\tgopher.example.com\\t70\\n' >> " TEST_GOPHER_DIR "/mapped/gophermap");
+
+	/* A large file */
+	return make_file(TEST_GOPHER_DIR "/large.txt", "This is a line in a large text file, served using sendfile", BENCH_FILE_LINES);
+}
+
+static int op_menu(struct test_bench_client *c)
+{
+	BENCH_SEND(c, "/big" ENDL);
+	BENCH_EXPECT_END(c);
+	return 0;
+
+cleanup:
+	return -1;
+}
+
+static int op_gophermap(struct test_bench_client *c)
+{
+	BENCH_SEND(c, "/mapped" ENDL);
+	BENCH_EXPECT_END(c);
+	return 0;
+
+cleanup:
+	return -1;
+}
+
+static int op_file(struct test_bench_client *c)
+{
+	BENCH_SEND(c, "/large.txt" ENDL);
+	BENCH_EXPECT_END(c);
+	return 0;
+
+cleanup:
+	return -1;
+}
+
+static int run(void)
+{
+	int res = 0;
+	/* Gopher is one request per connection, so every operation includes connection setup */
+	struct test_bench_profile menu = { .name = "gopher_menu", .port = 70, .op = op_menu, .reconnect = 1 };
+	struct test_bench_profile gophermap = { .name = "gopher_gophermap", .port = 70, .op = op_gophermap, .reconnect = 1 };
+	struct test_bench_profile file = { .name = "gopher_file", .port = 70, .op = op_file, .reconnect = 1 };
+
+	res |= test_bench_run(&menu);
+	res |= test_bench_run(&gophermap);
+	res |= test_bench_run(&file);
+	return res;
+}
+
+TEST_MODULE_INFO_STANDARD("Gopher Benchmarks");
@@ -0,0 +1,135 @@
+/*
+ * LBBS -- The Lightweight Bulletin Board System
+ *
+ * Copyright (C) 2023, Naveen Albert
+ *
+ * Naveen Albert <bbs@phreaknet.org>
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief HTTP Benchmarks
+ *
+ * \author Naveen Albert <bbs@phreaknet.org>
+ */
+
+#include "test.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#define TEST_WWW_DIR "/tmp/test_lbbs/www"
+
+/*! \brief Last line of the static page, so we know when we've read the whole response */
+#define BENCH_PAGE_END "</html>"
+
+/*! \brief Output of the CGI script, which is as trivial as possible so that we mostly measure spawning it */
+#define BENCH_CGI_OUTPUT "CGI benchmark"
+
+static int pre(void)
+{
+	FILE *fp;
+	int i;
+
+	test_preload_module("mod_http.so");
+	test_load_module("net_http.so");
+
+	/* Same as net_http.conf, but with CGI enabled */
+	fp = fopen(TEST_CONFIG_DIR "/net_http.conf", "w");
+	if (!fp) {
+		return -1;
+	}
+	fprintf(fp, "[general]\r\ndocroot=%s\r\ncgi=yes\r\nauthonly=no\r\n\r\n[http]\r\nport=8080\r\nenabled=yes\r\n", TEST_WWW_DIR);
+	fclose(fp);
+
+	system("rm -rf " TEST_WWW_DIR); /* Purge the contents of the directory, if it existed. */
+	mkdir(TEST_WWW_DIR, 0700); /* Make directory if it doesn't exist already (of course it won't due to the previous step) */
+
+	/* A few KB, about the size of a typical small static page */
+	fp = fopen(TEST_WWW_DIR "/bench.html", "w");
+	if (!fp) {
+		bbs_error("fopen failed: %s\n", strerror(errno));
+		return -1;
+	}
+	fprintf(fp, "<html>\r\n<head><title>Benchmark</title></head>\r\n<body>\r\n");
+	for (i = 0; i < 64; i++) {
+		fprintf(fp, "<p>This is line %d of a static page served as fast as possible.</p>\r\n", i);
+	}
+	fprintf(fp, "</body>\r\n" BENCH_PAGE_END "\r\n");
+	fclose(fp);
+
+	fp = fopen(TEST_WWW_DIR "/bench.cgi", "w");
+	if (!fp) {
+		bbs_error("fopen failed: %s\n", strerror(errno));
+		return -1;
+	}
+	fprintf(fp, "#!/bin/sh\nprintf 'Content-Type: text/plain\\r\\n\\r\\n%s\\r\\n'\n", BENCH_CGI_OUTPUT);
+	fclose(fp);
+	chmod(TEST_WWW_DIR "/bench.cgi", 0700);
+	return 0;
+}
+
+static int get_page(struct test_bench_client *c, int keepalive)
+{
+	BENCH_SEND(c, "GET /bench.html HTTP/1.1" ENDL
+		"Host: localhost:8080" ENDL
+		"Connection: %s" ENDL
+		ENDL, keepalive ? "keep-alive" : "close");
+	BENCH_EXPECT(c, "HTTP/1.1 200");
+	BENCH_EXPECT(c, BENCH_PAGE_END);
+	return 0;
+
+cleanup:
+	return -1;
+}
+
+static int op_static(struct test_bench_client *c)
+{
+	return get_page(c, 0);
+}
+
+static int op_keepalive(struct test_bench_client *c)
+{
+	return get_page(c, 1);
+}
+
+/*! \brief Each CGI request executes a program, so this mostly measures how long it takes to spawn one */
+static int op_cgi(struct test_bench_client *c)
+{
+	BENCH_SEND(c, "GET /bench.cgi HTTP/1.1" ENDL
+		"Host: localhost:8080" ENDL
+		"Connection: close" ENDL
+		ENDL);
+	BENCH_EXPECT(c, "HTTP/1.1 200");
+	BENCH_EXPECT(c, BENCH_CGI_OUTPUT);
+	return 0;
+
+cleanup:
+	return -1;
+}
+
+static int run(void)
+{
+	int res = 0;
+	/* A new connection for every request */
+	struct test_bench_profile single = { .name = "http_static", .port = 8080, .op = op_static, .reconnect = 1 };
+	/* Persistent connections */
+	struct test_bench_profile keepalive = { .name = "http_keepalive", .port = 8080, .op = op_keepalive };
+	/* Spawn latency (compare with helper=no in the [spawn] section of system.conf) */
+	struct test_bench_profile cgi = { .name = "http_cgi", .port = 8080, .op = op_cgi, .reconnect = 1 };
+
+	res |= test_bench_run(&single);
+	res |= test_bench_run(&keepalive);
+	res |= test_bench_run(&cgi);
+	return res;
+}
+
+TEST_MODULE_INFO_STANDARD("HTTP Benchmarks");
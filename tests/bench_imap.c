@@ -0,0 +1,214 @@
+/*
+ * LBBS -- The Lightweight Bulletin Board System
+ *
+ * Copyright (C) 2023, Naveen Albert
+ *
+ * Naveen Albert <bbs@phreaknet.org>
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief IMAP Benchmarks
+ *
+ * \author Naveen Albert <bbs@phreaknet.org>
+ */
+
+#include "test.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/stat.h>
+
+/*! \brief Number of messages in the mailbox used for the benchmarks */
+#define BENCH_MESSAGES 100
+
+static int pre(void)
+{
+	test_preload_module("mod_mail.so");
+	test_preload_module("mod_mimeparse.so");
+	test_preload_module("net_smtp.so");
+	test_load_module("mod_smtp_delivery_local.so");
+	test_load_module("net_imap.so");
+
+	TEST_ADD_CONFIG("mod_mail.conf");
+	TEST_ADD_CONFIG("net_smtp.conf");
+	TEST_ADD_CONFIG("net_imap.conf");
+
+	system("rm -rf " TEST_MAIL_DIR); /* Purge the contents of the directory, if it existed. */
+	mkdir(TEST_MAIL_DIR, 0700); /* Make directory if it doesn't exist already (of course it won't due to the previous step) */
+	return 0;
+}
+
+static int make_messages(int nummsg)
+{
+	struct test_bench_client c;
+	int i, res = -1;
+
+	memset(&c, 0, sizeof(c));
+	c.fd = test_make_socket(25);
+	if (c.fd < 0) {
+		return -1;
+	}
+
+	BENCH_EXPECT(&c, "220 ");
+	BENCH_SEND(&c, "EHLO " TEST_EXTERNAL_DOMAIN ENDL);
+	BENCH_EXPECT(&c, "250 ");
+	for (i = 1; i <= nummsg; i++) {
+		BENCH_SEND(&c, "MAIL FROM:<" TEST_EMAIL_EXTERNAL ">" ENDL);
+		BENCH_EXPECT(&c, "250");
+		BENCH_SEND(&c, "RCPT TO:<" TEST_EMAIL ">" ENDL);
+		BENCH_EXPECT(&c, "250");
+		BENCH_SEND(&c, "DATA" ENDL);
+		BENCH_EXPECT(&c, "354");
+		BENCH_SEND(&c, "Date: Sun, 1 Jan 2023 05:33:29 -0700" ENDL
+			"From: " TEST_EMAIL_EXTERNAL ENDL
+			"Subject: Message %d" ENDL
+			"To: " TEST_EMAIL ENDL
+			"Content-Type: text/plain" ENDL
+			ENDL
+			"This is test email message number %d." ENDL
+			"It exists purely to be fetched and searched as fast as possible." ENDL
+			"." ENDL, i, i);
+		BENCH_EXPECT(&c, "250");
+	}
+	BENCH_SEND(&c, "QUIT" ENDL);
+	res = 0;
+
+cleanup:
+	close(c.fd);
+	return res;
+}
+
+static int login(struct test_bench_client *c)
+{
+	BENCH_EXPECT(c, "* OK");
+	BENCH_SEND(c, "a1 LOGIN \"" TEST_USER "\" \"" TEST_PASS "\"" ENDL);
+	BENCH_EXPECT(c, "a1 OK");
+	return 0;
+
+cleanup:
+	return -1;
+}
+
+static int login_select(struct test_bench_client *c)
+{
+	if (login(c)) {
+		return -1;
+	}
+	BENCH_SEND(c, "a2 SELECT \"INBOX\"" ENDL);
+	BENCH_EXPECT(c, "a2 OK");
+	return 0;
+
+cleanup:
+	return -1;
+}
+
+static void logout(struct test_bench_client *c)
+{
+	if (test_bench_send(c, "z LOGOUT" ENDL) > 0) {
+		test_bench_expect(c, "z OK");
+	}
+}
+
+/*! \brief What a client does when it opens a mailbox to synchronize it */
+static int op_sync(struct test_bench_client *c)
+{
+	char tag[16];
+
+	snprintf(tag, sizeof(tag), "s%u OK", c->iteration);
+	BENCH_SEND(c, "s%u SELECT \"INBOX\"" ENDL, c->iteration);
+	BENCH_EXPECT(c, tag);
+	snprintf(tag, sizeof(tag), "f%u OK", c->iteration);
+	BENCH_SEND(c, "f%u UID FETCH 1:* (UID FLAGS)" ENDL, c->iteration);
+	BENCH_EXPECT(c, tag);
+	return 0;
+
+cleanup:
+	return -1;
+}
+
+static int op_fetch(struct test_bench_client *c)
+{
+	char tag[16];
+
+	snprintf(tag, sizeof(tag), "f%u OK", c->iteration);
+	BENCH_SEND(c, "f%u FETCH %u (FLAGS RFC822.SIZE BODY.PEEK[])" ENDL, c->iteration, 1 + (c->iteration + (unsigned int) c->index) % BENCH_MESSAGES);
+	BENCH_EXPECT(c, tag);
+	return 0;
+
+cleanup:
+	return -1;
+}
+
+static int op_search(struct test_bench_client *c)
+{
+	char tag[16];
+
+	snprintf(tag, sizeof(tag), "q%u OK", c->iteration);
+	/* Alternate between a header search and a full text search, both of which need to look at every message */
+	if (c->iteration % 2) {
+		BENCH_SEND(c, "q%u SEARCH SUBJECT \"Message %u\"" ENDL, c->iteration, 1 + c->iteration % BENCH_MESSAGES);
+	} else {
+		BENCH_SEND(c, "q%u SEARCH BODY \"number %u.\"" ENDL, c->iteration, 1 + c->iteration % BENCH_MESSAGES);
+	}
+	BENCH_EXPECT(c, tag);
+	return 0;
+
+cleanup:
+	return -1;
+}
+
+static int login_select_create(struct test_bench_client *c)
+{
+	if (login_select(c)) {
+		return -1;
+	}
+	/* Each client copies into its own folder */
+	BENCH_SEND(c, "a3 CREATE \"Copies%d\"" ENDL, c->index);
+	BENCH_EXPECT(c, "a3 OK");
+	return 0;
+
+cleanup:
+	return -1;
+}
+
+/*! \brief Bulk copy, like a client archiving or "deleting" (copying to Trash) an entire folder */
+static int op_copy(struct test_bench_client *c)
+{
+	char tag[16];
+
+	snprintf(tag, sizeof(tag), "c%u OK", c->iteration);
+	BENCH_SEND(c, "c%u COPY 1:* \"Copies%d\"" ENDL, c->iteration, c->index);
+	BENCH_EXPECT(c, tag);
+	return 0;
+
+cleanup:
+	return -1;
+}
+
+static int run(void)
+{
+	int res = 0;
+	struct test_bench_profile sync = { .name = "imap_sync", .port = 143, .setup = login, .op = op_sync, .cleanup = logout };
+	struct test_bench_profile fetch = { .name = "imap_fetch", .port = 143, .setup = login_select, .op = op_fetch, .cleanup = logout };
+	struct test_bench_profile search = { .name = "imap_search", .port = 143, .setup = login_select, .op = op_search, .cleanup = logout };
+	struct test_bench_profile copy = { .name = "imap_copy", .port = 143, .setup = login_select_create, .op = op_copy, .cleanup = logout };
+
+	if (make_messages(BENCH_MESSAGES)) {
+		return -1;
+	}
+
+	res |= test_bench_run(&sync);
+	res |= test_bench_run(&fetch);
+	res |= test_bench_run(&search);
+	res |= test_bench_run(&copy);
+	return res;
+}
+
+TEST_MODULE_INFO_STANDARD("IMAP Benchmarks");
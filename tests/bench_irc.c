@@ -0,0 +1,124 @@
+/*
+ * LBBS -- The Lightweight Bulletin Board System
+ *
+ * Copyright (C) 2023, Naveen Albert
+ *
+ * Naveen Albert <bbs@phreaknet.org>
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief IRC Benchmarks
+ *
+ * \author Naveen Albert <bbs@phreaknet.org>
+ */
+
+#include "test.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+
+static int pre(void)
+{
+	test_load_module("net_irc.so");
+
+	TEST_ADD_CONFIG("net_irc.conf");
+	return 0;
+}
+
+/*! \brief Minimal base64 encoder, for SASL PLAIN (the test framework is not linked with the BBS) */
+static void base64_encode(const unsigned char *in, size_t len, char *out)
+{
+	static const char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	size_t i;
+
+	for (i = 0; i + 2 < len; i += 3) {
+		*out++ = table[in[i] >> 2];
+		*out++ = table[((in[i] & 0x03) << 4) | (in[i + 1] >> 4)];
+		*out++ = table[((in[i + 1] & 0x0f) << 2) | (in[i + 2] >> 6)];
+		*out++ = table[in[i + 2] & 0x3f];
+	}
+	if (i < len) {
+		*out++ = table[in[i] >> 2];
+		if (i + 1 < len) {
+			*out++ = table[((in[i] & 0x03) << 4) | (in[i + 1] >> 4)];
+			*out++ = table[(in[i + 1] & 0x0f) << 2];
+		} else {
+			*out++ = table[(in[i] & 0x03) << 4];
+			*out++ = '=';
+		}
+		*out++ = '=';
+	}
+	*out = '\0';
+}
+
+static int login_join(struct test_bench_client *c)
+{
+	char plain[64], encoded[96];
+	int len;
+
+	/* authzid NUL authcid NUL password */
+	len = snprintf(plain, sizeof(plain), "%s%c%s%c%s", c->username, '\0', c->username, '\0', TEST_PASS);
+	base64_encode((unsigned char*) plain, (size_t) len, encoded);
+
+	BENCH_SEND(c, "CAP LS 302" ENDL);
+	BENCH_SEND(c, "NICK %s" ENDL, c->username);
+	BENCH_SEND(c, "USER %s" ENDL, c->username);
+	BENCH_EXPECT(c, "CAP * LS");
+	BENCH_SEND(c, "CAP REQ :sasl" ENDL);
+	BENCH_EXPECT(c, "CAP * ACK");
+	BENCH_SEND(c, "AUTHENTICATE PLAIN" ENDL);
+	BENCH_EXPECT(c, "AUTHENTICATE +");
+	BENCH_SEND(c, "AUTHENTICATE %s" ENDL, encoded);
+	BENCH_EXPECT(c, " 903 ");
+	BENCH_SEND(c, "CAP END" ENDL);
+	BENCH_EXPECT(c, " 376 "); /* End of MOTD */
+
+	/* Everyone joins the same channel, so every message fans out to all the other clients */
+	BENCH_SEND(c, "JOIN #bench" ENDL);
+	BENCH_EXPECT(c, " 366 "); /* End of NAMES */
+	return 0;
+
+cleanup:
+	return -1;
+}
+
+static void quit(struct test_bench_client *c)
+{
+	test_bench_send(c, "QUIT :Done" ENDL);
+}
+
+/*!
+ * \brief Send a channel message, then ping the server.
+ * The server processes commands in order, so once the PONG arrives,
+ * the message has been relayed to every other member of the channel.
+ * Reading up to the PONG also consumes the messages sent by the other clients in the meantime.
+ */
+static int op_fanout(struct test_bench_client *c)
+{
+	char token[32];
+
+	snprintf(token, sizeof(token), "bench-%d-%u", c->index, c->iteration);
+	BENCH_SEND(c, "PRIVMSG #bench :Message %u from client %d" ENDL, c->iteration, c->index);
+	BENCH_SEND(c, "PING :%s" ENDL, token);
+	BENCH_EXPECT(c, token);
+	return 0;
+
+cleanup:
+	return -1;
+}
+
+static int run(void)
+{
+	struct test_bench_profile fanout = { .name = "irc_channel_fanout", .port = 6667, .setup = login_join, .op = op_fanout, .cleanup = quit };
+
+	return test_bench_run(&fanout);
+}
+
+TEST_MODULE_INFO_STANDARD("IRC Benchmarks");
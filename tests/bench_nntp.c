@@ -0,0 +1,118 @@
+/*
+ * LBBS -- The Lightweight Bulletin Board System
+ *
+ * Copyright (C) 2023, Naveen Albert
+ *
+ * Naveen Albert <bbs@phreaknet.org>
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief NNTP Benchmarks
+ *
+ * \author Naveen Albert <bbs@phreaknet.org>
+ */
+
+#include "test.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/stat.h>
+
+/*! \brief Number of articles in the newsgroup */
+#define BENCH_ARTICLES 100
+
+static int pre(void)
+{
+	test_load_module("net_nntp.so");
+
+	TEST_ADD_CONFIG("net_nntp.conf");
+	system("rm -rf /tmp/test_lbbs/newsdir"); /* Yuck */
+	mkdir(TEST_NEWS_DIR, 0700); /* Make directory if it doesn't exist already */
+	mkdir(TEST_NEWS_DIR "/misc.test", 0700);
+	return 0;
+}
+
+static int make_articles(int numarticles)
+{
+	struct test_bench_client c;
+	int i, res = -1;
+
+	memset(&c, 0, sizeof(c));
+	c.fd = test_make_socket(119);
+	if (c.fd < 0) {
+		return -1;
+	}
+
+	BENCH_EXPECT(&c, "200 ");
+	BENCH_SEND(&c, "AUTHINFO USER " TEST_USER "@" TEST_HOSTNAME ENDL);
+	BENCH_EXPECT(&c, "381");
+	BENCH_SEND(&c, "AUTHINFO PASS " TEST_PASS ENDL);
+	BENCH_EXPECT(&c, "281");
+	for (i = 1; i <= numarticles; i++) {
+		BENCH_SEND(&c, "POST" ENDL);
+		BENCH_EXPECT(&c, "340");
+		BENCH_SEND(&c, "From: \"Demo User\" <" TEST_EMAIL ">" ENDL
+			"Newsgroups: misc.test" ENDL
+			"Subject: Benchmark article %d" ENDL
+			ENDL
+			"This is just a test article." ENDL
+			"." ENDL, i);
+		BENCH_EXPECT(&c, "240");
+	}
+	BENCH_SEND(&c, "QUIT" ENDL);
+	res = 0;
+
+cleanup:
+	close(c.fd);
+	return res;
+}
+
+static int select_group(struct test_bench_client *c)
+{
+	BENCH_EXPECT(c, "200 ");
+	BENCH_SEND(c, "GROUP misc.test" ENDL);
+	BENCH_EXPECT(c, "211 ");
+	return 0;
+
+cleanup:
+	return -1;
+}
+
+static void quit(struct test_bench_client *c)
+{
+	if (test_bench_send(c, "QUIT" ENDL) > 0) {
+		test_bench_expect(c, "205");
+	}
+}
+
+/*! \brief Overview of the whole group, as a newsreader does when it opens a group */
+static int op_over(struct test_bench_client *c)
+{
+	BENCH_SEND(c, "OVER 1-%d" ENDL, BENCH_ARTICLES);
+	BENCH_EXPECT(c, "224");
+	BENCH_EXPECT_END(c);
+	return 0;
+
+cleanup:
+	return -1;
+}
+
+static int run(void)
+{
+	struct test_bench_profile over = { .name = "nntp_over", .port = 119, .setup = select_group, .op = op_over, .cleanup = quit };
+
+	if (make_articles(BENCH_ARTICLES)) {
+		return -1;
+	}
+
+	return test_bench_run(&over);
+}
+
+TEST_MODULE_INFO_STANDARD("NNTP Benchmarks");
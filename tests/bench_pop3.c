@@ -0,0 +1,133 @@
+/*
+ * LBBS -- The Lightweight Bulletin Board System
+ *
+ * Copyright (C) 2023, Naveen Albert
+ *
+ * Naveen Albert <bbs@phreaknet.org>
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief POP3 Benchmarks
+ *
+ * \author Naveen Albert <bbs@phreaknet.org>
+ */
+
+#include "test.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/stat.h>
+
+/*! \brief Number of messages in each client's maildrop */
+#define BENCH_MESSAGES 25
+
+static int pre(void)
+{
+	test_preload_module("mod_mail.so");
+	test_preload_module("mod_mimeparse.so");
+	test_preload_module("net_smtp.so");
+	test_preload_module("mod_smtp_delivery_local.so");
+	test_load_module("net_pop3.so");
+
+	TEST_ADD_CONFIG("mod_mail.conf");
+	TEST_ADD_CONFIG("net_smtp.conf");
+	TEST_ADD_CONFIG("net_pop3.conf");
+
+	system("rm -rf " TEST_MAIL_DIR); /* Purge the contents of the directory, if it existed. */
+	mkdir(TEST_MAIL_DIR, 0700); /* Make directory if it doesn't exist already (of course it won't due to the previous step) */
+	return 0;
+}
+
+/*! \brief Fill each client's maildrop, since POP3 sessions lock the maildrop and so can't be shared */
+static int make_messages(int numclients, int nummsg)
+{
+	struct test_bench_client c;
+	int i, j, res = -1;
+
+	memset(&c, 0, sizeof(c));
+	c.fd = test_make_socket(25);
+	if (c.fd < 0) {
+		return -1;
+	}
+
+	BENCH_EXPECT(&c, "220 ");
+	BENCH_SEND(&c, "EHLO " TEST_EXTERNAL_DOMAIN ENDL);
+	BENCH_EXPECT(&c, "250 ");
+	for (i = 1; i <= numclients; i++) {
+		for (j = 1; j <= nummsg; j++) {
+			BENCH_SEND(&c, "MAIL FROM:<" TEST_EMAIL_EXTERNAL ">" ENDL);
+			BENCH_EXPECT(&c, "250");
+			BENCH_SEND(&c, "RCPT TO:<" TEST_BENCH_USER_PREFIX "%d@" TEST_HOSTNAME ">" ENDL, i);
+			BENCH_EXPECT(&c, "250");
+			BENCH_SEND(&c, "DATA" ENDL);
+			BENCH_EXPECT(&c, "354");
+			BENCH_SEND(&c, "Date: Sun, 1 Jan 2023 05:33:29 -0700" ENDL
+				"From: " TEST_EMAIL_EXTERNAL ENDL
+				"Subject: Message %d" ENDL
+				"To: " TEST_BENCH_USER_PREFIX "%d@" TEST_HOSTNAME ENDL
+				"Content-Type: text/plain" ENDL
+				ENDL
+				"This is a test email message." ENDL
+				"....Let's hope it gets retrieved quickly." ENDL
+				"." ENDL, j, i);
+			BENCH_EXPECT(&c, "250");
+		}
+	}
+	BENCH_SEND(&c, "QUIT" ENDL);
+	res = 0;
+
+cleanup:
+	close(c.fd);
+	return res;
+}
+
+static int login(struct test_bench_client *c)
+{
+	BENCH_EXPECT(c, "+OK");
+	BENCH_SEND(c, "USER %s" ENDL, c->username);
+	BENCH_EXPECT(c, "+OK");
+	BENCH_SEND(c, "PASS " TEST_PASS ENDL);
+	BENCH_EXPECT(c, "+OK");
+	return 0;
+
+cleanup:
+	return -1;
+}
+
+static void quit(struct test_bench_client *c)
+{
+	if (test_bench_send(c, "QUIT" ENDL) > 0) {
+		test_bench_expect(c, "+OK");
+	}
+}
+
+static int op_retr(struct test_bench_client *c)
+{
+	BENCH_SEND(c, "RETR %u" ENDL, 1 + c->iteration % BENCH_MESSAGES);
+	BENCH_EXPECT(c, "+OK");
+	BENCH_EXPECT_END(c);
+	return 0;
+
+cleanup:
+	return -1;
+}
+
+static int run(void)
+{
+	struct test_bench_profile retr = { .name = "pop3_retr", .port = 110, .setup = login, .op = op_retr, .cleanup = quit };
+
+	if (make_messages(test_bench_clients(), BENCH_MESSAGES)) {
+		return -1;
+	}
+
+	return test_bench_run(&retr);
+}
+
+TEST_MODULE_INFO_STANDARD("POP3 Benchmarks");
@@ -0,0 +1,112 @@
+/*
+ * LBBS -- The Lightweight Bulletin Board System
+ *
+ * Copyright (C) 2023, Naveen Albert
+ *
+ * Naveen Albert <bbs@phreaknet.org>
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief SMTP Benchmarks
+ *
+ * \author Naveen Albert <bbs@phreaknet.org>
+ */
+
+#include "test.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/stat.h>
+
+static int pre(void)
+{
+	test_preload_module("mod_mail.so");
+	test_preload_module("net_smtp.so");
+	test_load_module("mod_smtp_delivery_local.so");
+
+	TEST_ADD_CONFIG("mod_mail.conf");
+	TEST_ADD_CONFIG("net_smtp.conf");
+
+	system("rm -rf " TEST_MAIL_DIR); /* Purge the contents of the directory, if it existed. */
+	mkdir(TEST_MAIL_DIR, 0700); /* Make directory if it doesn't exist already (of course it won't due to the previous step) */
+	return 0;
+}
+
+static int ehlo(struct test_bench_client *c)
+{
+	BENCH_EXPECT(c, "220 ");
+	BENCH_SEND(c, "EHLO " TEST_EXTERNAL_DOMAIN ENDL);
+	BENCH_EXPECT(c, "250 ");
+	return 0;
+
+cleanup:
+	return -1;
+}
+
+static void quit(struct test_bench_client *c)
+{
+	if (test_bench_send(c, "QUIT" ENDL) > 0) {
+		test_bench_expect(c, "221");
+	}
+}
+
+/*! \brief A single inbound message transaction */
+static int send_message(struct test_bench_client *c, const char *user)
+{
+	BENCH_SEND(c, "MAIL FROM:<" TEST_EMAIL_EXTERNAL ">" ENDL);
+	BENCH_EXPECT(c, "250");
+	BENCH_SEND(c, "RCPT TO:<%s@" TEST_HOSTNAME ">" ENDL, user);
+	BENCH_EXPECT(c, "250");
+	BENCH_SEND(c, "DATA" ENDL);
+	BENCH_EXPECT(c, "354");
+	BENCH_SEND(c, "Date: Sun, 1 Jan 2023 05:33:29 -0700" ENDL
+		"From: " TEST_EMAIL_EXTERNAL ENDL
+		"Subject: Burst %d/%u" ENDL
+		"To: %s@" TEST_HOSTNAME ENDL
+		"Content-Type: text/plain" ENDL
+		ENDL
+		"This is a test email message." ENDL
+		"..Sent as part of an inbound burst." ENDL /* Byte stuffing */
+		"." ENDL, c->index, c->iteration, user);
+	BENCH_EXPECT(c, "250");
+	return 0;
+
+cleanup:
+	return -1;
+}
+
+static int op_message(struct test_bench_client *c)
+{
+	return send_message(c, c->username);
+}
+
+/*! \brief Every client delivers to the same mailbox, so deliveries contend for the same maildir */
+static int op_message_shared(struct test_bench_client *c)
+{
+	return send_message(c, TEST_USER);
+}
+
+static int run(void)
+{
+	int res = 0;
+	/* Many messages per connection, as a busy relay would do */
+	struct test_bench_profile burst = { .name = "smtp_inbound_burst", .port = 25, .setup = ehlo, .op = op_message, .cleanup = quit };
+	/* A new connection for every message, as is typical for inbound mail from many different MTAs */
+	struct test_bench_profile perconnection = { .name = "smtp_inbound_connect", .port = 25, .setup = ehlo, .op = op_message, .cleanup = quit, .reconnect = 1 };
+	/* Concurrent deliveries to a single mailbox */
+	struct test_bench_profile shared = { .name = "smtp_inbound_shared", .port = 25, .setup = ehlo, .op = op_message_shared, .cleanup = quit };
+
+	res |= test_bench_run(&burst);
+	res |= test_bench_run(&perconnection);
+	res |= test_bench_run(&shared);
+	return res;
+}
+
+TEST_MODULE_INFO_STANDARD("SMTP Benchmarks");
@@ -0,0 +1,209 @@
+/*
+ * LBBS -- The Lightweight Bulletin Board System
+ *
+ * Copyright (C) 2023, Naveen Albert
+ *
+ * Naveen Albert <bbs@phreaknet.org>
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief TLS Handshake Benchmarks
+ *
+ * \note A self-signed certificate is generated using the openssl command line tool
+ *
+ * \author Naveen Albert <bbs@phreaknet.org>
+ */
+
+#include "test.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#define TLS_CERT TEST_ROOT_DIR "/bench_tls.crt"
+#define TLS_KEY TEST_ROOT_DIR "/bench_tls.key"
+
+#define IMAPS_PORT 993
+
+/*! \brief Number of connections that stall in the middle of the handshake during the flood. Limited by maxnodes. */
+#define BENCH_STALLED_CLIENTS 32
+
+static SSL_CTX *ctx = NULL;
+static SSL *ssls[TEST_BENCH_MAX_CLIENTS];
+
+static int pre(void)
+{
+	FILE *fp;
+
+	test_preload_module("mod_mail.so");
+	test_preload_module("mod_mimeparse.so");
+	test_load_module("net_imap.so");
+
+	TEST_ADD_CONFIG("mod_mail.conf");
+
+	if (system("openssl req -x509 -newkey rsa:2048 -nodes -days 1 -subj /CN=" TEST_HOSTNAME " -keyout " TLS_KEY " -out " TLS_CERT " 2>/dev/null")) {
+		bbs_error("Failed to generate self-signed certificate (is openssl installed?)\n");
+		return -1;
+	}
+
+	fp = fopen(TEST_CONFIG_DIR "/tls.conf", "w");
+	if (!fp) {
+		return -1;
+	}
+	fprintf(fp, "[tls]\r\ncert=%s\r\nkey=%s\r\n", TLS_CERT, TLS_KEY);
+	fclose(fp);
+
+	/* Only implicit TLS, so every connection does a handshake */
+	fp = fopen(TEST_CONFIG_DIR "/net_imap.conf", "w");
+	if (!fp) {
+		return -1;
+	}
+	fprintf(fp, "[imap]\r\nenabled=no\r\n\r\n[imaps]\r\nenabled=yes\r\nport=%d\r\n", IMAPS_PORT);
+	fclose(fp);
+
+	system("rm -rf " TEST_MAIL_DIR); /* Purge the contents of the directory, if it existed. */
+	mkdir(TEST_MAIL_DIR, 0700);
+	return 0;
+}
+
+/*! \brief Complete a TLS handshake on a newly connected client and wait for the server greeting */
+static int op_handshake(struct test_bench_client *c)
+{
+	char buf[256];
+	int res;
+	SSL *ssl;
+
+	ssl = SSL_new(ctx);
+	if (!ssl) {
+		return -1;
+	}
+	ssls[c->index] = ssl;
+	SSL_set_fd(ssl, c->fd);
+	SSL_set_tlsext_host_name(ssl, TEST_HOSTNAME);
+	if (SSL_connect(ssl) != 1) {
+		bbs_debug(1, "Client %d: TLS handshake failed: %s\n", c->index, ERR_error_string(ERR_get_error(), NULL));
+		return -1;
+	}
+	res = SSL_read(ssl, buf, sizeof(buf) - 1);
+	if (res <= 0) {
+		return -1;
+	}
+	buf[res] = '\0';
+	if (strncmp(buf, "* OK", STRLEN("* OK"))) {
+		bbs_debug(1, "Client %d: unexpected greeting: %s\n", c->index, buf);
+		return -1;
+	}
+	return 0;
+}
+
+static void cleanup_handshake(struct test_bench_client *c)
+{
+	SSL *ssl = ssls[c->index];
+
+	if (ssl) {
+		SSL_write(ssl, "z LOGOUT" ENDL, STRLEN("z LOGOUT" ENDL));
+		SSL_shutdown(ssl);
+		SSL_free(ssl);
+		ssls[c->index] = NULL;
+	}
+}
+
+static volatile int flood_stop = 0;
+
+/*! \brief Begin a handshake but never finish it: just the header of a TLS record that never arrives */
+static int stalled_connect(void)
+{
+	const unsigned char partial[] = { 0x16, 0x03, 0x01, 0x02, 0x00 }; /* Handshake record, 512 bytes */
+	int fd = test_make_socket(IMAPS_PORT);
+
+	if (fd >= 0 && write(fd, partial, sizeof(partial)) != sizeof(partial)) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*! \brief Keep a number of stalled handshakes open, replacing any the server gives up on */
+static void *flood_thread(void *varg)
+{
+	struct pollfd pfds[BENCH_STALLED_CLIENTS];
+	int i, nfds = *(int*) varg;
+
+	for (i = 0; i < nfds; i++) {
+		pfds[i].fd = stalled_connect();
+		pfds[i].events = POLLIN;
+	}
+
+	while (!flood_stop) {
+		if (poll(pfds, (nfds_t) nfds, 100) <= 0) {
+			continue;
+		}
+		for (i = 0; i < nfds; i++) {
+			if (pfds[i].revents) {
+				/* Server closed the connection (probably timed out), start another one */
+				close_if(pfds[i].fd);
+				pfds[i].fd = stalled_connect();
+				pfds[i].revents = 0;
+			}
+		}
+	}
+
+	for (i = 0; i < nfds; i++) {
+		close_if(pfds[i].fd);
+	}
+	return NULL;
+}
+
+static int run(void)
+{
+	struct test_bench_profile handshake = { .name = "tls_handshake", .port = IMAPS_PORT, .op = op_handshake, .cleanup = cleanup_handshake, .reconnect = 1 };
+	struct test_bench_profile flood = handshake;
+	pthread_t thread;
+	int nstalled, res;
+
+	ctx = SSL_CTX_new(TLS_client_method());
+	if (!ctx) {
+		bbs_error("Failed to create SSL context\n");
+		return -1;
+	}
+	SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, NULL); /* Self-signed */
+	/* Don't resume sessions, so every connection does a full handshake */
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+	SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+
+	res = test_bench_run(&handshake);
+
+	/* Now do the same thing while other clients are stuck mid-handshake.
+	 * Leave some room for the benchmark clients themselves, since each stalled connection also uses a node. */
+	nstalled = MIN(BENCH_STALLED_CLIENTS, 60 - test_bench_clients());
+	if (nstalled > 0) {
+		flood.name = "tls_handshake_flood";
+		flood_stop = 0;
+		if (pthread_create(&thread, NULL, flood_thread, &nstalled)) {
+			bbs_error("pthread_create failed: %s\n", strerror(errno));
+			res = -1;
+		} else {
+			usleep(100000); /* Let the stalled connections get established first */
+			res |= test_bench_run(&flood);
+			flood_stop = 1;
+			pthread_join(thread, NULL);
+		}
+	}
+
+	SSL_CTX_free(ctx);
+	return res;
+}
+
+TEST_MODULE_INFO_STANDARD("TLS Handshake Benchmarks");
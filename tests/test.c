@@ -54,6 +54,15 @@ static int option_helgrind = 0;
 static int option_gen_supp = 0;
 static int option_exit_failure = 0;
 static const char *testfilter = NULL;
+static int option_bench_clients = 4;
+static int option_bench_seconds = 5;
+
+#ifdef TEST_BENCH
+/* The benchmark runner is built from the same source, but runs bench_*.so modules instead */
+#define TEST_MODULE_PREFIX "bench_"
+#else
+#define TEST_MODULE_PREFIX "test_"
+#endif
 
 int startup_run_unit_tests;
 
@@ -135,7 +144,11 @@ void __attribute__ ((format (gnu_printf, 6, 7))) __bbs_log(enum bbs_log_level lo
 
 static int parse_options(int argc, char *argv[])
 {
+#ifdef TEST_BENCH
+	static const char *getopt_settings = "?c:dDeglt:s:x";
+#else
 	static const char *getopt_settings = "?dDeglt:x";
+#endif
 	int c;
 
 	while ((c = getopt(argc, argv, getopt_settings)) != -1) {
@@ -143,15 +156,37 @@ static int parse_options(int argc, char *argv[])
 		case '?':
 		case 'h':
 			fprintf(stderr, "-?     Show this help and exit.\n");
+#ifdef TEST_BENCH
+			fprintf(stderr, "-c     Number of concurrent clients for each benchmark (default %d, max %d).\n", option_bench_clients, TEST_BENCH_MAX_CLIENTS);
+#endif
 			fprintf(stderr, "-d     Increase debug level. At least level 1 need for BBS log output (except debug, controlled by -D, separately)\n");
 			fprintf(stderr, "-D     Increase BBS debug level. Must have at least one -d to get BBS logging output.\n");
 			fprintf(stderr, "-e     Run the BBS under valgrind to check for errors and warnings.\n");
 			fprintf(stderr, "-g     Also generate valgrind suppressions for the valgrind report.\n");
 			fprintf(stderr, "-h     Show this help and exit.\n");
 			fprintf(stderr, "-h     Run the BBS under helgrind to check for locking errors.\n");
-			fprintf(stderr, "-t     Run a specific named test. Include the test_ prefix but not the .so suffix.\n");
+			fprintf(stderr, "-t     Run a specific named test. Include the " TEST_MODULE_PREFIX " prefix but not the .so suffix.\n");
+#ifdef TEST_BENCH
+			fprintf(stderr, "-s     Duration of each benchmark profile, in seconds (default %d).\n", option_bench_seconds);
+#endif
 			fprintf(stderr, "-x     Exit on the first failure.\n");
 			return -1;
+#ifdef TEST_BENCH
+		case 'c':
+			option_bench_clients = atoi(optarg);
+			if (option_bench_clients < 1 || option_bench_clients > TEST_BENCH_MAX_CLIENTS) {
+				fprintf(stderr, "Number of clients must be between 1 and %d\n", TEST_BENCH_MAX_CLIENTS);
+				return -1;
+			}
+			break;
+		case 's':
+			option_bench_seconds = atoi(optarg);
+			if (option_bench_seconds < 1) {
+				fprintf(stderr, "Invalid duration: %s\n", optarg);
+				return -1;
+			}
+			break;
+#endif
 		case 'd':
 			if (option_debug == MAX_DEBUG) {
 				fprintf(stderr, "Maximum debug level is %d\n", MAX_DEBUG);
@@ -359,6 +394,315 @@ int test_client_expect_eventually_buf(int fd, int ms, const char *restrict s, in
 	return -1;
 }
 
+int test_bench_clients(void)
+{
+	return option_bench_clients;
+}
+
+int test_bench_send(struct test_bench_client *c, const char *fmt, ...)
+{
+	char buf[1024];
+	int len;
+	va_list ap;
+
+	va_start(ap, fmt);
+	len = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+
+	if (len < 0 || len >= (int) sizeof(buf)) {
+		bbs_error("Command too long\n");
+		return -1;
+	}
+	if (write(c->fd, buf, (size_t) len) != len) {
+		bbs_debug(1, "Client %d: write failed: %s\n", c->index, strerror(errno));
+		return -1;
+	}
+	return len;
+}
+
+const char *test_bench_readline(struct test_bench_client *c)
+{
+	for (;;) {
+		struct pollfd pfd;
+		ssize_t res;
+		char *crlf = memmem(c->buf + c->start, c->end - c->start, "\r\n", 2);
+
+		if (crlf) {
+			char *line = c->buf + c->start;
+			*crlf = '\0';
+			c->start = (size_t) (crlf + 2 - c->buf);
+			return line;
+		}
+		/* No complete line yet. Shift what's left to the beginning and read more. */
+		if (c->start) {
+			memmove(c->buf, c->buf + c->start, c->end - c->start);
+			c->end -= c->start;
+			c->start = 0;
+		}
+		if (c->end >= sizeof(c->buf) - 1) {
+			/* Line is longer than the buffer. We only ever care about the beginning of lines, so just discard it,
+			 * keeping the last byte in case it's the CR of a CR LF split across reads. */
+			c->buf[0] = c->buf[c->end - 1];
+			c->end = 1;
+		}
+		memset(&pfd, 0, sizeof(pfd));
+		pfd.fd = c->fd;
+		pfd.events = POLLIN;
+		res = poll(&pfd, 1, SEC_MS(10));
+		if (res <= 0) {
+			bbs_warning("Client %d: %s\n", c->index, res ? strerror(errno) : "Timed out waiting for response");
+			return NULL;
+		}
+		res = read(c->fd, c->buf + c->end, sizeof(c->buf) - 1 - c->end);
+		if (res <= 0) {
+			bbs_debug(1, "Client %d: read returned %ld\n", c->index, res);
+			return NULL;
+		}
+		c->end += (size_t) res;
+	}
+}
+
+int test_bench_expect(struct test_bench_client *c, const char *s)
+{
+	for (;;) {
+		const char *line = test_bench_readline(c);
+		if (!line) {
+			bbs_warning("Client %d: Failed to receive expected output: %s\n", c->index, s);
+			return -1;
+		}
+		if (strstr(line, s)) {
+			return 0;
+		}
+	}
+}
+
+int test_bench_expect_end(struct test_bench_client *c)
+{
+	for (;;) {
+		const char *line = test_bench_readline(c);
+		if (!line) {
+			bbs_warning("Client %d: Failed to receive end of multiline response\n", c->index);
+			return -1;
+		}
+		if (!strcmp(line, ".")) {
+			return 0;
+		}
+	}
+}
+
+/*! \brief Maximum number of latency samples kept per client. Operations beyond this are counted, but not included in percentiles. */
+#define BENCH_MAX_SAMPLES 1048576
+
+struct bench_thread {
+	const struct test_bench_profile *profile;
+	struct test_bench_client client;
+	pthread_t thread;
+	pthread_barrier_t *barrier;
+	unsigned int ops;
+	unsigned int errors;
+	unsigned int numsamples;
+	unsigned int allocsamples;
+	unsigned int *samples; /* Latencies, in microseconds */
+	int setupfailed;
+};
+
+static volatile int bench_stop = 0;
+
+static inline int64_t bench_now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int bench_connect(const struct test_bench_profile *profile, struct test_bench_client *c)
+{
+	c->start = c->end = 0;
+	c->fd = test_make_socket(profile->port);
+	if (c->fd < 0) {
+		return -1;
+	}
+	if (profile->setup && profile->setup(c)) {
+		bbs_debug(1, "Client %d: setup failed\n", c->index);
+		close_if(c->fd);
+		return -1;
+	}
+	return 0;
+}
+
+static void bench_disconnect(const struct test_bench_profile *profile, struct test_bench_client *c)
+{
+	if (c->fd != -1) {
+		if (profile->cleanup) {
+			profile->cleanup(c);
+		}
+		close_if(c->fd);
+	}
+}
+
+static void *bench_thread(void *varg)
+{
+	struct bench_thread *t = varg;
+	const struct test_bench_profile *profile = t->profile;
+	struct test_bench_client *c = &t->client;
+
+	if (!profile->reconnect && bench_connect(profile, c)) {
+		t->setupfailed = 1;
+	}
+	/* Don't start the clock until all clients are ready */
+	pthread_barrier_wait(t->barrier);
+	if (t->setupfailed) {
+		return NULL;
+	}
+
+	while (!bench_stop) {
+		int res;
+		int64_t start = bench_now_us();
+		if (profile->reconnect) {
+			res = bench_connect(profile, c);
+			if (!res) {
+				res = profile->op(c);
+				bench_disconnect(profile, c);
+			}
+		} else {
+			res = profile->op(c);
+		}
+		c->iteration++;
+		if (res) {
+			t->errors++;
+			if (!profile->reconnect) {
+				/* The session is probably no longer in a usable state */
+				break;
+			}
+			continue;
+		}
+		t->ops++;
+		if (t->numsamples < BENCH_MAX_SAMPLES) {
+			if (t->numsamples == t->allocsamples) {
+				unsigned int newalloc = t->allocsamples ? 2 * t->allocsamples : 1024;
+				unsigned int *newsamples = realloc(t->samples, newalloc * sizeof(*t->samples));
+				if (ALLOC_FAILURE(newsamples)) {
+					continue;
+				}
+				t->samples = newsamples;
+				t->allocsamples = newalloc;
+			}
+			t->samples[t->numsamples++] = (unsigned int) (bench_now_us() - start);
+		}
+	}
+
+	if (!profile->reconnect) {
+		bench_disconnect(profile, c);
+	}
+	return NULL;
+}
+
+static int uint_cmp(const void *a, const void *b)
+{
+	unsigned int x = *(const unsigned int*) a, y = *(const unsigned int*) b;
+	return x < y ? -1 : x > y ? 1 : 0;
+}
+
+static unsigned int percentile(unsigned int *restrict samples, unsigned int numsamples, unsigned int p)
+{
+	size_t i;
+	if (!numsamples) {
+		return 0;
+	}
+	i = ((size_t) numsamples * p + 99) / 100; /* Nearest rank */
+	return samples[i ? i - 1 : 0];
+}
+
+int test_bench_run(const struct test_bench_profile *profile)
+{
+	struct bench_thread *threads;
+	pthread_barrier_t barrier;
+	int64_t start, end;
+	unsigned int ops = 0, errors = 0, numsamples = 0;
+	unsigned int *samples = NULL;
+	int i, started = 0, setupfailed = 0;
+	int numclients = option_bench_clients;
+	double elapsed;
+
+	if (profile->maxclients && numclients > (int) profile->maxclients) {
+		numclients = (int) profile->maxclients;
+	}
+
+	threads = calloc((size_t) numclients, sizeof(*threads));
+	if (ALLOC_FAILURE(threads)) {
+		return -1;
+	}
+	pthread_barrier_init(&barrier, NULL, (unsigned int) numclients + 1);
+
+	bench_stop = 0;
+	for (i = 0; i < numclients; i++) {
+		struct bench_thread *t = &threads[i];
+		t->profile = profile;
+		t->barrier = &barrier;
+		t->client.fd = -1;
+		t->client.index = i;
+		snprintf(t->client.username, sizeof(t->client.username), "%s%d", TEST_BENCH_USER_PREFIX, i + 1);
+		if (pthread_create(&t->thread, NULL, bench_thread, t)) {
+			bbs_error("pthread_create failed: %s\n", strerror(errno));
+			break;
+		}
+		started++;
+	}
+	if (started < numclients) {
+		/* The barrier will never be satisfied. Nothing we can do but bail out. */
+		bbs_error("Only started %d/%d client threads\n", started, numclients);
+		exit(EXIT_FAILURE);
+	}
+
+	pthread_barrier_wait(&barrier);
+	start = bench_now_us();
+	usleep((useconds_t) option_bench_seconds * 1000000);
+	bench_stop = 1;
+
+	for (i = 0; i < numclients; i++) {
+		pthread_join(threads[i].thread, NULL);
+	}
+	end = bench_now_us();
+	pthread_barrier_destroy(&barrier);
+
+	/* Aggregate all the results */
+	for (i = 0; i < numclients; i++) {
+		numsamples += threads[i].numsamples;
+	}
+	samples = malloc(MAX(1U, numsamples) * sizeof(*samples));
+	numsamples = 0;
+	for (i = 0; i < numclients; i++) {
+		struct bench_thread *t = &threads[i];
+		ops += t->ops;
+		errors += t->errors;
+		setupfailed += t->setupfailed;
+		if (samples && t->numsamples) {
+			memcpy(samples + numsamples, t->samples, t->numsamples * sizeof(*samples));
+			numsamples += t->numsamples;
+		}
+		free_if(t->samples);
+	}
+	free(threads);
+	if (samples) {
+		qsort(samples, numsamples, sizeof(*samples), uint_cmp);
+	} else {
+		numsamples = 0;
+	}
+
+	elapsed = (double) (end - start) / 1000000;
+	printf("{\"profile\":\"%s\",\"clients\":%d,\"duration_ms\":%ld,\"ops\":%u,\"errors\":%u,\"setup_failures\":%d,\"ops_per_sec\":%.1f,\"p50_us\":%u,\"p99_us\":%u,\"max_us\":%u}\n",
+		profile->name, numclients, (end - start) / 1000, ops, errors, setupfailed, elapsed > 0 ? ops / elapsed : 0,
+		percentile(samples, numsamples, 50), percentile(samples, numsamples, 99), numsamples ? samples[numsamples - 1] : 0);
+	fflush(stdout);
+	free_if(samples);
+
+	if (!ops || setupfailed) {
+		bbs_error("Benchmark profile %s failed (%u op%s, %d client%s failed setup)\n", profile->name, ops, ESS(ops), setupfailed, ESS(setupfailed));
+		return -1;
+	}
+	return 0;
+}
+
 static int do_abort = 0;
 static int bbspfd[2] = { -1 , -1 };
 static int notifypfd[2] = { -1, -1 };
@@ -836,6 +1180,14 @@ static int run_test(const char *filename, int multiple)
 				fprintf(modulefp, "[users]\r\n%s=%s\r\n", TEST_USER, TEST_HASH);
 				fprintf(modulefp, "%s=%s\r\n", TEST_USER2, TEST_HASH2);
 				fprintf(modulefp, "%s=%s\r\n", TEST_USER3, TEST_HASH3);
+#ifdef TEST_BENCH
+				{
+					int i;
+					for (i = 1; i <= TEST_BENCH_MAX_CLIENTS; i++) {
+						fprintf(modulefp, "%s%d=%s\r\n", TEST_BENCH_USER_PREFIX, i, TEST_HASH);
+					}
+				}
+#endif
 				fclose(modulefp);
 			}
 			if (option_autoload_all) {
@@ -1029,8 +1381,8 @@ int main(int argc, char *argv[])
 		}
 		fprintf(stderr, "Running all tests\n");
 		while ((entry = readdir(dir))) {
-			/* Look for any test_*.so files in the directory in which the tests were compiled. */
-			if (entry->d_type != DT_REG || !STARTS_WITH(entry->d_name, "test_") || !strstr(entry->d_name, ".so")) {
+			/* Look for any test_*.so (or bench_*.so) files in the directory in which the tests were compiled. */
+			if (entry->d_type != DT_REG || !STARTS_WITH(entry->d_name, TEST_MODULE_PREFIX) || !strstr(entry->d_name, ".so")) {
 				continue;
 			}
 			snprintf(fullpath, sizeof(fullpath), "%s/%s", XSTR(TEST_DIR), entry->d_name);
@@ -56,6 +56,8 @@ struct test_module *TEST_MODULE_SELF_SYM(void);
 
 /* Yuck, but why reinvent the wheel */
 #define TEST_ADD_CONFIG(filename) system("cp " filename " " TEST_CONFIG_DIR)
+/* For tests that need a different variant of a config file than the one in this directory */
+#define TEST_ADD_SUBCONFIG(subdir, filename) system("cp " subdir "/" filename " " TEST_CONFIG_DIR)
 
 #define TEST_HOSTNAME "bbs.example.com"
 
@@ -127,6 +129,70 @@ int test_client_drain(int fd, int ms);
 	} \
 }
 
+/* Benchmarks */
+
+/*! \brief Maximum number of concurrent benchmark clients */
+#define TEST_BENCH_MAX_CLIENTS 64
+
+/*! \brief Additional users, available only to benchmarks, one per client (benchuser1 ... benchuserN), all with password TEST_PASS */
+#define TEST_BENCH_USER_PREFIX "benchuser"
+
+/*! \brief A single benchmark client connection */
+struct test_bench_client {
+	int fd;						/*!< Connection to the BBS */
+	int index;					/*!< Client number, starting from 0 */
+	unsigned int iteration;		/*!< Number of operations performed by this client so far */
+	char username[24];			/*!< Username reserved for this client (TEST_BENCH_USER_PREFIX followed by index + 1) */
+	size_t start;				/*!< Beginning of unprocessed data in buf */
+	size_t end;					/*!< End of unprocessed data in buf */
+	char buf[16384];
+};
+
+/*! \brief A load profile for a benchmark */
+struct test_bench_profile {
+	const char *name;			/*!< Name of profile, used in the output */
+	int port;					/*!< TCP port to connect to */
+	unsigned int maxclients;	/*!< If nonzero, maximum number of concurrent clients, for resources that can't be shared */
+	/*! \brief Prepare a newly connected client (e.g. read the banner and log in). Not timed, unless reconnect is set. */
+	int (*setup)(struct test_bench_client *c);
+	/*! \brief A single operation. Each invocation is timed. */
+	int (*op)(struct test_bench_client *c);
+	/*! \brief Optional callback to cleanly end a session before disconnecting */
+	void (*cleanup)(struct test_bench_client *c);
+	/*! \brief If set, every operation is performed on a new connection, and connection setup is included in the latency */
+	unsigned int reconnect:1;
+};
+
+/*! \brief Number of concurrent clients configured for benchmarks */
+int test_bench_clients(void);
+
+/*!
+ * \brief Run a load profile using the configured number of concurrent clients, for the configured duration.
+ * \param profile
+ * \retval 0 on success, -1 if the profile could not be run or no operations succeeded
+ * \note Results are printed to STDOUT in JSON, one line per profile, and include ops/sec and p50/p99 latencies
+ */
+int test_bench_run(const struct test_bench_profile *profile);
+
+/*! \brief Send a formatted command to the server */
+int __attribute__ ((format (gnu_printf, 2, 3))) test_bench_send(struct test_bench_client *c, const char *fmt, ...);
+
+/*!
+ * \brief Read lines (CR LF terminated) until one containing s is received
+ * \retval 0 on success, -1 on timeout or disconnect
+ */
+int test_bench_expect(struct test_bench_client *c, const char *s);
+
+/*! \brief Read lines until the end of a multiline response (a line containing just a period) */
+int test_bench_expect_end(struct test_bench_client *c);
+
+/*! \brief Read and return the next line, or NULL on failure */
+const char *test_bench_readline(struct test_bench_client *c);
+
+#define BENCH_SEND(c, fmt, ...) if (test_bench_send(c, fmt, ## __VA_ARGS__) < 0) { goto cleanup; }
+#define BENCH_EXPECT(c, s) if (test_bench_expect(c, s)) { goto cleanup; }
+#define BENCH_EXPECT_END(c) if (test_bench_expect_end(c)) { goto cleanup; }
+
 struct test_module_info {
 	struct test_module *self;
 	int (*pre)(void);
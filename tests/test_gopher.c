@@ -39,6 +39,8 @@ static int pre(void)
 	/* Not efficient, but I feel lazy right now */
 	system("echo 'This is a test page' > " TEST_GOPHER_DIR "/file1.txt");
 	system("echo 'This is another test page' > " TEST_GOPHER_DIR "/file2.txt");
+	system("echo 'This is a page in a subdirectory' > " TEST_GOPHER_DIR "/testdir/file3.txt");
+	system("printf 'Hello from the gophermap\\n0Relative link\\tfile3.txt\\n' > " TEST_GOPHER_DIR "/testdir/gophermap");
 	return 0;
 }
 
@@ -70,6 +72,20 @@ static int run(void)
 	REQUIRE_FD(clientfd);
 	SWRITE(clientfd, "/file2.txt" ENDL);
 	CLIENT_EXPECT_EVENTUALLY(clientfd, "This is another test page");
+	close_if(clientfd);
+
+	/* A directory with a gophermap gets that menu instead of a listing */
+	clientfd = test_make_socket(70);
+	REQUIRE_FD(clientfd);
+	SWRITE(clientfd, "/testdir" ENDL);
+	CLIENT_EXPECT_EVENTUALLY(clientfd, "iHello from the gophermap");
+	close_if(clientfd);
+
+	/* Same thing, from the cache this time, with a relative selector resolved to this directory */
+	clientfd = test_make_socket(70);
+	REQUIRE_FD(clientfd);
+	SWRITE(clientfd, "/testdir/" ENDL);
+	CLIENT_EXPECT_EVENTUALLY(clientfd, "0Relative link\t/testdir/file3.txt");
 
 	res = 0;
 
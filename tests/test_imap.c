@@ -409,6 +409,38 @@ static int run(void)
 	SWRITE(client1, "a27 UID FETCH 11 (FLAGS UID BODYSTRUCTURE)" ENDL);
 	CLIENT_EXPECT(client1, "PLAIN");
 
+	/* Test FETCH PREVIEW: LAZY only returns stored previews, the first plain request generates it */
+	SWRITE(client1, "a27a UID FETCH 1 (PREVIEW (LAZY))" ENDL);
+	CLIENT_EXPECT(client1, "UID 1 PREVIEW NIL)");
+	CLIENT_DRAIN(client1);
+	SWRITE(client1, "a27b UID FETCH 1 (PREVIEW)" ENDL);
+	CLIENT_EXPECT(client1, "PREVIEW \"This is a test email message. ...Let's hope it gets delivered properly.\"");
+	CLIENT_DRAIN(client1);
+	SWRITE(client1, "a27c UID FETCH 1 (PREVIEW (LAZY))" ENDL);
+	CLIENT_EXPECT(client1, "PREVIEW \"This is a test");
+	CLIENT_DRAIN(client1);
+
+	/* A store whose last line was only partially written: complete lines are still used, the partial one is ignored */
+	system("printf '11 Stored preview\\n1 Truncated prev' > " TEST_MAIL_DIR "/1/.previews");
+	SWRITE(client1, "a27d UID FETCH 11 (PREVIEW (LAZY))" ENDL);
+	CLIENT_EXPECT(client1, "PREVIEW \"Stored preview\"");
+	CLIENT_DRAIN(client1);
+	SWRITE(client1, "a27e UID FETCH 1 (PREVIEW (LAZY))" ENDL);
+	CLIENT_EXPECT(client1, "UID 1 PREVIEW NIL)");
+	CLIENT_DRAIN(client1);
+	/* Generating it again appends a complete line after the partial one */
+	SWRITE(client1, "a27f UID FETCH 1 (PREVIEW)" ENDL);
+	CLIENT_EXPECT(client1, "PREVIEW \"This is a test");
+	CLIENT_DRAIN(client1);
+	SWRITE(client1, "a27g UID FETCH 1 (PREVIEW (LAZY))" ENDL);
+	CLIENT_EXPECT(client1, "PREVIEW \"This is a test");
+	CLIENT_DRAIN(client1);
+	/* Nothing but a partial line */
+	system("printf '1 Truncated prev' > " TEST_MAIL_DIR "/1/.previews");
+	SWRITE(client1, "a27h UID FETCH 1 (PREVIEW (LAZY))" ENDL);
+	CLIENT_EXPECT(client1, "UID 1 PREVIEW NIL)");
+	CLIENT_DRAIN(client1);
+
 	/* Test FETCH BODY.PEEK[HEADER] */
 	SWRITE(client1, "a28 UID FETCH 11 (FLAGS BODY.PEEK[HEADER])" ENDL);
 	CLIENT_EXPECT_EVENTUALLY(client1, "MIME-Version");
@@ -0,0 +1,151 @@
+/*
+ * LBBS -- The Lightweight Bulletin Board System
+ *
+ * Copyright (C) 2023, Naveen Albert
+ *
+ * Naveen Albert <bbs@phreaknet.org>
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief IMAP QRESYNC Expunge Log Tests
+ *
+ * \author Naveen Albert <bbs@phreaknet.org>
+ */
+
+#include "test.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define INBOX_DIR TEST_MAIL_DIR "/1"
+#define INBOX_MSG(uid, modseq) INBOX_DIR "/cur/1700000000.M" #uid ".test,S=28,U=" #uid ",M=" #modseq ":2,"
+
+static int write_file(const char *filename, const char *contents)
+{
+	FILE *fp = fopen(filename, "w");
+	if (!fp) {
+		bbs_error("fopen(%s) failed: %s\n", filename, strerror(errno));
+		return -1;
+	}
+	fprintf(fp, "%s", contents);
+	fclose(fp);
+	return 0;
+}
+
+/*! \brief Write an expunge log in the original format: HIGHESTMODSEQ, followed by a UID and MODSEQ for each expunged message */
+static int write_legacy_modseqs(void)
+{
+	unsigned long highestmodseq = 20;
+	unsigned int uids[] = { 1, 3, 5, 7, 8, 9, 10 };
+	unsigned long modseq = 11;
+	size_t i;
+	FILE *fp = fopen(INBOX_DIR "/.modseqs", "wb");
+
+	if (!fp) {
+		bbs_error("fopen failed: %s\n", strerror(errno));
+		return -1;
+	}
+	fwrite(&highestmodseq, sizeof(unsigned long), 1, fp);
+	for (i = 0; i < ARRAY_LEN(uids); i++, modseq++) {
+		fwrite(&uids[i], sizeof(unsigned int), 1, fp);
+		fwrite(&modseq, sizeof(unsigned long), 1, fp);
+	}
+	fclose(fp);
+	return 0;
+}
+
+static int pre(void)
+{
+	test_preload_module("mod_mail.so");
+	test_preload_module("mod_mimeparse.so");
+	test_load_module("net_imap.so");
+
+	TEST_ADD_CONFIG("mod_mail.conf");
+	TEST_ADD_CONFIG("net_imap.conf");
+	/* Keep only a few expunge records, so that the log gets compacted */
+	system("sed -i 's/^\\[general\\]/[general]\\nmaxexpunged=4/' " TEST_CONFIG_DIR "/mod_mail.conf");
+
+	system("rm -rf " TEST_MAIL_DIR); /* Purge the contents of the directory, if it existed. */
+	mkdir(TEST_MAIL_DIR, 0700);
+	mkdir(INBOX_DIR, 0700);
+	mkdir(INBOX_DIR "/cur", 0700);
+	mkdir(INBOX_DIR "/new", 0700);
+	mkdir(INBOX_DIR "/tmp", 0700);
+
+	/* UIDs 1 through 10 have been assigned, and only 2, 4, and 6 are left */
+	if (write_file(INBOX_DIR "/.uidvalidity", "1700000000/10") ||
+		write_file(INBOX_MSG(2, 18), "Subject: Message 2\r\n\r\nTest\r\n") ||
+		write_file(INBOX_MSG(4, 19), "Subject: Message 4\r\n\r\nTest\r\n") ||
+		write_file(INBOX_MSG(6, 20), "Subject: Message 6\r\n\r\nTest\r\n")) {
+		return -1;
+	}
+	return write_legacy_modseqs();
+}
+
+static int run(void)
+{
+	int client1;
+	int res = -1;
+	FILE *fp;
+	unsigned long highestmodseq;
+	unsigned int marker = 1, version = 0;
+
+	client1 = test_make_socket(143);
+	REQUIRE_FD(client1);
+
+	CLIENT_EXPECT(client1, "OK");
+	SWRITE(client1, "a1 LOGIN \"" TEST_USER "\" \"" TEST_PASS "\"" ENDL);
+	CLIENT_EXPECT(client1, "a1 OK");
+	SWRITE(client1, "a2 ENABLE QRESYNC" ENDL);
+	CLIENT_EXPECT_EVENTUALLY(client1, "a2 OK");
+
+	/* The log hasn't been written to yet, so it's still in the original format, which can still be read */
+	SWRITE(client1, "a3 SELECT INBOX (QRESYNC (1700000000 13))" ENDL);
+	CLIENT_EXPECT_EVENTUALLY(client1, "* VANISHED (EARLIER) 7:10\r\n");
+
+	/* Expunging a message converts the log to the current format, and since there are now more than 4 records, compacts it */
+	SWRITE(client1, "a4 UID STORE 6 +FLAGS.SILENT (\\Deleted)" ENDL);
+	CLIENT_EXPECT_EVENTUALLY(client1, "a4 OK");
+	SWRITE(client1, "a5 EXPUNGE" ENDL);
+	CLIENT_EXPECT_EVENTUALLY(client1, "a5 OK");
+
+	fp = fopen(INBOX_DIR "/.modseqs", "rb");
+	if (!fp) {
+		bbs_error("fopen failed: %s\n", strerror(errno));
+		goto cleanup;
+	}
+	if (fread(&highestmodseq, sizeof(unsigned long), 1, fp) != 1 || fread(&marker, sizeof(unsigned int), 1, fp) != 1 || fread(&version, sizeof(unsigned int), 1, fp) != 1) {
+		bbs_error("Failed to read expunge log header\n");
+	}
+	fclose(fp);
+	if (marker || version != 2) {
+		bbs_error("Expunge log was not upgraded (marker %u, version %u)\n", marker, version);
+		goto cleanup;
+	}
+
+	/* Compaction dropped the 5 oldest records (through MODSEQ 15), but anything newer than that is still exact */
+	SWRITE(client1, "a6 SELECT INBOX (QRESYNC (1700000000 16))" ENDL);
+	CLIENT_EXPECT_EVENTUALLY(client1, "* VANISHED (EARLIER) 6,10\r\n");
+
+	/* For anything older than that, the client gets every UID that no longer exists */
+	SWRITE(client1, "a7 SELECT INBOX (QRESYNC (1700000000 12))" ENDL);
+	CLIENT_EXPECT_EVENTUALLY(client1, "* VANISHED (EARLIER) 1,3,5:10\r\n");
+
+	SWRITE(client1, "a8 LOGOUT" ENDL);
+	CLIENT_EXPECT_EVENTUALLY(client1, "* BYE");
+	res = 0;
+
+cleanup:
+	close_if(client1);
+	return res;
+}
+
+TEST_MODULE_INFO_STANDARD("IMAP QRESYNC Expunge Log Tests");
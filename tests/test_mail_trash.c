@@ -0,0 +1,121 @@
+/*
+ * LBBS -- The Lightweight Bulletin Board System
+ *
+ * Copyright (C) 2023, Naveen Albert
+ *
+ * Naveen Albert <bbs@phreaknet.org>
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Trash Auto-Purge Tests
+ *
+ * \author Naveen Albert <bbs@phreaknet.org>
+ */
+
+#include "test.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define TRASH_DIR TEST_MAIL_DIR "/1/.Trash"
+#define TRASH_MSG(uid) TRASH_DIR "/cur/1700000000.M" #uid ".test,S=27,U=" #uid ":2,"
+
+static int write_file(const char *filename, const char *contents)
+{
+	FILE *fp = fopen(filename, "w");
+	if (!fp) {
+		bbs_error("fopen(%s) failed: %s\n", filename, strerror(errno));
+		return -1;
+	}
+	fprintf(fp, "%s", contents);
+	fclose(fp);
+	return 0;
+}
+
+static int pre(void)
+{
+	test_preload_module("mod_mail.so");
+	test_load_module("mod_mail_trash.so");
+
+	TEST_ADD_CONFIG("mod_mail.conf");
+
+	system("rm -rf " TEST_MAIL_DIR); /* Purge the contents of the directory, if it existed. */
+	mkdir(TEST_MAIL_DIR, 0700);
+	mkdir(TEST_MAIL_DIR "/1", 0700);
+	mkdir(TRASH_DIR, 0700);
+	mkdir(TRASH_DIR "/cur", 0700);
+	mkdir(TRASH_DIR "/new", 0700);
+	mkdir(TRASH_DIR "/tmp", 0700);
+
+	/* Three messages that were just placed in the Trash, so only the index can make them due */
+	if (write_file(TRASH_DIR "/.uidvalidity", "1700000000/3") ||
+		write_file(TRASH_MSG(1), "Subject: Trash 1\r\n\r\nTrash\r\n") ||
+		write_file(TRASH_MSG(2), "Subject: Trash 2\r\n\r\nTrash\r\n") ||
+		write_file(TRASH_MSG(3), "Subject: Trash 3\r\n\r\nTrash\r\n")) {
+		return -1;
+	}
+
+	/* 1 is due, 2 is due but was indexed under a different UIDVALIDITY, and 3 isn't indexed at all */
+	return write_file(TEST_MAIL_DIR "/.trashindex",
+		"1 1 1700000000 1\n"
+		"1 1 1600000000 2\n");
+}
+
+static int run(void)
+{
+	char buf[1024];
+	FILE *fp;
+	size_t bytes;
+	int i;
+
+	/* The index is processed as soon as the module loads */
+	for (i = 0; i < 50 && !eaccess(TRASH_MSG(1), F_OK); i++) {
+		usleep(100000);
+	}
+	if (!eaccess(TRASH_MSG(1), F_OK)) {
+		bbs_error("Message due for expiry was not expunged\n");
+		return -1;
+	}
+
+	/* The stale entry must not expunge whatever now has that UID */
+	if (eaccess(TRASH_MSG(2), F_OK)) {
+		bbs_error("Message with a stale index entry was expunged\n");
+		return -1;
+	}
+	if (eaccess(TRASH_MSG(3), F_OK)) {
+		bbs_error("Message that wasn't due was expunged\n");
+		return -1;
+	}
+
+	/* The stale entry means the mailbox's index can't be trusted, so it should get rebuilt under the current UIDVALIDITY */
+	for (i = 0; i < 50; i++) {
+		fp = fopen(TEST_MAIL_DIR "/.trashindex", "r");
+		if (!fp) {
+			bbs_error("fopen failed: %s\n", strerror(errno));
+			return -1;
+		}
+		bytes = fread(buf, 1, sizeof(buf) - 1, fp);
+		fclose(fp);
+		buf[bytes] = '\0';
+		if (strstr(buf, " 1 1700000000 2\n") && strstr(buf, " 1 1700000000 3\n")) {
+			break;
+		}
+		usleep(100000);
+	}
+	if (i == 50) {
+		bbs_error("Messages missing from Trash index: %s\n", buf);
+		return -1;
+	}
+
+	return 0;
+}
+
+TEST_MODULE_INFO_STANDARD("Trash Auto-Purge Tests");
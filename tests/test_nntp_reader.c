@@ -40,6 +40,7 @@ static int pre(void)
 static int run(void)
 {
 	const char *s;
+	char buf[256];
 	int clientfd;
 	int res = -1;
 
@@ -113,6 +114,29 @@ static int run(void)
 	SWRITE(clientfd, "ARTICLE 1\r\n");
 	CLIENT_EXPECT_EVENTUALLY(clientfd, ".\r\n");
 
+	/* An open-ended range runs through the last article */
+	SWRITE(clientfd, "XOVER 1-\r\n");
+	CLIENT_EXPECT_EVENTUALLY(clientfd, "1\tI am just a test article\t");
+	CLIENT_DRAIN(clientfd);
+
+	/* OVER is the RFC 3977 name for XOVER, and without arguments it uses the current article */
+	SWRITE(clientfd, "OVER\r\n");
+	CLIENT_EXPECT_EVENTUALLY(clientfd, "1\tI am just a test article\t");
+	CLIENT_DRAIN(clientfd);
+	SWRITE(clientfd, "OVER 1-1\r\n");
+	CLIENT_EXPECT_EVENTUALLY(clientfd, "1\tI am just a test article\t");
+	CLIENT_DRAIN(clientfd);
+
+	/* An explicit range must be honored, even if it doesn't include the current article */
+	SWRITE(clientfd, "XOVER 2-5\r\n");
+	CLIENT_EXPECT_BUF(clientfd, "224", buf);
+	if (strstr(buf, "1\tI am just")) {
+		bbs_error("Article outside of requested range returned\n");
+		goto cleanup;
+	} else if (!strstr(buf, ".\r\n")) {
+		CLIENT_EXPECT(clientfd, ".\r\n");
+	}
+
 	/* No previous */
 	SWRITE(clientfd, "LAST\r\n");
 	CLIENT_EXPECT(clientfd, "422");
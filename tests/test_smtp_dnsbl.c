@@ -0,0 +1,235 @@
+/*
+ * LBBS -- The Lightweight Bulletin Board System
+ *
+ * Copyright (C) 2023, Naveen Albert
+ *
+ * Naveen Albert <bbs@phreaknet.org>
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief SMTP DNSBL Connection Screening Tests
+ *
+ * \author Naveen Albert <bbs@phreaknet.org>
+ */
+
+#include "test.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <poll.h>
+#include <pthread.h>
+
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+
+#define STUB_DNS_PORT 5353
+
+static int dns_fd = -1;
+static pthread_mutex_t query_lock = PTHREAD_MUTEX_INITIALIZER;
+static int bl_queries = 0; /* Protected by query_lock, since these are updated by the stub server thread */
+static int wl_queries = 0;
+
+static int pre(void)
+{
+	test_preload_module("mod_mail.so");
+	test_preload_module("net_smtp.so");
+	test_load_module("mod_smtp_dnsbl.so");
+
+	TEST_ADD_CONFIG("mod_mail.conf");
+	TEST_ADD_CONFIG("net_smtp.conf");
+	TEST_ADD_CONFIG("mod_smtp_dnsbl.conf");
+	return 0;
+}
+
+/*!
+ * \brief Minimal authoritative server for the bl.test, pbl.test, and wl.test zones.
+ * 127.0.0.1 is listed only in bl.test, 127.0.0.2 only in pbl.test, and 127.0.0.3 in both bl.test and wl.test.
+ */
+static void *dns_stub(void *varg)
+{
+	unsigned char buf[512];
+	const char *listed[] = { "1.0.0.127.bl.test", "2.0.0.127.pbl.test", "3.0.0.127.bl.test", "3.0.0.127.wl.test" };
+
+	UNUSED(varg);
+
+	for (;;) {
+		struct sockaddr_in sin;
+		socklen_t sinlen = sizeof(sin);
+		char qname[256];
+		size_t i, qlen = 0;
+		unsigned char *p;
+		ssize_t res;
+
+		if (poll(&(struct pollfd) { .fd = dns_fd, .events = POLLIN }, 1, SEC_MS(15)) <= 0) {
+			break;
+		}
+		res = recvfrom(dns_fd, buf, sizeof(buf), 0, (struct sockaddr*) &sin, &sinlen);
+		if (res <= (ssize_t) sizeof(HEADER)) {
+			break;
+		}
+
+		/* Decode the question name */
+		p = buf + sizeof(HEADER);
+		while (*p && p < buf + res) {
+			if (qlen) {
+				qname[qlen++] = '.';
+			}
+			memcpy(qname + qlen, p + 1, *p);
+			qlen += *p;
+			p += *p + 1;
+		}
+		qname[qlen] = '\0';
+		p += 5; /* Terminating label, QTYPE, QCLASS */
+
+		pthread_mutex_lock(&query_lock);
+		if (!strcmp(qname, "1.0.0.127.bl.test")) {
+			bl_queries++;
+		} else if (!strcmp(qname, "1.0.0.127.wl.test")) {
+			wl_queries++;
+		}
+		pthread_mutex_unlock(&query_lock);
+
+		((HEADER*) buf)->qr = 1;
+		((HEADER*) buf)->aa = 1;
+		((HEADER*) buf)->rcode = NXDOMAIN;
+		for (i = 0; i < ARRAY_LEN(listed); i++) {
+			if (!strcmp(qname, listed[i])) {
+				/* Answer: pointer to question name, type A, class IN, TTL 300, 127.0.0.2 */
+				const unsigned char answer[] = { 0xc0, 0x0c, 0, 1, 0, 1, 0, 0, 1, 44, 0, 4, 127, 0, 0, 2 };
+				memcpy(p, answer, sizeof(answer));
+				p += sizeof(answer);
+				((HEADER*) buf)->rcode = NOERROR;
+				((HEADER*) buf)->ancount = htons(1);
+				break;
+			}
+		}
+		sendto(dns_fd, buf, (size_t) (p - buf), 0, (struct sockaddr*) &sin, sinlen);
+	}
+	return NULL;
+}
+
+/*! \brief Connect to the loopback interface from a particular loopback address, so it gets screened like a different client */
+static int make_socket_from(const char *ip, int port)
+{
+	struct sockaddr_in sin;
+	int fd;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0) {
+		bbs_error("Unable to create TCP socket: %s\n", strerror(errno));
+		return -1;
+	}
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = inet_addr(ip);
+	if (bind(fd, (struct sockaddr*) &sin, sizeof(sin))) {
+		bbs_error("Failed to bind to %s: %s\n", ip, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	sin.sin_addr.s_addr = inet_addr("127.0.0.1");
+	sin.sin_port = htons((uint16_t) port);
+	if (connect(fd, (struct sockaddr*) &sin, sizeof(sin))) {
+		bbs_error("Unable to connect to TCP port %d: %s\n", port, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int run(void)
+{
+	struct sockaddr_in sin;
+	pthread_t thread;
+	int clientfd = -1;
+	int bl, wl;
+	int res = -1;
+
+	dns_fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (dns_fd < 0) {
+		return -1;
+	}
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(STUB_DNS_PORT);
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(dns_fd, (struct sockaddr*) &sin, sizeof(sin))) {
+		bbs_error("Failed to bind stub DNS server: %s\n", strerror(errno));
+		close(dns_fd);
+		return -1;
+	}
+	if (pthread_create(&thread, NULL, dns_stub, NULL)) {
+		close(dns_fd);
+		return -1;
+	}
+
+	/* We're listed, so we should be turned away before even getting a banner */
+	clientfd = test_make_socket(25);
+	if (clientfd < 0) {
+		goto cleanup;
+	}
+	CLIENT_EXPECT(clientfd, "554 5.7.1");
+	close_if(clientfd);
+
+	/* The second time, the result should come from the cache, without any more queries */
+	clientfd = test_make_socket(25);
+	if (clientfd < 0) {
+		goto cleanup;
+	}
+	CLIENT_EXPECT(clientfd, "554 5.7.1");
+
+	pthread_mutex_lock(&query_lock);
+	bl = bl_queries;
+	wl = wl_queries;
+	pthread_mutex_unlock(&query_lock);
+	if (bl != 1 || wl != 1) {
+		bbs_error("Expected 1 query per zone, but got %d and %d\n", bl, wl);
+		goto cleanup;
+	}
+
+	/* Message submission is not subject to screening */
+	close_if(clientfd);
+	clientfd = test_make_socket(587);
+	if (clientfd < 0) {
+		goto cleanup;
+	}
+	CLIENT_EXPECT_EVENTUALLY(clientfd, "220 ");
+
+	/* Listed in a blocklist, but also in an allowlist that cancels it out, so not delayed at all */
+	close_if(clientfd);
+	clientfd = make_socket_from("127.0.0.3", 25);
+	if (clientfd < 0) {
+		goto cleanup;
+	}
+	CLIENT_EXPECT_EVENTUALLY(clientfd, "220 ");
+
+	/* Score is high enough to tarpit, but not to reject, so the banner should be drawn out */
+	close_if(clientfd);
+	clientfd = make_socket_from("127.0.0.2", 25);
+	if (clientfd < 0) {
+		goto cleanup;
+	}
+	CLIENT_EXPECT(clientfd, "220-");
+	if (test_client_expect_eventually(clientfd, SEC_MS(10), "220-Waiting for service", __LINE__)) {
+		goto cleanup;
+	}
+
+	res = 0;
+
+cleanup:
+	close_if(clientfd);
+	/* An empty datagram tells the stub server to exit */
+	sendto(dns_fd, "", 0, 0, (struct sockaddr*) &sin, sizeof(sin));
+	pthread_join(thread, NULL);
+	close(dns_fd);
+	return res;
+}
+
+TEST_MODULE_INFO_STANDARD("SMTP DNSBL Tests");
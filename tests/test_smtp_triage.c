@@ -0,0 +1,98 @@
+/*
+ * LBBS -- The Lightweight Bulletin Board System
+ *
+ * Copyright (C) 2023, Naveen Albert
+ *
+ * Naveen Albert <bbs@phreaknet.org>
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief SMTP Pre-Greeting Triage Tests
+ *
+ * \author Naveen Albert <bbs@phreaknet.org>
+ */
+
+#include "test.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+
+static int pre(void)
+{
+	test_preload_module("mod_mail.so");
+	test_load_module("net_smtp.so");
+
+	TEST_ADD_CONFIG("mod_mail.conf");
+	TEST_ADD_SUBCONFIG("smtp_triage", "net_smtp.conf");
+	return 0;
+}
+
+static int run(void)
+{
+	int client1 = -1, client2 = -1, client3 = -1;
+	int res = -1;
+
+	/* Talking before the banner gets us kicked out */
+	client1 = test_make_socket(25);
+	REQUIRE_FD(client1);
+	SWRITE(client1, "EHLO " TEST_EXTERNAL_DOMAIN ENDL);
+	CLIENT_EXPECT(client1, "554 5.5.1");
+	close_if(client1);
+
+	/* Connections still being held count towards the limit, too */
+	client1 = test_make_socket(25);
+	REQUIRE_FD(client1);
+	client2 = test_make_socket(25);
+	REQUIRE_FD(client2);
+	client3 = test_make_socket(25);
+	REQUIRE_FD(client3);
+	CLIENT_EXPECT(client3, "421 4.7.0");
+	close_if(client1);
+	close_if(client2);
+	close_if(client3);
+	usleep(250000); /* Let the listener notice they're gone */
+
+	/* Waiting patiently gets us through */
+	client1 = test_make_socket(25);
+	REQUIRE_FD(client1);
+	CLIENT_EXPECT_EVENTUALLY(client1, "220 ");
+
+	/* Now that we passed, we're not held again, even if we're impatient */
+	client2 = test_make_socket(25);
+	REQUIRE_FD(client2);
+	SWRITE(client2, "EHLO " TEST_EXTERNAL_DOMAIN ENDL);
+	CLIENT_EXPECT_EVENTUALLY(client2, "250 "); /* The banner, and then the EHLO response */
+
+	/* Two sessions are already in progress, so a third is too many */
+	client3 = test_make_socket(25);
+	REQUIRE_FD(client3);
+	CLIENT_EXPECT(client3, "421 4.7.0");
+	close_if(client3);
+
+	/* Once a session ends, there's room again */
+	SWRITE(client2, "QUIT" ENDL);
+	CLIENT_EXPECT(client2, "221");
+	close_if(client2);
+	usleep(250000); /* Let the session finish tearing down */
+
+	client3 = test_make_socket(25);
+	REQUIRE_FD(client3);
+	CLIENT_EXPECT_EVENTUALLY(client3, "220 ");
+
+	res = 0;
+
+cleanup:
+	close_if(client1);
+	close_if(client2);
+	close_if(client3);
+	return res;
+}
+
+TEST_MODULE_INFO_STANDARD("SMTP Triage Tests");
@@ -0,0 +1,145 @@
+/*
+ * LBBS -- The Lightweight Bulletin Board System
+ *
+ * Copyright (C) 2023, Naveen Albert
+ *
+ * Naveen Albert <bbs@phreaknet.org>
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Telnet Option Negotiation and MCCP2 Tests
+ *
+ * \author Naveen Albert <bbs@phreaknet.org>
+ */
+
+#include "test.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <poll.h>
+
+#include <arpa/telnet.h>
+#include <zlib.h>
+
+#define TELOPT_COMPRESS2 86
+
+static int pre(void)
+{
+	test_load_module("net_telnet.so");
+
+	/* no net_telnet.conf needed, compression is offered by default */
+	return 0;
+}
+
+/*! \brief Read from the server until the start of the compressed stream, and return how many bytes after it were already read */
+static int read_until_compressed(int fd, unsigned char *buf, size_t len, size_t *offset)
+{
+	const unsigned char marker[] = {IAC, SB, TELOPT_COMPRESS2, IAC, SE};
+	size_t total = 0;
+
+	while (total < len) {
+		ssize_t res;
+		unsigned char *start;
+		if (poll(&(struct pollfd) { .fd = fd, .events = POLLIN }, 1, SEC_MS(5)) <= 0) {
+			bbs_error("Timed out waiting for compression to start\n");
+			return -1;
+		}
+		res = read(fd, buf + total, len - total);
+		if (res <= 0) {
+			return -1;
+		}
+		total += (size_t) res;
+		start = memmem(buf, total, marker, sizeof(marker));
+		if (start) {
+			*offset = (size_t) (start - buf) + sizeof(marker);
+			return (int) (total - *offset);
+		}
+	}
+	return -1;
+}
+
+static int run(void)
+{
+	/* Reply to everything at once, in a different order than it was asked */
+	const unsigned char replies[] = {
+		IAC, DO, TELOPT_COMPRESS2,
+		IAC, WONT, TELOPT_TSPEED,
+		IAC, WILL, TELOPT_NAWS,
+		IAC, SB, TELOPT_NAWS, 0, 100, 0, 40, IAC, SE,
+		IAC, DO, TELOPT_ECHO,
+		IAC, DO, TELOPT_SGA,
+		IAC, WONT, TELOPT_TTYPE,
+	};
+	unsigned char buf[4096], out[8192];
+	size_t offset = 0, total = 0;
+	int clientfd = -1;
+	int res = -1;
+	z_stream zs;
+
+	memset(&zs, 0, sizeof(zs));
+	if (inflateInit(&zs) != Z_OK) {
+		return -1;
+	}
+
+	clientfd = test_make_socket(23);
+	if (clientfd < 0) {
+		goto cleanup;
+	}
+
+	if (write(clientfd, replies, sizeof(replies)) != sizeof(replies)) {
+		goto cleanup;
+	}
+
+	res = read_until_compressed(clientfd, buf, sizeof(buf), &offset);
+	if (res < 0) {
+		goto cleanup;
+	}
+	zs.next_in = buf + offset;
+	zs.avail_in = (unsigned int) res;
+	res = -1;
+
+	/* Everything after that is compressed, and should decompress to the usual terminal setup */
+	for (;;) {
+		ssize_t bytes;
+		zs.next_out = out + total;
+		zs.avail_out = (unsigned int) (sizeof(out) - 1 - total);
+		if (zs.avail_in && inflate(&zs, Z_SYNC_FLUSH) < 0) {
+			bbs_error("Failed to decompress output\n");
+			goto cleanup;
+		}
+		total = sizeof(out) - 1 - zs.avail_out;
+		out[total] = '\0';
+		if (memmem(out, total, "ENTER", STRLEN("ENTER"))) {
+			break;
+		} else if (!zs.avail_out) {
+			bbs_error("Didn't get expected output\n");
+			goto cleanup;
+		}
+		if (poll(&(struct pollfd) { .fd = clientfd, .events = POLLIN }, 1, SEC_MS(7)) <= 0) {
+			bbs_error("Timed out waiting for compressed output\n");
+			goto cleanup;
+		}
+		bytes = read(clientfd, buf, sizeof(buf));
+		if (bytes <= 0) {
+			goto cleanup;
+		}
+		zs.next_in = buf;
+		zs.avail_in = (unsigned int) bytes;
+	}
+
+	res = 0;
+
+cleanup:
+	inflateEnd(&zs);
+	close_if(clientfd);
+	return res;
+}
+
+TEST_MODULE_INFO_STANDARD("Telnet Tests");